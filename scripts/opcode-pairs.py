@@ -0,0 +1,69 @@
+"""
+Opcode pair miner requires Python3
+
+Runs scripts with a build that counts opcode pairs, and reports the
+pairs of adjacent instructions that are executed most often. These
+are the candidates for superinstructions.
+
+  python3 scripts/opcode-pairs.py [kind] [script ...]
+
+where 'kind' names a build at out/<kind>/mtots (default 'pairs') made
+with -DMTOTS_COUNT_OPCODE_PAIRS=1 (and, to count pairs of plain
+instructions, -DMTOTS_USE_SUPERINSTRUCTIONS=0), e.g.
+
+  gcc -std=c89 -O2 -Isrc -DMTOTS_COUNT_OPCODE_PAIRS=1 \\
+    -DMTOTS_USE_SUPERINSTRUCTIONS=0 -o out/pairs/mtots src/*.c -lm
+
+The scripts default to everything in misc/bench.
+Set PAIRS_TOP to change how many pairs are listed (default 30).
+"""
+import os, re, subprocess, sys, tempfile
+
+repoDir = os.path.dirname(os.path.dirname(os.path.realpath(__file__)))
+benchDir = os.path.join(repoDir, 'misc', 'bench')
+top = int(os.environ.get('PAIRS_TOP', '30'))
+
+args = sys.argv[1:]
+kind = 'pairs'
+if args and not args[0].endswith('.mtots'):
+  kind = args.pop(0)
+scriptPaths = args or [
+  os.path.join(benchDir, fn)
+  for fn in sorted(os.listdir(benchDir)) if fn.endswith('.mtots')]
+mtotsPath = os.path.join(repoDir, 'out', kind, 'mtots')
+
+
+def readOpcodeNames():
+  """Opcode names in the order of the OpCode enum in mtots_chunk.h"""
+  with open(os.path.join(repoDir, 'src', 'mtots_chunk.h')) as f:
+    source = f.read()
+  body = source[source.index('typedef enum OpCode'):]
+  body = body[:body.index('}')]
+  return re.findall(r'^\s*(OP_\w+)', body, re.MULTILINE)
+
+
+names = readOpcodeNames()
+
+
+def name(opcode):
+  return names[opcode] if opcode < len(names) else f'<{opcode}>'
+
+
+counts = {}
+with tempfile.TemporaryDirectory() as tmpdir:
+  countsPath = os.path.join(tmpdir, 'pairs.txt')
+  env = dict(os.environ, MTOTS_OPCODE_PAIRS_PATH=countsPath)
+  for scriptPath in scriptPaths:
+    subprocess.run(
+      [mtotsPath, scriptPath], env=env, check=True,
+      stdout=subprocess.DEVNULL)
+  if os.path.exists(countsPath):
+    with open(countsPath) as f:
+      for line in f:
+        a, b, count = map(int, line.split())
+        counts[a, b] = counts.get((a, b), 0) + count
+
+total = sum(counts.values()) or 1
+print(f'{total} adjacent instruction pairs executed')
+for (a, b), count in sorted(counts.items(), key=lambda p: -p[1])[:top]:
+  print(f'{100 * count / total:6.2f}%  {count:>12}  {name(a)} {name(b)}')
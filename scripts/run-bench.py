@@ -0,0 +1,55 @@
+"""
+Benchmark runner requires Python3
+
+Runs every script in misc/bench with one or more builds and reports
+the best wall time and the peak resident set size for each.
+
+  python3 scripts/run-bench.py [kind ...]
+
+where each 'kind' names a build at out/<kind>/mtots (default 'c89').
+Set BENCH_REPEAT to change how many times each script is run.
+"""
+import os, sys, time
+
+kinds = sys.argv[1:] or ['c89']
+repeat = int(os.environ.get('BENCH_REPEAT', '3'))
+
+repoDir = os.path.dirname(os.path.dirname(os.path.realpath(__file__)))
+benchDir = os.path.join(repoDir, 'misc', 'bench')
+
+scriptFilenames = sorted(
+  fn for fn in os.listdir(benchDir) if fn.endswith('.mtots'))
+
+
+def runOnce(mtotsPath, scriptPath):
+  """Returns (seconds, peak RSS in KiB) for a single run"""
+  pid = os.fork()
+  if pid == 0:
+    devnull = os.open(os.devnull, os.O_WRONLY)
+    os.dup2(devnull, 1)
+    os.execv(mtotsPath, [mtotsPath, scriptPath])
+  start = time.perf_counter()
+  _, status, usage = os.wait4(pid, 0)
+  end = time.perf_counter()
+  if os.waitstatus_to_exitcode(status) != 0:
+    raise Exception(f'{mtotsPath} {scriptPath} failed ({status})')
+  return end - start, usage.ru_maxrss
+
+
+results = {}
+for kind in kinds:
+  mtotsPath = os.path.join(repoDir, 'out', kind, 'mtots')
+  for sfn in scriptFilenames:
+    scriptPath = os.path.join(benchDir, sfn)
+    runs = [runOnce(mtotsPath, scriptPath) for _ in range(repeat)]
+    results[kind, sfn] = (min(t for t, _ in runs), max(m for _, m in runs))
+
+nameWidth = max(len(fn) for fn in scriptFilenames)
+header = ''.join(f'{kind:>24}' for kind in kinds)
+print(f'{"script":<{nameWidth}}{header}')
+for sfn in scriptFilenames:
+  row = ''
+  for kind in kinds:
+    seconds, rss = results[kind, sfn]
+    row += f'{seconds:>10.3f}s {rss // 1024:>8}MiB   '
+  print(f'{sfn:<{nameWidth}}{row}')
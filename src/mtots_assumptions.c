@@ -1,4 +1,5 @@
 #include "mtots_assumptions.h"
+#include "mtots_value.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -56,4 +57,18 @@ void checkAssumptions() {
       exit(1);
     }
   }
+
+#if MTOTS_USE_NAN_BOXING
+  /* check that heap and static pointers fit in a NaN-boxed Value */
+  {
+    static int staticInt;
+    void *heapPtr = malloc(1);
+    if ((((uint64_t)(size_t)heapPtr) & ~NANBOX_PTR_MASK) ||
+        (((uint64_t)(size_t)&staticInt) & ~NANBOX_PTR_MASK)) {
+      fprintf(stderr, "pointers do not fit in 48 bits (needed for NaN-boxing)\n");
+      exit(1);
+    }
+    free(heapPtr);
+  }
+#endif
 }
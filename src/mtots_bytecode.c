@@ -0,0 +1,505 @@
+#include "mtots_bytecode.h"
+#include "mtots_vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* File layout (all numbers in the byte order of the machine that wrote
+ * the file; the header rejects files from machines that differ):
+ *
+ *   header:
+ *     BYTECODE_MAGIC, u32 version, u32 BYTECODE_FLAGS,
+ *     u32 BYTECODE_BYTE_ORDER_CHECK, double BYTECODE_DOUBLE_CHECK,
+ *     u32 source length, u32 source hash, u32 checksum
+ *   dependencies:
+ *     u32 count, (value module name, value path, value) * count
+ *     (see getCompiledDependencies() in mtots_compiler.h)
+ *   thunk:
+ *     i16 arity, i16 upvalueCount, value name,
+ *     i16 defaultArgsCount, value * defaultArgsCount,
+ *     i32 count, u8 code * count, i16 lines * count,
+ *     u32 constantCount, value * constantCount,
+ *     i32 cacheCount
+ *   value:
+ *     u8 tag, followed by a double for BYTECODE_NUMBER, a u32 length and
+ *     the characters for BYTECODE_STRING, or a thunk for BYTECODE_THUNK
+ */
+
+#define BYTECODE_MAGIC "mtotsbc"
+#define BYTECODE_MAGIC_SIZE 8 /* including the terminating NUL */
+#define BYTECODE_BYTE_ORDER_CHECK 0x01020304UL
+#define BYTECODE_DOUBLE_CHECK 1.5
+
+/* The compile-time options that change what the compiler emits for the
+ * same source, one bit each. A cache file written by a build with other
+ * options is not used. */
+#define BYTECODE_FLAG_OPTIMIZE           0x01UL
+#define BYTECODE_FLAG_SUPERINSTRUCTIONS  0x02UL
+#define BYTECODE_FLAGS ( \
+  (MTOTS_OPTIMIZE_BYTECODE ? BYTECODE_FLAG_OPTIMIZE : 0) | \
+  (MTOTS_USE_SUPERINSTRUCTIONS ? BYTECODE_FLAG_SUPERINSTRUCTIONS : 0))
+
+#define BYTECODE_FILE_EXTENSION "c"
+
+typedef enum BytecodeTag {
+  BYTECODE_NIL,
+  BYTECODE_TRUE,
+  BYTECODE_FALSE,
+  BYTECODE_NUMBER,
+  BYTECODE_STRING,
+  BYTECODE_THUNK
+} BytecodeTag;
+
+typedef struct Reader {
+  const u8 *next;
+  const u8 *end;
+  ubool failed;
+} Reader;
+
+#define FNV_OFFSET_BASIS 2166136261u
+
+/* FNV-1a, like interned strings. Pass FNV_OFFSET_BASIS as 'hash' to
+ * start, or the previous result to continue. */
+static u32 hashBytes(u32 hash, const void *data, size_t length) {
+  const u8 *bytes = (const u8*)data;
+  size_t i;
+  for (i = 0; i < length; i++) {
+    hash ^= bytes[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+static u32 hashSource(const char *source, size_t length) {
+  return hashBytes(FNV_OFFSET_BASIS, source, length);
+}
+
+ubool getBytecodeCachePath(const char *sourcePath, char *out) {
+  size_t length = strlen(sourcePath);
+  if (length + strlen(BYTECODE_FILE_EXTENSION) + 1 > MAX_PATH_LENGTH) {
+    return UFALSE;
+  }
+  memcpy(out, sourcePath, length);
+  strcpy(out + length, BYTECODE_FILE_EXTENSION);
+  return UTRUE;
+}
+
+/* Reading */
+
+static ubool readBytes(Reader *reader, void *out, size_t size) {
+  if (reader->failed || (size_t)(reader->end - reader->next) < size) {
+    reader->failed = UTRUE;
+    return UFALSE;
+  }
+  memcpy(out, reader->next, size);
+  reader->next += size;
+  return UTRUE;
+}
+
+static u8 readU8(Reader *reader) {
+  u8 value = 0;
+  readBytes(reader, &value, sizeof(value));
+  return value;
+}
+
+static i16 readI16(Reader *reader) {
+  i16 value = 0;
+  readBytes(reader, &value, sizeof(value));
+  return value;
+}
+
+static u32 readU32(Reader *reader) {
+  u32 value = 0;
+  readBytes(reader, &value, sizeof(value));
+  return value;
+}
+
+static i32 readI32(Reader *reader) {
+  i32 value = 0;
+  readBytes(reader, &value, sizeof(value));
+  return value;
+}
+
+static double readDouble(Reader *reader) {
+  double value = 0;
+  readBytes(reader, &value, sizeof(value));
+  return value;
+}
+
+static ObjThunk *readThunk(Reader *reader, String *moduleName);
+
+/* If the value is a thunk, it is left on the stack, and *pushed is
+ * set, so that the caller can keep it reachable until it is stored */
+static Value readValue(
+    Reader *reader, String *moduleName, ubool allowThunk, ubool *pushed) {
+  *pushed = UFALSE;
+  switch (readU8(reader)) {
+    case BYTECODE_NIL: return NIL_VAL();
+    case BYTECODE_TRUE: return BOOL_VAL(UTRUE);
+    case BYTECODE_FALSE: return BOOL_VAL(UFALSE);
+    case BYTECODE_NUMBER: return NUMBER_VAL(readDouble(reader));
+    case BYTECODE_STRING: {
+      u32 length = readU32(reader);
+      if (reader->failed || (size_t)(reader->end - reader->next) < length) {
+        break;
+      }
+      reader->next += length;
+      /* Constants are always interned, as they are by the compiler */
+      return STRING_VAL(internString(
+        (const char*)reader->next - length, length));
+    }
+    case BYTECODE_THUNK: {
+      ObjThunk *thunk;
+      if (!allowThunk) {
+        break;
+      }
+      thunk = readThunk(reader, moduleName);
+      if (thunk == NULL) {
+        break;
+      }
+      *pushed = UTRUE;
+      return THUNK_VAL(thunk);
+    }
+  }
+  reader->failed = UTRUE;
+  return NIL_VAL();
+}
+
+/* Checks that the native module members that the code was compiled
+ * with still have the same values */
+static ubool readDependencies(Reader *reader) {
+  u32 i, count = readU32(reader);
+  for (i = 0; i < count && !reader->failed; i++) {
+    ubool pushed;
+    Value moduleName, path, value, member;
+    ObjInstance *module;
+    const char *start, *end;
+
+    moduleName = readValue(reader, NULL, UFALSE, &pushed);
+    push(moduleName);
+    path = readValue(reader, NULL, UFALSE, &pushed);
+    push(path);
+    value = readValue(reader, NULL, UFALSE, &pushed);
+    push(value);
+    if (reader->failed || !IS_STRING(moduleName) || !IS_STRING(path) ||
+        (module = importNativeModule(AS_STRING(moduleName))) == NULL) {
+      return UFALSE;
+    }
+    member = INSTANCE_VAL(module);
+    for (start = AS_STRING(path)->chars; ; start = end + 1) {
+      String *name;
+      end = strchr(start, '.');
+      if (end == NULL) {
+        end = start + strlen(start);
+      }
+      name = internString(start, end - start);
+      if (!IS_MODULE(member) || !mapGetStr(
+            &AS_INSTANCE(member)->klass->constants, name, &member)) {
+        return UFALSE;
+      }
+      if (*end == '\0') {
+        break;
+      }
+    }
+    if (!valuesIs(member, value)) {
+      return UFALSE;
+    }
+    pop(); /* value */
+    pop(); /* path */
+    pop(); /* moduleName */
+  }
+  return !reader->failed;
+}
+
+/* On success, the new thunk is left on the stack */
+static ObjThunk *readThunk(Reader *reader, String *moduleName) {
+  ObjThunk *thunk = newFunction();
+  Chunk *chunk = &thunk->chunk;
+  Value value;
+  ubool pushed;
+  i16 defaultArgsCount;
+  i32 count, cacheCount, i;
+  u32 constantCount, j;
+
+  push(THUNK_VAL(thunk));
+  thunk->moduleName = moduleName;
+  thunk->arity = readI16(reader);
+  thunk->upvalueCount = readI16(reader);
+
+  value = readValue(reader, moduleName, UFALSE, &pushed);
+  if (IS_STRING(value)) {
+    thunk->name = AS_STRING(value);
+  } else if (!IS_NIL(value)) {
+    reader->failed = UTRUE;
+  }
+
+  defaultArgsCount = readI16(reader);
+  if (reader->failed || defaultArgsCount < 0) {
+    return NULL;
+  }
+  if (defaultArgsCount > 0) {
+    thunk->defaultArgs = ALLOCATE(Value, defaultArgsCount);
+    for (i = 0; i < defaultArgsCount; i++) {
+      thunk->defaultArgs[i] = NIL_VAL();
+    }
+    thunk->defaultArgsCount = defaultArgsCount;
+    for (i = 0; i < defaultArgsCount; i++) {
+      thunk->defaultArgs[i] = readValue(reader, moduleName, UFALSE, &pushed);
+    }
+  }
+
+  count = readI32(reader);
+  if (reader->failed || count <= 0 ||
+      (size_t)(reader->end - reader->next) <
+        (size_t)count * (1 + sizeof(i16))) {
+    reader->failed = UTRUE;
+    return NULL;
+  }
+  chunk->code = ALLOCATE(u8, count);
+  chunk->lines = ALLOCATE(i16, count);
+  chunk->capacity = chunk->count = count;
+  readBytes(reader, chunk->code, count);
+  readBytes(reader, chunk->lines, sizeof(i16) * count);
+
+  constantCount = readU32(reader);
+  for (j = 0; j < constantCount && !reader->failed; j++) {
+    value = readValue(reader, moduleName, UTRUE, &pushed);
+    if (!pushed) {
+      push(value);
+    }
+    writeValueArray(&chunk->constants, value);
+    pop();
+  }
+
+  cacheCount = readI32(reader);
+  if (reader->failed || cacheCount < 0) {
+    reader->failed = UTRUE;
+    return NULL;
+  }
+  for (i = 0; i < cacheCount; i++) {
+    addInlineCache(chunk);
+  }
+
+  return thunk;
+}
+
+/* Reads the checksum at the end of the header, and checks it against
+ * the rest of the file. The rest of the reader does not check that
+ * opcodes and their operands are in range, so a damaged file must never
+ * get that far. */
+static ubool checkPayload(Reader *reader) {
+  u32 checksum = readU32(reader);
+  return !reader->failed && checksum == hashBytes(
+    FNV_OFFSET_BASIS, reader->next, (size_t)(reader->end - reader->next));
+}
+
+ObjThunk *loadBytecode(
+    const char *cachePath, const char *source, String *moduleName) {
+  size_t sourceLength = strlen(source);
+  char magic[BYTECODE_MAGIC_SIZE];
+  Value *stackStart = vm.stackTop;
+  Reader reader;
+  ObjThunk *thunk;
+  u8 *data;
+  long size;
+  FILE *file = fopen(cachePath, "rb");
+
+  if (file == NULL) {
+    return NULL;
+  }
+  if (fseek(file, 0L, SEEK_END) != 0 || (size = ftell(file)) <= 0) {
+    fclose(file);
+    return NULL;
+  }
+  rewind(file);
+  data = (u8*)malloc(size);
+  if (data == NULL || fread(data, 1, size, file) != (size_t)size) {
+    free(data);
+    fclose(file);
+    return NULL;
+  }
+  fclose(file);
+
+  reader.next = data;
+  reader.end = data + size;
+  reader.failed = UFALSE;
+
+  readBytes(&reader, magic, BYTECODE_MAGIC_SIZE);
+  if (reader.failed ||
+      memcmp(magic, BYTECODE_MAGIC, BYTECODE_MAGIC_SIZE) != 0 ||
+      readU32(&reader) != BYTECODE_FORMAT_VERSION ||
+      readU32(&reader) != BYTECODE_FLAGS ||
+      readU32(&reader) != BYTECODE_BYTE_ORDER_CHECK ||
+      readDouble(&reader) != BYTECODE_DOUBLE_CHECK ||
+      readU32(&reader) != (u32)sourceLength ||
+      readU32(&reader) != hashSource(source, sourceLength) ||
+      !checkPayload(&reader) ||
+      !readDependencies(&reader)) {
+    free(data);
+    vm.stackTop = stackStart;
+    return NULL;
+  }
+
+  thunk = readThunk(&reader, moduleName);
+  if (reader.next != reader.end) {
+    reader.failed = UTRUE;
+  }
+  free(data);
+  vm.stackTop = stackStart;
+  return reader.failed ? NULL : thunk;
+}
+
+/* Writing */
+
+typedef struct Writer {
+  FILE *file;
+  ubool failed;
+  ubool checksumming; /* whether writes count towards 'checksum' */
+  u32 checksum;
+} Writer;
+
+static void writeBytes(Writer *writer, const void *data, size_t size) {
+  if (size > 0 && fwrite(data, 1, size, writer->file) != size) {
+    writer->failed = UTRUE;
+  }
+  if (writer->checksumming) {
+    writer->checksum = hashBytes(writer->checksum, data, size);
+  }
+}
+
+static void writeU8(Writer *writer, u8 value) {
+  writeBytes(writer, &value, sizeof(value));
+}
+
+static void writeI16(Writer *writer, i16 value) {
+  writeBytes(writer, &value, sizeof(value));
+}
+
+static void writeU32(Writer *writer, u32 value) {
+  writeBytes(writer, &value, sizeof(value));
+}
+
+static void writeI32(Writer *writer, i32 value) {
+  writeBytes(writer, &value, sizeof(value));
+}
+
+static void writeDouble(Writer *writer, double value) {
+  writeBytes(writer, &value, sizeof(value));
+}
+
+static void writeThunk(Writer *writer, ObjThunk *thunk);
+
+static void writeValue(Writer *writer, Value value) {
+  if (IS_NIL(value)) {
+    writeU8(writer, BYTECODE_NIL);
+  } else if (IS_BOOL(value)) {
+    writeU8(writer, AS_BOOL(value) ? BYTECODE_TRUE : BYTECODE_FALSE);
+  } else if (IS_NUMBER(value)) {
+    writeU8(writer, BYTECODE_NUMBER);
+    writeDouble(writer, AS_NUMBER(value));
+  } else if (IS_STRING(value)) {
+    String *string = AS_STRING(value);
+    writeU8(writer, BYTECODE_STRING);
+    writeU32(writer, (u32)string->length);
+    writeBytes(writer, string->chars, string->length);
+  } else if (IS_THUNK(value)) {
+    writeU8(writer, BYTECODE_THUNK);
+    writeThunk(writer, AS_THUNK(value));
+  } else {
+    /* Not something the compiler puts in a thunk */
+    writer->failed = UTRUE;
+  }
+}
+
+static void writeThunk(Writer *writer, ObjThunk *thunk) {
+  Chunk *chunk = &thunk->chunk;
+  i16 i;
+  size_t j;
+
+  writeI16(writer, thunk->arity);
+  writeI16(writer, thunk->upvalueCount);
+  writeValue(writer, thunk->name ? STRING_VAL(thunk->name) : NIL_VAL());
+
+  writeI16(writer, thunk->defaultArgsCount);
+  for (i = 0; i < thunk->defaultArgsCount; i++) {
+    writeValue(writer, thunk->defaultArgs[i]);
+  }
+
+  writeI32(writer, chunk->count);
+  writeBytes(writer, chunk->code, chunk->count);
+  writeBytes(writer, chunk->lines, sizeof(i16) * chunk->count);
+
+  writeU32(writer, (u32)chunk->constants.count);
+  for (j = 0; j < chunk->constants.count; j++) {
+    writeValue(writer, chunk->constants.values[j]);
+  }
+
+  writeI32(writer, chunk->cacheCount);
+}
+
+void saveBytecode(
+    const char *cachePath, const char *source, ObjThunk *thunk,
+    ValueArray *dependencies) {
+  size_t sourceLength = strlen(source), i;
+  char tempPath[MAX_PATH_LENGTH];
+  Writer writer;
+  long checksumOffset;
+
+  /* Write to a temporary file first, so that other processes never
+   * see a partially written cache file */
+  if (strlen(cachePath) + 4 + 1 > MAX_PATH_LENGTH) {
+    return;
+  }
+  strcpy(tempPath, cachePath);
+  strcat(tempPath, ".tmp");
+
+  writer.file = fopen(tempPath, "wb");
+  writer.failed = UFALSE;
+  writer.checksumming = UFALSE;
+  writer.checksum = FNV_OFFSET_BASIS;
+  if (writer.file == NULL) {
+    return;
+  }
+
+  writeBytes(&writer, BYTECODE_MAGIC, BYTECODE_MAGIC_SIZE);
+  writeU32(&writer, BYTECODE_FORMAT_VERSION);
+  writeU32(&writer, BYTECODE_FLAGS);
+  writeU32(&writer, BYTECODE_BYTE_ORDER_CHECK);
+  writeDouble(&writer, BYTECODE_DOUBLE_CHECK);
+  writeU32(&writer, (u32)sourceLength);
+  writeU32(&writer, hashSource(source, sourceLength));
+
+  /* The checksum covers everything after the header, so it is only
+   * known at the end */
+  checksumOffset = ftell(writer.file);
+  writeU32(&writer, 0);
+  writer.checksumming = UTRUE;
+  writeU32(&writer, (u32)(dependencies->count / 3));
+  for (i = 0; i < dependencies->count; i++) {
+    writeValue(&writer, dependencies->values[i]);
+  }
+  writeThunk(&writer, thunk);
+  writer.checksumming = UFALSE;
+  if (checksumOffset < 0 ||
+      fseek(writer.file, checksumOffset, SEEK_SET) != 0) {
+    writer.failed = UTRUE;
+  } else {
+    writeU32(&writer, writer.checksum);
+  }
+
+  if (fclose(writer.file) != 0) {
+    writer.failed = UTRUE;
+  }
+  if (writer.failed) {
+    remove(tempPath);
+    return;
+  }
+  if (rename(tempPath, cachePath) != 0) {
+    /* e.g. on Windows, where rename does not replace existing files */
+    remove(cachePath);
+    if (rename(tempPath, cachePath) != 0) {
+      remove(tempPath);
+    }
+  }
+}
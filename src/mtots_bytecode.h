@@ -0,0 +1,42 @@
+#ifndef mtots_bytecode_h
+#define mtots_bytecode_h
+
+#include "mtots_object.h"
+
+/* Serialized bytecode, so that modules do not have to be compiled again
+ * every time a process starts.
+ *
+ * A cache file holds the thunk compiled from a module's source, along
+ * with the length and hash of that source. It is only used while both
+ * still match, and only by a build with the same bytecode format and
+ * the same compile-time options that affect the compiler's output (see
+ * BYTECODE_FLAGS in mtots_bytecode.c). A checksum over the rest of the
+ * file catches files that were damaged after they were written.
+ *
+ * BYTECODE_FORMAT_VERSION has to be bumped whenever the opcodes, or what
+ * the compiler emits for the same source, change.
+ */
+#define BYTECODE_FORMAT_VERSION 10
+
+/* Writes the path of the cache file for the given source file into 'out',
+ * which must have room for MAX_PATH_LENGTH characters.
+ * Returns UFALSE if the path would be too long. */
+ubool getBytecodeCachePath(const char *sourcePath, char *out);
+
+/* Returns the thunk stored in the given cache file, or NULL if there is
+ * no usable one (e.g. the file is missing, stale or corrupt).
+ * Every thunk in a module shares the module's name, so it is not stored
+ * in the file, but given here. */
+ObjThunk *loadBytecode(
+  const char *cachePath, const char *source, String *moduleName);
+
+/* Writes the thunk compiled from 'source' to the given cache file,
+ * along with the native module members it depends on (see
+ * getCompiledDependencies() in mtots_compiler.h). The file is only used
+ * again while those members keep the same values.
+ * Failures are ignored: the cache is only an optimization. */
+void saveBytecode(
+  const char *cachePath, const char *source, ObjThunk *thunk,
+  ValueArray *dependencies);
+
+#endif/*mtots_bytecode_h*/
@@ -8,12 +8,16 @@ void initChunk(Chunk *chunk) {
   chunk->code = NULL;
   chunk->lines = NULL;
   initValueArray(&chunk->constants);
+  chunk->caches = NULL;
+  chunk->cacheCount = 0;
+  chunk->cacheCapacity = 0;
 }
 
 void freeChunk(Chunk *chunk) {
   FREE_ARRAY(u8, chunk->code, chunk->capacity);
   FREE_ARRAY(i16, chunk->lines, chunk->capacity);
   freeValueArray(&chunk->constants);
+  FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
   initChunk(chunk);
 }
 
@@ -48,3 +52,72 @@ size_t addConstant(Chunk *chunk, Value value) {
   pop();
   return chunk->constants.count - 1;
 }
+
+size_t addInlineCache(Chunk *chunk) {
+  InlineCache *cache;
+  if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+    i32 oldCapacity = chunk->cacheCapacity;
+    chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->caches = GROW_ARRAY(
+      InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+  }
+  cache = &chunk->caches[chunk->cacheCount];
+  cache->guard = NULL;
+  cache->index = 0;
+  cache->misses = 0;
+  return chunk->cacheCount++;
+}
+
+i32 instructionSize(Chunk *chunk, i32 offset) {
+  switch (chunk->code[offset]) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CALL:
+    case OP_CALL_RANGE:
+    case OP_IMPORT:
+    case OP_NEW_LIST:
+    case OP_NEW_TUPLE:
+    case OP_NEW_DICT:
+    case OP_NEW_FROZEN_DICT:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_STATIC_METHOD:
+    case OP_SET_LOCAL_POP:
+    case OP_CHECK_NUMBER:
+      return 2;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+    case OP_JUMP_IF_STOP_ITERATION:
+    case OP_TRY_START:
+    case OP_TRY_END:
+    case OP_LOOP:
+    case OP_SUPER_INVOKE:
+    case OP_GET_LOCALS:
+    case OP_ADD_LOCALS:
+    case OP_GET_LOCAL_CONSTANT:
+    case OP_CHECK_LOCAL_NUMBER:
+    case OP_NUMBER_MULTIPLY_LOCALS:
+      return 3;
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_FIELD:
+    case OP_SET_FIELD:
+      return 4;
+    case OP_INVOKE:
+    case OP_GET_LOCAL_FIELD:
+    case OP_LESS_LOCAL_CONSTANT_JUMP_IF_FALSE:
+      return 5;
+    case OP_CLOSURE: {
+      ObjThunk *thunk = AS_THUNK(
+        chunk->constants.values[chunk->code[offset + 1]]);
+      return 2 + 2 * thunk->upvalueCount;
+    }
+    default:
+      return 1;
+  }
+}
@@ -11,13 +11,13 @@ typedef enum OpCode {
   OP_POP,
   OP_GET_LOCAL,
   OP_SET_LOCAL,
-  OP_GET_GLOBAL,
+  OP_GET_GLOBAL, /* name, 2-byte cache index */
   OP_DEFINE_GLOBAL,
-  OP_SET_GLOBAL,
+  OP_SET_GLOBAL, /* name, 2-byte cache index */
   OP_GET_UPVALUE,
   OP_SET_UPVALUE,
-  OP_GET_FIELD,
-  OP_SET_FIELD,
+  OP_GET_FIELD, /* name, 2-byte cache index */
+  OP_SET_FIELD, /* name, 2-byte cache index */
   OP_IS,
   OP_EQUAL,
   OP_GREATER,
@@ -39,15 +39,17 @@ typedef enum OpCode {
   OP_NEGATE,
   OP_JUMP,
   OP_JUMP_IF_FALSE,
+  OP_JUMP_IF_TRUE,
   OP_JUMP_IF_STOP_ITERATION,
   OP_TRY_START,
   OP_TRY_END,
   OP_RAISE,
-  OP_GET_ITER, /* iterable TOS, replaces with iterator */
-  OP_GET_NEXT, /* iterator TOS, pushes next item */
+  OP_GET_ITER, /* iterable TOS, replaces with a loop state */
+  OP_GET_NEXT, /* loop state on top, pushes next item or StopIteration */
   OP_LOOP,
   OP_CALL,
-  OP_INVOKE,
+  OP_CALL_RANGE, /* argCount: OP_CALL, but see below */
+  OP_INVOKE, /* name, argCount, 2-byte cache index */
   OP_SUPER_INVOKE,
   OP_CLOSURE,
   OP_CLOSE_UPVALUE,
@@ -60,20 +62,117 @@ typedef enum OpCode {
   OP_CLASS,
   OP_INHERIT,
   OP_METHOD,
-  OP_STATIC_METHOD
+  OP_STATIC_METHOD,
+
+  /* Superinstructions, each doing the work of a common sequence of the
+   * instructions above. Only the optimizer emits these (see
+   * mtots_optimizer.h), and scripts/opcode-pairs.py shows which
+   * sequences are worth fusing. */
+  OP_GET_LOCALS,        /* slot, slot: OP_GET_LOCAL, OP_GET_LOCAL */
+  OP_ADD_LOCALS,        /* slot, slot: OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD */
+  OP_GET_LOCAL_CONSTANT, /* slot, constant: OP_GET_LOCAL, OP_CONSTANT */
+  OP_GET_LOCAL_FIELD,   /* slot, name, 2-byte cache index:
+                         * OP_GET_LOCAL, OP_GET_FIELD */
+  OP_SET_LOCAL_POP,     /* slot: OP_SET_LOCAL, OP_POP */
+  OP_LESS_LOCAL_CONSTANT_JUMP_IF_FALSE,
+                        /* slot, constant, 2-byte offset:
+                         * OP_GET_LOCAL, OP_CONSTANT, OP_LESS,
+                         * OP_JUMP_IF_FALSE */
+
+  /* Instructions for typed modules (see compile() in mtots_compiler.h).
+   * The compiler only emits the OP_NUMBER_* instructions where it has
+   * proven that both operands are numbers, so they do not check them.
+   * OP_CHECK_NUMBER and OP_CHECK_LOCAL_NUMBER guard everything that
+   * such a proof relies on, and raise an error naming the variable. */
+  OP_NUMBER_ADD,
+  OP_NUMBER_SUBTRACT,
+  OP_NUMBER_MULTIPLY,
+  OP_NUMBER_DIVIDE,
+  OP_NUMBER_LESS,
+  OP_NUMBER_GREATER,
+  OP_CHECK_NUMBER,       /* name: checks TOS */
+  OP_CHECK_LOCAL_NUMBER, /* slot, name */
+  OP_NUMBER_MULTIPLY_LOCALS, /* slot, slot: a superinstruction for
+                              * OP_GET_LOCAL, OP_GET_LOCAL,
+                              * OP_NUMBER_MULTIPLY */
+
+  /* Quickened instructions. The VM rewrites a generic instruction into
+   * one of these once it has seen the types of its operands, and back
+   * again when they turn out to be different (see MTOTS_USE_QUICKENING).
+   * They never appear in compiled or cached bytecode. */
+  OP_EQUAL_NUMBERS,
+  OP_GREATER_NUMBERS,
+  OP_LESS_NUMBERS,
+  OP_ADD_NUMBERS,
+  OP_ADD_STRINGS
 } OpCode;
 
+/* The loop state of a for-in loop is three values on the stack, kept
+ * there as hidden locals. From the bottom:
+ *
+ *   - for range(): the next number, the stop and the step;
+ *   - for lists, tuples, strings, dicts and frozendicts: the index of
+ *     the next item, nil, and the container;
+ *   - for anything else: nil, nil, and an iterator, which is called
+ *     for each item.
+ *
+ * So the first two kinds are looped over without allocating anything
+ * or calling anything for each item.
+ *
+ * OP_GET_NEXT is always followed by OP_JUMP_IF_STOP_ITERATION, and
+ * skips it when it can tell right away that there is a next item.
+ *
+ * OP_CALL_RANGE is only emitted for 'for x in range(...)', and is always
+ * followed by OP_GET_ITER. If it is calling the builtin range() with
+ * number arguments, it turns the callee and the arguments into a loop
+ * state directly, and skips the OP_GET_ITER.
+ */
+
+/* Per call site cache for OP_GET_FIELD, OP_SET_FIELD and OP_INVOKE.
+ * Each of these instructions carries a 2-byte index into Chunk.caches.
+ *
+ * 'guard' is what the cache was last filled for, and 'index' is where
+ * the name was found there:
+ *
+ *   - for OP_INVOKE, the receiver's class and an entry of its methods;
+ *   - for fields of an instance in shape mode, its Shape and a slot;
+ *   - for fields of an instance in dictionary mode (e.g. a module),
+ *     its fields Map and an entry of that Map;
+ *   - for OP_GET_GLOBAL and OP_SET_GLOBAL, the fields Map of the
+ *     current module and an entry of that Map.
+ *
+ * A hit still checks that the name is at 'index', so a stale cache
+ * is only ever slow, never wrong.
+ */
+typedef struct InlineCache {
+  void *guard;
+  u32 index;
+  u32 misses; /* number of times the guard changed */
+} InlineCache;
+
+/* Sites whose guard changes more than this many times are considered
+ * megamorphic, and stop updating their cache */
+#define INLINE_CACHE_MAX_MISSES 16
+
 typedef struct Chunk {
   i32 count;
   i32 capacity;
   u8 *code;
   i16 *lines;
   ValueArray constants;
+  InlineCache *caches;
+  i32 cacheCount;
+  i32 cacheCapacity;
 } Chunk;
 
 void initChunk(Chunk *chunk);
 void freeChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, u8 byte, i16 line);
 size_t addConstant(Chunk *chunk, Value value);
+size_t addInlineCache(Chunk *chunk);
+
+/* Returns the size in bytes of the instruction at 'offset',
+ * including its operands */
+i32 instructionSize(Chunk *chunk, i32 offset);
 
 #endif/*mtots_chunk_h*/
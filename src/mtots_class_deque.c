@@ -0,0 +1,247 @@
+#include "mtots_class_deque.h"
+#include "mtots_vm.h"
+
+/* Makes room for at least one more item, and moves the items to the
+ * start of the new buffer */
+static void growDeque(ObjDeque *deque) {
+  size_t i, capacity = deque->capacity < 8 ? 8 : deque->capacity * 2;
+  Value *buffer = ALLOCATE(Value, capacity);
+  for (i = 0; i < deque->length; i++) {
+    buffer[i] = DEQUE_ITEM(deque, i);
+  }
+  FREE_ARRAY(Value, deque->buffer, deque->capacity);
+  deque->buffer = buffer;
+  deque->capacity = capacity;
+  deque->start = 0;
+}
+
+/* May allocate, so the deque and the value have to be reachable */
+static void dequeAppend(ObjDeque *deque, Value value) {
+  if (deque->maxLength > 0 && deque->length == deque->maxLength) {
+    WRITE_BARRIER(deque->buffer[deque->start]);
+    deque->start = (deque->start + 1) & (deque->capacity - 1);
+    deque->length--;
+  }
+  if (deque->length == deque->capacity) {
+    growDeque(deque);
+  }
+  DEQUE_ITEM(deque, deque->length) = value;
+  deque->length++;
+}
+
+static void dequeAppendLeft(ObjDeque *deque, Value value) {
+  if (deque->maxLength > 0 && deque->length == deque->maxLength) {
+    WRITE_BARRIER(DEQUE_ITEM(deque, deque->length - 1));
+    deque->length--;
+  }
+  if (deque->length == deque->capacity) {
+    growDeque(deque);
+  }
+  deque->start = (deque->start - 1) & (deque->capacity - 1);
+  deque->buffer[deque->start] = value;
+  deque->length++;
+}
+
+static ubool implDequeAppend(i16 argCount, Value *args, Value *out) {
+  dequeAppend(AS_DEQUE(args[-1]), args[0]);
+  return UTRUE;
+}
+
+static CFunction funcDequeAppend = { implDequeAppend, "append", 1 };
+
+static ubool implDequeAppendLeft(i16 argCount, Value *args, Value *out) {
+  dequeAppendLeft(AS_DEQUE(args[-1]), args[0]);
+  return UTRUE;
+}
+
+static CFunction funcDequeAppendLeft = {
+  implDequeAppendLeft, "appendLeft", 1 };
+
+static ubool implDequePop(i16 argCount, Value *args, Value *out) {
+  ObjDeque *deque = AS_DEQUE(args[-1]);
+  if (deque->length == 0) {
+    runtimeError("Pop from an empty Deque");
+    return UFALSE;
+  }
+  *out = DEQUE_ITEM(deque, deque->length - 1);
+  WRITE_BARRIER(*out);
+  deque->length--;
+  return UTRUE;
+}
+
+static CFunction funcDequePop = { implDequePop, "pop", 0 };
+
+static ubool implDequePopLeft(i16 argCount, Value *args, Value *out) {
+  ObjDeque *deque = AS_DEQUE(args[-1]);
+  if (deque->length == 0) {
+    runtimeError("Pop from an empty Deque");
+    return UFALSE;
+  }
+  *out = deque->buffer[deque->start];
+  WRITE_BARRIER(*out);
+  deque->start = (deque->start + 1) & (deque->capacity - 1);
+  deque->length--;
+  return UTRUE;
+}
+
+static CFunction funcDequePopLeft = { implDequePopLeft, "popLeft", 0 };
+
+/* Checks the index like List.__getitem__ does, allowing negative
+ * indices from the end */
+static ubool getDequeIndex(ObjDeque *deque, Value value, size_t *out) {
+  i32 index;
+  if (!IS_NUMBER(value)) {
+    runtimeError("Expected Deque index to be a number");
+    return UFALSE;
+  }
+  index = (i32) AS_NUMBER(value);
+  if (index < 0) {
+    index += deque->length;
+  }
+  if (index < 0 || (size_t)index >= deque->length) {
+    runtimeError("Deque index out of bounds");
+    return UFALSE;
+  }
+  *out = (size_t)index;
+  return UTRUE;
+}
+
+static ubool implDequeGetItem(i16 argCount, Value *args, Value *out) {
+  ObjDeque *deque = AS_DEQUE(args[-1]);
+  size_t index;
+  if (!getDequeIndex(deque, args[0], &index)) {
+    return UFALSE;
+  }
+  *out = DEQUE_ITEM(deque, index);
+  return UTRUE;
+}
+
+static CFunction funcDequeGetItem = { implDequeGetItem, "__getitem__", 1 };
+
+static ubool implDequeSetItem(i16 argCount, Value *args, Value *out) {
+  ObjDeque *deque = AS_DEQUE(args[-1]);
+  size_t index;
+  if (!getDequeIndex(deque, args[0], &index)) {
+    return UFALSE;
+  }
+  WRITE_BARRIER(DEQUE_ITEM(deque, index));
+  DEQUE_ITEM(deque, index) = args[1];
+  return UTRUE;
+}
+
+static CFunction funcDequeSetItem = { implDequeSetItem, "__setitem__", 2 };
+
+typedef struct ObjDequeIterator {
+  ObjNativeClosure obj;
+  ObjDeque *deque;
+  size_t index;
+} ObjDequeIterator;
+
+static ubool implDequeIterator(
+    void *it, i16 argCount, Value *args, Value *out) {
+  ObjDequeIterator *iter = (ObjDequeIterator*)it;
+  if (iter->index < iter->deque->length) {
+    *out = DEQUE_ITEM(iter->deque, iter->index);
+    iter->index++;
+  } else {
+    *out = STOP_ITERATION_VAL();
+  }
+  return UTRUE;
+}
+
+static void blackenDequeIterator(void *it) {
+  ObjDequeIterator *di = (ObjDequeIterator*)it;
+  markObject((Obj*)(di->deque));
+}
+
+static ubool implDequeIter(i16 argCount, Value *args, Value *out) {
+  ObjDequeIterator *iter;
+  iter = NEW_NATIVE_CLOSURE(
+    ObjDequeIterator,
+    implDequeIterator,
+    blackenDequeIterator,
+    NULL,
+    "DequeIterator", 0, 0);
+  iter->deque = AS_DEQUE(args[-1]);
+  iter->index = 0;
+  *out = OBJ_VAL_EXPLICIT((Obj*)iter);
+  return UTRUE;
+}
+
+static CFunction funcDequeIter = { implDequeIter, "__iter__", 0 };
+
+/* Appends the items of 'iterable' to the deque, which has to be
+ * reachable */
+static ubool extendDeque(ObjDeque *deque, Value iterable) {
+  Value *state;
+  push(iterable);
+  if (!startIteration()) {
+    return UFALSE;
+  }
+  state = vm.stackTop - 3;
+  for (;;) {
+    if (!nextIteration(state)) {
+      return UFALSE;
+    }
+    if (IS_STOP_ITERATION(vm.stackTop[-1])) {
+      break;
+    }
+    dequeAppend(deque, vm.stackTop[-1]);
+    pop(); /* item */
+  }
+  vm.stackTop = state;
+  return UTRUE;
+}
+
+ubool callDequeClass(i16 argCount) {
+  Value *args = vm.stackTop - argCount;
+  size_t maxLength = 0;
+  ObjDeque *deque;
+
+  if (argCount > 2) {
+    runtimeError("Deque() expects at most 2 arguments but got %d", argCount);
+    return UFALSE;
+  }
+  if (argCount > 1 && !IS_NIL(args[1])) {
+    if (!IS_NUMBER(args[1]) || AS_NUMBER(args[1]) < 1) {
+      runtimeError("Deque() expects maxLength to be a positive number");
+      return UFALSE;
+    }
+    maxLength = (size_t)AS_NUMBER(args[1]);
+  }
+
+  deque = newDeque(maxLength);
+  push(DEQUE_VAL(deque));
+  if (argCount > 0 && !IS_NIL(args[0]) && !extendDeque(deque, args[0])) {
+    return UFALSE;
+  }
+  vm.stackTop = args - 1; /* the arguments, and the Deque class */
+  push(DEQUE_VAL(deque));
+  return UTRUE;
+}
+
+void initDequeClass() {
+  String *tmpstr;
+  CFunction *methods[] = {
+    &funcDequeAppend,
+    &funcDequeAppendLeft,
+    &funcDequePop,
+    &funcDequePopLeft,
+    &funcDequeGetItem,
+    &funcDequeSetItem,
+    &funcDequeIter,
+  };
+  size_t i;
+  ObjClass *cls;
+
+  tmpstr = internCString("Deque");
+  push(STRING_VAL(tmpstr));
+  cls = vm.dequeClass = newClass(tmpstr);
+  cls->isBuiltinClass = UTRUE;
+  pop();
+
+  for (i = 0; i < sizeof(methods) / sizeof(CFunction*); i++) {
+    methods[i]->receiverType.type = TYPE_PATTERN_DEQUE;
+    mapSetN(&cls->methods, methods[i]->name, CFUNCTION_VAL(methods[i]));
+  }
+}
@@ -0,0 +1,13 @@
+#ifndef mtots_class_deque_h
+#define mtots_class_deque_h
+
+#include "mtots_object.h"
+
+void initDequeClass();
+
+/* Deque(iterable?, maxLength?), called with the class and its arguments
+ * on the stack, like any other call. Once the deque holds maxLength
+ * items, adding one to either end drops one from the other end. */
+ubool callDequeClass(i16 argCount);
+
+#endif/*mtots_class_deque_h*/
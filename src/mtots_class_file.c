@@ -41,7 +41,7 @@ static String *readAll(FILE *fin) {
   memcpy(str + size, buffer, nread);
   size += nread;
   str[size] = '\0';
-  return internOwnedString(str, size);
+  return makeOwnedString(str, size);
 }
 
 static ubool readBytes(FILE *fin, size_t count, String **out) {
@@ -60,7 +60,7 @@ static ubool readBytes(FILE *fin, size_t count, String **out) {
     return UFALSE;
   }
   buffer[count] = '\0';
-  *out = internOwnedString(buffer, count);
+  *out = makeOwnedString(buffer, count);
   return UTRUE;
 }
 
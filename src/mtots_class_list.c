@@ -1,16 +1,6 @@
 #include "mtots_class_list.h"
 #include "mtots_vm.h"
 
-static void listAppend(ObjList *list, Value value) {
-  if (list->capacity < list->length + 1) {
-    size_t oldCapacity = list->capacity;
-    list->capacity = GROW_CAPACITY(list->capacity);
-    list->buffer = GROW_ARRAY(
-      Value, list->buffer, oldCapacity, list->capacity);
-  }
-  list->buffer[list->length++] = value;
-}
-
 static ubool implListAppend(i16 argCount, Value *args, Value *out) {
   Value receiver = args[-1];
   ObjList *list;
@@ -38,6 +28,7 @@ static ubool implListPop(i16 argCount, Value *args, Value *out) {
     return UFALSE;
   }
   *out = list->buffer[--list->length];
+  WRITE_BARRIER(*out);
   return UTRUE;
 }
 
@@ -118,6 +109,7 @@ static ubool implListSetItem(i16 argCount, Value *args, Value *out) {
     runtimeError("List index out of bounds");
     return UFALSE;
   }
+  WRITE_BARRIER(list->buffer[index]);
   list->buffer[index] = args[1];
   return UTRUE;
 }
@@ -169,6 +161,43 @@ static ubool implListIter(i16 argCount, Value *args, Value *out) {
 
 static CFunction funcListIter = { implListIter, "__iter__", 0 };
 
+ubool sortListWithKey(ObjList *list, Value key) {
+  ObjList *keys;
+  size_t i;
+  if (IS_NIL(key)) {
+    sortList(list, NULL);
+    return UTRUE;
+  }
+  keys = newList(list->length);
+  push(LIST_VAL(keys));
+  for (i = 0; i < keys->length && i < list->length; i++) {
+    push(key);
+    push(list->buffer[i]);
+    if (!callFunction(1)) {
+      return UFALSE;
+    }
+    keys->buffer[i] = pop();
+  }
+  if (keys->length != list->length) {
+    runtimeError("List changed size while its sort keys were computed");
+    return UFALSE;
+  }
+  sortList(list, keys);
+  pop(); /* keys */
+  return UTRUE;
+}
+
+static ubool implListSort(i16 argCount, Value *args, Value *out) {
+  Value receiver = args[-1];
+  if (!IS_LIST(receiver)) {
+    runtimeError("Expected list as receiver to List.sort()");
+    return UFALSE;
+  }
+  return sortListWithKey(AS_LIST(receiver), argCount > 0 ? args[0] : NIL_VAL());
+}
+
+static CFunction funcListSort = { implListSort, "sort", 0, 1 };
+
 void initListClass() {
   String *tmpstr;
   CFunction *methods[] = {
@@ -178,6 +207,7 @@ void initListClass() {
     &funcListGetItem,
     &funcListSetItem,
     &funcListIter,
+    &funcListSort,
   };
   size_t i;
   ObjClass *cls;
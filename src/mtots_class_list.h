@@ -1,6 +1,13 @@
 #ifndef mtots_class_list_h
 #define mtots_class_list_h
 
+#include "mtots_object.h"
+
 void initListClass();
 
+/* Sorts the list by what 'key' returns for each item, or by the items
+ * themselves if 'key' is nil. The list has to be reachable.
+ * Returns UFALSE if a call to 'key' fails. */
+ubool sortListWithKey(ObjList *list, Value key);
+
 #endif/*mtots_class_list_h*/
@@ -0,0 +1,190 @@
+#include "mtots_class_set.h"
+#include "mtots_vm.h"
+
+/* Set and FrozenSet share most of their methods, so both live here */
+
+/* The KeySet of a Set or FrozenSet, or NULL for any other value */
+static KeySet *getKeySet(Value value) {
+  if (IS_SET(value)) {
+    return &AS_SET(value)->set;
+  } else if (IS_FROZEN_SET(value)) {
+    return &AS_FROZEN_SET(value)->set;
+  }
+  return NULL;
+}
+
+static ubool implSetContains(i16 argCount, Value *args, Value *out) {
+  *out = BOOL_VAL(keySetContains(getKeySet(args[-1]), args[0]));
+  return UTRUE;
+}
+
+static CFunction funcSetContains = { implSetContains, "__contains__", 1 };
+static CFunction funcFrozenSetContains = {
+  implSetContains, "__contains__", 1 };
+
+typedef struct ObjSetIterator {
+  ObjNativeClosure obj;
+  Obj *set;
+  KeySetIterator it;
+} ObjSetIterator;
+
+static ubool implSetIterator(
+    void *it, i16 argCount, Value *args, Value *out) {
+  ObjSetIterator *iter = (ObjSetIterator*)it;
+  if (keySetIteratorNext(&iter->it, out)) {
+    return UTRUE;
+  }
+  *out = STOP_ITERATION_VAL();
+  return UTRUE;
+}
+
+static void blackenSetIterator(void *it) {
+  ObjSetIterator *si = (ObjSetIterator*)it;
+  markObject(si->set);
+}
+
+static ubool implSetIter(i16 argCount, Value *args, Value *out) {
+  ObjSetIterator *iter;
+  iter = NEW_NATIVE_CLOSURE(
+    ObjSetIterator,
+    implSetIterator,
+    blackenSetIterator,
+    NULL,
+    "SetIterator", 0, 0);
+  iter->set = AS_OBJ(args[-1]);
+  initKeySetIterator(&iter->it, getKeySet(args[-1]));
+  *out = OBJ_VAL_EXPLICIT((Obj*)iter);
+  return UTRUE;
+}
+
+static CFunction funcSetIter = { implSetIter, "__iter__", 0 };
+static CFunction funcFrozenSetIter = { implSetIter, "__iter__", 0 };
+
+static ubool implSetAdd(i16 argCount, Value *args, Value *out) {
+  *out = BOOL_VAL(keySetAdd(&AS_SET(args[-1])->set, args[0]));
+  return UTRUE;
+}
+
+static CFunction funcSetAdd = { implSetAdd, "add", 1 };
+
+static ubool implSetRemove(i16 argCount, Value *args, Value *out) {
+  if (!keySetDelete(&AS_SET(args[-1])->set, args[0])) {
+    runtimeError("Key not found in set");
+    return UFALSE;
+  }
+  return UTRUE;
+}
+
+static CFunction funcSetRemove = { implSetRemove, "remove", 1 };
+
+/* Runs one of the set operations in mtots_map.h on the receiver and the
+ * argument, which may each be a Set or a FrozenSet. The result is of
+ * the same kind as the receiver. */
+static ubool setOperation(
+    const char *name,
+    void (*operation)(KeySet *a, KeySet *b, KeySet *out),
+    Value *args,
+    Value *out) {
+  KeySet *other = getKeySet(args[0]);
+  ObjSet *result;
+  if (other == NULL) {
+    runtimeError(
+      "%s() expects a set or frozenset but got %s",
+      name, getKindName(args[0]));
+    return UFALSE;
+  }
+  result = newSet();
+  push(SET_VAL(result));
+  operation(getKeySet(args[-1]), other, &result->set);
+  if (IS_FROZEN_SET(args[-1])) {
+    *out = FROZEN_SET_VAL(newFrozenSet(&result->set));
+  } else {
+    *out = SET_VAL(result);
+  }
+  pop(); /* result */
+  return UTRUE;
+}
+
+static ubool implSetUnion(i16 argCount, Value *args, Value *out) {
+  return setOperation("union", keySetUnion, args, out);
+}
+
+static CFunction funcSetUnion = { implSetUnion, "union", 1 };
+static CFunction funcFrozenSetUnion = { implSetUnion, "union", 1 };
+
+static ubool implSetIntersection(i16 argCount, Value *args, Value *out) {
+  return setOperation("intersection", keySetIntersection, args, out);
+}
+
+static CFunction funcSetIntersection = {
+  implSetIntersection, "intersection", 1 };
+static CFunction funcFrozenSetIntersection = {
+  implSetIntersection, "intersection", 1 };
+
+static ubool implSetDifference(i16 argCount, Value *args, Value *out) {
+  return setOperation("difference", keySetDifference, args, out);
+}
+
+static CFunction funcSetDifference = {
+  implSetDifference, "difference", 1 };
+static CFunction funcFrozenSetDifference = {
+  implSetDifference, "difference", 1 };
+
+static ubool implSetFreeze(i16 argCount, Value *args, Value *out) {
+  ObjFrozenSet *fset = newFrozenSet(&AS_SET(args[-1])->set);
+  *out = FROZEN_SET_VAL(fset);
+  return UTRUE;
+}
+
+static CFunction funcSetFreeze = { implSetFreeze, "freeze", 0 };
+
+static void initSetLikeClass(
+    ObjClass **slot,
+    const char *name,
+    TypePatternType receiverType,
+    CFunction **methods,
+    size_t methodCount) {
+  String *tmpstr;
+  size_t i;
+  ObjClass *cls;
+
+  tmpstr = internCString(name);
+  push(STRING_VAL(tmpstr));
+  cls = *slot = newClass(tmpstr);
+  cls->isBuiltinClass = UTRUE;
+  pop();
+
+  for (i = 0; i < methodCount; i++) {
+    methods[i]->receiverType.type = receiverType;
+    mapSetN(&cls->methods, methods[i]->name, CFUNCTION_VAL(methods[i]));
+  }
+}
+
+void initSetClass() {
+  CFunction *methods[] = {
+    &funcSetContains,
+    &funcSetIter,
+    &funcSetAdd,
+    &funcSetRemove,
+    &funcSetUnion,
+    &funcSetIntersection,
+    &funcSetDifference,
+    &funcSetFreeze,
+  };
+  initSetLikeClass(
+    &vm.setClass, "Set", TYPE_PATTERN_SET,
+    methods, sizeof(methods) / sizeof(CFunction*));
+}
+
+void initFrozenSetClass() {
+  CFunction *methods[] = {
+    &funcFrozenSetContains,
+    &funcFrozenSetIter,
+    &funcFrozenSetUnion,
+    &funcFrozenSetIntersection,
+    &funcFrozenSetDifference,
+  };
+  initSetLikeClass(
+    &vm.frozenSetClass, "FrozenSet", TYPE_PATTERN_FROZEN_SET,
+    methods, sizeof(methods) / sizeof(CFunction*));
+}
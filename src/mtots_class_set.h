@@ -0,0 +1,7 @@
+#ifndef mtots_class_set_h
+#define mtots_class_set_h
+
+void initSetClass();
+void initFrozenSetClass();
+
+#endif/*mtots_class_set_h*/
@@ -81,7 +81,7 @@ static ubool implStrSlice(i16 argCount, Value *args, Value *out) {
     runtimeError("Upper slice index out of bounds");
     return UFALSE;
   }
-  *out = STRING_VAL(internString(str->chars + lower, upper - lower));
+  *out = STRING_VAL(makeString(str->chars + lower, upper - lower));
   return UTRUE;
 }
 
@@ -98,7 +98,7 @@ static ubool implStrMod(i16 argCount, Value *args, Value *out) {
     return UFALSE;
   }
 
-  *out = STRING_VAL(internString(sb.chars, sb.length));
+  *out = STRING_VAL(makeString(sb.chars, sb.length));
   freeStringBuffer(&sb);
 
   return UTRUE;
@@ -176,7 +176,7 @@ static ubool implStrReplace(i16 argCount, Value *args, Value *out) {
   char *chars = malloc(sizeof(char) * (len + 1));
   cStrReplace(orig->chars, oldstr->chars, newstr->chars, chars);
   chars[len] = '\0';
-  *out = STRING_VAL(internOwnedString(chars, len));
+  *out = STRING_VAL(makeOwnedString(chars, len));
   return UTRUE;
 }
 
@@ -216,7 +216,7 @@ static ubool implStrJoin(i16 argCount, Value *args, Value *out) {
   if (p - chars != len) {
     panic("Consistency error in String.join()");
   }
-  *out = STRING_VAL(internOwnedString(chars, len));
+  *out = STRING_VAL(makeOwnedString(chars, len));
   return UTRUE;
 }
 
@@ -1,4 +1,6 @@
 #include "mtots_compiler.h"
+#include "mtots_optimizer.h"
+#include "mtots_vm.h"
 
 #if DEBUG_PRINT_CODE
 #include "mtots_debug.h"
@@ -13,6 +15,26 @@ typedef struct Parser {
   Token previous;
   ubool hadError;
   ubool panicMode;
+
+  /* Whether the module being compiled is in typed mode (see compile()
+   * in mtots_compiler.h) */
+  ubool typed;
+
+  /* Whether the expression that was just parsed is known to evaluate
+   * to a number, and the same for the left operand of the infix
+   * operator being parsed */
+  ubool isNumber;
+  ubool leftIsNumber;
+
+  /* If the expression that was just parsed is a native module that is
+   * known at compile time (see parseModuleMember): the module, the name
+   * of the imported module it was reached from, its path from there
+   * (e.g. "gl." for 'sdl.gl'), and where the code that loads it starts */
+  ObjInstance *module;
+  String *moduleName;
+  char modulePath[MAX_PATH_LENGTH];
+  i32 moduleStart;
+  i32 moduleCacheCount;
 } Parser;
 
 typedef enum Precedence {
@@ -44,11 +66,13 @@ typedef struct Local {
   Token name;
   i16 depth;
   ubool isCaptured;
+  ubool isNumber; /* only ever holds a number (typed mode only) */
 } Local;
 
 typedef struct Upvalue {
   u8 index;
   ubool isLocal;
+  ubool isNumber;
 } Upvalue;
 
 typedef enum ThunkType {
@@ -81,6 +105,18 @@ Parser parser;
 Compiler *current = NULL;
 ClassCompiler *currentClass = NULL;
 
+/* Module-level names whose values are known at compile time: final
+ * variables initialized with a literal, which map to that value, and
+ * aliases of imported native modules, which map to the module */
+static Map knownGlobals;
+
+/* How many times each name is bound anywhere in the module being
+ * compiled (see countBindings()) */
+static Map bindingCounts;
+
+/* See getCompiledDependencies() */
+static ValueArray dependencies;
+
 static Token syntheticToken(const char *text);
 
 static Chunk *currentChunk() {
@@ -114,6 +150,12 @@ static void errorAtCurrent(const char *message) {
   errorAt(&parser.current, message);
 }
 
+static void warningAt(Token *token, const char *message) {
+  fprintf(
+    stderr, "[line %d] Warning at '%.*s': %s\n",
+    token->line, (int) token->length, token->start, message);
+}
+
 static void advance() {
   parser.previous = parser.current;
 
@@ -200,6 +242,14 @@ static u8 makeConstant(Value value) {
   return (u8) constant;
 }
 
+static void emitInlineCache() {
+  size_t index = addInlineCache(currentChunk());
+  if (index > U16_MAX) {
+    error("Too many global, field and method accesses in one chunk");
+  }
+  emitBytes((index >> 8) & 0xFF, index & 0xFF);
+}
+
 static void emitConstant(Value value) {
   emitBytes(OP_CONSTANT, makeConstant(value));
 }
@@ -237,6 +287,7 @@ static void initCompiler(Compiler *compiler, ThunkType type) {
   local = &current->locals[current->localCount++];
   local->depth = 0;
   local->isCaptured = UFALSE;
+  local->isNumber = UFALSE;
   if (type != TYPE_FUNCTION) {
     local->name.start = "this";
     local->name.length = 4;
@@ -262,6 +313,12 @@ static ObjThunk *endCompiler() {
       sizeof(Value) * current->defaultArgsCount);
   }
 
+#if MTOTS_OPTIMIZE_BYTECODE
+  if (!parser.hadError) {
+    optimizeChunk(currentChunk());
+  }
+#endif
+
 #if DEBUG_PRINT_CODE
   if (!parser.hadError) {
     disassembleChunk(
@@ -295,7 +352,7 @@ static void endScope() {
 }
 
 static void parseFieldDeclaration();
-static void parseTypeExpression();
+static ubool parseTypeExpression();
 static void parseExpression();
 static void parseStatement();
 static void parseDeclaration();
@@ -355,8 +412,11 @@ static i16 resolveUpvalue(Compiler *compiler, Token *name) {
 
   local = resolveLocal(compiler->enclosing, name);
   if (local != -1) {
+    i16 upvalue = addUpvalue(compiler, (u8) local, UTRUE);
     compiler->enclosing->locals[local].isCaptured = UTRUE;
-    return addUpvalue(compiler, (u8) local, UTRUE);
+    compiler->upvalues[upvalue].isNumber =
+      compiler->enclosing->locals[local].isNumber;
+    return upvalue;
   }
 
   return -1;
@@ -374,6 +434,127 @@ static void addLocal(Token name) {
   local->name = name;
   local->depth = -1;
   local->isCaptured = UFALSE;
+  local->isNumber = UFALSE;
+}
+
+/* A module-level name that is defined again no longer has a value that
+ * is known at compile time. Final ones can't be defined again. */
+static void forgetKnownGlobal(Token *name) {
+  String *global = internString(name->start, name->length);
+  Value known;
+  if (!mapGetStr(&knownGlobals, global, &known)) {
+    return;
+  }
+  if (IS_MODULE(known)) {
+    mapDeleteStr(&knownGlobals, global);
+  } else {
+    errorAt(name, "Already a final variable with this name");
+  }
+}
+
+static void addBinding(Token *name, u32 count) {
+  String *key;
+  Value value;
+  if (name->length == 0) {
+    return; /* e.g. an 'import' with no name after it */
+  }
+  key = internString(name->start, name->length);
+  push(STRING_VAL(key));
+  if (mapGetStr(&bindingCounts, key, &value)) {
+    count += (u32)AS_NUMBER(value);
+  }
+  mapSetStr(&bindingCounts, key, NUMBER_VAL(count));
+  pop(); /* key */
+}
+
+/* Scans the whole module for the places that bind a name: imports,
+ * 'def', 'class', 'var', 'final', 'for' and 'as', and assignments.
+ * Assigning to a member of a name ('os.name = ...') counts twice.
+ *
+ * An import alias is only known at compile time if its import is the
+ * only binding of that name. Finding that out as the module is compiled
+ * would be too late for functions compiled before a later assignment,
+ * which would keep using the module the alias no longer refers to.
+ * Locals are counted too, which only ever makes this more careful. */
+static void countBindings(const char *source) {
+  Token token, previous, root;
+  ubool inImport = UFALSE, inFor = UFALSE, hasRoot = UFALSE;
+  ubool isMember = UFALSE;
+
+  initScanner(source);
+  previous.type = TOKEN_NEWLINE;
+  root.start = source;
+  root.length = 0;
+  for (;;) {
+    token = scanToken();
+    if (token.type == TOKEN_EOF || token.type == TOKEN_ERROR) {
+      break;
+    }
+    if (inImport) {
+      /* the alias is the last name in the statement */
+      if (token.type == TOKEN_IDENTIFIER) {
+        root = token;
+      } else if (token.type != TOKEN_DOT && token.type != TOKEN_AS) {
+        addBinding(&root, 1);
+        inImport = UFALSE;
+      }
+    } else if (token.type == TOKEN_IMPORT) {
+      inImport = UTRUE;
+      hasRoot = UFALSE;
+    } else if (token.type == TOKEN_IDENTIFIER &&
+        previous.type != TOKEN_DOT) {
+      if (inFor ||
+          previous.type == TOKEN_DEF || previous.type == TOKEN_CLASS ||
+          previous.type == TOKEN_VAR || previous.type == TOKEN_FINAL ||
+          previous.type == TOKEN_AS) {
+        addBinding(&token, 1);
+      }
+      root = token;
+      hasRoot = UTRUE;
+      isMember = UFALSE;
+    } else if (token.type == TOKEN_IDENTIFIER) {
+      isMember = UTRUE;
+    } else if (token.type == TOKEN_EQUAL && hasRoot &&
+        previous.type == TOKEN_IDENTIFIER) {
+      addBinding(&root, isMember ? 2 : 1);
+      hasRoot = UFALSE;
+    } else if (token.type != TOKEN_DOT ||
+        previous.type != TOKEN_IDENTIFIER) {
+      hasRoot = UFALSE;
+    }
+    if (token.type == TOKEN_FOR) {
+      inFor = UTRUE;
+    } else if (token.type == TOKEN_IN) {
+      inFor = UFALSE;
+    }
+    previous = token;
+  }
+  if (inImport) {
+    addBinding(&root, 1);
+  }
+}
+
+/* If the code from 'start' to the end of the chunk just pushes a
+ * literal (number, string, bool or nil), stores it in 'out' */
+static ubool getLiteral(i32 start, Value *out) {
+  Chunk *chunk = currentChunk();
+  u8 *code = chunk->code + start;
+  i32 size = chunk->count - start;
+  if (size == 1 && (code[0] == OP_NIL || code[0] == OP_TRUE ||
+      code[0] == OP_FALSE)) {
+    *out = code[0] == OP_NIL ? NIL_VAL() : BOOL_VAL(code[0] == OP_TRUE);
+    return UTRUE;
+  }
+  if (size < 2 || code[0] != OP_CONSTANT) {
+    return UFALSE;
+  }
+  *out = chunk->constants.values[code[1]];
+  if (size == 3 && code[2] == OP_NEGATE && IS_NUMBER(*out)) {
+    *out = NUMBER_VAL(-AS_NUMBER(*out));
+    return UTRUE;
+  }
+  return size == 2 && (IS_NUMBER(*out) || IS_STRING(*out) ||
+    IS_BOOL(*out) || IS_NIL(*out));
 }
 
 /* Record the existance of a variable */
@@ -381,6 +562,7 @@ static void parseDeclareVariable() {
   Token *name;
   i16 i;
   if (current->scopeDepth == 0) {
+    forgetKnownGlobal(&parser.previous);
     return;
   }
 
@@ -458,10 +640,44 @@ static void parseAs() {
   parseTypeExpression();
 }
 
+/* In typed mode, emits the OP_NUMBER_* instruction for the given
+ * binary operator when both operands are known to be numbers.
+ * Returns UFALSE if the generic instruction has to be emitted instead. */
+static ubool emitNumberBinary(
+    Token *operatorToken, ubool leftIsNumber, ubool rightIsNumber) {
+  u8 op;
+  switch (operatorToken->type) {
+    case TOKEN_PLUS: op = OP_NUMBER_ADD; break;
+    case TOKEN_MINUS: op = OP_NUMBER_SUBTRACT; break;
+    case TOKEN_STAR: op = OP_NUMBER_MULTIPLY; break;
+    case TOKEN_SLASH: op = OP_NUMBER_DIVIDE; break;
+    case TOKEN_LESS: case TOKEN_GREATER_EQUAL: op = OP_NUMBER_LESS; break;
+    case TOKEN_GREATER: case TOKEN_LESS_EQUAL: op = OP_NUMBER_GREATER; break;
+    default: return UFALSE;
+  }
+  if (!parser.typed || (!leftIsNumber && !rightIsNumber)) {
+    return UFALSE;
+  }
+  if (!leftIsNumber || !rightIsNumber) {
+    warningAt(operatorToken, leftIsNumber ?
+      "Not specialized, the right operand is not known to be a number" :
+      "Not specialized, the left operand is not known to be a number");
+    return UFALSE;
+  }
+  emitByte(op);
+  if (operatorToken->type == TOKEN_GREATER_EQUAL ||
+      operatorToken->type == TOKEN_LESS_EQUAL) {
+    emitByte(OP_NOT);
+  }
+  return UTRUE;
+}
+
 static void parseBinary() {
+  Token operatorToken = parser.previous;
   TokenType operatorType = parser.previous.type;
   ParseRule *rule = getRule(operatorType);
   ubool isNot = UFALSE, notIn = UFALSE;
+  ubool leftIsNumber = parser.leftIsNumber, rightIsNumber;
   if (operatorType == TOKEN_IS && consumeToken(TOKEN_NOT)) {
     isNot = UTRUE;
   } else if (operatorType == TOKEN_NOT) {
@@ -472,6 +688,28 @@ static void parseBinary() {
     operatorType = TOKEN_IN;
   }
   parsePrecedence((Precedence) (rule->precedence + 1));
+  rightIsNumber = parser.isNumber;
+
+  /* '-', '/' and '//' raise an error unless both operands are numbers,
+   * and the others only give a number for two numbers */
+  switch (operatorType) {
+    case TOKEN_MINUS:
+    case TOKEN_SLASH:
+    case TOKEN_SLASH_SLASH:
+      parser.isNumber = UTRUE;
+      break;
+    case TOKEN_PLUS:
+    case TOKEN_STAR:
+    case TOKEN_PERCENT:
+      parser.isNumber = leftIsNumber && rightIsNumber;
+      break;
+    default:
+      parser.isNumber = UFALSE;
+  }
+
+  if (emitNumberBinary(&operatorToken, leftIsNumber, rightIsNumber)) {
+    return;
+  }
 
   switch (operatorType) {
     case TOKEN_IS: emitByte(OP_IS); if (isNot) emitByte(OP_NOT); break;
@@ -504,21 +742,85 @@ static void parseCall() {
   emitBytes(OP_CALL, argCount);
 }
 
+/* Compiles '.name' on a native module known at compile time, where
+ * 'name' is the previous token. Only members that the module registered
+ * with setModuleConstant() are looked at; the rest are ordinary fields
+ * that can be assigned at any time. A constant number, string, bool or
+ * nil is compiled into a constant, and the code that loaded the module
+ * is dropped. A constant that is itself a module is loaded as usual,
+ * but stays known. Returns UFALSE for any other member, which is left
+ * for parseDot to compile. */
+static ubool parseModuleMember(ObjInstance *module) {
+  Token name = parser.previous;
+  String *nameString = internString(name.start, name.length);
+  size_t pathLength = strlen(parser.modulePath);
+  Value value;
+  size_t i;
+
+  if (!mapGetStr(&module->klass->constants, nameString, &value) ||
+      pathLength + name.length + 2 > MAX_PATH_LENGTH) {
+    return UFALSE;
+  }
+  memcpy(parser.modulePath + pathLength, name.start, name.length);
+  parser.modulePath[pathLength + name.length] = '\0';
+
+  if (IS_MODULE(value)) {
+    emitBytes(OP_GET_FIELD, parseIdentifierConstant(&name));
+    emitInlineCache();
+    strcat(parser.modulePath, ".");
+    parser.module = AS_INSTANCE(value);
+    return UTRUE;
+  }
+
+  if (!IS_NUMBER(value) && !IS_STRING(value) &&
+      !IS_BOOL(value) && !IS_NIL(value)) {
+    parser.modulePath[pathLength] = '\0';
+    return UFALSE;
+  }
+
+  currentChunk()->count = parser.moduleStart;
+  currentChunk()->cacheCount = parser.moduleCacheCount;
+  emitConstant(value);
+
+  nameString = internCString(parser.modulePath);
+  for (i = 0; i < dependencies.count; i += 3) {
+    if (AS_STRING(dependencies.values[i]) == parser.moduleName &&
+        AS_STRING(dependencies.values[i + 1]) == nameString) {
+      return UTRUE;
+    }
+  }
+  push(STRING_VAL(nameString));
+  writeValueArray(&dependencies, STRING_VAL(parser.moduleName));
+  writeValueArray(&dependencies, STRING_VAL(nameString));
+  writeValueArray(&dependencies, value);
+  pop(); /* nameString */
+  return UTRUE;
+}
+
 static void parseDot() {
+  ObjInstance *module = parser.module;
   u8 name;
 
+  parser.module = NULL;
   expectToken(TOKEN_IDENTIFIER, "Expect property name after '.'");
+  if (module != NULL && !atToken(TOKEN_EQUAL) &&
+      !atToken(TOKEN_LEFT_PAREN) && parseModuleMember(module)) {
+    return;
+  }
   name = parseIdentifierConstant(&parser.previous);
 
   if (consumeToken(TOKEN_EQUAL)) {
     parseExpression();
     emitBytes(OP_SET_FIELD, name);
+    emitInlineCache();
   } else if (consumeToken(TOKEN_LEFT_PAREN)) {
     u8 argCount = parseArgumentList();
     emitBytes(OP_INVOKE, name);
     emitByte(argCount);
+    emitInlineCache();
   } else {
     emitBytes(OP_GET_FIELD, name);
+    emitInlineCache();
   }
 }
 
@@ -548,6 +850,7 @@ static void parseSubscript() {
     expectToken(TOKEN_RIGHT_BRACKET, "Expect ']' after slice index expression");
     emitBytes(OP_INVOKE, name);
     emitByte(2); /* argCount */
+    emitInlineCache();
   } else {
     expectToken(TOKEN_RIGHT_BRACKET, "Expect ']' after index expression");
     if (consumeToken(TOKEN_EQUAL)) {
@@ -556,11 +859,13 @@ static void parseSubscript() {
       parseExpression();
       emitBytes(OP_INVOKE, name);
       emitByte(2); /* argCount */
+      emitInlineCache();
     } else {
       Token nameToken = syntheticToken("__getitem__");
       u8 name = parseIdentifierConstant(&nameToken);
       emitBytes(OP_INVOKE, name);
       emitByte(1);
+      emitInlineCache();
     }
   }
 }
@@ -584,6 +889,7 @@ static void parseGrouping() {
 static void parseNumber() {
   double value = strtod(parser.previous.start, NULL);
   emitConstant(NUMBER_VAL(value));
+  parser.isNumber = UTRUE;
 }
 
 static void parseNumberHex() {
@@ -603,6 +909,7 @@ static void parseNumberHex() {
     }
   }
   emitConstant(NUMBER_VAL(value));
+  parser.isNumber = UTRUE;
 }
 
 static void parseNumberBin() {
@@ -618,6 +925,7 @@ static void parseNumberBin() {
     }
   }
   emitConstant(NUMBER_VAL(value));
+  parser.isNumber = UTRUE;
 }
 
 static void parseTry() {
@@ -702,24 +1010,57 @@ static void parseString() {
 
 static void parseNamedVariable(Token name, ubool canAssign) {
   u8 getOp, setOp;
+  ubool isNumber = UFALSE, isKnown = UFALSE;
+  String *global = NULL;
+  Value known;
+  i32 start = currentChunk()->count;
   i16 arg = resolveLocal(current, &name);
+  parser.module = NULL;
   if (arg != -1) {
     getOp = OP_GET_LOCAL;
     setOp = OP_SET_LOCAL;
+    isNumber = current->locals[arg].isNumber;
   } else if ((arg = resolveUpvalue(current, &name)) != -1) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
+    isNumber = current->upvalues[arg].isNumber;
   } else {
     arg = parseIdentifierConstant(&name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
+    global = AS_STRING(currentChunk()->constants.values[arg]);
+    isKnown = mapGetStr(&knownGlobals, global, &known);
   }
 
   if (canAssign && consumeToken(TOKEN_EQUAL)) {
+    if (isKnown && !IS_MODULE(known)) {
+      errorAt(&name, "Can't assign to a final variable");
+    } else if (isKnown) {
+      mapDeleteStr(&knownGlobals, global);
+    }
     parseExpression();
+    if (isNumber && !parser.isNumber) {
+      emitBytes(OP_CHECK_NUMBER, parseIdentifierConstant(&name));
+    }
     emitBytes(setOp, (u8) arg);
+    parser.isNumber = parser.isNumber || isNumber;
+  } else if (isKnown && !IS_MODULE(known)) {
+    emitConstant(known);
+    parser.isNumber = IS_NUMBER(known);
+    return;
   } else {
     emitBytes(getOp, (u8) arg);
+    parser.isNumber = isNumber;
+  }
+  if (getOp == OP_GET_GLOBAL) {
+    emitInlineCache();
+  }
+  if (isKnown && IS_MODULE(known)) {
+    parser.module = AS_INSTANCE(known);
+    parser.moduleName = AS_INSTANCE(known)->klass->name;
+    parser.modulePath[0] = '\0';
+    parser.moduleStart = start;
+    parser.moduleCacheCount = currentChunk()->cacheCount - 1;
   }
 }
 
@@ -852,6 +1193,9 @@ static void parseUnary() {
       abort();
       return; /* Unreachable */
   }
+
+  /* OP_NEGATE raises an error for anything but a number */
+  parser.isNumber = operatorType == TOKEN_MINUS;
 }
 
 static ParseRule rules[TOKEN_EOF + 1];
@@ -914,6 +1258,33 @@ void initParseRules() {
   rules[TOKEN_TRY] = newRule(parseTry, NULL, PREC_NONE);
 }
 
+/* Whether the rule sets parser.isNumber for the expression it parses.
+ * Any other rule may leave it set by one of its subexpressions instead
+ * (e.g. the last argument of a call), so it is cleared after them. */
+static ubool setsIsNumber(ParseFn rule) {
+  return rule == parseNumber || rule == parseNumberHex ||
+    rule == parseNumberBin || rule == parseGrouping ||
+    rule == parseVariable || rule == parseUnary || rule == parseBinary;
+}
+
+/* Parses the rest of an expression whose first operand has already
+ * been parsed */
+static void parseInfixOperators(Precedence precedence) {
+  while (precedence <= getRule(parser.current.type)->precedence) {
+    ParseFn infixRule;
+    advance();
+    infixRule = getRule(parser.previous.type)->infix;
+    parser.leftIsNumber = parser.isNumber;
+    infixRule();
+    if (!setsIsNumber(infixRule)) {
+      parser.isNumber = UFALSE;
+    }
+    if (infixRule != parseDot) {
+      parser.module = NULL;
+    }
+  }
+}
+
 static void parsePrecedence(Precedence precedence) {
   ParseFn prefixRule;
   advance();
@@ -925,13 +1296,14 @@ static void parsePrecedence(Precedence precedence) {
     return;
   }
   prefixRule();
-
-  while (precedence <= getRule(parser.current.type)->precedence) {
-    ParseFn infixRule;
-    advance();
-    infixRule = getRule(parser.previous.type)->infix;
-    infixRule();
+  if (!setsIsNumber(prefixRule)) {
+    parser.isNumber = UFALSE;
   }
+  if (prefixRule != parseVariable &&
+      prefixRule != parseVariableNoAssignment) {
+    parser.module = NULL;
+  }
+  parseInfixOperators(precedence);
 }
 
 static ParseRule *getRule(TokenType type) {
@@ -1021,7 +1393,9 @@ static void parseFunction(ThunkType type) {
       constant = parseAndGetVariable("Expect parameter name");
       parseDefineVariable(constant);
       if (atToken(TOKEN_IDENTIFIER) || atToken(TOKEN_NIL)) {
-        parseTypeExpression();
+        if (parseTypeExpression() && parser.typed) {
+          current->locals[current->localCount - 1].isNumber = UTRUE;
+        }
       }
       if (compiler.defaultArgsCount > 0 && !atToken(TOKEN_EQUAL)) {
         error("non-optional argument may not follow an optional argument");
@@ -1038,6 +1412,16 @@ static void parseFunction(ThunkType type) {
   }
 
   expectToken(TOKEN_COLON, "Expect ':' before function body");
+
+  /* Number parameters are checked once here, so that the body
+   * can rely on them */
+  for (i = 1; i < current->localCount; i++) {
+    if (current->locals[i].isNumber) {
+      emitBytes(OP_CHECK_LOCAL_NUMBER, (u8) i);
+      emitByte(parseIdentifierConstant(&current->locals[i].name));
+    }
+  }
+
   while (consumeToken(TOKEN_NEWLINE));
   parseBlock(UFALSE);
 
@@ -1167,21 +1551,51 @@ static void expectStatementDelimiter(const char *message) {
 }
 
 static void parseVarDeclaration() {
+  ubool isFinal = parser.previous.type == TOKEN_FINAL;
   u8 global = parseAndGetVariable("Expect variable name");
+  Token name = parser.previous;
+  ubool isNumber = UFALSE, hasLiteral = UFALSE;
+  Value literal;
 
   if (atToken(TOKEN_IDENTIFIER) || atToken(TOKEN_NIL)) {
-    parseTypeExpression();
+    isNumber = parseTypeExpression();
   }
 
+  /* In typed mode, a local is a number local if it is declared as one,
+   * or if it is final and starts out as a number */
   if (consumeToken(TOKEN_EQUAL)) {
+    i32 start = currentChunk()->count;
     parseExpression();
+    hasLiteral = getLiteral(start, &literal);
+    if (parser.typed && current->scopeDepth > 0) {
+      if (isNumber && !parser.isNumber) {
+        emitBytes(OP_CHECK_NUMBER, parseIdentifierConstant(&name));
+      }
+      isNumber = isNumber || (isFinal && parser.isNumber);
+    }
   } else {
     emitByte(OP_NIL);
+    if (parser.typed && current->scopeDepth > 0 && isNumber) {
+      warningAt(&name, "Not specialized, there is no initial value");
+    }
+    isNumber = UFALSE;
   }
   expectStatementDelimiter(
     "Expected statement delimiter after variable declaration");
 
+  if (parser.typed && current->scopeDepth > 0) {
+    current->locals[current->localCount - 1].isNumber = isNumber;
+  }
   parseDefineVariable(global);
+
+  /* Module-level final variables initialized with a literal are
+   * compiled into constants from here on */
+  if (isFinal && hasLiteral && current->scopeDepth == 0) {
+    push(literal);
+    mapSetStr(&knownGlobals,
+      AS_STRING(currentChunk()->constants.values[global]), literal);
+    pop(); /* literal */
+  }
 }
 
 static void parseExpressionStatement() {
@@ -1191,6 +1605,35 @@ static void parseExpressionStatement() {
   emitByte(OP_POP);
 }
 
+/* Parses the iterable of a for-in loop, and emits code that replaces
+ * it with the loop state (see OP_GET_ITER in mtots_chunk.h).
+ * When the iterable is a call to the global 'range', the call is
+ * emitted as OP_CALL_RANGE, so that no iterator has to be allocated
+ * for it. */
+static void parseForInIterable() {
+  Token name = parser.current;
+  if (name.type == TOKEN_IDENTIFIER &&
+      name.length == 5 && memcmp(name.start, "range", 5) == 0 &&
+      resolveLocal(current, &name) == -1 &&
+      resolveUpvalue(current, &name) == -1) {
+    advance();
+    parseNamedVariable(name, UFALSE);
+    if (consumeToken(TOKEN_LEFT_PAREN)) {
+      u8 argCount = parseArgumentList();
+      if (atToken(TOKEN_COLON)) {
+        emitBytes(OP_CALL_RANGE, argCount);
+        emitByte(OP_GET_ITER);
+        return;
+      }
+      emitBytes(OP_CALL, argCount);
+    }
+    parseInfixOperators(PREC_OR);
+  } else {
+    parseExpression();
+  }
+  emitByte(OP_GET_ITER);
+}
+
 static void parseForInStatement() {
   i32 jump, loopStart;
   Token variableToken;
@@ -1202,8 +1645,11 @@ static void parseForInStatement() {
   variableToken = parser.previous;
 
   expectToken(TOKEN_IN, "Expect 'in' in for-in statement");
-  parseExpression();          /* container/iterable */
-  emitByte(OP_GET_ITER); /* replace container/iterable with an iterator */
+  parseForInIterable();
+  addLocal(syntheticToken("@index"));
+  parseDefineVariable(0);
+  addLocal(syntheticToken("@stop"));
+  parseDefineVariable(0);
   addLocal(syntheticToken("@iterator"));
   parseDefineVariable(0);
   loopStart = currentChunk()->count;
@@ -1221,10 +1667,10 @@ static void parseForInStatement() {
   patchJump(jump);
   emitByte(OP_POP); /* StopIteration */
 
-  /* iterator does not need an explicit
-   * OP_POP, because iterator was added as a local
-   * variable as '@iterator', so endScope() will pop it
-   * automatically */
+  /* the loop state does not need explicit
+   * OP_POPs, because it was added as the local
+   * variables '@index', '@stop' and '@iterator', so endScope()
+   * will pop it automatically */
   endScope();
 }
 
@@ -1299,6 +1745,23 @@ static void parseImportStatement() {
   emitBytes(OP_IMPORT, moduleName);
   parseDefineVariable(alias); /* store in variable */
 
+  /* Native modules are imported right away, so that their constants
+   * can be compiled into constants (see parseModuleMember), unless
+   * something else in the module binds the alias too (see
+   * countBindings()) */
+  if (current->scopeDepth == 0) {
+    String *aliasString = AS_STRING(currentChunk()->constants.values[alias]);
+    Value count;
+    if (mapGetStr(&bindingCounts, aliasString, &count) &&
+        AS_NUMBER(count) == 1) {
+      ObjInstance *module = importNativeModule(
+        AS_STRING(currentChunk()->constants.values[moduleName]));
+      if (module != NULL) {
+        mapSetStr(&knownGlobals, aliasString, INSTANCE_VAL(module));
+      }
+    }
+  }
+
   expectStatementDelimiter(
     "Expect statement delimiter after import statement");
 }
@@ -1410,25 +1873,44 @@ static void parseFieldDeclaration() {
   expectStatementDelimiter("Expected delimiter after field declaration");
 }
 
-static void parseTypeExpression() {
-  /* Type expressions are completely ignored by the runtime, and are used
-   * purely for documentation */
+static ubool isNumberTypeName(Token *name) {
+  static const char *const names[] = { "Int", "Float", "Number" };
+  size_t i;
+  for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (name->length == strlen(names[i]) &&
+        memcmp(name->start, names[i], name->length) == 0) {
+      return UTRUE;
+    }
+  }
+  return UFALSE;
+}
+
+/* Returns UTRUE if the type is Int, Float or Number, or a union of them */
+static ubool parseTypeExpression() {
+  /* Type expressions are ignored by the runtime, and are used purely
+   * for documentation, except in typed mode, where number types let
+   * the compiler specialize code (see compile() in mtots_compiler.h) */
+  ubool isNumber = UFALSE;
   if (!consumeToken(TOKEN_NIL)) {
     expectToken(TOKEN_IDENTIFIER, "Expected type expression");
+    isNumber = isNumberTypeName(&parser.previous);
   }
   for (;;) {
     if (consumeToken(TOKEN_QMARK)) {
+      isNumber = UFALSE;
       continue;
     }
     if (consumeToken(TOKEN_DOT)) {
       expectToken(TOKEN_IDENTIFIER, "Expected type member identifier");
+      isNumber = UFALSE;
       continue;
     }
     if (consumeToken(TOKEN_PIPE)) {
-      parseTypeExpression();
+      isNumber = parseTypeExpression() && isNumber;
       continue;
     }
     if (consumeToken(TOKEN_LEFT_BRACKET)) {
+      isNumber = UFALSE;
       while (atToken(TOKEN_IDENTIFIER)) {
         parseTypeExpression();
         if (!consumeToken(TOKEN_COMMA)) {
@@ -1440,16 +1922,37 @@ static void parseTypeExpression() {
     }
     break;
   }
+  return isNumber;
+}
+
+static ubool hasTypedPragma(const char *source) {
+  static const char pragma[] = "# mtots: typed";
+  const char *line = source;
+  while (*line == '#' || *line == '\n' || *line == '\r') {
+    size_t length = strcspn(line, "\r\n");
+    if (length == sizeof(pragma) - 1 &&
+        memcmp(line, pragma, length) == 0) {
+      return UTRUE;
+    }
+    line += length;
+    line += strspn(line, "\r\n");
+  }
+  return UFALSE;
 }
 
 ObjThunk *compile(const char *source, String *moduleName) {
   Compiler compiler;
   ObjThunk *thunk;
+  countBindings(source);
   initScanner(source);
   initCompiler(&compiler, TYPE_SCRIPT);
   compiler.thunk->moduleName = moduleName;
   parser.hadError = 0;
   parser.panicMode = 0;
+  parser.typed = hasTypedPragma(source);
+  parser.isNumber = parser.leftIsNumber = UFALSE;
+  parser.module = NULL;
+  freeValueArray(&dependencies);
   advance();
 
   while (!consumeToken(TOKEN_EOF)) {
@@ -1457,11 +1960,18 @@ ObjThunk *compile(const char *source, String *moduleName) {
   }
 
   thunk = endCompiler();
+  freeMap(&knownGlobals);
+  freeMap(&bindingCounts);
   return parser.hadError ? NULL : thunk;
 }
 
+ValueArray *getCompiledDependencies() {
+  return &dependencies;
+}
+
 void markCompilerRoots() {
   Compiler *compiler = current;
+  size_t j;
   while (compiler != NULL) {
     i16 i;
     for (i = 0; i < compiler->defaultArgsCount; i++) {
@@ -1470,4 +1980,9 @@ void markCompilerRoots() {
     markObject((Obj*)compiler->thunk);
     compiler = compiler->enclosing;
   }
+  markMap(&knownGlobals);
+  markMap(&bindingCounts);
+  for (j = 0; j < dependencies.count; j++) {
+    markValue(dependencies.values[j]);
+  }
 }
@@ -5,7 +5,35 @@
 
 void initParseRules();
 
+/* Compiles a module's source into the thunk that runs it, or returns
+ * NULL after printing errors to stderr.
+ *
+ * A module that starts with the comment line
+ *
+ *   # mtots: typed
+ *
+ * (possibly after other comment lines) is compiled in typed mode.
+ * There, parameters and local variables annotated as Int, Float or
+ * Number, and final locals initialized with a number, only ever hold
+ * numbers: parameters are checked when the function is called, and
+ * anything assigned to them that is not already known to be a number
+ * is checked before it is stored. Arithmetic and comparisons whose
+ * operands are all known to be numbers then compile to instructions
+ * that do not check their operands again (OP_NUMBER_ADD, etc.), and
+ * a warning is printed for each one that only has one such operand.
+ *
+ * Unannotated code compiles the same way in either mode. */
 ObjThunk *compile(const char *source, String *moduleName);
+
+/* Module-level final variables initialized with a literal, and members
+ * of imported native modules that are numbers, strings, bools or nil,
+ * are compiled into constants.
+ *
+ * The native module members that the last call to compile() used this
+ * way, as (module name, path, value) triples, e.g. "sdl", "gl.RED_SIZE"
+ * and the value of sdl.gl.RED_SIZE. The code is only valid for as long
+ * as they keep those values (see saveBytecode()). */
+ValueArray *getCompiledDependencies();
 void markCompilerRoots();
 
 #endif/*mtots_compiler_h*/
@@ -8,6 +8,103 @@
 #define DEBUG_LOG_GC           0
 
 
+/* Collect garbage incrementally: instead of stopping the world for a
+ * whole collection, marking and sweeping are done a bounded number of
+ * objects at a time, interleaved with allocation (see mtots_memory.c).
+ * Off by default. */
+#ifndef MTOTS_INCREMENTAL_GC
+#define MTOTS_INCREMENTAL_GC 0
+#endif
+
+/* Serve small allocations made through reallocate() from size-classed
+ * pools (see mtots_pool.h) instead of malloc. Turning this off can be
+ * useful with tools like AddressSanitizer or valgrind, which only see
+ * malloc'd blocks. On by default. */
+#ifndef MTOTS_USE_POOL_ALLOCATOR
+#define MTOTS_USE_POOL_ALLOCATOR 1
+#endif
+
+/* Run the bytecode optimizer (see mtots_optimizer.h) on every chunk
+ * the compiler produces. Turning this off makes it easy to compare
+ * optimized and unoptimized code. On by default.
+ *
+ * The bytecode cache records this option, so .mtotsc files written by
+ * a build with it set the other way are compiled again rather than run. */
+#ifndef MTOTS_OPTIMIZE_BYTECODE
+#define MTOTS_OPTIMIZE_BYTECODE 1
+#endif
+
+/* Let the optimizer fuse common sequences of instructions into
+ * superinstructions (e.g. OP_ADD_LOCALS). Turn this off when counting
+ * opcode pairs, so that the counts are in terms of the plain
+ * instructions. On by default. Recorded in the bytecode cache, like
+ * MTOTS_OPTIMIZE_BYTECODE. */
+#ifndef MTOTS_USE_SUPERINSTRUCTIONS
+#define MTOTS_USE_SUPERINSTRUCTIONS 1
+#endif
+
+/* Let the VM rewrite OP_ADD, OP_LESS, OP_GREATER and OP_EQUAL, as they
+ * run, into variants that only check for the operand types they saw
+ * last (e.g. OP_ADD_NUMBERS). On by default. */
+#ifndef MTOTS_USE_QUICKENING
+#define MTOTS_USE_QUICKENING 1
+#endif
+
+/* Count how often each opcode is directly followed by each other opcode
+ * while running, and write the counts out at exit. This slows down
+ * dispatch, and is only meant for choosing superinstructions
+ * (see scripts/opcode-pairs.py). Off by default. */
+#ifndef MTOTS_COUNT_OPCODE_PAIRS
+#define MTOTS_COUNT_OPCODE_PAIRS 0
+#endif
+
+/* Keep the compiled bytecode of each imported module next to its source
+ * (foo.mtots -> foo.mtotsc), and load it instead of compiling the source
+ * again while the source is unchanged (see mtots_bytecode.h).
+ * The main script is always compiled from source. On by default. */
+#ifndef MTOTS_USE_BYTECODE_CACHE
+#define MTOTS_USE_BYTECODE_CACHE 1
+#endif
+
+/* Represent each Value as a single NaN-boxed 64-bit word instead of
+ * a tagged union (see mtots_value.h). Requires C99 and a platform where
+ * pointers fit in 48 bits. Off by default. */
+#ifndef MTOTS_USE_NAN_BOXING
+#define MTOTS_USE_NAN_BOXING 0
+#endif
+
+/* Use labels-as-values ("computed goto") for opcode dispatch in run().
+ * This is a GNU extension, so it is only enabled by default when the
+ * compiler is GCC-compatible and not in strict ISO mode (e.g. -std=gnu89
+ * rather than -std=c89). It is left off for emscripten, where indirect
+ * gotos are lowered back into a switch anyway.
+ * Pass -DMTOTS_USE_COMPUTED_GOTO=0 or =1 to override.
+ *
+ * With GCC, also pass -fno-gcse -fno-crossjumping, otherwise GCC tends
+ * to merge the per-opcode indirect jumps back into a few shared ones. */
+#ifndef MTOTS_USE_COMPUTED_GOTO
+#if defined(__GNUC__) && !defined(__STRICT_ANSI__) && !defined(__EMSCRIPTEN__)
+#define MTOTS_USE_COMPUTED_GOTO 1
+#else
+#define MTOTS_USE_COMPUTED_GOTO 0
+#endif
+#endif
+
+/* Compile the bytecode of hot thunks into machine code, and run that
+ * instead where it can (see mtots_jit.h). Only supported on x86-64
+ * Linux (or another x86-64 system with mmap). Off by default. */
+#ifndef MTOTS_USE_JIT
+#define MTOTS_USE_JIT 0
+#endif
+
+/* How many calls plus loop iterations it takes before a thunk is
+ * compiled by the JIT. 0 compiles every thunk the first time it runs,
+ * which is how the test suite should be run against the JIT. */
+#ifndef MTOTS_JIT_THRESHOLD
+#define MTOTS_JIT_THRESHOLD 1000
+#endif
+
+
 #define MAX_PATH_LENGTH        4096
 #define MAX_ELIF_CHAIN_COUNT     64
 #define MAX_IDENTIFIER_LENGTH   128
@@ -32,7 +129,7 @@
 /* #if __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900) */
 #if __cplusplus >= 201103L /* C++11 and above */
 #define NORETURN [[ noreturn ]]
-#elif __STDC_VERSION__ >= 199901L /* C99 and above  */
+#elif __STDC_VERSION__ >= 201112L /* C11 and above  */
 #define NORETURN _Noreturn
 #else /* Assume C89 only */
 #define NORETURN
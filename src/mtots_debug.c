@@ -30,6 +30,26 @@ static int invokeInstruction(const char *name, Chunk *chunk, int offset) {
   return offset + 3;
 }
 
+static int fieldInstruction(const char *name, Chunk *chunk, int offset) {
+  u8 constant = chunk->code[offset + 1];
+  u16 cache = (u16)(chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' (cache %d)\n", cache);
+  return offset + 4;
+}
+
+static int cachedInvokeInstruction(
+    const char *name, Chunk *chunk, int offset) {
+  u8 constant = chunk->code[offset + 1];
+  u8 argCount = chunk->code[offset + 2];
+  u16 cache = (u16)(chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' (cache %d)\n", cache);
+  return offset + 5;
+}
+
 static int simpleInstruction(const char *name, int offset) {
   printf("%s\n", name);
   return offset + 1;
@@ -41,6 +61,46 @@ static int byteInstruction(const char *name, Chunk *chunk, int offset) {
   return offset + 2;
 }
 
+static int twoByteInstruction(
+    const char *name, Chunk *chunk, int offset) {
+  u8 first = chunk->code[offset + 1];
+  u8 second = chunk->code[offset + 2];
+  printf("%-16s %4d %4d\n", name, first, second);
+  return offset + 3;
+}
+
+static int localConstantInstruction(
+    const char *name, Chunk *chunk, int offset) {
+  u8 slot = chunk->code[offset + 1];
+  u8 constant = chunk->code[offset + 2];
+  printf("%-16s %4d %4d '", name, slot, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 3;
+}
+
+static int localFieldInstruction(
+    const char *name, Chunk *chunk, int offset) {
+  u8 slot = chunk->code[offset + 1];
+  u8 constant = chunk->code[offset + 2];
+  u16 cache = (u16)(chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+  printf("%-16s %4d %4d '", name, slot, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' (cache %d)\n", cache);
+  return offset + 5;
+}
+
+static int localConstantJumpInstruction(
+    const char *name, Chunk *chunk, int offset) {
+  u8 slot = chunk->code[offset + 1];
+  u8 constant = chunk->code[offset + 2];
+  u16 jump = (u16)(chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+  printf("%-16s %4d %4d '", name, slot, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' %4d -> %d\n", offset, offset + 5 + jump);
+  return offset + 5;
+}
+
 static int jumpInstruction(
     const char *name, int sign, Chunk *chunk, int offset) {
   u16 jump = (u16)(chunk->code[offset + 1] << 8);
@@ -77,19 +137,19 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     case OP_SET_LOCAL:
       return byteInstruction("OP_SET_LOCAL", chunk, offset);
     case OP_GET_GLOBAL:
-      return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+      return fieldInstruction("OP_GET_GLOBAL", chunk, offset);
     case OP_DEFINE_GLOBAL:
       return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL:
-      return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+      return fieldInstruction("OP_SET_GLOBAL", chunk, offset);
     case OP_GET_UPVALUE:
       return byteInstruction("OP_GET_UPVALUE", chunk, offset);
     case OP_SET_UPVALUE:
       return byteInstruction("OP_SET_UPVALUE", chunk, offset);
     case OP_GET_FIELD:
-      return constantInstruction("OP_GET_FIELD", chunk, offset);
+      return fieldInstruction("OP_GET_FIELD", chunk, offset);
     case OP_SET_FIELD:
-      return constantInstruction("OP_SET_FIELD", chunk, offset);
+      return fieldInstruction("OP_SET_FIELD", chunk, offset);
     case OP_IS:
       return simpleInstruction("OP_IS", offset);
     case OP_EQUAL:
@@ -132,6 +192,8 @@ int disassembleInstruction(Chunk *chunk, int offset) {
       return jumpInstruction("OP_JUMP", 1, chunk, offset);
     case OP_JUMP_IF_FALSE:
       return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_JUMP_IF_TRUE:
+      return jumpInstruction("OP_JUMP_IF_TRUE", 1, chunk, offset);
     case OP_JUMP_IF_STOP_ITERATION:
       return jumpInstruction("OP_JUMP_IF_STOP_ITERATION", 1, chunk, offset);
     case OP_TRY_START:
@@ -148,8 +210,10 @@ int disassembleInstruction(Chunk *chunk, int offset) {
       return jumpInstruction("OP_LOOP", -1, chunk, offset);
     case OP_CALL:
       return byteInstruction("OP_CALL", chunk, offset);
+    case OP_CALL_RANGE:
+      return byteInstruction("OP_CALL_RANGE", chunk, offset);
     case OP_INVOKE:
-      return invokeInstruction("OP_INVOKE", chunk, offset);
+      return cachedInvokeInstruction("OP_INVOKE", chunk, offset);
     case OP_SUPER_INVOKE:
       return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
     case OP_CLOSURE: {
@@ -196,6 +260,49 @@ int disassembleInstruction(Chunk *chunk, int offset) {
       return constantInstruction("OP_METHOD", chunk, offset);
     case OP_STATIC_METHOD:
       return constantInstruction("OP_STATIC_METHOD", chunk, offset);
+    case OP_GET_LOCALS:
+      return twoByteInstruction("OP_GET_LOCALS", chunk, offset);
+    case OP_ADD_LOCALS:
+      return twoByteInstruction("OP_ADD_LOCALS", chunk, offset);
+    case OP_GET_LOCAL_CONSTANT:
+      return localConstantInstruction(
+        "OP_GET_LOCAL_CONSTANT", chunk, offset);
+    case OP_GET_LOCAL_FIELD:
+      return localFieldInstruction("OP_GET_LOCAL_FIELD", chunk, offset);
+    case OP_SET_LOCAL_POP:
+      return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+    case OP_LESS_LOCAL_CONSTANT_JUMP_IF_FALSE:
+      return localConstantJumpInstruction(
+        "OP_LESS_LOCAL_CONSTANT_JUMP_IF_FALSE", chunk, offset);
+    case OP_NUMBER_ADD:
+      return simpleInstruction("OP_NUMBER_ADD", offset);
+    case OP_NUMBER_SUBTRACT:
+      return simpleInstruction("OP_NUMBER_SUBTRACT", offset);
+    case OP_NUMBER_MULTIPLY:
+      return simpleInstruction("OP_NUMBER_MULTIPLY", offset);
+    case OP_NUMBER_DIVIDE:
+      return simpleInstruction("OP_NUMBER_DIVIDE", offset);
+    case OP_NUMBER_LESS:
+      return simpleInstruction("OP_NUMBER_LESS", offset);
+    case OP_NUMBER_GREATER:
+      return simpleInstruction("OP_NUMBER_GREATER", offset);
+    case OP_CHECK_NUMBER:
+      return constantInstruction("OP_CHECK_NUMBER", chunk, offset);
+    case OP_CHECK_LOCAL_NUMBER:
+      return localConstantInstruction(
+        "OP_CHECK_LOCAL_NUMBER", chunk, offset);
+    case OP_NUMBER_MULTIPLY_LOCALS:
+      return twoByteInstruction("OP_NUMBER_MULTIPLY_LOCALS", chunk, offset);
+    case OP_EQUAL_NUMBERS:
+      return simpleInstruction("OP_EQUAL_NUMBERS", offset);
+    case OP_GREATER_NUMBERS:
+      return simpleInstruction("OP_GREATER_NUMBERS", offset);
+    case OP_LESS_NUMBERS:
+      return simpleInstruction("OP_LESS_NUMBERS", offset);
+    case OP_ADD_NUMBERS:
+      return simpleInstruction("OP_ADD_NUMBERS", offset);
+    case OP_ADD_STRINGS:
+      return simpleInstruction("OP_ADD_STRINGS", offset);
     default:
       printf("Unknown opcode %d\n", instruction);
       return offset + 1;
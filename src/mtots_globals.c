@@ -1,5 +1,6 @@
 #include "mtots_globals.h"
 #include "mtots_vm.h"
+#include "mtots_class_list.h"
 
 #include <time.h>
 #include <stdio.h>
@@ -45,7 +46,7 @@ static ubool implRepr(i16 argCount, Value *args, Value *out) {
     freeStringBuffer(&sb);
     return UFALSE;
   }
-  *out = STRING_VAL(internString(sb.chars, sb.length));
+  *out = STRING_VAL(makeString(sb.chars, sb.length));
   freeStringBuffer(&sb);
   return UTRUE;
 }
@@ -177,7 +178,7 @@ static ubool implRange(i16 argCount, Value *args, Value *out) {
   return UTRUE;
 }
 
-static CFunction cfunctionRange = { implRange, "range", 1, 3 };
+CFunction cfunctionRange = { implRange, "range", 1, 3 };
 
 static ubool implOpen(i16 argCount, Value *args, Value *out) {
   FileMode mode = FILE_MODE_READ;
@@ -352,36 +353,352 @@ static CFunction funcIsInstance = {
   implIsInstance, "isinstance", sizeof(argsIsInstance)/sizeof(TypePattern), 0, argsIsInstance
 };
 
+/* Appends the items of 'iterable' to 'list', which has to be
+ * reachable */
+static ubool extendList(ObjList *list, Value iterable) {
+  Value *state;
+  push(iterable);
+  if (!startIteration()) {
+    return UFALSE;
+  }
+  state = vm.stackTop - 3;
+  for (;;) {
+    if (!nextIteration(state)) {
+      return UFALSE;
+    }
+    if (IS_STOP_ITERATION(vm.stackTop[-1])) {
+      break;
+    }
+    listAppend(list, vm.stackTop[-1]);
+    pop(); /* item */
+  }
+  vm.stackTop = state;
+  return UTRUE;
+}
+
+/* Pushes the result of calling 'function' with 'item' */
+static ubool callWithItem(Value function, Value item) {
+  push(function);
+  push(item);
+  return callFunction(1);
+}
+
+static ubool implList(i16 argCount, Value *args, Value *out) {
+  ObjList *list = newList(0);
+  push(LIST_VAL(list));
+  if (!extendList(list, args[0])) {
+    return UFALSE;
+  }
+  pop(); /* list */
+  *out = LIST_VAL(list);
+  return UTRUE;
+}
+
+static CFunction funcList = { implList, "list", 1 };
+
 static ubool implTuple(i16 argCount, Value *args, Value *out) {
-  ObjList *list = AS_LIST(args[0]);
+  ObjList *list;
+  if (IS_TUPLE(args[0])) {
+    *out = args[0];
+    return UTRUE;
+  }
+  list = newList(0);
+  push(LIST_VAL(list));
+  if (!extendList(list, args[0])) {
+    return UFALSE;
+  }
   *out = TUPLE_VAL(copyTuple(list->buffer, list->length));
+  pop(); /* list */
   return UTRUE;
 }
 
-static TypePattern argsTuple[] = {
-  { TYPE_PATTERN_LIST },
-};
+static CFunction funcTuple = { implTuple, "tuple", 1 };
 
-static CFunction cfunctionTuple = { implTuple, "__tuple__", 1, 0, argsTuple };
-
-static ubool implSort(i16 argCount, Value *args, Value *out) {
-  ObjList *list = AS_LIST(args[0]);
-  ObjList *keys =
-    argCount < 2 ?
-      NULL :
-      IS_NIL(args[1]) ?
-        NULL :
-        AS_LIST(args[1]);
-  sortList(list, keys);
+static ubool implSet(i16 argCount, Value *args, Value *out) {
+  ObjSet *set = newSet();
+  Value *state;
+  push(SET_VAL(set));
+  if (argCount == 0) {
+    pop(); /* set */
+    *out = SET_VAL(set);
+    return UTRUE;
+  }
+  if (IS_SET(args[0]) || IS_FROZEN_SET(args[0])) {
+    keySetCopy(
+      IS_SET(args[0]) ?
+        &AS_SET(args[0])->set :
+        &AS_FROZEN_SET(args[0])->set,
+      &set->set);
+    pop(); /* set */
+    *out = SET_VAL(set);
+    return UTRUE;
+  }
+  push(args[0]);
+  if (!startIteration()) {
+    return UFALSE;
+  }
+  state = vm.stackTop - 3;
+  for (;;) {
+    if (!nextIteration(state)) {
+      return UFALSE;
+    }
+    if (IS_STOP_ITERATION(vm.stackTop[-1])) {
+      break;
+    }
+    keySetAdd(&set->set, vm.stackTop[-1]);
+    pop(); /* item */
+  }
+  vm.stackTop = state;
+  pop(); /* set */
+  *out = SET_VAL(set);
   return UTRUE;
 }
 
-static TypePattern argsSort[] = {
-  { TYPE_PATTERN_LIST },
-  { TYPE_PATTERN_LIST_OR_NIL },
-};
+static CFunction funcSet = { implSet, "set", 0, 1 };
+
+static ubool implDict(i16 argCount, Value *args, Value *out) {
+  ObjDict *dict = newDict();
+  String *getitemString;
+  Value *state;
+  push(DICT_VAL(dict));
+  if (IS_DICT(args[0]) || IS_FROZEN_DICT(args[0])) {
+    mapAddAll(
+      IS_DICT(args[0]) ?
+        &AS_DICT(args[0])->map :
+        &AS_FROZEN_DICT(args[0])->map,
+      &dict->map);
+    pop(); /* dict */
+    *out = DICT_VAL(dict);
+    return UTRUE;
+  }
+
+  /* Anything else has to have keys to iterate over, and __getitem__ */
+  getitemString = internCString("__getitem__");
+  push(STRING_VAL(getitemString));
+  push(args[0]);
+  if (!startIteration()) {
+    return UFALSE;
+  }
+  state = vm.stackTop - 3;
+  for (;;) {
+    if (!nextIteration(state)) {
+      return UFALSE;
+    }
+    if (IS_STOP_ITERATION(vm.stackTop[-1])) {
+      break;
+    }
+    push(args[0]);
+    push(vm.stackTop[-2]); /* key */
+    if (!callMethod(getitemString, 1)) {
+      return UFALSE;
+    }
+    mapSet(&dict->map, vm.stackTop[-2], vm.stackTop[-1]);
+    pop(); /* value */
+    pop(); /* key */
+  }
+  vm.stackTop = state;
+  pop(); /* getitemString */
+  pop(); /* dict */
+  *out = DICT_VAL(dict);
+  return UTRUE;
+}
+
+static CFunction funcDict = { implDict, "dict", 1 };
+
+static ubool implSorted(i16 argCount, Value *args, Value *out) {
+  ObjList *list = newList(0);
+  push(LIST_VAL(list));
+  if (!extendList(list, args[0]) ||
+      !sortListWithKey(list, argCount > 1 ? args[1] : NIL_VAL())) {
+    return UFALSE;
+  }
+  pop(); /* list */
+  *out = LIST_VAL(list);
+  return UTRUE;
+}
+
+static CFunction funcSorted = { implSorted, "sorted", 1, 2 };
+
+/* map() and filter() */
+static ubool mapOrFilter(Value *args, Value *out, ubool isFilter) {
+  ObjList *list = newList(0);
+  Value *state;
+  push(LIST_VAL(list));
+  push(args[1]);
+  if (!startIteration()) {
+    return UFALSE;
+  }
+  state = vm.stackTop - 3;
+  for (;;) {
+    if (!nextIteration(state)) {
+      return UFALSE;
+    }
+    if (IS_STOP_ITERATION(vm.stackTop[-1])) {
+      break;
+    }
+    if (!callWithItem(args[0], vm.stackTop[-1])) {
+      return UFALSE;
+    }
+    if (!isFilter) {
+      listAppend(list, vm.stackTop[-1]);
+    } else if (!isFalsey(vm.stackTop[-1])) {
+      listAppend(list, vm.stackTop[-2]);
+    }
+    pop(); /* result */
+    pop(); /* item */
+  }
+  vm.stackTop = state;
+  pop(); /* list */
+  *out = LIST_VAL(list);
+  return UTRUE;
+}
+
+static ubool implMap(i16 argCount, Value *args, Value *out) {
+  return mapOrFilter(args, out, UFALSE);
+}
+
+static CFunction funcMap = { implMap, "map", 2 };
+
+static ubool implFilter(i16 argCount, Value *args, Value *out) {
+  return mapOrFilter(args, out, UTRUE);
+}
+
+static CFunction funcFilter = { implFilter, "filter", 2 };
+
+/* any() and all(): looks for an item that is (or, with a predicate,
+ * whose result is) true for any(), or false for all() */
+static ubool anyOrAll(i16 argCount, Value *args, Value *out, ubool isAll) {
+  Value predicate = argCount > 1 ? args[1] : NIL_VAL();
+  Value *state;
+  push(args[0]);
+  if (!startIteration()) {
+    return UFALSE;
+  }
+  state = vm.stackTop - 3;
+  for (;;) {
+    if (!nextIteration(state)) {
+      return UFALSE;
+    }
+    if (IS_STOP_ITERATION(vm.stackTop[-1])) {
+      break;
+    }
+    if (!IS_NIL(predicate) && !callWithItem(predicate, vm.stackTop[-1])) {
+      return UFALSE;
+    }
+    if (isFalsey(vm.stackTop[-1]) == isAll) {
+      vm.stackTop = state;
+      *out = BOOL_VAL(!isAll);
+      return UTRUE;
+    }
+    vm.stackTop = state + 3;
+  }
+  vm.stackTop = state;
+  *out = BOOL_VAL(isAll);
+  return UTRUE;
+}
+
+static ubool implAny(i16 argCount, Value *args, Value *out) {
+  return anyOrAll(argCount, args, out, UFALSE);
+}
+
+static CFunction funcAny = { implAny, "any", 1, 2 };
+
+static ubool implAll(i16 argCount, Value *args, Value *out) {
+  return anyOrAll(argCount, args, out, UTRUE);
+}
+
+static CFunction funcAll = { implAll, "all", 1, 2 };
+
+static ubool implSum(i16 argCount, Value *args, Value *out) {
+  Value key = argCount > 1 ? args[1] : NIL_VAL();
+  double total = 0;
+  Value *state;
+  push(args[0]);
+  if (!startIteration()) {
+    return UFALSE;
+  }
+  state = vm.stackTop - 3;
+  for (;;) {
+    if (!nextIteration(state)) {
+      return UFALSE;
+    }
+    if (IS_STOP_ITERATION(vm.stackTop[-1])) {
+      break;
+    }
+    if (!IS_NIL(key) && !callWithItem(key, vm.stackTop[-1])) {
+      return UFALSE;
+    }
+    if (!IS_NUMBER(vm.stackTop[-1])) {
+      runtimeError(
+        "sum() expects numbers but got %s", getKindName(vm.stackTop[-1]));
+      return UFALSE;
+    }
+    total += AS_NUMBER(vm.stackTop[-1]);
+    vm.stackTop = state + 3;
+  }
+  vm.stackTop = state;
+  *out = NUMBER_VAL(total);
+  return UTRUE;
+}
+
+static CFunction funcSum = { implSum, "sum", 1, 2 };
+
+/* min() and max(). The first of the smallest (or largest) items wins. */
+static ubool minOrMax(
+    i16 argCount, Value *args, Value *out, ubool isMax, const char *name) {
+  Value key = argCount > 1 ? args[1] : NIL_VAL();
+  Value *best, *state;
+  ubool found = UFALSE;
+  push(NIL_VAL()); /* best item */
+  push(NIL_VAL()); /* its key */
+  best = vm.stackTop - 2;
+  push(args[0]);
+  if (!startIteration()) {
+    return UFALSE;
+  }
+  state = vm.stackTop - 3;
+  for (;;) {
+    Value itemKey;
+    if (!nextIteration(state)) {
+      return UFALSE;
+    }
+    if (IS_STOP_ITERATION(vm.stackTop[-1])) {
+      break;
+    }
+    if (!IS_NIL(key) && !callWithItem(key, vm.stackTop[-1])) {
+      return UFALSE;
+    }
+    itemKey = vm.stackTop[-1];
+    if (!found ||
+        (isMax ?
+          valueLessThan(best[1], itemKey) :
+          valueLessThan(itemKey, best[1]))) {
+      best[0] = state[3];
+      best[1] = itemKey;
+      found = UTRUE;
+    }
+    vm.stackTop = state + 3;
+  }
+  if (!found) {
+    runtimeError("%s() requires a non-empty iterable", name);
+    return UFALSE;
+  }
+  *out = best[0];
+  vm.stackTop = best;
+  return UTRUE;
+}
+
+static ubool implMin(i16 argCount, Value *args, Value *out) {
+  return minOrMax(argCount, args, out, UFALSE, "min");
+}
+
+static CFunction funcMin = { implMin, "min", 1, 2 };
+
+static ubool implMax(i16 argCount, Value *args, Value *out) {
+  return minOrMax(argCount, args, out, UTRUE, "max");
+}
 
-static CFunction cfunctionSort = { implSort, "__sort__", 1, 2, argsSort };
+static CFunction funcMax = { implMax, "max", 1, 2 };
 
 static void defineStandardIOGlobals() {
   String *name;
@@ -441,8 +758,18 @@ void defineDefaultGlobals() {
   defineGlobal("isinstance", CFUNCTION_VAL(&funcIsInstance));
   defineGlobal("StopIteration", STOP_ITERATION_VAL());
 
-  defineGlobal("__sort__", CFUNCTION_VAL(&cfunctionSort));
-  defineGlobal("__tuple__", CFUNCTION_VAL(&cfunctionTuple));
+  defineGlobal("list", CFUNCTION_VAL(&funcList));
+  defineGlobal("tuple", CFUNCTION_VAL(&funcTuple));
+  defineGlobal("set", CFUNCTION_VAL(&funcSet));
+  defineGlobal("dict", CFUNCTION_VAL(&funcDict));
+  defineGlobal("sorted", CFUNCTION_VAL(&funcSorted));
+  defineGlobal("map", CFUNCTION_VAL(&funcMap));
+  defineGlobal("filter", CFUNCTION_VAL(&funcFilter));
+  defineGlobal("any", CFUNCTION_VAL(&funcAny));
+  defineGlobal("all", CFUNCTION_VAL(&funcAll));
+  defineGlobal("sum", CFUNCTION_VAL(&funcSum));
+  defineGlobal("min", CFUNCTION_VAL(&funcMin));
+  defineGlobal("max", CFUNCTION_VAL(&funcMax));
 
   mapSetStr(&vm.globals, vm.sentinelClass->name, CLASS_VAL(vm.sentinelClass));
   mapSetStr(&vm.globals, vm.nilClass->name, CLASS_VAL(vm.nilClass));
@@ -454,6 +781,9 @@ void defineDefaultGlobals() {
   mapSetStr(&vm.globals, vm.tupleClass->name, CLASS_VAL(vm.tupleClass));
   mapSetStr(&vm.globals, vm.mapClass->name, CLASS_VAL(vm.mapClass));
   mapSetStr(&vm.globals, vm.frozenDictClass->name, CLASS_VAL(vm.frozenDictClass));
+  mapSetStr(&vm.globals, vm.setClass->name, CLASS_VAL(vm.setClass));
+  mapSetStr(&vm.globals, vm.frozenSetClass->name, CLASS_VAL(vm.frozenSetClass));
+  mapSetStr(&vm.globals, vm.dequeClass->name, CLASS_VAL(vm.dequeClass));
   mapSetStr(&vm.globals, vm.functionClass->name, CLASS_VAL(vm.functionClass));
   mapSetStr(&vm.globals, vm.operatorClass->name, CLASS_VAL(vm.operatorClass));
   mapSetStr(&vm.globals, vm.classClass->name, CLASS_VAL(vm.classClass));
@@ -1,6 +1,11 @@
 #ifndef mtots_globals_h
 #define mtots_globals_h
 
+#include "mtots_value.h"
+
+/* The builtin range(), which OP_CALL_RANGE recognizes */
+extern CFunction cfunctionRange;
+
 void defineDefaultGlobals();
 
 #endif/*mtots_globals_h*/
@@ -1,15 +1,39 @@
 #include "mtots_import.h"
+#include "mtots_bytecode.h"
+#include "mtots_compiler.h"
 #include "mtots_vm.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-/* Runs the module specified by the given path with the given moduleName
- * Puts the result of running the module on the top of the stack
- * NOTE: Never cached (unlike importModule())
- */
-ubool importModuleWithPath(String *moduleName, const char *path) {
+/* Compiles the given source, or loads it from the bytecode cache
+ * if there is an up to date cache file for it */
+static ObjThunk *compileOrLoad(
+    const char *source, String *moduleName, const char *path,
+    ubool useCache) {
+  char cachePath[MAX_PATH_LENGTH];
+  ObjThunk *thunk;
+
+  if (!useCache || !getBytecodeCachePath(path, cachePath)) {
+    return compile(source, moduleName);
+  }
+
+  thunk = loadBytecode(cachePath, source, moduleName);
+  if (thunk != NULL) {
+    return thunk;
+  }
+
+  thunk = compile(source, moduleName);
+  if (thunk != NULL) {
+    push(THUNK_VAL(thunk));
+    saveBytecode(cachePath, source, thunk, getCompiledDependencies());
+    pop(); /* thunk */
+  }
+  return thunk;
+}
+
+static ubool runModule(String *moduleName, const char *path, ubool useCache) {
   char *source = readFile(path);
   ObjClosure *closure;
   ObjThunk *thunk;
@@ -24,7 +48,8 @@ ubool importModuleWithPath(String *moduleName, const char *path) {
   mapSetN(&module->fields, "__path__", STRING_VAL(pathStr));
   pop(); /* pathStr */
 
-  thunk = compile(source, moduleName);
+  thunk = compileOrLoad(source, moduleName, path, useCache);
+  free(source);
   if (thunk == NULL) {
     runtimeError("Failed to compile %s", path);
     return UFALSE;
@@ -55,6 +80,15 @@ ubool importModuleWithPath(String *moduleName, const char *path) {
   return UFALSE;
 }
 
+/* Runs the module specified by the given path with the given moduleName
+ * Puts the result of running the module on the top of the stack
+ * NOTE: Never cached (unlike importModule()), and always compiled
+ * from source
+ */
+ubool importModuleWithPath(String *moduleName, const char *path) {
+  return runModule(moduleName, path, UFALSE);
+}
+
 static ubool importModuleNoCache(String *moduleName) {
   Value nativeModuleThunkValue;
 
@@ -97,7 +131,7 @@ static ubool importModuleNoCache(String *moduleName) {
       runtimeError("Could not find module %s", moduleName->chars);
       return UFALSE;
     }
-    return importModuleWithPath(moduleName, path);
+    return runModule(moduleName, path, MTOTS_USE_BYTECODE_CACHE);
   }
 }
 
@@ -129,3 +163,13 @@ ubool importModule(String *moduleName) {
   mapSetStr(&vm.modules, moduleName, vm.stackTop[-1]);
   return UTRUE;
 }
+
+ObjInstance *importNativeModule(String *moduleName) {
+  Value module;
+  if (!mapGetStr(&vm.nativeModuleThunks, moduleName, &module) ||
+      !importModule(moduleName)) {
+    return NULL;
+  }
+  module = pop(); /* still reachable from vm.modules */
+  return AS_INSTANCE(module);
+}
@@ -6,4 +6,9 @@
 ubool importModuleWithPath(String *moduleName, const char *path);
 ubool importModule(String *moduleName);
 
+/* Returns the native module with the given name, importing it first if
+ * it has not been imported yet, or NULL if there is no such native
+ * module. Unlike importModule(), nothing is left on the stack. */
+ObjInstance *importNativeModule(String *moduleName);
+
 #endif/*mtots_import_h*/
@@ -0,0 +1,802 @@
+/* For MAP_ANONYMOUS */
+#define _DEFAULT_SOURCE
+
+#include "mtots_jit.h"
+
+#if MTOTS_USE_JIT
+
+#if !defined(__x86_64__)
+#error "MTOTS_USE_JIT requires x86-64"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* Machine code for a chunk starts with a prologue, which every call
+ * from runJitCode() goes through, followed by the exit stub, which every
+ * return to the interpreter goes through, followed by the code for each
+ * instruction of the chunk, in order.
+ *
+ * The stack is kept in memory, exactly as the interpreter keeps it, so
+ * that the interpreter can take over between any two instructions.
+ * While the machine code runs, vm.stackTop, frame->slots and frame are
+ * kept in the registers below, and vm.stackTop is written back on exit.
+ */
+
+struct JitCode {
+  u8 *memory;
+  size_t size;
+  u8 **entries; /* where the code for the instruction at each offset of
+                 * the chunk starts, or NULL between instructions */
+};
+
+/* 64 bits, on the platforms the JIT supports (LP64) */
+typedef unsigned long Word;
+
+typedef Value *(*JitFunction)(CallFrame *frame, u8 *entry, Value *stackTop);
+
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSP 4
+#define RSI 6
+#define RDI 7
+#define R12 12
+#define R13 13
+#define R14 14
+#define R15 15
+
+#define SLOTS RBX
+#define TOP   R12
+#define FRAME R13
+
+#define CC_B  0x2
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_A  0x7
+#define CC_NP 0xB
+
+#define VALUE_SIZE ((i32)sizeof(Value))
+
+#if MTOTS_USE_NAN_BOXING
+#define NUMBER_OFFSET 0
+#else
+#define TYPE_OFFSET ((i32)offsetof(Value, type))
+#define NUMBER_OFFSET ((i32)offsetof(Value, as))
+#endif
+
+typedef struct Fixup {
+  size_t at;    /* where the 32-bit displacement of the jump is */
+  i32 target;   /* offset in the chunk to jump to */
+} Fixup;
+
+typedef struct Emitter {
+  Chunk *chunk;
+  u8 *code;
+  size_t count;
+  size_t capacity;
+  Fixup *fixups;
+  size_t fixupCount;
+  size_t fixupCapacity;
+  size_t exitStub;
+} Emitter;
+
+static void emitByte(Emitter *e, u8 byte) {
+  if (e->count == e->capacity) {
+    e->capacity = e->capacity < 256 ? 256 : e->capacity * 2;
+    e->code = (u8*)realloc(e->code, e->capacity);
+    if (e->code == NULL) {
+      panic("out of memory");
+    }
+  }
+  e->code[e->count++] = byte;
+}
+
+static void emit32(Emitter *e, u32 value) {
+  i32 i;
+  for (i = 0; i < 4; i++) {
+    emitByte(e, (u8)(value >> (8 * i)));
+  }
+}
+
+static void emit64(Emitter *e, Word value) {
+  i32 i;
+  for (i = 0; i < 8; i++) {
+    emitByte(e, (u8)(value >> (8 * i)));
+  }
+}
+
+static void patch32(Emitter *e, size_t at, u32 value) {
+  i32 i;
+  for (i = 0; i < 4; i++) {
+    e->code[at + i] = (u8)(value >> (8 * i));
+  }
+}
+
+/* Instruction encoding */
+
+static void emitRex(Emitter *e, ubool wide, u8 reg, u8 rm) {
+  u8 rex = 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+  if (rex != 0x40) {
+    emitByte(e, rex);
+  }
+}
+
+/* [base + disp32] */
+static void emitModRmMemory(Emitter *e, u8 reg, u8 base, i32 disp) {
+  emitByte(e, 0x80 | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP) {
+    emitByte(e, 0x24); /* SIB: no index */
+  }
+  emit32(e, (u32)disp);
+}
+
+static void emitModRmRegister(Emitter *e, u8 reg, u8 rm) {
+  emitByte(e, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* mov reg, [base + disp] */
+static void emitLoad(Emitter *e, u8 reg, u8 base, i32 disp) {
+  emitRex(e, UTRUE, reg, base);
+  emitByte(e, 0x8B);
+  emitModRmMemory(e, reg, base, disp);
+}
+
+/* mov [base + disp], reg */
+static void emitStore(Emitter *e, u8 base, i32 disp, u8 reg) {
+  emitRex(e, UTRUE, reg, base);
+  emitByte(e, 0x89);
+  emitModRmMemory(e, reg, base, disp);
+}
+
+/* mov reg, imm64 */
+static void emitLoadImmediate(Emitter *e, u8 reg, Word value) {
+  emitRex(e, UTRUE, 0, reg);
+  emitByte(e, 0xB8 + (reg & 7));
+  emit64(e, value);
+}
+
+/* op dst, src, for the 64-bit ALU ops whose encoding is 'op /r' */
+static void emitAlu(Emitter *e, u8 op, u8 dst, u8 src) {
+  emitRex(e, UTRUE, src, dst);
+  emitByte(e, op);
+  emitModRmRegister(e, src, dst);
+}
+
+#define ALU_OR  0x09
+#define ALU_AND 0x21
+#define ALU_CMP 0x39
+#define ALU_MOV 0x89
+
+/* add reg, imm32 */
+static void emitAddImmediate(Emitter *e, u8 reg, i32 value) {
+  emitRex(e, UTRUE, 0, reg);
+  emitByte(e, 0x81);
+  emitModRmRegister(e, 0, reg);
+  emit32(e, (u32)value);
+}
+
+#if !MTOTS_USE_NAN_BOXING
+/* The 32-bit immediate forms are only needed to read and write the type
+ * tag of an unboxed Value */
+
+/* mov dword [base + disp], imm32 */
+static void emitStore32Immediate(Emitter *e, u8 base, i32 disp, u32 value) {
+  emitRex(e, UFALSE, 0, base);
+  emitByte(e, 0xC7);
+  emitModRmMemory(e, 0, base, disp);
+  emit32(e, value);
+}
+
+/* cmp dword [base + disp], imm32 */
+static void emitCompare32Immediate(
+    Emitter *e, u8 base, i32 disp, u32 value) {
+  emitRex(e, UFALSE, 0, base);
+  emitByte(e, 0x81);
+  emitModRmMemory(e, 7, base, disp);
+  emit32(e, value);
+}
+#endif
+
+/* Scalar double instructions: 'prefix 0F op' with an xmm register
+ * and either memory or another xmm register */
+static void emitSseMemory(
+    Emitter *e, u8 prefix, u8 op, u8 xmm, u8 base, i32 disp) {
+  emitByte(e, prefix);
+  emitRex(e, UFALSE, xmm, base);
+  emitByte(e, 0x0F);
+  emitByte(e, op);
+  emitModRmMemory(e, xmm, base, disp);
+}
+
+static void emitSseRegister(Emitter *e, u8 prefix, u8 op, u8 dst, u8 src) {
+  emitByte(e, prefix);
+  emitByte(e, 0x0F);
+  emitByte(e, op);
+  emitModRmRegister(e, dst, src);
+}
+
+#define SSE_MOVSD_LOAD  0x10
+#define SSE_MOVSD_STORE 0x11
+#define SSE_ADDSD       0x58
+#define SSE_MULSD       0x59
+#define SSE_SUBSD       0x5C
+#define SSE_DIVSD       0x5E
+#define SSE_UCOMISD     0x2E
+#define SSE_XORPD       0x57
+
+/* movq xmm, reg */
+static void emitMoveToXmm(Emitter *e, u8 xmm, u8 reg) {
+  emitByte(e, 0x66);
+  emitRex(e, UTRUE, xmm, reg);
+  emitByte(e, 0x0F);
+  emitByte(e, 0x6E);
+  emitModRmRegister(e, xmm, reg);
+}
+
+/* setcc al */
+static void emitSetAl(Emitter *e, u8 cc) {
+  emitByte(e, 0x0F);
+  emitByte(e, 0x90 | cc);
+  emitByte(e, 0xC0);
+}
+
+/* setcc cl; and al, cl */
+static void emitAndAl(Emitter *e, u8 cc) {
+  emitByte(e, 0x0F);
+  emitByte(e, 0x90 | cc);
+  emitByte(e, 0xC1);
+  emitByte(e, 0x20);
+  emitByte(e, 0xC8);
+}
+
+/* mov al, imm8 (leaves the flags alone) */
+static void emitSetAlImmediate(Emitter *e, u8 value) {
+  emitByte(e, 0xB0);
+  emitByte(e, value);
+}
+
+/* movzx eax, al */
+static void emitZeroExtendAl(Emitter *e) {
+  emitByte(e, 0x0F);
+  emitByte(e, 0xB6);
+  emitByte(e, 0xC0);
+}
+
+/* Jumps within the code of one instruction. Returns where the
+ * displacement is, to be patched with patchJumpHere() */
+static size_t emitForwardJump(Emitter *e, i32 cc) {
+  if (cc < 0) {
+    emitByte(e, 0xE9);
+  } else {
+    emitByte(e, 0x0F);
+    emitByte(e, 0x80 | cc);
+  }
+  emit32(e, 0);
+  return e->count - 4;
+}
+
+static void patchJumpHere(Emitter *e, size_t at) {
+  patch32(e, at, (u32)(e->count - (at + 4)));
+}
+
+/* Jumps to the code for the instruction at 'target' in the chunk.
+ * 'cc' is -1 for an unconditional jump. */
+static void emitJumpTo(Emitter *e, i32 cc, i32 target) {
+  Fixup *fixup;
+  if (e->fixupCount == e->fixupCapacity) {
+    e->fixupCapacity = e->fixupCapacity < 16 ? 16 : e->fixupCapacity * 2;
+    e->fixups = (Fixup*)realloc(e->fixups, sizeof(Fixup) * e->fixupCapacity);
+    if (e->fixups == NULL) {
+      panic("out of memory");
+    }
+  }
+  fixup = &e->fixups[e->fixupCount++];
+  fixup->at = emitForwardJump(e, cc);
+  fixup->target = target;
+}
+
+/* Leaves the instruction at 'offset' for the interpreter */
+static void emitBail(Emitter *e, i32 offset) {
+  emitLoadImmediate(e, RAX, (Word)(size_t)(e->chunk->code + offset));
+  emitByte(e, 0xE9);
+  emit32(e, (u32)(e->exitStub - (e->count + 4)));
+}
+
+static void emitBailIf(Emitter *e, u8 cc, i32 offset) {
+  size_t skip = emitForwardJump(e, cc ^ 1);
+  emitBail(e, offset);
+  patchJumpHere(e, skip);
+}
+
+/* Values */
+
+static void emitCopyValue(
+    Emitter *e, u8 dstBase, i32 dstDisp, u8 srcBase, i32 srcDisp) {
+  i32 i;
+  for (i = 0; i < VALUE_SIZE; i += 8) {
+    emitLoad(e, RAX, srcBase, srcDisp + i);
+    emitStore(e, dstBase, dstDisp + i, RAX);
+  }
+}
+
+static void emitStoreValue(Emitter *e, u8 base, i32 disp, Value value) {
+  Word words[sizeof(Value) / sizeof(Word)];
+  i32 i;
+  memcpy(words, &value, sizeof(Value));
+  for (i = 0; i < VALUE_SIZE; i += 8) {
+    emitLoadImmediate(e, RAX, words[i / 8]);
+    emitStore(e, base, disp + i, RAX);
+  }
+}
+
+static void emitBailUnlessNumber(Emitter *e, u8 base, i32 disp, i32 offset) {
+#if MTOTS_USE_NAN_BOXING
+  emitLoad(e, RAX, base, disp);
+  emitLoadImmediate(e, RCX, NANBOX_QNAN);
+  emitAlu(e, ALU_AND, RAX, RCX);
+  emitAlu(e, ALU_CMP, RAX, RCX);
+  emitBailIf(e, CC_E, offset);
+#else
+  emitCompare32Immediate(e, base, disp + TYPE_OFFSET, VAL_NUMBER);
+  emitBailIf(e, CC_NE, offset);
+#endif
+}
+
+static void emitLoadNumber(Emitter *e, u8 xmm, u8 base, i32 disp) {
+  emitSseMemory(e, 0xF2, SSE_MOVSD_LOAD, xmm, base, disp + NUMBER_OFFSET);
+}
+
+static void emitStoreNumber(Emitter *e, u8 base, i32 disp, u8 xmm) {
+#if MTOTS_USE_NAN_BOXING
+  /* NaNs have to be canonicalized, like NUMBER_VAL does */
+  size_t skip;
+  emitSseRegister(e, 0x66, SSE_UCOMISD, xmm, xmm);
+  skip = emitForwardJump(e, CC_NP);
+  emitLoadImmediate(e, RAX, (Word)0x7ff8000000000000UL);
+  emitMoveToXmm(e, xmm, RAX);
+  patchJumpHere(e, skip);
+#else
+  emitStore32Immediate(e, base, disp + TYPE_OFFSET, VAL_NUMBER);
+#endif
+  emitSseMemory(e, 0xF2, SSE_MOVSD_STORE, xmm, base, disp + NUMBER_OFFSET);
+}
+
+/* Stores the bool in rax (0 or 1) */
+static void emitStoreBool(Emitter *e, u8 base, i32 disp) {
+#if MTOTS_USE_NAN_BOXING
+  emitLoadImmediate(e, RCX, NANBOX_BOOL);
+  emitAlu(e, ALU_OR, RAX, RCX);
+  emitStore(e, base, disp, RAX);
+#else
+  emitStore32Immediate(e, base, disp + TYPE_OFFSET, VAL_BOOL);
+  emitStore(e, base, disp + NUMBER_OFFSET, RAX);
+#endif
+}
+
+/* Sets rax to 1 if the value is falsey, and to 0 otherwise.
+ * Must agree with isFalsey() in mtots_vm.c */
+static void emitIsFalsey(Emitter *e, u8 base, i32 disp) {
+  size_t done[4];
+  i32 i, doneCount = 0;
+#if MTOTS_USE_NAN_BOXING
+  emitLoad(e, RDX, base, disp);
+  emitLoadImmediate(e, RCX, BOOL_VAL(UFALSE).bits);
+  emitAlu(e, ALU_CMP, RDX, RCX);
+  emitSetAl(e, CC_E);
+  done[doneCount++] = emitForwardJump(e, CC_E);
+  emitLoadImmediate(e, RCX, NIL_VAL().bits);
+  emitAlu(e, ALU_CMP, RDX, RCX);
+  emitSetAl(e, CC_E);
+  done[doneCount++] = emitForwardJump(e, CC_E);
+  emitLoadImmediate(e, RCX, NANBOX_QNAN);
+  emitAlu(e, ALU_MOV, RSI, RDX);
+  emitAlu(e, ALU_AND, RSI, RCX);
+  emitAlu(e, ALU_CMP, RSI, RCX);
+  emitSetAlImmediate(e, 0);
+  done[doneCount++] = emitForwardJump(e, CC_E);
+  emitMoveToXmm(e, 0, RDX);
+#else
+  size_t notBool, notNil, notNumber;
+  emitCompare32Immediate(e, base, disp + TYPE_OFFSET, VAL_BOOL);
+  notBool = emitForwardJump(e, CC_NE);
+  /* cmp byte [base + disp], 0 */
+  emitRex(e, UFALSE, 0, base);
+  emitByte(e, 0x80);
+  emitModRmMemory(e, 7, base, disp + NUMBER_OFFSET);
+  emitByte(e, 0);
+  emitSetAl(e, CC_E);
+  done[doneCount++] = emitForwardJump(e, -1);
+  patchJumpHere(e, notBool);
+  emitCompare32Immediate(e, base, disp + TYPE_OFFSET, VAL_NIL);
+  notNil = emitForwardJump(e, CC_NE);
+  emitSetAlImmediate(e, 1);
+  done[doneCount++] = emitForwardJump(e, -1);
+  patchJumpHere(e, notNil);
+  emitCompare32Immediate(e, base, disp + TYPE_OFFSET, VAL_NUMBER);
+  emitSetAlImmediate(e, 0);
+  notNumber = emitForwardJump(e, CC_NE);
+  emitLoadNumber(e, 0, base, disp);
+  done[doneCount++] = notNumber;
+#endif
+  /* 0 is the only falsey number, and NaN is not equal to it */
+  emitSseRegister(e, 0x66, SSE_XORPD, 1, 1);
+  emitSseRegister(e, 0x66, SSE_UCOMISD, 0, 1);
+  emitSetAl(e, CC_E);
+  emitAndAl(e, CC_NP);
+  for (i = 0; i < doneCount; i++) {
+    patchJumpHere(e, done[i]);
+  }
+  emitZeroExtendAl(e);
+}
+
+/* Instructions */
+
+static u16 readShort(Chunk *chunk, i32 offset) {
+  return (u16)((chunk->code[offset] << 8) | chunk->code[offset + 1]);
+}
+
+static Value readConstant(Chunk *chunk, i32 offset) {
+  return chunk->constants.values[chunk->code[offset]];
+}
+
+/* Pops two numbers and pushes the result of the given SSE op.
+ * The operands are only checked if 'check' is set. */
+static void emitArithmetic(Emitter *e, i32 offset, u8 sseOp, ubool check) {
+  if (check) {
+    emitBailUnlessNumber(e, TOP, -2 * VALUE_SIZE, offset);
+    emitBailUnlessNumber(e, TOP, -VALUE_SIZE, offset);
+  }
+  emitLoadNumber(e, 0, TOP, -2 * VALUE_SIZE);
+  emitSseMemory(e, 0xF2, sseOp, 0, TOP, -VALUE_SIZE + NUMBER_OFFSET);
+  emitAddImmediate(e, TOP, -VALUE_SIZE);
+  emitStoreNumber(e, TOP, -VALUE_SIZE, 0);
+}
+
+/* Pops two numbers and pushes a comparison of them: TOKEN_LESS,
+ * TOKEN_GREATER, or TOKEN_EQUAL_EQUAL */
+static void emitComparison(Emitter *e, i32 offset, OpCode op, ubool check) {
+  if (check) {
+    emitBailUnlessNumber(e, TOP, -2 * VALUE_SIZE, offset);
+    emitBailUnlessNumber(e, TOP, -VALUE_SIZE, offset);
+  }
+  emitLoadNumber(e, 0, TOP, -2 * VALUE_SIZE);
+  emitLoadNumber(e, 1, TOP, -VALUE_SIZE);
+  switch (op) {
+    case OP_LESS:
+      emitSseRegister(e, 0x66, SSE_UCOMISD, 1, 0);
+      emitSetAl(e, CC_A);
+      break;
+    case OP_GREATER:
+      emitSseRegister(e, 0x66, SSE_UCOMISD, 0, 1);
+      emitSetAl(e, CC_A);
+      break;
+    default:
+      emitSseRegister(e, 0x66, SSE_UCOMISD, 0, 1);
+      emitSetAl(e, CC_E);
+      emitAndAl(e, CC_NP);
+  }
+  emitZeroExtendAl(e);
+  emitAddImmediate(e, TOP, -VALUE_SIZE);
+  emitStoreBool(e, TOP, -VALUE_SIZE);
+}
+
+static void emitPushLocal(Emitter *e, i32 slot, i32 position) {
+  emitCopyValue(e, TOP, position * VALUE_SIZE, SLOTS, slot * VALUE_SIZE);
+}
+
+static ubool getGlobal(
+    CallFrame *frame, String *name, InlineCache *ic, Value *out) {
+  Map *fields = &frame->closure->module->fields;
+  u32 index;
+  if (ic->guard == fields && mapGetStrAt(fields, ic->index, name, out)) {
+    return UTRUE;
+  }
+  if (mapGetStrIndex(fields, name, out, &index)) {
+    ic->guard = fields;
+    ic->index = index;
+    return UTRUE;
+  }
+  return UFALSE;
+}
+
+static void emitInstruction(Emitter *e, i32 offset) {
+  Chunk *chunk = e->chunk;
+  u8 *code = chunk->code + offset;
+  switch (code[0]) {
+    case OP_CONSTANT:
+      emitStoreValue(e, TOP, 0, readConstant(chunk, offset + 1));
+      emitAddImmediate(e, TOP, VALUE_SIZE);
+      return;
+    case OP_NIL:
+      emitStoreValue(e, TOP, 0, NIL_VAL());
+      emitAddImmediate(e, TOP, VALUE_SIZE);
+      return;
+    case OP_TRUE:
+    case OP_FALSE:
+      emitLoadImmediate(e, RAX, code[0] == OP_TRUE);
+      emitStoreBool(e, TOP, 0);
+      emitAddImmediate(e, TOP, VALUE_SIZE);
+      return;
+    case OP_POP:
+      emitAddImmediate(e, TOP, -VALUE_SIZE);
+      return;
+    case OP_GET_LOCAL:
+      emitPushLocal(e, code[1], 0);
+      emitAddImmediate(e, TOP, VALUE_SIZE);
+      return;
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
+      emitCopyValue(e, SLOTS, code[1] * VALUE_SIZE, TOP, -VALUE_SIZE);
+      if (code[0] == OP_SET_LOCAL_POP) {
+        emitAddImmediate(e, TOP, -VALUE_SIZE);
+      }
+      return;
+    case OP_GET_LOCALS:
+      emitPushLocal(e, code[1], 0);
+      emitPushLocal(e, code[2], 1);
+      emitAddImmediate(e, TOP, 2 * VALUE_SIZE);
+      return;
+    case OP_GET_LOCAL_CONSTANT:
+      emitPushLocal(e, code[1], 0);
+      emitStoreValue(e, TOP, VALUE_SIZE, readConstant(chunk, offset + 2));
+      emitAddImmediate(e, TOP, 2 * VALUE_SIZE);
+      return;
+    case OP_GET_UPVALUE:
+      emitLoad(e, RCX, FRAME, (i32)offsetof(CallFrame, closure));
+      emitLoad(e, RCX, RCX, (i32)offsetof(ObjClosure, upvalues));
+      emitLoad(e, RCX, RCX, code[1] * (i32)sizeof(ObjUpvalue*));
+      emitLoad(e, RCX, RCX, (i32)offsetof(ObjUpvalue, location));
+      emitCopyValue(e, TOP, 0, RCX, 0);
+      emitAddImmediate(e, TOP, VALUE_SIZE);
+      return;
+    case OP_GET_GLOBAL: {
+      String *name = AS_STRING_OR_ROPE(readConstant(chunk, offset + 1));
+      InlineCache *ic = &chunk->caches[readShort(chunk, offset + 2)];
+      emitAlu(e, ALU_MOV, RDI, FRAME);
+      emitLoadImmediate(e, RSI, (Word)(size_t)name);
+      emitLoadImmediate(e, RDX, (Word)(size_t)ic);
+      emitAlu(e, ALU_MOV, RCX, TOP);
+      emitLoadImmediate(e, RAX, (Word)(size_t)getGlobal);
+      emitByte(e, 0xFF); /* call rax */
+      emitByte(e, 0xD0);
+      emitByte(e, 0x84); /* test al, al */
+      emitByte(e, 0xC0);
+      emitBailIf(e, CC_E, offset);
+      emitAddImmediate(e, TOP, VALUE_SIZE);
+      return;
+    }
+    case OP_EQUAL:
+    case OP_EQUAL_NUMBERS:
+      emitComparison(e, offset, OP_EQUAL, UTRUE);
+      return;
+    case OP_GREATER:
+    case OP_GREATER_NUMBERS:
+    case OP_NUMBER_GREATER:
+      emitComparison(e, offset, OP_GREATER, code[0] != OP_NUMBER_GREATER);
+      return;
+    case OP_LESS:
+    case OP_LESS_NUMBERS:
+    case OP_NUMBER_LESS:
+      emitComparison(e, offset, OP_LESS, code[0] != OP_NUMBER_LESS);
+      return;
+    case OP_ADD:
+    case OP_ADD_NUMBERS:
+    case OP_NUMBER_ADD:
+      emitArithmetic(e, offset, SSE_ADDSD, code[0] != OP_NUMBER_ADD);
+      return;
+    case OP_SUBTRACT:
+    case OP_NUMBER_SUBTRACT:
+      emitArithmetic(e, offset, SSE_SUBSD, code[0] != OP_NUMBER_SUBTRACT);
+      return;
+    case OP_MULTIPLY:
+    case OP_NUMBER_MULTIPLY:
+      emitArithmetic(e, offset, SSE_MULSD, code[0] != OP_NUMBER_MULTIPLY);
+      return;
+    case OP_DIVIDE:
+    case OP_NUMBER_DIVIDE:
+      emitArithmetic(e, offset, SSE_DIVSD, code[0] != OP_NUMBER_DIVIDE);
+      return;
+    case OP_ADD_LOCALS:
+    case OP_NUMBER_MULTIPLY_LOCALS:
+      if (code[0] == OP_ADD_LOCALS) {
+        emitBailUnlessNumber(e, SLOTS, code[1] * VALUE_SIZE, offset);
+        emitBailUnlessNumber(e, SLOTS, code[2] * VALUE_SIZE, offset);
+      }
+      emitLoadNumber(e, 0, SLOTS, code[1] * VALUE_SIZE);
+      emitSseMemory(
+        e, 0xF2, code[0] == OP_ADD_LOCALS ? SSE_ADDSD : SSE_MULSD,
+        0, SLOTS, code[2] * VALUE_SIZE + NUMBER_OFFSET);
+      emitStoreNumber(e, TOP, 0, 0);
+      emitAddImmediate(e, TOP, VALUE_SIZE);
+      return;
+    case OP_NOT:
+      emitIsFalsey(e, TOP, -VALUE_SIZE);
+      emitStoreBool(e, TOP, -VALUE_SIZE);
+      return;
+    case OP_NEGATE:
+      emitBailUnlessNumber(e, TOP, -VALUE_SIZE, offset);
+      emitLoadNumber(e, 0, TOP, -VALUE_SIZE);
+      emitLoadImmediate(e, RAX, (Word)0x8000000000000000UL);
+      emitMoveToXmm(e, 1, RAX);
+      emitSseRegister(e, 0x66, SSE_XORPD, 0, 1);
+      emitStoreNumber(e, TOP, -VALUE_SIZE, 0);
+      return;
+    case OP_JUMP:
+      emitJumpTo(e, -1, offset + 3 + readShort(chunk, offset + 1));
+      return;
+    case OP_LOOP:
+      emitJumpTo(e, -1, offset + 3 - readShort(chunk, offset + 1));
+      return;
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+      emitIsFalsey(e, TOP, -VALUE_SIZE);
+      emitByte(e, 0x85); /* test eax, eax */
+      emitByte(e, 0xC0);
+      emitJumpTo(
+        e, code[0] == OP_JUMP_IF_FALSE ? CC_NE : CC_E,
+        offset + 3 + readShort(chunk, offset + 1));
+      return;
+    case OP_LESS_LOCAL_CONSTANT_JUMP_IF_FALSE: {
+      Value constant = readConstant(chunk, offset + 2);
+      double number;
+      Word bits;
+      if (!IS_NUMBER(constant)) {
+        break;
+      }
+      number = AS_NUMBER(constant);
+      memcpy(&bits, &number, sizeof(bits));
+      emitBailUnlessNumber(e, SLOTS, code[1] * VALUE_SIZE, offset);
+      emitLoadNumber(e, 0, SLOTS, code[1] * VALUE_SIZE);
+      emitLoadImmediate(e, RAX, bits);
+      emitMoveToXmm(e, 1, RAX);
+      emitSseRegister(e, 0x66, SSE_UCOMISD, 1, 0);
+      emitSetAl(e, CC_A);
+      emitZeroExtendAl(e);
+      emitAlu(e, ALU_MOV, RDX, RAX);
+      emitStoreBool(e, TOP, 0);
+      emitAddImmediate(e, TOP, VALUE_SIZE);
+      emitByte(e, 0x85); /* test edx, edx */
+      emitByte(e, 0xD2);
+      emitJumpTo(e, CC_E, offset + 5 + readShort(chunk, offset + 3));
+      return;
+    }
+    case OP_CHECK_NUMBER:
+      emitBailUnlessNumber(e, TOP, -VALUE_SIZE, offset);
+      return;
+    case OP_CHECK_LOCAL_NUMBER:
+      emitBailUnlessNumber(e, SLOTS, code[1] * VALUE_SIZE, offset);
+      return;
+    default:
+      break;
+  }
+  emitBail(e, offset);
+}
+
+static void emitPrologue(Emitter *e) {
+  static const u8 saved[] = { RBX, R12, R13, R14, R15 };
+  i32 i;
+
+  /* Five registers plus the return address keep the stack aligned
+   * to 16 bytes for calls into C */
+  for (i = 0; i < 5; i++) {
+    emitRex(e, UFALSE, 0, saved[i]);
+    emitByte(e, 0x50 + (saved[i] & 7)); /* push */
+  }
+  emitAlu(e, ALU_MOV, FRAME, RDI);
+  emitLoad(e, SLOTS, FRAME, (i32)offsetof(CallFrame, slots));
+  emitAlu(e, ALU_MOV, TOP, RDX);
+  emitByte(e, 0xFF); /* jmp rsi */
+  emitByte(e, 0xE6);
+
+  /* The exit stub, with the address of the next instruction for the
+   * interpreter in rax */
+  e->exitStub = e->count;
+  emitStore(e, FRAME, (i32)offsetof(CallFrame, ip), RAX);
+  emitAlu(e, ALU_MOV, RAX, TOP);
+  for (i = 4; i >= 0; i--) {
+    emitRex(e, UFALSE, 0, saved[i]);
+    emitByte(e, 0x58 + (saved[i] & 7)); /* pop */
+  }
+  emitByte(e, 0xC3); /* ret */
+}
+
+void compileJitCode(ObjThunk *thunk) {
+  Chunk *chunk = &thunk->chunk;
+  Emitter e;
+  size_t *nativeOffsets, i;
+  i32 offset;
+  JitCode *jitCode;
+  void *memory;
+
+  if (thunk->jitCode != NULL || chunk->count == 0) {
+    return;
+  }
+
+  e.chunk = chunk;
+  e.code = NULL;
+  e.count = e.capacity = 0;
+  e.fixups = NULL;
+  e.fixupCount = e.fixupCapacity = 0;
+  nativeOffsets = (size_t*)malloc(sizeof(size_t) * chunk->count);
+  if (nativeOffsets == NULL) {
+    panic("out of memory");
+  }
+  for (offset = 0; offset < chunk->count; offset++) {
+    nativeOffsets[offset] = 0;
+  }
+
+  emitPrologue(&e);
+  for (offset = 0; offset < chunk->count;
+      offset += instructionSize(chunk, offset)) {
+    nativeOffsets[offset] = e.count;
+    emitInstruction(&e, offset);
+  }
+  for (i = 0; i < e.fixupCount; i++) {
+    Fixup *fixup = &e.fixups[i];
+    patch32(&e, fixup->at,
+      (u32)(nativeOffsets[fixup->target] - (fixup->at + 4)));
+  }
+
+  memory = mmap(
+    NULL, e.count, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory != MAP_FAILED) {
+    memcpy(memory, e.code, e.count);
+    if (mprotect(memory, e.count, PROT_READ | PROT_EXEC) != 0) {
+      munmap(memory, e.count);
+      memory = MAP_FAILED;
+    }
+  }
+
+  if (memory != MAP_FAILED) {
+    jitCode = (JitCode*)malloc(sizeof(JitCode));
+    if (jitCode == NULL) {
+      panic("out of memory");
+    }
+    jitCode->memory = (u8*)memory;
+    jitCode->size = e.count;
+    jitCode->entries = (u8**)malloc(sizeof(u8*) * chunk->count);
+    if (jitCode->entries == NULL) {
+      panic("out of memory");
+    }
+    for (offset = 0; offset < chunk->count; offset++) {
+      jitCode->entries[offset] = NULL;
+    }
+    for (offset = 0; offset < chunk->count;
+        offset += instructionSize(chunk, offset)) {
+      jitCode->entries[offset] = jitCode->memory + nativeOffsets[offset];
+    }
+    thunk->jitCode = jitCode;
+  }
+
+  free(nativeOffsets);
+  free(e.code);
+  free(e.fixups);
+}
+
+void runJitCode(CallFrame *frame) {
+  ObjThunk *thunk = frame->closure->thunk;
+  union {
+    u8 *memory;
+    JitFunction function;
+  } u;
+  u.memory = thunk->jitCode->memory;
+  vm.stackTop = u.function(
+    frame,
+    thunk->jitCode->entries[frame->ip - thunk->chunk.code],
+    vm.stackTop);
+}
+
+void freeJitCode(JitCode *code) {
+  if (code == NULL) {
+    return;
+  }
+  munmap(code->memory, code->size);
+  free(code->entries);
+  free(code);
+}
+
+#endif/*MTOTS_USE_JIT*/
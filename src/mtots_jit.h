@@ -0,0 +1,47 @@
+#ifndef mtots_jit_h
+#define mtots_jit_h
+
+#include "mtots_vm.h"
+
+/* A baseline JIT for x86-64 (see MTOTS_USE_JIT in mtots_config.h).
+ *
+ * Each thunk counts how often it is called, and how often its loops
+ * jump back. Once that reaches MTOTS_JIT_THRESHOLD, its chunk is
+ * translated, one instruction at a time, into machine code that does
+ * the same thing to the same stack.
+ *
+ * Only the common and simple cases get machine code: locals, constants,
+ * jumps, and arithmetic and comparisons on numbers. For anything else,
+ * including an instruction whose operands turn out not to be numbers,
+ * the machine code stores the address of that instruction in frame->ip
+ * and returns. run() then runs that one instruction itself, and goes
+ * back to the machine code for the instruction after it (which may be
+ * in another frame, e.g. after a call). So errors, calls, allocation
+ * and everything that touches the GC happen only in the interpreter,
+ * and the machine code never has to be thrown away.
+ */
+
+#if MTOTS_USE_JIT
+
+typedef struct JitCode JitCode;
+
+#define JIT_TICK(thunk) \
+  do { \
+    if ((thunk)->hotness++ == MTOTS_JIT_THRESHOLD) { \
+      compileJitCode(thunk); \
+    } \
+  } while (0)
+
+/* Sets thunk->jitCode, unless the thunk cannot be compiled */
+void compileJitCode(ObjThunk *thunk);
+
+/* Runs the machine code of the frame's thunk, from frame->ip for as long
+ * as it can. On return, frame->ip is an instruction that the interpreter
+ * has to run, and vm.stackTop is up to date. */
+void runJitCode(CallFrame *frame);
+
+void freeJitCode(JitCode *code);
+
+#endif/*MTOTS_USE_JIT*/
+
+#endif/*mtots_jit_h*/
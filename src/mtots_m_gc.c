@@ -0,0 +1,237 @@
+#include "mtots_m_gc.h"
+
+#include "mtots_vm.h"
+
+static ubool implCollect(i16 argCount, Value *args, Value *out) {
+  collectGarbage();
+  return UTRUE;
+}
+
+static CFunction funcCollect = { implCollect, "collect", 0 };
+
+static ubool implPauses(i16 argCount, Value *args, Value *out) {
+  ObjList *list = newList(GC_PAUSE_BUCKET_COUNT);
+  size_t i;
+  for (i = 0; i < GC_PAUSE_BUCKET_COUNT; i++) {
+    list->buffer[i] = NUMBER_VAL(vm.gcPauses[i]);
+  }
+  *out = LIST_VAL(list);
+  return UTRUE;
+}
+
+static CFunction funcPauses = { implPauses, "pauses", 0 };
+
+static ubool implMaxPause(i16 argCount, Value *args, Value *out) {
+  *out = NUMBER_VAL(vm.gcMaxPause);
+  return UTRUE;
+}
+
+static CFunction funcMaxPause = { implMaxPause, "maxPause", 0 };
+
+static ubool implIsIncremental(i16 argCount, Value *args, Value *out) {
+  *out = BOOL_VAL(vm.gcIncremental);
+  return UTRUE;
+}
+
+static CFunction funcIsIncremental = {
+  implIsIncremental, "isIncremental", 0 };
+
+static ubool implEnable(i16 argCount, Value *args, Value *out) {
+  setGCEnabled(UTRUE);
+  return UTRUE;
+}
+
+static CFunction funcEnable = { implEnable, "enable", 0 };
+
+static ubool implDisable(i16 argCount, Value *args, Value *out) {
+  setGCEnabled(UFALSE);
+  return UTRUE;
+}
+
+static CFunction funcDisable = { implDisable, "disable", 0 };
+
+static ubool implIsEnabled(i16 argCount, Value *args, Value *out) {
+  *out = BOOL_VAL(vm.gcEnabled);
+  return UTRUE;
+}
+
+static CFunction funcIsEnabled = { implIsEnabled, "isEnabled", 0 };
+
+static TypePattern argsSetStress[] = {
+  { TYPE_PATTERN_BOOL },
+};
+
+static ubool implSetStress(i16 argCount, Value *args, Value *out) {
+  setGCStress(AS_BOOL(args[0]));
+  return UTRUE;
+}
+
+static CFunction funcSetStress = {
+  implSetStress, "setStress", 1, 0, argsSetStress };
+
+static ubool implIsStress(i16 argCount, Value *args, Value *out) {
+  *out = BOOL_VAL(vm.gcStress);
+  return UTRUE;
+}
+
+static CFunction funcIsStress = { implIsStress, "isStress", 0 };
+
+static ubool implHeapSize(i16 argCount, Value *args, Value *out) {
+  *out = NUMBER_VAL(getHeapSize());
+  return UTRUE;
+}
+
+static CFunction funcHeapSize = { implHeapSize, "heapSize", 0 };
+
+/* Sizes are numbers of bytes; 'what' is for the error message */
+static ubool getSize(Value value, const char *what, size_t *out) {
+  double size = AS_NUMBER(value);
+  if (!(size >= 0)) {
+    runtimeError("Expected a non-negative %s but got %g", what, size);
+    return UFALSE;
+  }
+  *out = (size_t)size;
+  return UTRUE;
+}
+
+static TypePattern argsSize[] = {
+  { TYPE_PATTERN_NUMBER },
+};
+
+static ubool implThreshold(i16 argCount, Value *args, Value *out) {
+  *out = NUMBER_VAL(vm.nextGC);
+  return UTRUE;
+}
+
+static CFunction funcThreshold = { implThreshold, "threshold", 0 };
+
+static ubool implSetThreshold(i16 argCount, Value *args, Value *out) {
+  size_t size;
+  if (!getSize(args[0], "threshold", &size)) {
+    return UFALSE;
+  }
+  setGCThreshold(size);
+  return UTRUE;
+}
+
+static CFunction funcSetThreshold = {
+  implSetThreshold, "setThreshold", 1, 0, argsSize };
+
+static ubool implMaxHeapSize(i16 argCount, Value *args, Value *out) {
+  *out = NUMBER_VAL(vm.gcMaxHeapSize);
+  return UTRUE;
+}
+
+static CFunction funcMaxHeapSize = { implMaxHeapSize, "maxHeapSize", 0 };
+
+static ubool implSetMaxHeapSize(i16 argCount, Value *args, Value *out) {
+  size_t size;
+  if (!getSize(args[0], "heap size", &size)) {
+    return UFALSE;
+  }
+  setGCMaxHeapSize(size);
+  return UTRUE;
+}
+
+static CFunction funcSetMaxHeapSize = {
+  implSetMaxHeapSize, "setMaxHeapSize", 1, 0, argsSize };
+
+static ubool implGrowthFactor(i16 argCount, Value *args, Value *out) {
+  *out = NUMBER_VAL(vm.gcGrowthFactor);
+  return UTRUE;
+}
+
+static CFunction funcGrowthFactor = { implGrowthFactor, "growthFactor", 0 };
+
+static ubool implSetGrowthFactor(i16 argCount, Value *args, Value *out) {
+  if (!setGCGrowthFactor(AS_NUMBER(args[0]))) {
+    runtimeError(
+      "Expected a growth factor of at least 1 but got %g",
+      AS_NUMBER(args[0]));
+    return UFALSE;
+  }
+  return UTRUE;
+}
+
+static CFunction funcSetGrowthFactor = {
+  implSetGrowthFactor, "setGrowthFactor", 1, 0, argsSize };
+
+/* Sets 'key' in 'dict' to a dict with a number for each ObjType */
+static void setPerType(ObjDict *dict, const char *key, size_t *values) {
+  ObjDict *perType = newDict();
+  size_t i;
+  push(DICT_VAL(perType));
+  for (i = 0; i < OBJ_TYPE_COUNT; i++) {
+    mapSetN(
+      &perType->map, getObjectTypeName((ObjType)i), NUMBER_VAL(values[i]));
+  }
+  mapSetN(&dict->map, key, DICT_VAL(perType));
+  pop(); /* perType */
+}
+
+static ubool implStats(i16 argCount, Value *args, Value *out) {
+  GCStats stats;
+  ObjDict *dict;
+
+  /* Taken before building the dict, which allocates */
+  getGCStats(&stats);
+
+  dict = newDict();
+  push(DICT_VAL(dict));
+  mapSetN(&dict->map, "collections", NUMBER_VAL(stats.collections));
+  mapSetN(&dict->map, "pauses", NUMBER_VAL(stats.pauses));
+  mapSetN(&dict->map, "totalPause", NUMBER_VAL(stats.totalPause));
+  mapSetN(&dict->map, "maxPause", NUMBER_VAL(stats.maxPause));
+  mapSetN(&dict->map, "heapSize", NUMBER_VAL(stats.heapSize));
+  mapSetN(&dict->map, "stringsSize", NUMBER_VAL(stats.stringsSize));
+  mapSetN(&dict->map, "internedStrings", NUMBER_VAL(stats.internedStrings));
+  mapSetN(&dict->map, "internTableSize", NUMBER_VAL(stats.internTableSize));
+  mapSetN(&dict->map, "internedTuples", NUMBER_VAL(stats.internedTuples));
+  mapSetN(
+    &dict->map, "internedFrozenDicts", NUMBER_VAL(stats.internedFrozenDicts));
+  mapSetN(
+    &dict->map, "internedFrozenSets", NUMBER_VAL(stats.internedFrozenSets));
+  setPerType(dict, "allocatedBytes", stats.allocatedBytes);
+  setPerType(dict, "liveObjects", stats.liveObjects);
+  pop(); /* dict */
+  *out = DICT_VAL(dict);
+  return UTRUE;
+}
+
+static CFunction funcStats = { implStats, "stats", 0 };
+
+static ubool impl(i16 argCount, Value *args, Value *out) {
+  ObjInstance *module = AS_INSTANCE(args[0]);
+  CFunction *functions[] = {
+    &funcCollect,
+    &funcPauses,
+    &funcMaxPause,
+    &funcIsIncremental,
+    &funcEnable,
+    &funcDisable,
+    &funcIsEnabled,
+    &funcSetStress,
+    &funcIsStress,
+    &funcHeapSize,
+    &funcThreshold,
+    &funcSetThreshold,
+    &funcMaxHeapSize,
+    &funcSetMaxHeapSize,
+    &funcGrowthFactor,
+    &funcSetGrowthFactor,
+    &funcStats,
+  };
+  size_t i;
+
+  for (i = 0; i < sizeof(functions)/sizeof(CFunction*); i++) {
+    mapSetN(&module->fields, functions[i]->name, CFUNCTION_VAL(functions[i]));
+  }
+
+  return UTRUE;
+}
+
+static CFunction func = { impl, "gc", 1 };
+
+void addNativeModuleGC() {
+  addNativeModule(&func);
+}
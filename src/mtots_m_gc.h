@@ -0,0 +1,8 @@
+#ifndef mtots_m_gc_h
+#define mtots_m_gc_h
+
+/* Native Module gc */
+
+void addNativeModuleGC();
+
+#endif/*mtots_m_gc_h*/
@@ -0,0 +1,479 @@
+#include "mtots_m_heap.h"
+
+#include "mtots_vm.h"
+
+/**********************************************************
+ * Binary heaps in lists, in the style of Python's heapq
+ *********************************************************/
+
+/* Numbers, and tuples that start with a number (e.g. a priority and an
+ * item), are by far the most common things to keep in a heap, so they
+ * are compared here without going through valueLessThan(). Tuples whose
+ * first items are equal are still compared as a whole. */
+static ubool heapLessThan(Value a, Value b) {
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    return AS_NUMBER(a) < AS_NUMBER(b);
+  }
+  if (IS_TUPLE(a) && IS_TUPLE(b)) {
+    ObjTuple *tupleA = AS_TUPLE(a);
+    ObjTuple *tupleB = AS_TUPLE(b);
+    if (tupleA->length > 0 && tupleB->length > 0 &&
+        IS_NUMBER(tupleA->buffer[0]) && IS_NUMBER(tupleB->buffer[0])) {
+      double x = AS_NUMBER(tupleA->buffer[0]);
+      double y = AS_NUMBER(tupleB->buffer[0]);
+      if (x < y) {
+        return UTRUE;
+      }
+      if (y < x) {
+        return UFALSE;
+      }
+    }
+  }
+  return valueLessThan(a, b);
+}
+
+/* Moves the item at 'pos' up towards 'start' until its parent is not
+ * greater than it.
+ * The item is kept on the stack while it is out of the list. */
+static void siftUp(Value *heap, size_t start, size_t pos) {
+  Value item = heap[pos];
+  push(item);
+  while (pos > start) {
+    size_t parent = (pos - 1) / 2;
+    if (!heapLessThan(item, heap[parent])) {
+      break;
+    }
+    heap[pos] = heap[parent];
+    pos = parent;
+  }
+  heap[pos] = item;
+  pop(); /* item */
+}
+
+/* Moves the item at 'pos' down into its place.
+ *
+ * Like heapq, this moves the smaller child up all the way to a leaf, and
+ * only then sifts the item back up. The item usually came from the
+ * bottom of the heap, so this ends up with about half as many
+ * comparisons as stopping as soon as the item is smaller than both
+ * children. */
+static void siftDown(Value *heap, size_t length, size_t pos) {
+  size_t start = pos;
+  size_t child = 2 * pos + 1;
+  Value item = heap[pos];
+  push(item);
+  while (child < length) {
+    size_t right = child + 1;
+    if (right < length && !heapLessThan(heap[child], heap[right])) {
+      child = right;
+    }
+    heap[pos] = heap[child];
+    pos = child;
+    child = 2 * pos + 1;
+  }
+  heap[pos] = item;
+  pop(); /* item */
+  siftUp(heap, start, pos);
+}
+
+static TypePattern argsListItem[] = {
+  { TYPE_PATTERN_LIST },
+  { TYPE_PATTERN_ANY },
+};
+
+static TypePattern argsList[] = {
+  { TYPE_PATTERN_LIST },
+};
+
+static ubool implPush(i16 argCount, Value *args, Value *out) {
+  ObjList *list = AS_LIST(args[0]);
+  listAppend(list, args[1]);
+  siftUp(list->buffer, 0, list->length - 1);
+  return UTRUE;
+}
+
+static CFunction funcPush = { implPush, "push", 2, 0, argsListItem };
+
+static ubool implPop(i16 argCount, Value *args, Value *out) {
+  ObjList *list = AS_LIST(args[0]);
+  Value last;
+  if (list->length == 0) {
+    runtimeError("Pop from an empty heap");
+    return UFALSE;
+  }
+  last = list->buffer[--list->length];
+  if (list->length == 0) {
+    WRITE_BARRIER(last);
+    *out = last;
+    return UTRUE;
+  }
+  *out = list->buffer[0];
+  WRITE_BARRIER(*out);
+  list->buffer[0] = last;
+  siftDown(list->buffer, list->length, 0);
+  return UTRUE;
+}
+
+static CFunction funcPop = { implPop, "pop", 1, 0, argsList };
+
+static ubool implPushPop(i16 argCount, Value *args, Value *out) {
+  ObjList *list = AS_LIST(args[0]);
+  if (list->length > 0 && heapLessThan(list->buffer[0], args[1])) {
+    *out = list->buffer[0];
+    WRITE_BARRIER(*out);
+    list->buffer[0] = args[1];
+    siftDown(list->buffer, list->length, 0);
+  } else {
+    *out = args[1];
+  }
+  return UTRUE;
+}
+
+static CFunction funcPushPop = {
+  implPushPop, "pushpop", 2, 0, argsListItem };
+
+static ubool implHeapify(i16 argCount, Value *args, Value *out) {
+  ObjList *list = AS_LIST(args[0]);
+  size_t i;
+  for (i = list->length / 2; i > 0; i--) {
+    siftDown(list->buffer, list->length, i - 1);
+  }
+  return UTRUE;
+}
+
+static CFunction funcHeapify = { implHeapify, "heapify", 1, 0, argsList };
+
+/**********************************************************
+ * PriorityQueue
+ *********************************************************/
+
+/* Each item gets an entry that stays in the same place for as long as
+ * the item is in the queue. The heap itself only holds the indices of
+ * the entries, and each entry knows where in the heap it is, so that
+ * changing the priority of an item (found through 'handles') only has to
+ * sift that one entry.
+ *
+ * Items with equal priorities come out in the order they were pushed. */
+typedef struct PriorityQueueEntry {
+  Value item;
+  Value priority;
+  size_t order;
+  size_t position; /* in 'heap', or the next free entry if this one is */
+} PriorityQueueEntry;
+
+typedef struct ObjPriorityQueue {
+  ObjNative obj;
+  PriorityQueueEntry *entries;
+  size_t *heap;
+  size_t length;
+  size_t capacity;     /* of both 'entries' and 'heap' */
+  size_t entriesUsed;  /* entries past this one have never been used */
+  size_t freeEntry;    /* first entry in the free list, or NO_ENTRY */
+  size_t nextOrder;
+  Map handles;         /* item -> NUMBER_VAL(index into 'entries') */
+} ObjPriorityQueue;
+
+#define NO_ENTRY ((size_t)-1)
+
+static void blackenPriorityQueue(ObjNative *n) {
+  ObjPriorityQueue *pq = (ObjPriorityQueue*)n;
+  MapIterator di;
+  MapEntry *entry;
+
+  /* Goes through 'handles' rather than 'heap', since the heap is not
+   * always in one piece while it is being sifted */
+  markMap(&pq->handles);
+  initMapIterator(&di, &pq->handles);
+  while (mapIteratorNext(&di, &entry)) {
+    PriorityQueueEntry *e = &pq->entries[(size_t)AS_NUMBER(entry->value)];
+    markValue(e->item);
+    markValue(e->priority);
+  }
+}
+
+static void freePriorityQueue(ObjNative *n) {
+  ObjPriorityQueue *pq = (ObjPriorityQueue*)n;
+  FREE_ARRAY(PriorityQueueEntry, pq->entries, pq->capacity);
+  FREE_ARRAY(size_t, pq->heap, pq->capacity);
+  freeMap(&pq->handles);
+}
+
+static NativeObjectDescriptor descriptorPriorityQueue;
+
+static ubool entryLessThan(ObjPriorityQueue *pq, size_t a, size_t b) {
+  PriorityQueueEntry *entryA = &pq->entries[a];
+  PriorityQueueEntry *entryB = &pq->entries[b];
+  if (IS_NUMBER(entryA->priority) && IS_NUMBER(entryB->priority)) {
+    double x = AS_NUMBER(entryA->priority);
+    double y = AS_NUMBER(entryB->priority);
+    if (x != y) {
+      return x < y;
+    }
+  } else if (heapLessThan(entryA->priority, entryB->priority)) {
+    return UTRUE;
+  } else if (heapLessThan(entryB->priority, entryA->priority)) {
+    return UFALSE;
+  }
+  return entryA->order < entryB->order;
+}
+
+static void queueSiftUp(ObjPriorityQueue *pq, size_t pos) {
+  size_t index = pq->heap[pos];
+  while (pos > 0) {
+    size_t parent = (pos - 1) / 2;
+    if (!entryLessThan(pq, index, pq->heap[parent])) {
+      break;
+    }
+    pq->heap[pos] = pq->heap[parent];
+    pq->entries[pq->heap[pos]].position = pos;
+    pos = parent;
+  }
+  pq->heap[pos] = index;
+  pq->entries[index].position = pos;
+}
+
+static void queueSiftDown(ObjPriorityQueue *pq, size_t pos) {
+  size_t index = pq->heap[pos];
+  size_t child = 2 * pos + 1;
+  while (child < pq->length) {
+    size_t right = child + 1;
+    if (right < pq->length &&
+        entryLessThan(pq, pq->heap[right], pq->heap[child])) {
+      child = right;
+    }
+    if (!entryLessThan(pq, pq->heap[child], index)) {
+      break;
+    }
+    pq->heap[pos] = pq->heap[child];
+    pq->entries[pq->heap[pos]].position = pos;
+    pos = child;
+    child = 2 * pos + 1;
+  }
+  pq->heap[pos] = index;
+  pq->entries[index].position = pos;
+}
+
+/* Takes the entry at 'pos' in the heap out of the queue, and returns
+ * its item */
+static Value queueRemoveAt(ObjPriorityQueue *pq, size_t pos) {
+  size_t index = pq->heap[pos];
+  PriorityQueueEntry *entry = &pq->entries[index];
+  size_t last = pq->heap[--pq->length];
+
+  if (pos < pq->length) {
+    pq->heap[pos] = last;
+    pq->entries[last].position = pos;
+    queueSiftUp(pq, pos);
+    queueSiftDown(pq, pq->entries[last].position);
+  }
+
+  mapDelete(&pq->handles, entry->item);
+  WRITE_BARRIER(entry->item);
+  WRITE_BARRIER(entry->priority);
+  entry->position = pq->freeEntry;
+  pq->freeEntry = index;
+  return entry->item;
+}
+
+static ubool getHandle(ObjPriorityQueue *pq, Value item, size_t *out) {
+  Value handle;
+  if (!mapGet(&pq->handles, item, &handle)) {
+    return UFALSE;
+  }
+  *out = (size_t)AS_NUMBER(handle);
+  return UTRUE;
+}
+
+static ubool implPriorityQueue(i16 argCount, Value *args, Value *out) {
+  ObjPriorityQueue *pq =
+    NEW_NATIVE(ObjPriorityQueue, &descriptorPriorityQueue);
+  pq->entries = NULL;
+  pq->heap = NULL;
+  pq->length = 0;
+  pq->capacity = 0;
+  pq->entriesUsed = 0;
+  pq->freeEntry = NO_ENTRY;
+  pq->nextOrder = 0;
+  initMap(&pq->handles);
+  *out = OBJ_VAL_EXPLICIT((Obj*)pq);
+  return UTRUE;
+}
+
+static CFunction funcPriorityQueue = {
+  implPriorityQueue, "PriorityQueue", 0 };
+
+/* Adds the item with the given priority, or if the item is already in
+ * the queue, changes its priority (in either direction).
+ * Returns true if the item was added. */
+static ubool implPriorityQueuePush(i16 argCount, Value *args, Value *out) {
+  ObjPriorityQueue *pq = (ObjPriorityQueue*)AS_OBJ(args[-1]);
+  Value item = args[0];
+  Value priority = args[1];
+  PriorityQueueEntry *entry;
+  size_t index;
+
+  if (getHandle(pq, item, &index)) {
+    entry = &pq->entries[index];
+    WRITE_BARRIER(entry->priority);
+    entry->priority = priority;
+    queueSiftUp(pq, entry->position);
+    queueSiftDown(pq, entry->position);
+    *out = BOOL_VAL(UFALSE);
+    return UTRUE;
+  }
+
+  if (pq->freeEntry != NO_ENTRY) {
+    index = pq->freeEntry;
+    pq->freeEntry = pq->entries[index].position;
+  } else {
+    if (pq->entriesUsed == pq->capacity) {
+      size_t oldCapacity = pq->capacity;
+      size_t newCapacity = GROW_CAPACITY(oldCapacity);
+      pq->entries = GROW_ARRAY(
+        PriorityQueueEntry, pq->entries, oldCapacity, newCapacity);
+      pq->heap = GROW_ARRAY(size_t, pq->heap, oldCapacity, newCapacity);
+      pq->capacity = newCapacity;
+    }
+    index = pq->entriesUsed++;
+  }
+
+  entry = &pq->entries[index];
+  entry->item = item;
+  entry->priority = priority;
+  entry->order = pq->nextOrder++;
+  mapSet(&pq->handles, item, NUMBER_VAL(index));
+
+  pq->heap[pq->length] = index;
+  queueSiftUp(pq, pq->length++);
+  *out = BOOL_VAL(UTRUE);
+  return UTRUE;
+}
+
+static CFunction funcPriorityQueuePush = {
+  implPriorityQueuePush, "push", 2 };
+
+static ubool implPriorityQueuePop(i16 argCount, Value *args, Value *out) {
+  ObjPriorityQueue *pq = (ObjPriorityQueue*)AS_OBJ(args[-1]);
+  if (pq->length == 0) {
+    runtimeError("Pop from an empty PriorityQueue");
+    return UFALSE;
+  }
+  *out = queueRemoveAt(pq, 0);
+  return UTRUE;
+}
+
+static CFunction funcPriorityQueuePop = {
+  implPriorityQueuePop, "pop", 0 };
+
+static ubool implPriorityQueuePeek(i16 argCount, Value *args, Value *out) {
+  ObjPriorityQueue *pq = (ObjPriorityQueue*)AS_OBJ(args[-1]);
+  if (pq->length == 0) {
+    runtimeError("Peek into an empty PriorityQueue");
+    return UFALSE;
+  }
+  *out = pq->entries[pq->heap[0]].item;
+  return UTRUE;
+}
+
+static CFunction funcPriorityQueuePeek = {
+  implPriorityQueuePeek, "peek", 0 };
+
+static ubool implPriorityQueuePriority(
+    i16 argCount, Value *args, Value *out) {
+  ObjPriorityQueue *pq = (ObjPriorityQueue*)AS_OBJ(args[-1]);
+  size_t index;
+  if (!getHandle(pq, args[0], &index)) {
+    runtimeError("Item not found in PriorityQueue");
+    return UFALSE;
+  }
+  *out = pq->entries[index].priority;
+  return UTRUE;
+}
+
+static CFunction funcPriorityQueuePriority = {
+  implPriorityQueuePriority, "priority", 1 };
+
+static ubool implPriorityQueueRemove(i16 argCount, Value *args, Value *out) {
+  ObjPriorityQueue *pq = (ObjPriorityQueue*)AS_OBJ(args[-1]);
+  size_t index;
+  if (!getHandle(pq, args[0], &index)) {
+    runtimeError("Item not found in PriorityQueue");
+    return UFALSE;
+  }
+  queueRemoveAt(pq, pq->entries[index].position);
+  return UTRUE;
+}
+
+static CFunction funcPriorityQueueRemove = {
+  implPriorityQueueRemove, "remove", 1 };
+
+static ubool implPriorityQueueContains(
+    i16 argCount, Value *args, Value *out) {
+  ObjPriorityQueue *pq = (ObjPriorityQueue*)AS_OBJ(args[-1]);
+  Value handle;
+  *out = BOOL_VAL(mapGet(&pq->handles, args[0], &handle));
+  return UTRUE;
+}
+
+static CFunction funcPriorityQueueContains = {
+  implPriorityQueueContains, "__contains__", 1 };
+
+static ubool implPriorityQueueLen(i16 argCount, Value *args, Value *out) {
+  ObjPriorityQueue *pq = (ObjPriorityQueue*)AS_OBJ(args[-1]);
+  *out = NUMBER_VAL(pq->length);
+  return UTRUE;
+}
+
+static CFunction funcPriorityQueueLen = {
+  implPriorityQueueLen, "__len__", 0 };
+
+static CFunction *priorityQueueMethods[] = {
+  &funcPriorityQueuePush,
+  &funcPriorityQueuePop,
+  &funcPriorityQueuePeek,
+  &funcPriorityQueuePriority,
+  &funcPriorityQueueRemove,
+  &funcPriorityQueueContains,
+  &funcPriorityQueueLen,
+  NULL,
+};
+
+static NativeObjectDescriptor descriptorPriorityQueue = {
+  blackenPriorityQueue, freePriorityQueue, NULL, NULL, &funcPriorityQueue,
+  sizeof(ObjPriorityQueue), "PriorityQueue", priorityQueueMethods };
+
+static ubool impl(i16 argCount, Value *args, Value *out) {
+  ObjInstance *module = AS_INSTANCE(args[0]);
+  CFunction *functions[] = {
+    &funcPush,
+    &funcPop,
+    &funcPushPop,
+    &funcHeapify,
+  };
+  NativeObjectDescriptor *descriptor = &descriptorPriorityQueue;
+  ObjClass *klass;
+  CFunction **method;
+  size_t i;
+
+  for (i = 0; i < sizeof(functions)/sizeof(CFunction*); i++) {
+    mapSetN(&module->fields, functions[i]->name, CFUNCTION_VAL(functions[i]));
+  }
+
+  klass = newClassFromCString(descriptor->name);
+  mapSetN(&module->fields, descriptor->name, CLASS_VAL(klass));
+  descriptor->klass = klass;
+  klass->descriptor = descriptor;
+  for (method = descriptor->methods; method && *method; method++) {
+    mapSetN(&klass->methods, (*method)->name, CFUNCTION_VAL(*method));
+    (*method)->receiverType.type = TYPE_PATTERN_NATIVE;
+    (*method)->receiverType.nativeTypeDescriptor = descriptor;
+  }
+
+  return UTRUE;
+}
+
+static CFunction func = { impl, "heap", 1 };
+
+void addNativeModuleHeap() {
+  addNativeModule(&func);
+}
@@ -0,0 +1,8 @@
+#ifndef mtots_m_heap_h
+#define mtots_m_heap_h
+
+/* Native Module heap */
+
+void addNativeModuleHeap();
+
+#endif/*mtots_m_heap_h*/
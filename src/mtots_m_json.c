@@ -31,7 +31,7 @@ static ubool implDumps(i16 argCount, Value *args, Value *out) {
   chars = malloc(sizeof(char) * (len + 1));
   writeJSON(args[0], NULL, chars);
   chars[len] = '\0';
-  *out = STRING_VAL(internOwnedString(chars, len));
+  *out = STRING_VAL(makeOwnedString(chars, len));
   return UTRUE;
 }
 
@@ -208,7 +208,7 @@ static ubool parseString(JSONParseState *s) {
 
   incr(s); /* ending '"' */
 
-  push(STRING_VAL(internOwnedString(chars, len)));
+  push(STRING_VAL(makeOwnedString(chars, len)));
   return UTRUE;
 }
 
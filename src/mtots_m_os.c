@@ -99,8 +99,8 @@ static ubool impl(i16 argCount, Value *args, Value *out) {
     mapSetN(&module->fields, cfunctions[i]->name, CFUNCTION_VAL(cfunctions[i]));
   }
 
-  mapSetN(&module->fields, "name", STRING_VAL(internCString(OS_NAME)));
-  mapSetN(&module->fields, "sep", STRING_VAL(internCString(PATH_SEP_STR)));
+  setModuleConstant(module, "name", STRING_VAL(internCString(OS_NAME)));
+  setModuleConstant(module, "sep", STRING_VAL(internCString(PATH_SEP_STR)));
 
   return UTRUE;
 }
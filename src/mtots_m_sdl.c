@@ -51,7 +51,7 @@ static ubool impl(i16 argCount, Value *args, Value *out) {
 
   sdlglModule = createSDLGLModule();
   push(INSTANCE_VAL(sdlglModule));
-  mapSetN(&module->fields, "gl", INSTANCE_VAL(sdlglModule));
+  setModuleConstant(module, "gl", INSTANCE_VAL(sdlglModule));
   pop(); /* sdlglModule */
 
   dict = newDict();
@@ -77,7 +77,7 @@ static ubool impl(i16 argCount, Value *args, Value *out) {
 
   for (i = 0; i < sizeof(numericConstants)/sizeof(NumericConstant); i++) {
     NumericConstant c = numericConstants[i];
-    mapSetN(&module->fields, c.name, NUMBER_VAL(c.value));
+    setModuleConstant(module, c.name, NUMBER_VAL(c.value));
   }
 
   return UTRUE;
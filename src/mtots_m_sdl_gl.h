@@ -170,7 +170,7 @@ static ObjInstance *createSDLGLModule() {
 
   for (i = 0; i < sizeof(sdlglConstants)/sizeof(SDLGLConstant); i++) {
     SDLGLConstant c = sdlglConstants[i];
-    mapSetN(&module->fields, c.name, NUMBER_VAL(c.value));
+    setModuleConstant(module, c.name, NUMBER_VAL(c.value));
   }
 
   initMapIterator(&ti, &module->fields);
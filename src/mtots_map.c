@@ -2,24 +2,81 @@
 
 #include <string.h>
 
-#define DICT_MAX_LOAD 0.75
+/* Entries are allocated for 3/4 of the index capacity */
+#define MAP_USABLE(capacity) ((capacity) / 4 * 3)
+
+#define MAP_INDEX_EMPTY   0
+#define MAP_INDEX_DELETED 1
+#define MAP_INDEX_OFFSET  2
+
+/* Largest capacities whose entry indices fit in u8 and u16 */
+#define MAP_U8_MAX_CAPACITY  256
+#define MAP_U16_MAX_CAPACITY 65536
+
+static size_t indexWidth(size_t capacity) {
+  return
+    capacity <= MAP_U8_MAX_CAPACITY ? sizeof(u8) :
+    capacity <= MAP_U16_MAX_CAPACITY ? sizeof(u16) :
+    sizeof(u32);
+}
+
+/* The index table is laid out the same way in Map and KeySet */
+static size_t readIndex(void *index, size_t capacity, size_t slot) {
+  if (capacity <= MAP_U8_MAX_CAPACITY) {
+    return ((u8*)index)[slot];
+  } else if (capacity <= MAP_U16_MAX_CAPACITY) {
+    return ((u16*)index)[slot];
+  }
+  return ((u32*)index)[slot];
+}
+
+static void writeIndex(
+    void *index, size_t capacity, size_t slot, size_t value) {
+  if (capacity <= MAP_U8_MAX_CAPACITY) {
+    ((u8*)index)[slot] = (u8)value;
+  } else if (capacity <= MAP_U16_MAX_CAPACITY) {
+    ((u16*)index)[slot] = (u16)value;
+  } else {
+    ((u32*)index)[slot] = (u32)value;
+  }
+}
+
+static size_t getIndex(Map *map, size_t slot) {
+  return readIndex(map->index, map->capacity, slot);
+}
+
+static void setIndex(Map *map, size_t slot, size_t value) {
+  writeIndex(map->index, map->capacity, slot, value);
+}
+
+/* Smallest capacity with room for 'size' entries, and some to spare.
+ * Leaving room after compacting means that a table where keys are
+ * constantly added and removed does not need to be rebuilt on every
+ * insert */
+static size_t capacityForSize(size_t size) {
+  size_t capacity = 8;
+  while (MAP_USABLE(capacity) < size + size / 2 + 1) {
+    capacity *= 2;
+  }
+  return capacity;
+}
 
 void initMap(Map *map) {
-  map->occupied = 0;
   map->capacity = 0;
   map->size = 0;
+  map->used = 0;
   map->entries = NULL;
-  map->first = NULL;
-  map->last = NULL;
+  map->index = NULL;
 }
 
 void freeMap(Map *map) {
-  FREE_ARRAY(MapEntry, map->entries, map->capacity);
+  FREE_ARRAY(MapEntry, map->entries, MAP_USABLE(map->capacity));
+  FREE_ARRAY(u8, map->index, map->capacity * indexWidth(map->capacity));
   initMap(map);
 }
 
 u32 hashval(Value value) {
-  switch (value.type) {
+  switch (VALUE_TYPE(value)) {
     /* hash values for bool taken from Java */
     case VAL_BOOL: return AS_BOOL(value) ? 1231 : 1237;
     case VAL_NIL: return 17;
@@ -32,13 +89,14 @@ u32 hashval(Value value) {
       /* TODO: smarter hashing */
       return ((u32*)(&x))[0] ^ ((u32*)(&x))[1];
     }
-    case VAL_STRING: return AS_STRING(value)->hash;
+    case VAL_STRING: return stringHash(AS_STRING_OR_ROPE(value));
     case VAL_CFUNCTION: break;
     case VAL_OPERATOR: break;
     case VAL_SENTINEL: return (u32) AS_SENTINEL(value);
     case VAL_OBJ: switch (AS_OBJ(value)->type) {
       case OBJ_TUPLE: return AS_TUPLE(value)->hash;
       case OBJ_FROZEN_DICT: return AS_FROZEN_DICT(value)->hash;
+      case OBJ_FROZEN_SET: return AS_FROZEN_SET(value)->hash;
       default: break;
     }
   }
@@ -46,127 +104,157 @@ u32 hashval(Value value) {
   return 0;
 }
 
-/* NOTE: capacity should always be non-zero.
- * If findMapEntry was a non-static function, I probably would do the check
+/* Finds the slot in the index table that refers to the given key,
+ * or if the key is not present, the slot a new entry for the key
+ * should use.
+ * Returns UTRUE if the key was found.
+ *
+ * NOTE: capacity should always be non-zero.
+ * If findSlot was a non-static function, I probably would do the check
  * in the function itself. But since it is static, all places where
  * it can be called are within this file.
  */
-static MapEntry *findMapEntry(MapEntry *entries, size_t capacity, Value key) {
+static ubool findSlot(Map *map, Value key, size_t *slotOut) {
   /* OPT: key->hash % capacity */
-  u32 index = hashval(key) & (capacity - 1);
-  MapEntry *tombstone = NULL;
+  size_t slot = hashval(key) & (map->capacity - 1);
+  size_t tombstone = map->capacity;
   for (;;) {
-    MapEntry *entry = &entries[index];
-    if (IS_EMPTY_KEY(entry->key)) {
-      if (IS_NIL(entry->value)) {
-        /* Empty entry */
-        return tombstone != NULL ? tombstone : entry;
-      } else if (tombstone == NULL) {
-        /* We found a tombstone */
-        tombstone = entry;
+    size_t ix = getIndex(map, slot);
+    if (ix == MAP_INDEX_EMPTY) {
+      *slotOut = tombstone != map->capacity ? tombstone : slot;
+      return UFALSE;
+    } else if (ix == MAP_INDEX_DELETED) {
+      if (tombstone == map->capacity) {
+        tombstone = slot;
       }
-    } else if (valuesEqual(entry->key, key)) {
-      /* We found the key */
-      return entry;
+    } else if (valuesEqual(map->entries[ix - MAP_INDEX_OFFSET].key, key)) {
+      *slotOut = slot;
+      return UTRUE;
     }
-    /* OPT: (index + 1) % capacity */
-    index = (index + 1) & (capacity - 1);
+    /* OPT: (slot + 1) % capacity */
+    slot = (slot + 1) & (map->capacity - 1);
   }
 }
 
-ubool mapGet(Map *map, Value key, Value *value) {
-  MapEntry *entry;
+static MapEntry *findMapEntry(Map *map, Value key) {
+  size_t slot;
+  if (map->size == 0 || !findSlot(map, key, &slot)) {
+    return NULL;
+  }
+  return &map->entries[getIndex(map, slot) - MAP_INDEX_OFFSET];
+}
 
-  if (map->occupied == 0) {
+ubool mapGet(Map *map, Value key, Value *value) {
+  MapEntry *entry = findMapEntry(map, key);
+  if (entry == NULL) {
     return UFALSE;
   }
+  *value = entry->value;
+  return UTRUE;
+}
 
-  entry = findMapEntry(map->entries, map->capacity, key);
-  if (IS_EMPTY_KEY(entry->key)) {
+ubool mapGetStr(Map *map, String *key, Value *value) {
+  return mapGet(map, STRING_VAL(key), value);
+}
+
+ubool mapGetStrIndex(Map *map, String *key, Value *value, u32 *index) {
+  MapEntry *entry = findMapEntry(map, STRING_VAL(key));
+  if (entry == NULL) {
     return UFALSE;
   }
+  *value = entry->value;
+  *index = (u32)(entry - map->entries);
+  return UTRUE;
+}
 
+ubool mapGetStrAt(Map *map, u32 index, String *key, Value *value) {
+  MapEntry *entry;
+  if (index >= map->used) {
+    return UFALSE;
+  }
+  entry = &map->entries[index];
+  if (!IS_STRING(entry->key) || AS_STRING_OR_ROPE(entry->key) != key) {
+    return UFALSE;
+  }
   *value = entry->value;
   return UTRUE;
 }
 
-ubool mapGetStr(Map *map, String *key, Value *value) {
-  return mapGet(map, STRING_VAL(key), value);
+ubool mapSetStrAt(Map *map, u32 index, String *key, Value value) {
+  MapEntry *entry;
+  if (index >= map->used) {
+    return UFALSE;
+  }
+  entry = &map->entries[index];
+  if (!IS_STRING(entry->key) || AS_STRING_OR_ROPE(entry->key) != key) {
+    return UFALSE;
+  }
+  WRITE_BARRIER(entry->value);
+  entry->value = value;
+  return UTRUE;
 }
 
+/* Rebuilds the map with the given capacity, dropping the holes
+ * left behind by deleted entries */
 static void adjustMapCapacity(Map *map, size_t capacity) {
-  size_t i;
-  MapEntry *entries = ALLOCATE(MapEntry, capacity);
-  MapEntry *p, *first = NULL, *last = NULL;
-  for (i = 0; i < capacity; i++) {
-    entries[i].key = EMPTY_KEY_VAL();
-    entries[i].value = NIL_VAL();
-  }
-
-  map->occupied = 0;
-  for (p = map->first; p; p = p->next) {
-    MapEntry *dest;
-
-    dest = findMapEntry(entries, capacity, p->key);
-    dest->key = p->key;
-    dest->value = p->value;
-
-    if (first == NULL) {
-      dest->prev = NULL;
-      dest->next = NULL;
-      first = last = dest;
-    } else {
-      dest->prev = last;
-      dest->next = NULL;
-      last->next = dest;
-      last = dest;
+  size_t i, used = 0, width = indexWidth(capacity);
+  MapEntry *entries = ALLOCATE(MapEntry, MAP_USABLE(capacity));
+  u8 *index = ALLOCATE(u8, capacity * width);
+  Map newMap;
+
+  memset(index, MAP_INDEX_EMPTY, capacity * width);
+
+  newMap.capacity = capacity;
+  newMap.size = map->size;
+  newMap.entries = entries;
+  newMap.index = index;
+  for (i = 0; i < map->used; i++) {
+    MapEntry *entry = &map->entries[i];
+    size_t slot;
+    if (IS_EMPTY_KEY(entry->key)) {
+      continue;
     }
-
-    map->occupied++;
+    /* Keys are already known to be distinct, so any empty slot will do */
+    slot = hashval(entry->key) & (capacity - 1);
+    while (getIndex(&newMap, slot) != MAP_INDEX_EMPTY) {
+      slot = (slot + 1) & (capacity - 1);
+    }
+    setIndex(&newMap, slot, used + MAP_INDEX_OFFSET);
+    entries[used++] = *entry;
   }
+  newMap.used = used;
 
-  FREE_ARRAY(MapEntry, map->entries, map->capacity);
-  map->entries = entries;
-  map->capacity = capacity;
-  map->first = first;
-  map->last = last;
+  freeMap(map);
+  *map = newMap;
 }
 
 ubool mapSet(Map *map, Value key, Value value) {
-  MapEntry *entry;
-  ubool isNewKey;
-
-  if (map->occupied + 1 > map->capacity * DICT_MAX_LOAD) {
-    size_t capacity = GROW_CAPACITY(map->capacity);
-    adjustMapCapacity(map, capacity);
-  }
-  entry = findMapEntry(map->entries, map->capacity, key);
-  isNewKey = IS_EMPTY_KEY(entry->key);
-
-  if (isNewKey) {
-    /* If entry->value is not nil, we're reusing a tombstone
-    * so we don't want to increment the count since tombstones
-    * are already included in count.
-    * We include tombstones in the count so that the loadfactor
-    * is sensitive to slots occupied by tombstones */
-    if (IS_NIL(entry->value)) {
-      map->occupied++;
-    }
-    map->size++;
-
-    if (map->last == NULL) {
-      map->first = map->last = entry;
-      entry->prev = entry->next = NULL;
-    } else {
-      entry->prev = map->last;
-      entry->next = NULL;
-      map->last->next = entry;
-      map->last = entry;
-    }
+  size_t slot = 0;
+
+  if (map->capacity > 0 && findSlot(map, key, &slot)) {
+    MapEntry *entry = &map->entries[getIndex(map, slot) - MAP_INDEX_OFFSET];
+    WRITE_BARRIER(entry->value);
+    entry->value = value;
+    return UFALSE;
   }
-  entry->key = key;
-  entry->value = value;
-  return isNewKey;
+
+  if (map->used + 1 > MAP_USABLE(map->capacity)) {
+    adjustMapCapacity(map, capacityForSize(map->size));
+    findSlot(map, key, &slot);
+  }
+
+  /* Keys are always interned, so that the *Str functions can
+   * compare them by address */
+  if (IS_STRING(key)) {
+    key = STRING_VAL(internedString(AS_STRING_OR_ROPE(key)));
+  }
+
+  setIndex(map, slot, map->used + MAP_INDEX_OFFSET);
+  map->entries[map->used].key = key;
+  map->entries[map->used].value = value;
+  map->used++;
+  map->size++;
+  return UTRUE;
 }
 
 ubool mapSetStr(Map *map, String *key, Value value) {
@@ -198,34 +286,28 @@ ubool mapSetN(Map *map, const char *key, Value value) {
 }
 
 ubool mapDelete(Map *map, Value key) {
+  size_t slot;
   MapEntry *entry;
 
-  if (map->occupied == 0) {
+  if (map->size == 0 || !findSlot(map, key, &slot)) {
     return UFALSE;
   }
 
-  entry = findMapEntry(map->entries, map->capacity, key);
-  if (IS_EMPTY_KEY(entry->key)) {
-    return UFALSE;
-  }
-
-  /* Update linked list */
-  if (entry->prev == NULL) {
-    map->first = entry->next;
-  } else {
-    entry->prev->next = entry->next;
-  }
-  if (entry->next == NULL) {
-    map->last = entry->prev;
-  } else {
-    entry->next->prev = entry->prev;
-  }
-  entry->prev = entry->next = NULL;
-
-  /* Place a tombstone in the entry */
+  entry = &map->entries[getIndex(map, slot) - MAP_INDEX_OFFSET];
+  WRITE_BARRIER(entry->key);
+  WRITE_BARRIER(entry->value);
   entry->key = EMPTY_KEY_VAL();
-  entry->value = BOOL_VAL(1);
+  entry->value = NIL_VAL();
+  setIndex(map, slot, MAP_INDEX_DELETED);
   map->size--;
+
+  /* Once the map is empty, start over from the first entry, so that
+   * maps that are repeatedly filled and drained are never rebuilt */
+  if (map->size == 0) {
+    memset(map->index, MAP_INDEX_EMPTY,
+      map->capacity * indexWidth(map->capacity));
+    map->used = 0;
+  }
   return UTRUE;
 }
 
@@ -235,7 +317,7 @@ ubool mapDeleteStr(Map *map, String *key) {
 
 void mapAddAll(Map *from, Map *to) {
   size_t i;
-  for (i = 0; i < from->capacity; i++) {
+  for (i = 0; i < from->used; i++) {
     MapEntry *entry = &from->entries[i];
     if (!IS_EMPTY_KEY(entry->key)) {
       mapSet(to, entry->key, entry->value);
@@ -245,29 +327,29 @@ void mapAddAll(Map *from, Map *to) {
 
 String *mapFindString(
     Map *map, const char *chars, size_t length, u32 hash) {
-  u32 index;
-  if (map->occupied == 0) {
+  size_t slot;
+  if (map->size == 0) {
     return NULL;
   }
   /* OPT: hash % map->capacity */
-  index = hash & (map->capacity - 1);
+  slot = hash & (map->capacity - 1);
   for (;;) {
-    MapEntry *entry = &map->entries[index];
-    if (IS_EMPTY_KEY(entry->key)) {
-      /* Stop if we find an empty non-tombstone entry */
-      if (IS_NIL(entry->value)) {
-        return NULL;
-      }
-    } else if (IS_STRING(entry->key)) {
-      String *key = AS_STRING(entry->key);
-      if (key->length == length &&
-          key->hash == hash &&
-          memcmp(key->chars, chars, length) == 0) {
-        return key; /* We found it */
+    size_t ix = getIndex(map, slot);
+    if (ix == MAP_INDEX_EMPTY) {
+      return NULL;
+    } else if (ix != MAP_INDEX_DELETED) {
+      MapEntry *entry = &map->entries[ix - MAP_INDEX_OFFSET];
+      if (IS_STRING(entry->key)) {
+        String *key = AS_STRING(entry->key);
+        if (key->length == length &&
+            key->hash == hash &&
+            memcmp(key->chars, chars, length) == 0) {
+          return key; /* We found it */
+        }
       }
     }
-    /* OPT: (index + 1) % map->capacity */
-    index = (index + 1) & (map->capacity - 1);
+    /* OPT: (slot + 1) % map->capacity */
+    slot = (slot + 1) & (map->capacity - 1);
   }
 }
 
@@ -276,37 +358,37 @@ ObjTuple *mapFindTuple(
     Value *buffer,
     size_t length,
     u32 hash) {
-  u32 index;
-  if (map->occupied == 0) {
+  size_t slot;
+  if (map->size == 0) {
     return NULL;
   }
   /* OPT: hash % map->capacity */
-  index = hash & (map->capacity - 1);
+  slot = hash & (map->capacity - 1);
   for (;;) {
-    MapEntry *entry = &map->entries[index];
-    if (IS_EMPTY_KEY(entry->key)) {
-      /* Stop if we find an empty non-tombstone entry */
-      if (IS_NIL(entry->value)) {
-        return NULL;
-      }
-    } else if (IS_TUPLE(entry->key)) {
-      ObjTuple *key = AS_TUPLE(entry->key);
-      if (key->length == length && key->hash == hash) {
-        size_t i;
-        ubool equal = UTRUE;
-        for (i = 0; i < length; i++) {
-          if (!valuesEqual(key->buffer[i], buffer[i])) {
-            equal = UFALSE;
-            break;
+    size_t ix = getIndex(map, slot);
+    if (ix == MAP_INDEX_EMPTY) {
+      return NULL;
+    } else if (ix != MAP_INDEX_DELETED) {
+      MapEntry *entry = &map->entries[ix - MAP_INDEX_OFFSET];
+      if (IS_TUPLE(entry->key)) {
+        ObjTuple *key = AS_TUPLE(entry->key);
+        if (key->length == length && key->hash == hash) {
+          size_t i;
+          ubool equal = UTRUE;
+          for (i = 0; i < length; i++) {
+            if (!valuesEqual(key->buffer[i], buffer[i])) {
+              equal = UFALSE;
+              break;
+            }
+          }
+          if (equal) {
+            return key; /* We found it */
           }
-        }
-        if (equal) {
-          return key; /* We found it */
         }
       }
     }
-    /* OPT: (index + 1) % map->capacity */
-    index = (index + 1) & (map->capacity - 1);
+    /* OPT: (slot + 1) % map->capacity */
+    slot = (slot + 1) & (map->capacity - 1);
   }
 }
 
@@ -314,33 +396,58 @@ ObjFrozenDict *mapFindFrozenDict(
     Map *map,
     Map *frozenDictMap,
     u32 hash) {
-  u32 index;
-  if (map->occupied == 0) {
+  size_t slot;
+  if (map->size == 0) {
     return NULL;
   }
   /* OPT: hash % map->capacity */
-  index = hash & (map->capacity - 1);
+  slot = hash & (map->capacity - 1);
   for (;;) {
-    MapEntry *entry = &map->entries[index];
-    if (IS_EMPTY_KEY(entry->key)) {
-      /* Stop if we find an empty non-tombstone entry */
-      if (IS_NIL(entry->value)) {
-        return NULL;
+    size_t ix = getIndex(map, slot);
+    if (ix == MAP_INDEX_EMPTY) {
+      return NULL;
+    } else if (ix != MAP_INDEX_DELETED) {
+      MapEntry *entry = &map->entries[ix - MAP_INDEX_OFFSET];
+      if (IS_FROZEN_DICT(entry->key)) {
+        ObjFrozenDict *key = AS_FROZEN_DICT(entry->key);
+        if (key->hash == hash && mapsEqual(frozenDictMap, &key->map)) {
+          return key; /* We found it */
+        }
       }
-    } else if (IS_FROZEN_DICT(entry->key)) {
-      ObjFrozenDict *key = AS_FROZEN_DICT(entry->key);
-      if (key->hash == hash && mapsEqual(frozenDictMap, &key->map)) {
-        return key; /* We found it */
+    }
+    /* OPT: (slot + 1) % map->capacity */
+    slot = (slot + 1) & (map->capacity - 1);
+  }
+}
+
+ObjFrozenSet *mapFindFrozenSet(Map *map, KeySet *set, u32 hash) {
+  size_t slot;
+  if (map->size == 0) {
+    return NULL;
+  }
+  /* OPT: hash % map->capacity */
+  slot = hash & (map->capacity - 1);
+  for (;;) {
+    size_t ix = getIndex(map, slot);
+    if (ix == MAP_INDEX_EMPTY) {
+      return NULL;
+    } else if (ix != MAP_INDEX_DELETED) {
+      MapEntry *entry = &map->entries[ix - MAP_INDEX_OFFSET];
+      if (IS_FROZEN_SET(entry->key)) {
+        ObjFrozenSet *key = AS_FROZEN_SET(entry->key);
+        if (key->hash == hash && keySetsEqual(set, &key->set)) {
+          return key; /* We found it */
+        }
       }
     }
-    /* OPT: (index + 1) % map->capacity */
-    index = (index + 1) & (map->capacity - 1);
+    /* OPT: (slot + 1) % map->capacity */
+    slot = (slot + 1) & (map->capacity - 1);
   }
 }
 
 void mapRemoveWhite(Map *map) {
   size_t i;
-  for (i = 0; i < map->capacity; i++) {
+  for (i = 0; i < map->used; i++) {
     MapEntry *entry = &map->entries[i];
     if (!IS_EMPTY_KEY(entry->key) &&
         IS_OBJ(entry->key) &&
@@ -352,7 +459,7 @@ void mapRemoveWhite(Map *map) {
 
 void markMap(Map *map) {
   size_t i;
-  for (i = 0; i < map->capacity; i++) {
+  for (i = 0; i < map->used; i++) {
     MapEntry *entry = &map->entries[i];
     if (!IS_EMPTY_KEY(entry->key)) {
       markValue(entry->key);
@@ -362,28 +469,257 @@ void markMap(Map *map) {
 }
 
 void initMapIterator(MapIterator *di, Map *map) {
-  di->entry = map->first;
+  di->map = map;
+  di->index = 0;
 }
 
 ubool mapIteratorDone(MapIterator *di) {
-  return di->entry == NULL;
+  while (di->index < di->map->used &&
+      IS_EMPTY_KEY(di->map->entries[di->index].key)) {
+    di->index++;
+  }
+  return di->index >= di->map->used;
 }
 
 ubool mapIteratorNext(MapIterator *di, MapEntry **out) {
-  if (di->entry) {
-    *out = di->entry;
-    di->entry = di->entry->next;
-    return UTRUE;
+  if (mapIteratorDone(di)) {
+    return UFALSE;
   }
-  return UFALSE;
+  *out = &di->map->entries[di->index++];
+  return UTRUE;
 }
 
 ubool mapIteratorNextKey(MapIterator *di, Value *out) {
-  if (di->entry) {
-    *out = di->entry->key;
-    di->entry = di->entry->next;
-    return UTRUE;
+  if (mapIteratorDone(di)) {
+    return UFALSE;
   }
-  return UFALSE;
+  *out = di->map->entries[di->index++].key;
+  return UTRUE;
 }
 
+void initKeySet(KeySet *set) {
+  set->capacity = 0;
+  set->size = 0;
+  set->used = 0;
+  set->keys = NULL;
+  set->index = NULL;
+}
+
+void freeKeySet(KeySet *set) {
+  FREE_ARRAY(Value, set->keys, MAP_USABLE(set->capacity));
+  FREE_ARRAY(u8, set->index, set->capacity * indexWidth(set->capacity));
+  initKeySet(set);
+}
+
+/* Same as findSlot, for a KeySet */
+static ubool findKeySlot(KeySet *set, Value key, size_t *slotOut) {
+  /* OPT: key->hash % capacity */
+  size_t slot = hashval(key) & (set->capacity - 1);
+  size_t tombstone = set->capacity;
+  for (;;) {
+    size_t ix = readIndex(set->index, set->capacity, slot);
+    if (ix == MAP_INDEX_EMPTY) {
+      *slotOut = tombstone != set->capacity ? tombstone : slot;
+      return UFALSE;
+    } else if (ix == MAP_INDEX_DELETED) {
+      if (tombstone == set->capacity) {
+        tombstone = slot;
+      }
+    } else if (valuesEqual(set->keys[ix - MAP_INDEX_OFFSET], key)) {
+      *slotOut = slot;
+      return UTRUE;
+    }
+    /* OPT: (slot + 1) % capacity */
+    slot = (slot + 1) & (set->capacity - 1);
+  }
+}
+
+/* Fills 'to' with the keys of 'from', in the same order but without
+ * the holes. 'to' is overwritten, so it should not own any memory. */
+static void rebuildKeySet(KeySet *from, KeySet *to, size_t capacity) {
+  size_t i, used = 0, width = indexWidth(capacity);
+  Value *keys = ALLOCATE(Value, MAP_USABLE(capacity));
+  u8 *index = ALLOCATE(u8, capacity * width);
+
+  memset(index, MAP_INDEX_EMPTY, capacity * width);
+  for (i = 0; i < from->used; i++) {
+    Value key = from->keys[i];
+    size_t slot;
+    if (IS_EMPTY_KEY(key)) {
+      continue;
+    }
+    /* Keys are already known to be distinct, so any empty slot will do */
+    slot = hashval(key) & (capacity - 1);
+    while (readIndex(index, capacity, slot) != MAP_INDEX_EMPTY) {
+      slot = (slot + 1) & (capacity - 1);
+    }
+    writeIndex(index, capacity, slot, used + MAP_INDEX_OFFSET);
+    keys[used++] = key;
+  }
+
+  to->capacity = capacity;
+  to->size = used;
+  to->used = used;
+  to->keys = keys;
+  to->index = index;
+}
+
+ubool keySetContains(KeySet *set, Value key) {
+  size_t slot;
+  return set->size > 0 && findKeySlot(set, key, &slot);
+}
+
+ubool keySetAdd(KeySet *set, Value key) {
+  size_t slot = 0;
+
+  if (set->capacity > 0 && findKeySlot(set, key, &slot)) {
+    return UFALSE;
+  }
+
+  if (set->used + 1 > MAP_USABLE(set->capacity)) {
+    KeySet newSet;
+    rebuildKeySet(set, &newSet, capacityForSize(set->size));
+    freeKeySet(set);
+    *set = newSet;
+    findKeySlot(set, key, &slot);
+  }
+
+  /* Interned, like the keys of a Map */
+  if (IS_STRING(key)) {
+    key = STRING_VAL(internedString(AS_STRING_OR_ROPE(key)));
+  }
+
+  writeIndex(set->index, set->capacity, slot, set->used + MAP_INDEX_OFFSET);
+  set->keys[set->used++] = key;
+  set->size++;
+  return UTRUE;
+}
+
+ubool keySetDelete(KeySet *set, Value key) {
+  size_t slot;
+  Value *stored;
+
+  if (set->size == 0 || !findKeySlot(set, key, &slot)) {
+    return UFALSE;
+  }
+
+  stored = &set->keys[
+    readIndex(set->index, set->capacity, slot) - MAP_INDEX_OFFSET];
+  WRITE_BARRIER(*stored);
+  *stored = EMPTY_KEY_VAL();
+  writeIndex(set->index, set->capacity, slot, MAP_INDEX_DELETED);
+  set->size--;
+
+  /* See mapDelete */
+  if (set->size == 0) {
+    memset(set->index, MAP_INDEX_EMPTY,
+      set->capacity * indexWidth(set->capacity));
+    set->used = 0;
+  }
+  return UTRUE;
+}
+
+void keySetAddAll(KeySet *from, KeySet *to) {
+  size_t i;
+  for (i = 0; i < from->used; i++) {
+    if (!IS_EMPTY_KEY(from->keys[i])) {
+      keySetAdd(to, from->keys[i]);
+    }
+  }
+}
+
+void keySetCopy(KeySet *from, KeySet *to) {
+  size_t width = indexWidth(from->capacity);
+  Value *keys;
+  u8 *index;
+
+  if (from->size == 0) {
+    return;
+  }
+  if (from->used != from->size) {
+    rebuildKeySet(from, to, capacityForSize(from->size));
+    return;
+  }
+
+  /* Without holes, the table can be copied as it is, without hashing
+   * any of the keys again */
+  keys = ALLOCATE(Value, MAP_USABLE(from->capacity));
+  index = ALLOCATE(u8, from->capacity * width);
+  memcpy(keys, from->keys, sizeof(Value) * from->used);
+  memcpy(index, from->index, from->capacity * width);
+  to->capacity = from->capacity;
+  to->size = from->size;
+  to->used = from->used;
+  to->keys = keys;
+  to->index = index;
+}
+
+void keySetUnion(KeySet *a, KeySet *b, KeySet *out) {
+  if (a->size < b->size) {
+    KeySet *tmp = a;
+    a = b;
+    b = tmp;
+  }
+  keySetCopy(a, out);
+  keySetAddAll(b, out);
+}
+
+void keySetIntersection(KeySet *a, KeySet *b, KeySet *out) {
+  size_t i;
+  if (a->size > b->size) {
+    KeySet *tmp = a;
+    a = b;
+    b = tmp;
+  }
+  for (i = 0; i < a->used; i++) {
+    Value key = a->keys[i];
+    if (!IS_EMPTY_KEY(key) && keySetContains(b, key)) {
+      keySetAdd(out, key);
+    }
+  }
+}
+
+void keySetDifference(KeySet *a, KeySet *b, KeySet *out) {
+  size_t i;
+  if (b->size < a->size) {
+    keySetCopy(a, out);
+    for (i = 0; i < b->used; i++) {
+      if (!IS_EMPTY_KEY(b->keys[i])) {
+        keySetDelete(out, b->keys[i]);
+      }
+    }
+    return;
+  }
+  for (i = 0; i < a->used; i++) {
+    Value key = a->keys[i];
+    if (!IS_EMPTY_KEY(key) && !keySetContains(b, key)) {
+      keySetAdd(out, key);
+    }
+  }
+}
+
+void markKeySet(KeySet *set) {
+  size_t i;
+  for (i = 0; i < set->used; i++) {
+    if (!IS_EMPTY_KEY(set->keys[i])) {
+      markValue(set->keys[i]);
+    }
+  }
+}
+
+void initKeySetIterator(KeySetIterator *it, KeySet *set) {
+  it->set = set;
+  it->index = 0;
+}
+
+ubool keySetIteratorNext(KeySetIterator *it, Value *out) {
+  while (it->index < it->set->used &&
+      IS_EMPTY_KEY(it->set->keys[it->index])) {
+    it->index++;
+  }
+  if (it->index >= it->set->used) {
+    return UFALSE;
+  }
+  *out = it->set->keys[it->index++];
+  return UTRUE;
+}
@@ -6,32 +6,51 @@
 typedef struct MapEntry {
   Value key;
   Value value;
-  struct MapEntry *prev;
-  struct MapEntry *next;
 } MapEntry;
 
-/* TODO: Do what Python does with Map layout
+/* Compact, insertion ordered hash map, in the style of CPython's dict
  * https://mail.python.org/pipermail/python-dev/2012-December/123028.html
+ *
+ * 'entries' holds the key/value pairs in insertion order.
+ * 'index' is the actual open addressing hash table. Each of its
+ * 'capacity' slots is a small integer: MAP_INDEX_EMPTY,
+ * MAP_INDEX_DELETED, or (MAP_INDEX_OFFSET + i) for entries[i].
+ * The integer width (u8, u16 or u32) is the narrowest that can
+ * hold every entry index for the given capacity.
+ *
+ * Deleting a key leaves a hole in 'entries' (its key is EMPTY_KEY)
+ * until the next resize compacts the array.
  */
 typedef struct Map {
-  /* `occupied` is stored to keep track of the load factor.
-   * `occupied` is the number of entries that are either
-   * contain a live entry or a tombstone.
-   * To get the actual number of entries in this Map,
-   * see field 'size'.
-   */
-  size_t occupied; /* size + tombstones */
   size_t capacity; /* 0 or (8 * <power of 2>) */
   size_t size;     /* actual number of active elements */
+  size_t used;     /* number of entries used so far, including holes */
   MapEntry *entries;
-  MapEntry *first;
-  MapEntry *last;
+  void *index;
 } Map;
 
 typedef struct MapIterator {
-  MapEntry *entry;
+  Map *map;
+  size_t index;
 } MapIterator;
 
+/* The keys-only counterpart of Map, for sets (see ObjSet).
+ * It has the same index table and probing as a Map, with 'keys'
+ * in place of 'entries', so that each element takes a single Value.
+ */
+typedef struct KeySet {
+  size_t capacity; /* 0 or (8 * <power of 2>) */
+  size_t size;     /* actual number of active elements */
+  size_t used;     /* number of keys used so far, including holes */
+  Value *keys;
+  void *index;
+} KeySet;
+
+typedef struct KeySetIterator {
+  KeySet *set;
+  size_t index;
+} KeySetIterator;
+
 u32 hashval(Value value);
 
 void initMap(Map *map);
@@ -44,6 +63,15 @@ ubool mapSetN(Map *map, const char *key, Value value);
 ubool mapDelete(Map *map, Value key);
 ubool mapDeleteStr(Map *map, String *key);
 void mapAddAll(Map *from, Map *to);
+
+/* Variants of mapGetStr and mapSetStr for inline caches.
+ * mapGetStrIndex also reports the index in 'entries' of the key.
+ * mapGetStrAt and mapSetStrAt only look at the entry at the given index,
+ * and fail if it does not currently hold the key (mapSetStrAt never
+ * adds a new key). */
+ubool mapGetStrIndex(Map *map, String *key, Value *value, u32 *index);
+ubool mapGetStrAt(Map *map, u32 index, String *key, Value *value);
+ubool mapSetStrAt(Map *map, u32 index, String *key, Value value);
 String *mapFindString(
   Map *map, const char *chars, size_t length, u32 hash);
 struct ObjTuple *mapFindTuple(
@@ -55,6 +83,7 @@ struct ObjFrozenDict *mapFindFrozenDict(
     Map *map,
     Map *frozenDictMap,
     u32 hash);
+struct ObjFrozenSet *mapFindFrozenSet(Map *map, KeySet *set, u32 hash);
 void mapRemoveWhite(Map *map);
 void markMap(Map *map);
 
@@ -62,4 +91,29 @@ void initMapIterator(MapIterator *di, Map *map);
 ubool mapIteratorNext(MapIterator *di, MapEntry **out);
 ubool mapIteratorNextKey(MapIterator *di, Value *out);
 
+void initKeySet(KeySet *set);
+void freeKeySet(KeySet *set);
+ubool keySetContains(KeySet *set, Value key);
+/* Returns UTRUE if the key was not already in the set */
+ubool keySetAdd(KeySet *set, Value key);
+ubool keySetDelete(KeySet *set, Value key);
+void keySetAddAll(KeySet *from, KeySet *to);
+
+/* keySetCopy, keySetUnion, keySetIntersection and keySetDifference
+ * all fill 'out' (or 'to'), which has to be empty.
+ *
+ * The set operations do work in proportion to the smaller of the two
+ * sets where they can: the union starts from a copy of the larger set,
+ * and the intersection only looks up the keys of the smaller one.
+ * The keys of a union or an intersection are in the order of the set
+ * that it started from, so they may not be in the order of 'a'. */
+void keySetCopy(KeySet *from, KeySet *to);
+void keySetUnion(KeySet *a, KeySet *b, KeySet *out);
+void keySetIntersection(KeySet *a, KeySet *b, KeySet *out);
+void keySetDifference(KeySet *a, KeySet *b, KeySet *out);
+void markKeySet(KeySet *set);
+
+void initKeySetIterator(KeySetIterator *it, KeySet *set);
+ubool keySetIteratorNext(KeySetIterator *it, Value *out);
+
 #endif/*mtots_map_h*/
@@ -1,27 +1,118 @@
 #include "mtots_vm.h"
+#include "mtots_pool.h"
+#include "mtots_jit.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <stdio.h>
+#include <time.h>
 
 #if DEBUG_LOG_GC
 #include <stdio.h>
 #include "mtots_debug.h"
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+/* Defaults for the GC policy (see mtots_memory.h) */
+#define GC_DEFAULT_INITIAL_HEAP_SIZE (1024 * 1024)
+#define GC_DEFAULT_GROWTH_FACTOR 2
+
+/* In incremental mode, a GC step runs after every GC_STEP_SIZE bytes
+ * allocated, and blackens or sweeps up to GC_STEP_WORK objects.
+ * In stress mode, a much smaller step runs on every allocation. */
+#define GC_STEP_SIZE (16 * 1024)
+#define GC_STEP_WORK 1024
+#define GC_STRESS_STEP_WORK 8
+
+#define GC_UNBOUNDED_WORK ((size_t)-1)
+
+/* Whether a block of the given size comes from the pool allocator */
+#define IN_POOL(size) ((size) > 0 && (size) <= POOL_MAX_SIZE)
+
+static void startCycle();
+static void gcStep(size_t budget);
+static void recordPause(clock_t start);
+
+static void incrementalStep(size_t budget) {
+  clock_t start = clock();
+  if (vm.gcPhase == GC_PHASE_IDLE) {
+    startCycle();
+  }
+  gcStep(budget);
+  recordPause(start);
+}
+
+/* Gives the GC a chance to run after 'size' more bytes were allocated */
+static void allocated(size_t size) {
+  if (vm.gcMaxHeapSize > 0 && getHeapSize() > vm.gcMaxHeapSize) {
+    collectGarbage();
+    if (getHeapSize() > vm.gcMaxHeapSize) {
+      panic(
+        "Out of memory: the heap needs %lu bytes, but its maximum size "
+        "is %lu bytes",
+        (unsigned long)getHeapSize(), (unsigned long)vm.gcMaxHeapSize);
+    }
+    return;
+  }
+  if (!vm.gcEnabled) {
+    return;
+  }
+  if (vm.gcStress) {
+    if (vm.gcIncremental) {
+      incrementalStep(GC_STRESS_STEP_WORK);
+    } else {
+      collectGarbage();
+    }
+  }
+  if (vm.gcPhase != GC_PHASE_IDLE) {
+    vm.gcDebt += size;
+    if (vm.gcDebt > GC_STEP_SIZE) {
+      vm.gcDebt = 0;
+      incrementalStep(GC_STEP_WORK);
+    }
+  } else if (getHeapSize() > vm.nextGC) {
+    if (vm.gcIncremental) {
+      vm.gcDebt = 0;
+      incrementalStep(GC_STEP_WORK);
+    } else {
+      collectGarbage();
+    }
+  }
+}
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
   void *result;
 
   vm.bytesAllocated += newSize - oldSize;
   if (newSize > oldSize) {
-#if DEBUG_STRESS_GC
-  collectGarbage();
-#endif
-    if (vm.bytesAllocated + getInternedStringsAllocationSize() > vm.nextGC) {
-      collectGarbage();
+    allocated(newSize - oldSize);
+  }
+
+#if MTOTS_USE_POOL_ALLOCATOR
+  if (IN_POOL(oldSize) || IN_POOL(newSize)) {
+    if (IN_POOL(oldSize) && IN_POOL(newSize) &&
+        poolSizeClass(oldSize) == poolSizeClass(newSize)) {
+      return pointer;
+    }
+    if (newSize == 0) {
+      result = NULL;
+    } else if (IN_POOL(newSize)) {
+      result = poolAllocate(newSize);
+    } else if ((result = malloc(newSize)) == NULL) {
+      panic("out of memory");
     }
+    if (pointer != NULL) {
+      if (result != NULL) {
+        memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+      }
+      if (IN_POOL(oldSize)) {
+        poolFree(pointer);
+      } else {
+        free(pointer);
+      }
+    }
+    return result;
   }
+#endif
 
   if (newSize == 0) {
     free(pointer);
@@ -35,6 +126,16 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
   return result;
 }
 
+void collectGarbageForStrings() {
+  size_t size = getStringsAllocationSize();
+  if (size > vm.stringsAllocationSize) {
+    size_t grown = size - vm.stringsAllocationSize;
+    vm.stringsAllocationSize = size;
+    allocated(grown);
+  }
+  vm.stringsAllocationSize = getStringsAllocationSize();
+}
+
 void markObject(Obj *object) {
   if (object == NULL || object->isMarked) {
     return;
@@ -58,15 +159,13 @@ void markObject(Obj *object) {
 }
 
 void markString(String *string) {
-  if (string) {
-    string->isMarked = UTRUE;
-  }
+  markStringParts(string);
 }
 
 void markValue(Value value) {
-  switch (value.type) {
+  switch (VALUE_TYPE(value)) {
     case VAL_STRING:
-      markString(AS_STRING(value));
+      markString(AS_STRING_OR_ROPE(value));
       break;
     case VAL_OBJ:
       markObject(AS_OBJ(value));
@@ -96,6 +195,8 @@ static void blackenObject(Obj *object) {
       markString(klass->name);
       markMap(&klass->methods);
       markMap(&klass->staticMethods);
+      markMap(&klass->constants);
+      markShape(&klass->rootShape);
       break;
     }
     case OBJ_CLOSURE: {
@@ -129,6 +230,12 @@ static void blackenObject(Obj *object) {
     case OBJ_INSTANCE: {
       ObjInstance *instance = (ObjInstance*)object;
       markObject((Obj*)instance->klass);
+      if (instance->shape != NULL) {
+        u32 i;
+        for (i = 0; i < instance->shape->fieldCount; i++) {
+          markValue(instance->slots[i]);
+        }
+      }
       markMap(&instance->fields);
       break;
     }
@@ -163,6 +270,24 @@ static void blackenObject(Obj *object) {
       markMap(&dict->map);
       break;
     }
+    case OBJ_SET: {
+      ObjSet *set = (ObjSet*)object;
+      markKeySet(&set->set);
+      break;
+    }
+    case OBJ_FROZEN_SET: {
+      ObjFrozenSet *set = (ObjFrozenSet*)object;
+      markKeySet(&set->set);
+      break;
+    }
+    case OBJ_DEQUE: {
+      ObjDeque *deque = (ObjDeque*)object;
+      size_t i;
+      for (i = 0; i < deque->length; i++) {
+        markValue(DEQUE_ITEM(deque, i));
+      }
+      break;
+    }
     case OBJ_FILE: {
       ObjFile *file = (ObjFile*)object;
       markString(file->name);
@@ -183,10 +308,14 @@ static void freeObject(Obj *object) {
   printf("%p free type %s\n", (void*) object, getObjectTypeName(object->type));
 #endif
 
+  vm.liveObjects[object->type]--;
+
   switch (object->type) {
     case OBJ_CLASS: {
       ObjClass *klass = (ObjClass*)object;
       freeMap(&klass->methods);
+      freeMap(&klass->constants);
+      freeShapeChildren(&klass->rootShape);
       FREE(ObjClass, object);
       break;
     }
@@ -200,6 +329,9 @@ static void freeObject(Obj *object) {
       ObjThunk *thunk = (ObjThunk*) object;
       freeChunk(&thunk->chunk);
       FREE_ARRAY(Value, thunk->defaultArgs, thunk->defaultArgsCount);
+#if MTOTS_USE_JIT
+      freeJitCode(thunk->jitCode);
+#endif
       FREE(ObjThunk, object);
       break;
     }
@@ -220,6 +352,7 @@ static void freeObject(Obj *object) {
     }
     case OBJ_INSTANCE: {
       ObjInstance *instance = (ObjInstance*)object;
+      FREE_ARRAY(Value, instance->slots, instance->slotCapacity);
       freeMap(&instance->fields);
       FREE(ObjInstance, object);
       break;
@@ -254,6 +387,24 @@ static void freeObject(Obj *object) {
       FREE(ObjFrozenDict, object);
       break;
     }
+    case OBJ_SET: {
+      ObjSet *set = (ObjSet*)object;
+      freeKeySet(&set->set);
+      FREE(ObjSet, object);
+      break;
+    }
+    case OBJ_FROZEN_SET: {
+      ObjFrozenSet *set = (ObjFrozenSet*)object;
+      freeKeySet(&set->set);
+      FREE(ObjFrozenSet, object);
+      break;
+    }
+    case OBJ_DEQUE: {
+      ObjDeque *deque = (ObjDeque*)object;
+      FREE_ARRAY(Value, deque->buffer, deque->capacity);
+      FREE(ObjDeque, object);
+      break;
+    }
     case OBJ_FILE: {
       FREE(ObjFile, object);
       break;
@@ -294,7 +445,6 @@ static void markRoots() {
   markMap(&vm.modules);
   markMap(&vm.nativeModuleThunks);
   markCompilerRoots();
-  markString(vm.preludeString);
   markString(vm.initString);
   markString(vm.iterString);
   markString(vm.lenString);
@@ -314,6 +464,9 @@ static void markRoots() {
   markObject((Obj*)vm.tupleClass);
   markObject((Obj*)vm.mapClass);
   markObject((Obj*)vm.frozenDictClass);
+  markObject((Obj*)vm.setClass);
+  markObject((Obj*)vm.frozenSetClass);
+  markObject((Obj*)vm.dequeClass);
   markObject((Obj*)vm.functionClass);
   markObject((Obj*)vm.operatorClass);
   markObject((Obj*)vm.classClass);
@@ -330,60 +483,291 @@ static void traceReferences() {
   }
 }
 
-static void sweep() {
-  Obj *previous = NULL;
-  Obj *object = vm.objects;
-  while (object != NULL) {
-    if (object->isMarked) {
-      object->isMarked = UFALSE;
-      previous = object;
-      object = object->next;
-    } else {
-      Obj *unreached = object;
-      object = object->next;
-      if (previous != NULL) {
-        previous->next = object;
-      } else {
-        vm.objects = object;
-      }
-      freeObject(unreached);
-    }
-  }
-}
-
-void freeObjects() {
-  Obj *object = vm.objects;
+static void freeObjectList(Obj *object) {
   while (object != NULL) {
     Obj *next = object->next;
     freeObject(object);
     object = next;
   }
+}
+
+void freeObjects() {
+  freeObjectList(vm.objects);
+  freeObjectList(vm.sweepObjects);
+  vm.objects = vm.sweepObjects = NULL;
+  vm.gcPhase = GC_PHASE_IDLE;
+  setMarkInternedStrings(UFALSE);
 
   free(vm.grayStack);
+#if MTOTS_USE_POOL_ALLOCATOR
+  poolReleaseEmptyPages();
+#endif
 }
 
-void collectGarbage() {
+/* Objects allocated while marking are born marked (see allocateObject),
+ * and strings interned while marking are marked as well. */
+static void startCycle() {
 #if DEBUG_LOG_GC
-  size_t before = vm.bytesAllocated + getInternedStringsAllocationSize();
   printf("-- gc begin\n");
 #endif
+  vm.gcPhase = GC_PHASE_MARK;
+  setMarkInternedStrings(UTRUE);
+  markRoots();
+}
 
+/* Runs once the gray stack is empty. The roots are marked again so that
+ * values that were moved onto the stack while marking are kept, and
+ * then the weak tables are cleared and sweeping starts. */
+static void finishMarking() {
   markRoots();
   traceReferences();
+
+  vm.gcPhase = GC_PHASE_SWEEP;
+  setMarkInternedStrings(UFALSE);
   freeUnmarkedStrings();
   mapRemoveWhite(&vm.tuples);
   mapRemoveWhite(&vm.frozenDicts);
-  sweep();
+  mapRemoveWhite(&vm.frozenSets);
 
-  vm.nextGC = (vm.bytesAllocated + getInternedStringsAllocationSize()) * GC_HEAP_GROW_FACTOR;
+  /* New objects allocated during the sweep go on 'vm.objects',
+   * out of the sweep's way */
+  vm.sweepObjects = vm.objects;
+  vm.objects = NULL;
+}
 
+static void finishCycle() {
+  vm.gcPhase = GC_PHASE_IDLE;
+  vm.gcCollections++;
+#if MTOTS_USE_POOL_ALLOCATOR
+  poolReleaseEmptyPages();
+#endif
+  vm.nextGC = (size_t)(getHeapSize() * vm.gcGrowthFactor);
+  if (vm.gcMaxHeapSize > 0 && vm.nextGC > vm.gcMaxHeapSize) {
+    vm.nextGC = vm.gcMaxHeapSize;
+  }
 #if DEBUG_LOG_GC
   printf("-- gc end \n");
   printf(
-    "   collected %zu bytes (from %zu to %zu) next at %zu\n",
-    before - (vm.bytesAllocated + getInternedStringsAllocationSize()),
-    before,
-    vm.bytesAllocated + getInternedStringsAllocationSize(),
-    vm.nextGC);
+    "   now at %zu bytes, next at %zu\n", getHeapSize(), vm.nextGC);
 #endif
 }
+
+/* Does at most 'budget' objects' worth of marking or sweeping */
+static void gcStep(size_t budget) {
+  size_t work = 0;
+  if (vm.gcPhase == GC_PHASE_MARK) {
+    while (work < budget && vm.grayCount > 0) {
+      Obj *object = vm.grayStack[--vm.grayCount];
+      blackenObject(object);
+      work++;
+    }
+    if (vm.grayCount == 0) {
+      finishMarking();
+    }
+  } else if (vm.gcPhase == GC_PHASE_SWEEP) {
+    while (work < budget && vm.sweepObjects != NULL) {
+      Obj *object = vm.sweepObjects;
+      vm.sweepObjects = object->next;
+      if (object->isMarked) {
+        object->isMarked = UFALSE;
+        object->next = vm.objects;
+        vm.objects = object;
+      } else {
+        freeObject(object);
+      }
+      work++;
+    }
+    if (vm.sweepObjects == NULL) {
+      finishCycle();
+    }
+  }
+}
+
+static void recordPause(clock_t start) {
+  double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+  double micros = seconds * 1000000;
+  size_t bucket = 0;
+  while (bucket + 1 < GC_PAUSE_BUCKET_COUNT && micros >= 1) {
+    micros /= 2;
+    bucket++;
+  }
+  vm.gcPauses[bucket]++;
+  vm.gcTotalPause += seconds;
+  if (seconds > vm.gcMaxPause) {
+    vm.gcMaxPause = seconds;
+  }
+}
+
+void collectGarbage() {
+  clock_t start = clock();
+
+  /* Finish whatever incremental cycle is in progress,
+   * then run a complete one */
+  while (vm.gcPhase != GC_PHASE_IDLE) {
+    gcStep(GC_UNBOUNDED_WORK);
+  }
+  startCycle();
+  while (vm.gcPhase != GC_PHASE_IDLE) {
+    gcStep(GC_UNBOUNDED_WORK);
+  }
+
+  recordPause(start);
+}
+
+/* Parses a size in bytes, optionally followed by K, M or G */
+static ubool parseSize(const char *string, size_t *out) {
+  char *end;
+  double size = strtod(string, &end);
+  switch (*end) {
+    case 'K': case 'k': size *= 1024; end++; break;
+    case 'M': case 'm': size *= 1024 * 1024; end++; break;
+    case 'G': case 'g': size *= 1024 * 1024 * 1024; end++; break;
+  }
+  if (end == string || *end != '\0' || !(size >= 0)) {
+    return UFALSE;
+  }
+  *out = (size_t)size;
+  return UTRUE;
+}
+
+static const char *getVariable(const char *name) {
+  const char *value = getenv(name);
+  return value != NULL && value[0] != '\0' ? value : NULL;
+}
+
+void initGCPolicy() {
+  const char *value;
+  size_t size;
+
+  vm.nextGC = GC_DEFAULT_INITIAL_HEAP_SIZE;
+  vm.gcGrowthFactor = GC_DEFAULT_GROWTH_FACTOR;
+  vm.gcMaxHeapSize = 0;
+  vm.gcEnabled = UTRUE;
+  vm.gcStress = DEBUG_STRESS_GC;
+
+  if ((value = getVariable("MTOTS_GC_INITIAL_HEAP")) != NULL) {
+    if (!parseSize(value, &size)) {
+      panic("Invalid MTOTS_GC_INITIAL_HEAP: %s", value);
+    }
+    setGCThreshold(size);
+  }
+  if ((value = getVariable("MTOTS_GC_GROWTH_FACTOR")) != NULL) {
+    char *end;
+    double factor = strtod(value, &end);
+    if (end == value || *end != '\0' || !setGCGrowthFactor(factor)) {
+      panic("Invalid MTOTS_GC_GROWTH_FACTOR: %s", value);
+    }
+  }
+  if ((value = getVariable("MTOTS_GC_MAX_HEAP")) != NULL) {
+    if (!parseSize(value, &size)) {
+      panic("Invalid MTOTS_GC_MAX_HEAP: %s", value);
+    }
+    setGCMaxHeapSize(size);
+  }
+  if ((value = getVariable("MTOTS_GC_STRESS")) != NULL) {
+    if (strcmp(value, "0") != 0 && strcmp(value, "1") != 0) {
+      panic("Invalid MTOTS_GC_STRESS: %s", value);
+    }
+    setGCStress(value[0] == '1');
+  }
+  if (getVariable("MTOTS_GC_STATS") != NULL) {
+    atexit(writeGCStatsAtExit);
+  }
+}
+
+size_t getHeapSize() {
+  return vm.bytesAllocated + getStringsAllocationSize();
+}
+
+void setGCThreshold(size_t size) {
+  vm.nextGC = size;
+}
+
+ubool setGCGrowthFactor(double factor) {
+  if (!(factor >= 1)) {
+    return UFALSE;
+  }
+  vm.gcGrowthFactor = factor;
+  return UTRUE;
+}
+
+void setGCMaxHeapSize(size_t size) {
+  vm.gcMaxHeapSize = size;
+}
+
+void setGCEnabled(ubool enabled) {
+  vm.gcEnabled = enabled;
+}
+
+void setGCStress(ubool stress) {
+  vm.gcStress = stress;
+}
+
+void getGCStats(GCStats *out) {
+  size_t i;
+  out->collections = vm.gcCollections;
+  out->pauses = 0;
+  for (i = 0; i < GC_PAUSE_BUCKET_COUNT; i++) {
+    out->pauses += vm.gcPauses[i];
+  }
+  out->totalPause = vm.gcTotalPause;
+  out->maxPause = vm.gcMaxPause;
+  out->heapSize = getHeapSize();
+  out->stringsSize = getStringsAllocationSize();
+  out->internedStrings = getInternedStringCount();
+  out->internTableSize = getInternTableSize();
+  out->internedTuples = vm.tuples.size;
+  out->internedFrozenDicts = vm.frozenDicts.size;
+  out->internedFrozenSets = vm.frozenSets.size;
+  for (i = 0; i < OBJ_TYPE_COUNT; i++) {
+    out->allocatedBytes[i] = vm.objectBytes[i];
+    out->liveObjects[i] = vm.liveObjects[i];
+  }
+}
+
+void writeGCStats(FILE *out) {
+  GCStats stats;
+  size_t i;
+  getGCStats(&stats);
+  fprintf(out, "collections %lu\n", (unsigned long)stats.collections);
+  fprintf(out, "pauses %lu\n", (unsigned long)stats.pauses);
+  fprintf(out, "totalPause %f\n", stats.totalPause);
+  fprintf(out, "maxPause %f\n", stats.maxPause);
+  fprintf(out, "heapSize %lu\n", (unsigned long)stats.heapSize);
+  fprintf(out, "stringsSize %lu\n", (unsigned long)stats.stringsSize);
+  fprintf(out, "internedStrings %lu\n",
+    (unsigned long)stats.internedStrings);
+  fprintf(out, "internTableSize %lu\n",
+    (unsigned long)stats.internTableSize);
+  fprintf(out, "internedTuples %lu\n", (unsigned long)stats.internedTuples);
+  fprintf(out, "internedFrozenDicts %lu\n",
+    (unsigned long)stats.internedFrozenDicts);
+  fprintf(out, "internedFrozenSets %lu\n",
+    (unsigned long)stats.internedFrozenSets);
+  for (i = 0; i < OBJ_TYPE_COUNT; i++) {
+    fprintf(out, "allocatedBytes.%s %lu\n",
+      getObjectTypeName((ObjType)i), (unsigned long)stats.allocatedBytes[i]);
+  }
+  for (i = 0; i < OBJ_TYPE_COUNT; i++) {
+    fprintf(out, "liveObjects.%s %lu\n",
+      getObjectTypeName((ObjType)i), (unsigned long)stats.liveObjects[i]);
+  }
+}
+
+void writeGCStatsAtExit() {
+  static ubool written = UFALSE;
+  const char *path = getVariable("MTOTS_GC_STATS");
+  FILE *out;
+  if (path == NULL || written) {
+    return;
+  }
+  written = UTRUE;
+  out = strcmp(path, "1") == 0 ? stderr : fopen(path, "a");
+  if (out == NULL) {
+    return;
+  }
+  writeGCStats(out);
+  if (out != stderr) {
+    fclose(out);
+  }
+}
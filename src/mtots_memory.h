@@ -3,6 +3,8 @@
 
 #include "mtots_value.h"
 
+#include <stdio.h>
+
 #define ALLOCATE(type, count) \
     (type*)reallocate(NULL, 0, sizeof(type) * (count))
 
@@ -18,11 +20,101 @@
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
+/* Number of buckets in the GC pause time histogram. Bucket 0 counts
+ * pauses shorter than 1 microsecond, bucket i counts pauses of at least
+ * 2^(i-1) but less than 2^i microseconds, and the last bucket also
+ * counts everything longer. */
+#define GC_PAUSE_BUCKET_COUNT 24
+
+/* Write barrier for the incremental collector.
+ *
+ * While a collection is marking, anything that was reachable when it
+ * started is kept alive ("snapshot at the beginning"). To make that work,
+ * any code that overwrites or removes a Value held by a heap object
+ * needs to pass the old Value to WRITE_BARRIER first.
+ *
+ * Stores into the VM stack, and the initial stores into a freshly
+ * allocated object, do not need the barrier.
+ */
+#define WRITE_BARRIER(oldValue) do { \
+    if (vm.gcPhase == GC_PHASE_MARK) { \
+      markValue(oldValue); \
+    } \
+  } while (0)
+
+typedef enum GCPhase {
+  GC_PHASE_IDLE,
+  GC_PHASE_MARK,
+  GC_PHASE_SWEEP
+} GCPhase;
+
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
 void markObject(Obj *object);
 void markString(String *string);
 void markValue(Value value);
 void collectGarbage();
+
+/* GC policy
+ *
+ * A collection starts once the heap (everything allocated through
+ * reallocate(), plus strings) grows past a threshold. The threshold
+ * starts out at the initial heap size (1MB by default). After every
+ * collection, it is set to the size of what is left times the growth
+ * factor (2 by default), but never to more than the maximum heap size,
+ * if there is one. If a full collection cannot bring the heap back under
+ * the maximum, the process panics.
+ *
+ * initGCPolicy(), called by initVM(), applies these environment
+ * variables, if they are set:
+ *
+ *   MTOTS_GC_INITIAL_HEAP   initial threshold, in bytes
+ *   MTOTS_GC_GROWTH_FACTOR  growth factor, at least 1
+ *   MTOTS_GC_MAX_HEAP       maximum heap size in bytes, or 0 for none
+ *   MTOTS_GC_STRESS         1 or 0, to turn stress mode on or off
+ *
+ * Sizes may end in K, M or G. Afterwards, the policy can be changed with
+ * the functions below, or from mtots with the gc module.
+ * setGCGrowthFactor() returns UFALSE, and changes nothing, if the factor
+ * is less than 1. */
+void initGCPolicy();
+size_t getHeapSize();
+void setGCThreshold(size_t size);
+ubool setGCGrowthFactor(double factor);
+void setGCMaxHeapSize(size_t size);
+
+/* While disabled, the GC only runs when collectGarbage() is called, or
+ * when the heap grows past its maximum size. Meant for sections of a
+ * program that cannot afford to pause. Enabled by default. */
+void setGCEnabled(ubool enabled);
+
+/* In stress mode, every allocation runs a full collection (or, in
+ * incremental mode, a small step), so that values that are not kept
+ * reachable are found right away. Very slow. The default is
+ * DEBUG_STRESS_GC. */
+void setGCStress(ubool stress);
+
+/* GC and allocation statistics
+ *
+ * The VM always keeps these counters; updating them costs an increment
+ * or two per allocation, free and GC pause. getGCStats() fills in a
+ * snapshot of them (struct GCStats is defined in mtots_vm.h), and from
+ * mtots, gc.stats() returns the same numbers in a dict.
+ *
+ * If the environment variable MTOTS_GC_STATS is set, the statistics
+ * are written when the process exits (or when freeVM() is called,
+ * whichever comes first), one 'name value' line each. They are written
+ * to stderr if it is '1', and appended to the file it names otherwise.
+ */
+typedef struct GCStats GCStats;
+void getGCStats(GCStats *out);
+void writeGCStats(FILE *out);
+void writeGCStatsAtExit();
+
+/* Strings are not allocated through reallocate(), so code that may
+ * create many strings and nothing else calls this to let the GC keep up.
+ * Like reallocate(), it may collect, so every live value has to be
+ * reachable when it is called. */
+void collectGarbageForStrings();
 void freeObjects();
 
 #endif/*mtots_memory_h*/
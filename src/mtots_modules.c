@@ -1,11 +1,15 @@
 #include "mtots_modules.h"
 #include "mtots_m_os.h"
 #include "mtots_m_json.h"
+#include "mtots_m_gc.h"
+#include "mtots_m_heap.h"
 #include "mtots_m_sdl.h"
 
 void addNativeModules() {
   addNativeModuleOs();
   addNativeModuleJson();
+  addNativeModuleGC();
+  addNativeModuleHeap();
 
   addNativeModuleSDL();
 }
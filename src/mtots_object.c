@@ -14,9 +14,13 @@
 static Obj *allocateObject(size_t size, ObjType type) {
   Obj *object = (Obj*)reallocate(NULL, 0, size);
   object->type = type;
-  object->isMarked = UFALSE;
+  /* Objects created while the GC is marking are not traced,
+   * so they need to start out marked */
+  object->isMarked = vm.gcPhase == GC_PHASE_MARK;
   object->next = vm.objects;
   vm.objects = object;
+  vm.objectBytes[type] += size;
+  vm.liveObjects[type]++;
 
 #if DEBUG_LOG_GC
   printf("%p allocate %zu for %d\n", (void*) object, size, type);
@@ -40,6 +44,10 @@ ObjInstance *newModule(String *name, ubool includeGlobals) {
   instance = newInstance(klass);
   pop(); /* klass */
 
+  /* Modules use their fields like a namespace, so they are kept
+   * in dictionary mode from the start */
+  instance->shape = NULL;
+
   if (includeGlobals) {
     push(INSTANCE_VAL(instance));
     mapAddAll(&vm.globals, &instance->fields);
@@ -61,14 +69,21 @@ ObjInstance *newModuleFromCString(const char *name, ubool includeGlobals) {
   return instance;
 }
 
+void setModuleConstant(ObjInstance *module, const char *name, Value value) {
+  mapSetN(&module->fields, name, value);
+  mapSetN(&module->klass->constants, name, value);
+}
+
 ObjClass *newClass(String *name) {
   ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
   klass->name = name;
   initMap(&klass->methods);
   initMap(&klass->staticMethods);
+  initMap(&klass->constants);
   klass->isModuleClass = UFALSE;
   klass->isBuiltinClass = UFALSE;
   klass->descriptor = NULL;
+  initShape(&klass->rootShape);
   return klass;
 }
 
@@ -103,6 +118,10 @@ ObjThunk *newFunction() {
   thunk->defaultArgs = NULL;
   thunk->defaultArgsCount = 0;
   thunk->moduleName = NULL;
+#if MTOTS_USE_JIT
+  thunk->hotness = 0;
+  thunk->jitCode = NULL;
+#endif
   initChunk(&thunk->chunk);
   return thunk;
 }
@@ -142,10 +161,74 @@ ObjNativeClosure *newNativeClosure(
 ObjInstance *newInstance(ObjClass *klass) {
   ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
   instance->klass = klass;
+  instance->shape = &klass->rootShape;
+  instance->slots = NULL;
+  instance->slotCapacity = 0;
   initMap(&instance->fields);
   return instance;
 }
 
+ubool instanceGetField(ObjInstance *instance, String *name, Value *out) {
+  i32 slot;
+  if (instance->shape == NULL) {
+    return mapGetStr(&instance->fields, name, out);
+  }
+  slot = shapeFindField(instance->shape, name);
+  if (slot < 0) {
+    return UFALSE;
+  }
+  *out = instance->slots[slot];
+  return UTRUE;
+}
+
+static void switchToDictionaryMode(ObjInstance *instance) {
+  Shape *shape = instance->shape;
+  u32 i;
+
+  /* The instance stays in shape mode until all the fields are copied,
+   * so that a GC triggered by mapSetStr still sees the slots */
+  for (i = 0; i < shape->fieldCount; i++) {
+    mapSetStr(&instance->fields, shape->keys[i], instance->slots[i]);
+  }
+  instance->shape = NULL;
+  FREE_ARRAY(Value, instance->slots, instance->slotCapacity);
+  instance->slots = NULL;
+  instance->slotCapacity = 0;
+}
+
+/* NOTE: this may allocate, so both the instance and the value
+ * need to be reachable by the GC */
+void instanceSetField(ObjInstance *instance, String *name, Value value) {
+  Shape *shape = instance->shape;
+  i32 slot;
+
+  if (shape != NULL) {
+    slot = shapeFindField(shape, name);
+    if (slot >= 0) {
+      WRITE_BARRIER(instance->slots[slot]);
+      instance->slots[slot] = value;
+      return;
+    }
+
+    shape = shapeAddField(shape, name);
+    if (shape == NULL) {
+      switchToDictionaryMode(instance);
+    } else {
+      if (shape->fieldCount > instance->slotCapacity) {
+        u32 oldCapacity = instance->slotCapacity;
+        instance->slotCapacity = oldCapacity < 4 ? 4 : oldCapacity * 2;
+        instance->slots = GROW_ARRAY(
+          Value, instance->slots, oldCapacity, instance->slotCapacity);
+      }
+      instance->slots[shape->fieldCount - 1] = value;
+      instance->shape = shape;
+      return;
+    }
+  }
+
+  mapSetStr(&instance->fields, name, value);
+}
+
 static u32 hashTuple(Value *buffer, size_t length) {
   /* FNV-1a as presented in the Crafting Interpreters book */
   size_t i;
@@ -195,6 +278,16 @@ ObjList *newList(size_t size) {
   return list;
 }
 
+void listAppend(ObjList *list, Value value) {
+  if (list->capacity < list->length + 1) {
+    size_t oldCapacity = list->capacity;
+    list->capacity = GROW_CAPACITY(list->capacity);
+    list->buffer = GROW_ARRAY(
+      Value, list->buffer, oldCapacity, list->capacity);
+  }
+  list->buffer[list->length++] = value;
+}
+
 static ObjTuple *allocateTuple(Value *buffer, int length, u32 hash) {
   ObjTuple *tuple = ALLOCATE_OBJ(ObjTuple, OBJ_TUPLE);
   tuple->length = length;
@@ -213,6 +306,9 @@ ObjTuple *copyTuple(Value *buffer, size_t length) {
   ObjTuple *interned = mapFindTuple(&vm.tuples, buffer, length, hash);
   Value *newBuffer;
   if (interned != NULL) {
+    /* vm.tuples does not keep its tuples alive, so this one may be
+     * garbage that the GC has not gotten to yet */
+    WRITE_BARRIER(TUPLE_VAL(interned));
     return interned;
   }
   newBuffer = ALLOCATE(Value, length);
@@ -229,6 +325,8 @@ ObjDict *newDict() {
 static ObjFrozenDict *newFrozenDictWithHash(Map *map, u32 hash) {
   ObjFrozenDict *fdict = mapFindFrozenDict(&vm.frozenDicts, map, hash);
   if (fdict != NULL) {
+    /* See copyTuple */
+    WRITE_BARRIER(FROZEN_DICT_VAL(fdict));
     return fdict;
   }
   fdict = ALLOCATE_OBJ(ObjFrozenDict, OBJ_FROZEN_DICT);
@@ -263,6 +361,55 @@ ObjFrozenDict *newFrozenDict(Map *map) {
   return newFrozenDictWithHash(map, hashMap(map));
 }
 
+ObjSet *newSet() {
+  ObjSet *set = ALLOCATE_OBJ(ObjSet, OBJ_SET);
+  initKeySet(&set->set);
+  return set;
+}
+
+/* Same as hashMap, with only the keys */
+static u32 hashKeySet(KeySet *set) {
+  u32 hash = 1927868237UL;
+  KeySetIterator it;
+  Value key;
+  hash *= 2 * set->size;
+  initKeySetIterator(&it, set);
+  while (keySetIteratorNext(&it, &key)) {
+    u32 kh = hashval(key);
+    hash ^= (kh ^ (kh << 16) ^ 89869747UL)  * 3644798167UL;
+  }
+  hash = hash * 69069U + 907133923UL;
+  return hash;
+}
+
+ObjFrozenSet *newFrozenSet(KeySet *set) {
+  u32 hash = hashKeySet(set);
+  ObjFrozenSet *fset = mapFindFrozenSet(&vm.frozenSets, set, hash);
+  if (fset != NULL) {
+    /* See copyTuple */
+    WRITE_BARRIER(FROZEN_SET_VAL(fset));
+    return fset;
+  }
+  fset = ALLOCATE_OBJ(ObjFrozenSet, OBJ_FROZEN_SET);
+  fset->hash = hash;
+  initKeySet(&fset->set);
+  push(FROZEN_SET_VAL(fset));
+  keySetCopy(set, &fset->set);
+  mapSet(&vm.frozenSets, FROZEN_SET_VAL(fset), NIL_VAL());
+  pop();
+  return fset;
+}
+
+ObjDeque *newDeque(size_t maxLength) {
+  ObjDeque *deque = ALLOCATE_OBJ(ObjDeque, OBJ_DEQUE);
+  deque->start = 0;
+  deque->length = 0;
+  deque->capacity = 0;
+  deque->maxLength = maxLength;
+  deque->buffer = NULL;
+  return deque;
+}
+
 ObjFile *newFile(FILE *file, ubool isOpen, String *name, FileMode mode) {
   ObjFile *f = ALLOCATE_OBJ(ObjFile, OBJ_FILE);
   f->file = file;
@@ -307,7 +454,7 @@ ObjUpvalue *newUpvalue(Value *slot) {
 }
 
 ObjClass *getClassOfValue(Value value) {
-  switch (value.type) {
+  switch (VALUE_TYPE(value)) {
     case VAL_BOOL: return vm.boolClass;
     case VAL_NIL: return vm.nilClass;
     case VAL_NUMBER: return vm.numberClass;
@@ -327,6 +474,9 @@ ObjClass *getClassOfValue(Value value) {
         case OBJ_TUPLE: return vm.tupleClass;
         case OBJ_DICT: return vm.mapClass;
         case OBJ_FROZEN_DICT: return vm.frozenDictClass;
+        case OBJ_SET: return vm.setClass;
+        case OBJ_FROZEN_SET: return vm.frozenSetClass;
+        case OBJ_DEQUE: return vm.dequeClass;
         case OBJ_FILE: return vm.fileClass;
         case OBJ_NATIVE: return AS_NATIVE(value)->descriptor->klass;
         case OBJ_UPVALUE: panic("upvalue kinds do not have classes");
@@ -383,6 +533,15 @@ void printObject(Value value) {
     case OBJ_FROZEN_DICT:
       printf("<frozendict>");
       break;
+    case OBJ_SET:
+      printf("<set>");
+      break;
+    case OBJ_FROZEN_SET:
+      printf("<frozenset>");
+      break;
+    case OBJ_DEQUE:
+      printf("<deque %lu items>", (unsigned long) AS_DEQUE(value)->length);
+      break;
     case OBJ_FILE:
       printf("<file %s>", AS_FILE(value)->name->chars);
       break;
@@ -410,6 +569,9 @@ const char *getObjectTypeName(ObjType type) {
   case OBJ_TUPLE: return "OBJ_TUPLE";
   case OBJ_DICT: return "OBJ_DICT";
   case OBJ_FROZEN_DICT: return "OBJ_FROZEN_DICT";
+  case OBJ_SET: return "OBJ_SET";
+  case OBJ_FROZEN_SET: return "OBJ_FROZEN_SET";
+  case OBJ_DEQUE: return "OBJ_DEQUE";
   case OBJ_FILE: return "OBJ_FILE";
   case OBJ_NATIVE: return "OBJ_NATIVE";
   case OBJ_UPVALUE: return "OBJ_UPVALUE";
@@ -433,6 +595,18 @@ Value FROZEN_DICT_VAL(ObjFrozenDict *fdict) {
   return OBJ_VAL_EXPLICIT((Obj*)fdict);
 }
 
+Value SET_VAL(ObjSet *set) {
+  return OBJ_VAL_EXPLICIT((Obj*)set);
+}
+
+Value FROZEN_SET_VAL(ObjFrozenSet *fset) {
+  return OBJ_VAL_EXPLICIT((Obj*)fset);
+}
+
+Value DEQUE_VAL(ObjDeque *deque) {
+  return OBJ_VAL_EXPLICIT((Obj*)deque);
+}
+
 Value INSTANCE_VAL(ObjInstance *instance) {
   return OBJ_VAL_EXPLICIT((Obj*)instance);
 }
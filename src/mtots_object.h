@@ -4,6 +4,7 @@
 #include "mtots_common.h"
 #include "mtots_chunk.h"
 #include "mtots_map.h"
+#include "mtots_shape.h"
 #include "mtots_memory.h"
 
 #include <stdio.h>
@@ -20,6 +21,9 @@
 #define IS_TUPLE(value) isObjType(value, OBJ_TUPLE)
 #define IS_DICT(value) isObjType(value, OBJ_DICT)
 #define IS_FROZEN_DICT(value) isObjType(value, OBJ_FROZEN_DICT)
+#define IS_SET(value) isObjType(value, OBJ_SET)
+#define IS_FROZEN_SET(value) isObjType(value, OBJ_FROZEN_SET)
+#define IS_DEQUE(value) isObjType(value, OBJ_DEQUE)
 #define IS_FILE(value) isObjType(value, OBJ_FILE)
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
 
@@ -33,6 +37,9 @@
 #define AS_TUPLE(value) ((ObjTuple*)AS_OBJ(value))
 #define AS_DICT(value) ((ObjDict*)AS_OBJ(value))
 #define AS_FROZEN_DICT(value) ((ObjFrozenDict*)AS_OBJ(value))
+#define AS_SET(value) ((ObjSet*)AS_OBJ(value))
+#define AS_FROZEN_SET(value) ((ObjFrozenSet*)AS_OBJ(value))
+#define AS_DEQUE(value) ((ObjDeque*)AS_OBJ(value))
 #define AS_FILE(value) ((ObjFile*)AS_OBJ(value))
 #define AS_NATIVE(value) ((ObjNative*)AS_OBJ(value))
 
@@ -59,6 +66,9 @@ typedef enum ObjType {
   OBJ_TUPLE,
   OBJ_DICT,
   OBJ_FROZEN_DICT,
+  OBJ_SET,
+  OBJ_FROZEN_SET,
+  OBJ_DEQUE,
 
   OBJ_FILE,
 
@@ -67,6 +77,8 @@ typedef enum ObjType {
   OBJ_UPVALUE
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_UPVALUE + 1)
+
 struct Obj {
   ObjType type;
   ubool isMarked;
@@ -82,6 +94,10 @@ typedef struct ObjThunk {
   Value *defaultArgs;
   i16 defaultArgsCount;
   String *moduleName;
+#if MTOTS_USE_JIT
+  u32 hotness; /* calls and loop iterations so far (see mtots_jit.h) */
+  struct JitCode *jitCode; /* NULL until compiled */
+#endif
 } ObjThunk;
 
 /**
@@ -120,6 +136,35 @@ typedef struct ObjFrozenDict {
   u32 hash;
 } ObjFrozenDict;
 
+typedef struct ObjSet {
+  Obj obj;
+  KeySet set;
+} ObjSet;
+
+/* Interned like ObjFrozenDict */
+typedef struct ObjFrozenSet {
+  Obj obj;
+  KeySet set;
+  u32 hash;
+} ObjFrozenSet;
+
+/* A ring buffer: the items are buffer[start], buffer[start + 1], ...
+ * wrapping around at the end of the buffer, so that items can be added
+ * and removed at either end without moving the others.
+ * 'capacity' is always 0 or a power of 2. */
+typedef struct ObjDeque {
+  Obj obj;
+  size_t start;
+  size_t length;
+  size_t capacity;
+  size_t maxLength; /* 0 if there is no maximum */
+  Value *buffer;
+} ObjDeque;
+
+/* The item at the given index, which has to be less than the length */
+#define DEQUE_ITEM(deque, index) \
+  ((deque)->buffer[((deque)->start + (index)) & ((deque)->capacity - 1)])
+
 typedef struct NativeObjectDescriptor {
   void (*blacken)(ObjNative*);
   void (*free)(ObjNative*);
@@ -189,14 +234,31 @@ struct ObjClass {
   String *name;
   Map methods;
   Map staticMethods;
+  /* For native modules: the members registered with setModuleConstant().
+   * They can't be assigned, so the compiler may inline them. */
+  Map constants;
   ubool isModuleClass;
   ubool isBuiltinClass;
   NativeObjectDescriptor *descriptor; /* NULL if not native */
+  Shape rootShape; /* empty shape that new instances start with */
 };
 
+/* An instance keeps its fields in one of two ways:
+ *
+ *   - shape mode: 'shape' describes which field lives in which
+ *     entry of 'slots', and 'fields' is empty.
+ *   - dictionary mode: 'shape' is NULL and the fields live in 'fields'.
+ *
+ * Instances start in shape mode, and switch to dictionary mode for good
+ * if they grow fields that their class's shape tree cannot accommodate.
+ * Modules are always in dictionary mode.
+ */
 struct ObjInstance {
   Obj obj;
   ObjClass *klass;
+  Shape *shape;
+  Value *slots;
+  u32 slotCapacity;
   Map fields;
 };
 
@@ -204,6 +266,9 @@ ubool IS_MODULE(Value value);
 
 ObjInstance *newModule(String *name, ubool includeGlobals);
 ObjInstance *newModuleFromCString(const char *name, ubool includeGlobals);
+/* Sets a member of a native module that stays the same for as long as
+ * the process runs, e.g. an entry of one of its constant tables */
+void setModuleConstant(ObjInstance *module, const char *name, Value value);
 ObjClass *newClass(String *name);
 ObjClass *newClassFromCString(const char *name);
 ObjClosure *newClosure(ObjThunk *function, ObjInstance *module);
@@ -217,11 +282,20 @@ ObjNativeClosure *newNativeClosure(
   i16 arity,
   i16 maxArity);
 ObjInstance *newInstance(ObjClass *klass);
+
+/* Field names are compared by address, so 'name' must be interned */
+ubool instanceGetField(ObjInstance *instance, String *name, Value *out);
+void instanceSetField(ObjInstance *instance, String *name, Value value);
 ObjBuffer *newBuffer();
 ObjList *newList(size_t size);
+/* May allocate, so the list and the value have to be reachable */
+void listAppend(ObjList *list, Value value);
 ObjTuple *copyTuple(Value *buffer, size_t length);
 ObjDict *newDict();
 ObjFrozenDict *newFrozenDict(Map *map);
+ObjSet *newSet();
+ObjFrozenSet *newFrozenSet(KeySet *set);
+ObjDeque *newDeque(size_t maxLength);
 ObjFile *newFile(FILE *file, ubool isOpen, String *name, FileMode mode);
 ObjFile *openFile(const char *filename, FileMode mode);
 ObjNative *newNative(NativeObjectDescriptor *descriptor, size_t objectSize);
@@ -237,6 +311,9 @@ const char *getObjectTypeName(ObjType type);
 Value LIST_VAL(ObjList *list);
 Value DICT_VAL(ObjDict *dict);
 Value FROZEN_DICT_VAL(ObjFrozenDict *fdict);
+Value SET_VAL(ObjSet *set);
+Value FROZEN_SET_VAL(ObjFrozenSet *fset);
+Value DEQUE_VAL(ObjDeque *deque);
 Value INSTANCE_VAL(ObjInstance *instance);
 Value BUFFER_VAL(ObjBuffer *buffer);
 Value THUNK_VAL(ObjThunk *thunk);
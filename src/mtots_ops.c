@@ -3,16 +3,29 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 
 ubool valuesIs(Value a, Value b) {
-  if (a.type != b.type) {
+#if MTOTS_USE_NAN_BOXING
+  /* Every non-number value has exactly one representation,
+   * except for strings that are not interned */
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    return AS_NUMBER(a) == AS_NUMBER(b);
+  }
+  if (IS_STRING(a) && IS_STRING(b)) {
+    return stringsEqual(AS_STRING_OR_ROPE(a), AS_STRING_OR_ROPE(b));
+  }
+  return a.bits == b.bits;
+#else
+  if (VALUE_TYPE(a) != VALUE_TYPE(b)) {
     return UFALSE;
   }
-  switch (a.type) {
+  switch (VALUE_TYPE(a)) {
     case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
     case VAL_NIL: return UTRUE;
     case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-    case VAL_STRING: return AS_STRING(a) == AS_STRING(b);
+    case VAL_STRING:
+      return stringsEqual(AS_STRING_OR_ROPE(a), AS_STRING_OR_ROPE(b));
     case VAL_CFUNCTION: return AS_CFUNCTION(a) == AS_CFUNCTION(b);
     case VAL_OPERATOR: return AS_OPERATOR(a) == AS_OPERATOR(b);
     case VAL_SENTINEL: return AS_SENTINEL(a) == AS_SENTINEL(b);
@@ -20,6 +33,7 @@ ubool valuesIs(Value a, Value b) {
   }
   abort();
   return UFALSE; /* Unreachable */
+#endif
 }
 
 ubool mapsEqual(Map *a, Map *b) {
@@ -44,15 +58,36 @@ ubool mapsEqual(Map *a, Map *b) {
   return UTRUE;
 }
 
+ubool keySetsEqual(KeySet *a, KeySet *b) {
+  KeySetIterator it;
+  Value key;
+  if (a->size != b->size) {
+    return UFALSE;
+  }
+  initKeySetIterator(&it, a);
+  while (keySetIteratorNext(&it, &key)) {
+    if (!keySetContains(b, key)) {
+      return UFALSE;
+    }
+  }
+  return UTRUE;
+}
+
 ubool valuesEqual(Value a, Value b) {
-  if (a.type != b.type) {
+#if MTOTS_USE_NAN_BOXING
+  if (!IS_OBJ(a) || !IS_OBJ(b)) {
+    return valuesIs(a, b);
+  }
+#endif
+  if (VALUE_TYPE(a) != VALUE_TYPE(b)) {
     return UFALSE;
   }
-  switch (a.type) {
+  switch (VALUE_TYPE(a)) {
     case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
     case VAL_NIL: return UTRUE;
     case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-    case VAL_STRING: return AS_STRING(a) == AS_STRING(b);
+    case VAL_STRING:
+      return stringsEqual(AS_STRING_OR_ROPE(a), AS_STRING_OR_ROPE(b));
     case VAL_CFUNCTION: return AS_CFUNCTION(a) == AS_CFUNCTION(b);
     case VAL_OPERATOR: return AS_OPERATOR(a) == AS_OPERATOR(b);
     case VAL_SENTINEL: return AS_SENTINEL(a) == AS_SENTINEL(b);
@@ -90,6 +125,24 @@ ubool valuesEqual(Value a, Value b) {
           ObjDict *dictA = (ObjDict*)objA, *dictB = (ObjDict*)objB;
           return mapsEqual(&dictA->map, &dictB->map);
         }
+        case OBJ_DEQUE: {
+          ObjDeque *dequeA = (ObjDeque*)objA, *dequeB = (ObjDeque*)objB;
+          size_t i;
+          if (dequeA->length != dequeB->length) {
+            return UFALSE;
+          }
+          for (i = 0; i < dequeA->length; i++) {
+            if (!valuesEqual(
+                DEQUE_ITEM(dequeA, i), DEQUE_ITEM(dequeB, i))) {
+              return UFALSE;
+            }
+          }
+          return UTRUE;
+        }
+        case OBJ_SET: {
+          ObjSet *setA = (ObjSet*)objA, *setB = (ObjSet*)objB;
+          return keySetsEqual(&setA->set, &setB->set);
+        }
         default: return objA == objB;
       }
     }
@@ -98,35 +151,36 @@ ubool valuesEqual(Value a, Value b) {
   return UFALSE; /* Unreachable */
 }
 
+/* Both strings have to be flat (see flattenString()) */
+static ubool stringLessThan(String *strA, String *strB) {
+  size_t lenA = strA->length;
+  size_t lenB = strB->length;
+  size_t len = lenA < lenB ? lenA : lenB;
+  size_t i;
+  const char *charsA = strA->chars;
+  const char *charsB = strB->chars;
+  if (strA == strB) {
+    return UFALSE;
+  }
+  for (i = 0; i < len; i++) {
+    if (charsA[i] != charsB[i]) {
+      return charsA[i] < charsB[i];
+    }
+  }
+  return lenA < lenB;
+}
+
 ubool valueLessThan(Value a, Value b) {
-  if (a.type != b.type) {
+  if (VALUE_TYPE(a) != VALUE_TYPE(b)) {
     panic(
       "'<' requires values of the same type but got %s and %s",
       getKindName(a), getKindName(b));
   }
-  switch (a.type) {
+  switch (VALUE_TYPE(a)) {
     case VAL_BOOL: return AS_BOOL(a) < AS_BOOL(b);
     case VAL_NIL: return UFALSE;
     case VAL_NUMBER: return AS_NUMBER(a) < AS_NUMBER(b);
-    case VAL_STRING: {
-      String *strA = AS_STRING(a);
-      String *strB = AS_STRING(b);
-      size_t lenA = strA->length;
-      size_t lenB = strB->length;
-      size_t len = lenA < lenB ? lenA : lenB;
-      size_t i;
-      const char *charsA = strA->chars;
-      const char *charsB = strB->chars;
-      if (strA == strB) {
-        return UFALSE;
-      }
-      for (i = 0; i < len; i++) {
-        if (charsA[i] != charsB[i]) {
-          return charsA[i] < charsB[i];
-        }
-      }
-      return lenA < lenB;
-    }
+    case VAL_STRING: return stringLessThan(AS_STRING(a), AS_STRING(b));
     case VAL_CFUNCTION: break;
     case VAL_OPERATOR: break;
     case VAL_SENTINEL: break;
@@ -191,14 +245,103 @@ typedef struct SortEntry {
   Value value;
 } SortEntry;
 
-/* Basic mergesort.
- * TODO: Consider using timsort instead */
+/* Lists shorter than this are sorted with insertion sort alone */
+#define SORT_MIN_MERGE 32
+
+#define SORT_MIN_GALLOP 7
+
+/* More than enough runs for any list that fits in memory, since their
+ * lengths grow at least as fast as the Fibonacci numbers */
+#define SORT_MAX_RUNS 85
+
+/* Runs shorter than this are extended with insertion sort, to a length
+ * between SORT_MIN_MERGE / 2 and SORT_MIN_MERGE, chosen so that n / minRun
+ * is a power of 2 or close to one (see timsort in mtots_ops_sort.h) */
+static ptrdiff_t sortMinRunLength(ptrdiff_t n) {
+  ptrdiff_t r = 0;
+  while (n >= SORT_MIN_MERGE) {
+    r |= n & 1;
+    n >>= 1;
+  }
+  return n + r;
+}
+
+#define NUMBER_LESS(a, b) (AS_NUMBER(a) < AS_NUMBER(b))
+#define STRING_LESS(a, b) \
+  stringLessThan(AS_STRING_OR_ROPE(a), AS_STRING_OR_ROPE(b))
+
+#define SORT_SUFFIX Numbers
+#define SORT_ELEMENT Value
+#define SORT_LESS NUMBER_LESS
+#include "mtots_ops_sort.h"
+
+#define SORT_SUFFIX Strings
+#define SORT_ELEMENT Value
+#define SORT_LESS STRING_LESS
+#include "mtots_ops_sort.h"
+
+#define SORT_SUFFIX Values
+#define SORT_ELEMENT Value
+#define SORT_LESS valueLessThan
+#include "mtots_ops_sort.h"
+
+#define ENTRY_NUMBER_LESS(a, b) NUMBER_LESS((a).key, (b).key)
+#define ENTRY_STRING_LESS(a, b) STRING_LESS((a).key, (b).key)
+#define ENTRY_LESS(a, b) valueLessThan((a).key, (b).key)
+
+#define SORT_SUFFIX NumberEntries
+#define SORT_ELEMENT SortEntry
+#define SORT_LESS ENTRY_NUMBER_LESS
+#include "mtots_ops_sort.h"
+
+#define SORT_SUFFIX StringEntries
+#define SORT_ELEMENT SortEntry
+#define SORT_LESS ENTRY_STRING_LESS
+#include "mtots_ops_sort.h"
+
+#define SORT_SUFFIX Entries
+#define SORT_ELEMENT SortEntry
+#define SORT_LESS ENTRY_LESS
+#include "mtots_ops_sort.h"
+
+typedef enum SortKind {
+  SORT_NUMBERS,
+  SORT_STRINGS,
+  SORT_VALUES
+} SortKind;
+
+/* Finds out whether all the keys are numbers, or all are strings, so
+ * that they can be compared without checking their types every time.
+ * Strings are flattened here, so that the comparisons do not have to. */
+static SortKind getSortKind(Value *keys, size_t length) {
+  size_t i;
+  if (length == 0) {
+    return SORT_VALUES;
+  }
+  if (IS_NUMBER(keys[0])) {
+    for (i = 1; i < length; i++) {
+      if (!IS_NUMBER(keys[i])) {
+        return SORT_VALUES;
+      }
+    }
+    return SORT_NUMBERS;
+  }
+  if (IS_STRING(keys[0])) {
+    for (i = 0; i < length; i++) {
+      if (!IS_STRING(keys[i])) {
+        return SORT_VALUES;
+      }
+      flattenString(AS_STRING_OR_ROPE(keys[i]));
+    }
+    return SORT_STRINGS;
+  }
+  return SORT_VALUES;
+}
+
 void sortList(ObjList *list, ObjList *keys) {
-  SortEntry *buffer, *src, *dst;
-  size_t i, len = list->length, width;
-  /* TODO: this check is untested - come back and
-    * actually think this through when there is more bandwidth */
-  if (len >= ((size_t)(-1)) / 4) {
+  SortEntry *entries;
+  size_t i, len = list->length;
+  if (len >= ((size_t)(-1)) / (4 * sizeof(SortEntry))) {
     panic("sortList(): list too long (%lu)", (long) len);
   }
   if (keys != NULL && len != keys->length) {
@@ -207,46 +350,35 @@ void sortList(ObjList *list, ObjList *keys) {
       "%lu, %lu",
       (unsigned long) list->length, (unsigned long) keys->length);
   }
-  /* TODO: Consider falling back to an in-place sorting algorithm
-   * if we run do not have enough memory for the buffer (maybe qsort?) */
-  /* NOTE: We call malloc directly instead of ALLOCATE because
-   * I don't want to potentially trigger a GC call here.
-   * And besides, none of the memory we allocate in this call should
-   * outlive this call */
-  buffer = malloc(sizeof(SortEntry) * 2 * len);
-  src = buffer;
-  dst = buffer + len;
-  for (i = 0; i < len; i++) {
-    src[i].key = keys == NULL ? list->buffer[i] : keys->buffer[i];
-    src[i].value = list->buffer[i];
-  }
 
-  /* bottom up merge sort */
-  for (width = 1; width < len; width *= 2) {
-    for (i = 0; i < len; i += 2 * width) {
-      size_t low  = i;
-      size_t mid  = i +     width < len ? i +     width : len;
-      size_t high = i + 2 * width < len ? i + 2 * width : len;
-      size_t a = low, b = mid, j;
-      for (j = low; j < high; j++) {
-        dst[j] =
-          b < high && (a >= mid || valueLessThan(src[b].key, src[a].key)) ?
-            src[b++] : src[a++];
-      }
-    }
-    {
-      SortEntry *tmp = src;
-      src = dst;
-      dst = tmp;
+  /* NOTE: The sort only ever calls malloc directly instead of ALLOCATE,
+   * so that it cannot trigger a GC. None of the memory it allocates
+   * outlives the call. */
+  if (keys == NULL) {
+    switch (getSortKind(list->buffer, len)) {
+      case SORT_NUMBERS: timsortNumbers(list->buffer, len); return;
+      case SORT_STRINGS: timsortStrings(list->buffer, len); return;
+      case SORT_VALUES: timsortValues(list->buffer, len); return;
     }
   }
 
-  /* copy contents back into the list */
+  entries = malloc(sizeof(SortEntry) * len);
+  if (entries == NULL && len > 0) {
+    panic("sortList(): out of memory");
+  }
   for (i = 0; i < len; i++) {
-    list->buffer[i] = src[i].value;
+    entries[i].key = keys->buffer[i];
+    entries[i].value = list->buffer[i];
   }
-
-  free(buffer);
+  switch (getSortKind(keys->buffer, len)) {
+    case SORT_NUMBERS: timsortNumberEntries(entries, len); break;
+    case SORT_STRINGS: timsortStringEntries(entries, len); break;
+    case SORT_VALUES: timsortEntries(entries, len); break;
+  }
+  for (i = 0; i < len; i++) {
+    list->buffer[i] = entries[i].value;
+  }
+  free(entries);
 }
 
 static ubool mapRepr(StringBuffer *out, Map *map) {
@@ -276,8 +408,28 @@ static ubool mapRepr(StringBuffer *out, Map *map) {
   return UTRUE;
 }
 
+static ubool keySetRepr(StringBuffer *out, KeySet *set) {
+  KeySetIterator it;
+  Value key;
+  ubool first = UTRUE;
+  sbputchar(out, '{');
+  initKeySetIterator(&it, set);
+  while (keySetIteratorNext(&it, &key)) {
+    if (!first) {
+      sbputchar(out, ',');
+      sbputchar(out, ' ');
+    }
+    first = UFALSE;
+    if (!valueRepr(out, key)) {
+      return UFALSE;
+    }
+  }
+  sbputchar(out, '}');
+  return UTRUE;
+}
+
 ubool valueRepr(StringBuffer *out, Value value) {
-  switch (value.type) {
+  switch (VALUE_TYPE(value)) {
     case VAL_BOOL: sbprintf(out, AS_BOOL(value) ? "true" : "false"); return UTRUE;
     case VAL_NIL: sbprintf(out, "nil"); return UTRUE;
     case VAL_NUMBER: StringBufferWriteNumber(out, AS_NUMBER(value)); return UTRUE;
@@ -365,6 +517,44 @@ ubool valueRepr(StringBuffer *out, Value value) {
           sbputstr(out, "final");
           return mapRepr(out, &dict->map);
         }
+        case OBJ_DEQUE: {
+          ObjDeque *deque = AS_DEQUE(value);
+          size_t i;
+          sbputstr(out, "Deque([");
+          for (i = 0; i < deque->length; i++) {
+            if (i > 0) {
+              sbputchar(out, ',');
+              sbputchar(out, ' ');
+            }
+            if (!valueRepr(out, DEQUE_ITEM(deque, i))) {
+              return UFALSE;
+            }
+          }
+          sbputchar(out, ']');
+          if (deque->maxLength > 0) {
+            sbprintf(out, ", %lu", (unsigned long)deque->maxLength);
+          }
+          sbputchar(out, ')');
+          return UTRUE;
+        }
+        case OBJ_SET: {
+          /* '{}' would be an empty dict */
+          ObjSet *set = AS_SET(value);
+          if (set->set.size == 0) {
+            sbputstr(out, "set()");
+            return UTRUE;
+          }
+          return keySetRepr(out, &set->set);
+        }
+        case OBJ_FROZEN_SET: {
+          ObjFrozenSet *set = AS_FROZEN_SET(value);
+          if (set->set.size == 0) {
+            sbputstr(out, "set().freeze()");
+            return UTRUE;
+          }
+          sbputstr(out, "final");
+          return keySetRepr(out, &set->set);
+        }
         case OBJ_FILE:
           sbprintf(out, "<file %s>", AS_FILE(value)->name->chars);
           return UTRUE;
@@ -5,6 +5,7 @@
 
 ubool valuesIs(Value a, Value b);
 ubool mapsEqual(Map *a, Map *b);
+ubool keySetsEqual(KeySet *a, KeySet *b);
 ubool valuesEqual(Value a, Value b);
 ubool valueLessThan(Value a, Value b);
 void sortList(ObjList *list, ObjList *keys);
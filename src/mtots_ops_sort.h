@@ -0,0 +1,498 @@
+/* Timsort, for sortList() in mtots_ops.c
+ *
+ * Stable, and adaptive: it finds the runs that are already in order (or
+ * in reverse), and merges them, galloping over long stretches of one run
+ * that all go before the next item of the other. Sorting a list that is
+ * already nearly in order takes close to n comparisons.
+ *
+ * This file has no include guard. It is included once for each kind of
+ * element and comparison, with these defined:
+ *
+ *   SORT_SUFFIX      appended to the name of every function
+ *   SORT_ELEMENT     the type of the elements
+ *   SORT_LESS(a, b)  whether element a goes before element b
+ *
+ * which it undefines again at the end. The entry point is
+ * timsort<SORT_SUFFIX>(array, length).
+ *
+ * Ported from the timsort in OpenJDK (java.util.TimSort), which follows
+ * Tim Peters' listsort.txt.
+ */
+
+#define SORT_CAT2(a, b) a##b
+#define SORT_CAT(a, b) SORT_CAT2(a, b)
+#define SORT_FN(name) SORT_CAT(name, SORT_SUFFIX)
+#define SORT_STATE SORT_FN(SortState)
+
+typedef struct SORT_STATE {
+  SORT_ELEMENT *a;
+  SORT_ELEMENT *tmp;
+  ptrdiff_t tmpLength;
+  ptrdiff_t minGallop;
+  ptrdiff_t stackSize;
+  ptrdiff_t runBase[SORT_MAX_RUNS];
+  ptrdiff_t runLength[SORT_MAX_RUNS];
+} SORT_STATE;
+
+/* Sorts a[lo, hi), of which a[lo, start) is already sorted */
+static void SORT_FN(binaryInsertionSort)(
+    SORT_ELEMENT *a, ptrdiff_t lo, ptrdiff_t hi, ptrdiff_t start) {
+  if (start == lo) {
+    start++;
+  }
+  for (; start < hi; start++) {
+    SORT_ELEMENT pivot = a[start];
+    ptrdiff_t left = lo, right = start;
+    while (left < right) {
+      ptrdiff_t mid = left + (right - left) / 2;
+      if (SORT_LESS(pivot, a[mid])) {
+        right = mid;
+      } else {
+        left = mid + 1;
+      }
+    }
+    memmove(a + left + 1, a + left, sizeof(SORT_ELEMENT) * (start - left));
+    a[left] = pivot;
+  }
+}
+
+/* Returns the length of the run that starts at a[lo], reversing it
+ * first if it is strictly descending (so that stability is kept) */
+static ptrdiff_t SORT_FN(countRun)(
+    SORT_ELEMENT *a, ptrdiff_t lo, ptrdiff_t hi) {
+  ptrdiff_t runHi = lo + 1;
+  if (runHi == hi) {
+    return 1;
+  }
+  if (SORT_LESS(a[runHi], a[lo])) {
+    ptrdiff_t i, j;
+    runHi++;
+    while (runHi < hi && SORT_LESS(a[runHi], a[runHi - 1])) {
+      runHi++;
+    }
+    for (i = lo, j = runHi - 1; i < j; i++, j--) {
+      SORT_ELEMENT t = a[i];
+      a[i] = a[j];
+      a[j] = t;
+    }
+  } else {
+    runHi++;
+    while (runHi < hi && !SORT_LESS(a[runHi], a[runHi - 1])) {
+      runHi++;
+    }
+  }
+  return runHi - lo;
+}
+
+/* Returns where 'key' would go in the sorted a[base, base + length),
+ * before any elements equal to it. The search starts at 'hint'. */
+static ptrdiff_t SORT_FN(gallopLeft)(
+    SORT_ELEMENT key, SORT_ELEMENT *a, ptrdiff_t base, ptrdiff_t length,
+    ptrdiff_t hint) {
+  ptrdiff_t lastOffset = 0, offset = 1, maxOffset;
+  a += base;
+  if (SORT_LESS(a[hint], key)) {
+    /* gallop right, until a[hint + lastOffset] < key <= a[hint + offset] */
+    maxOffset = length - hint;
+    while (offset < maxOffset && SORT_LESS(a[hint + offset], key)) {
+      lastOffset = offset;
+      offset = offset * 2 + 1;
+    }
+    if (offset > maxOffset) {
+      offset = maxOffset;
+    }
+    lastOffset += hint;
+    offset += hint;
+  } else {
+    /* gallop left, until a[hint - offset] < key <= a[hint - lastOffset] */
+    ptrdiff_t t;
+    maxOffset = hint + 1;
+    while (offset < maxOffset && !SORT_LESS(a[hint - offset], key)) {
+      lastOffset = offset;
+      offset = offset * 2 + 1;
+    }
+    if (offset > maxOffset) {
+      offset = maxOffset;
+    }
+    t = lastOffset;
+    lastOffset = hint - offset;
+    offset = hint - t;
+  }
+
+  /* binary search in a[lastOffset + 1, offset] */
+  lastOffset++;
+  while (lastOffset < offset) {
+    ptrdiff_t mid = lastOffset + (offset - lastOffset) / 2;
+    if (SORT_LESS(a[mid], key)) {
+      lastOffset = mid + 1;
+    } else {
+      offset = mid;
+    }
+  }
+  return offset;
+}
+
+/* Like gallopLeft(), but returns the position after any elements
+ * equal to 'key' */
+static ptrdiff_t SORT_FN(gallopRight)(
+    SORT_ELEMENT key, SORT_ELEMENT *a, ptrdiff_t base, ptrdiff_t length,
+    ptrdiff_t hint) {
+  ptrdiff_t lastOffset = 0, offset = 1, maxOffset;
+  a += base;
+  if (SORT_LESS(key, a[hint])) {
+    /* gallop left, until a[hint - offset] <= key < a[hint - lastOffset] */
+    ptrdiff_t t;
+    maxOffset = hint + 1;
+    while (offset < maxOffset && SORT_LESS(key, a[hint - offset])) {
+      lastOffset = offset;
+      offset = offset * 2 + 1;
+    }
+    if (offset > maxOffset) {
+      offset = maxOffset;
+    }
+    t = lastOffset;
+    lastOffset = hint - offset;
+    offset = hint - t;
+  } else {
+    /* gallop right, until a[hint + lastOffset] <= key < a[hint + offset] */
+    maxOffset = length - hint;
+    while (offset < maxOffset && !SORT_LESS(key, a[hint + offset])) {
+      lastOffset = offset;
+      offset = offset * 2 + 1;
+    }
+    if (offset > maxOffset) {
+      offset = maxOffset;
+    }
+    lastOffset += hint;
+    offset += hint;
+  }
+
+  /* binary search in a[lastOffset + 1, offset] */
+  lastOffset++;
+  while (lastOffset < offset) {
+    ptrdiff_t mid = lastOffset + (offset - lastOffset) / 2;
+    if (SORT_LESS(key, a[mid])) {
+      offset = mid;
+    } else {
+      lastOffset = mid + 1;
+    }
+  }
+  return offset;
+}
+
+static SORT_ELEMENT *SORT_FN(ensureTmp)(SORT_STATE *s, ptrdiff_t length) {
+  if (s->tmpLength < length) {
+    free(s->tmp);
+    s->tmp = (SORT_ELEMENT*)malloc(sizeof(SORT_ELEMENT) * length);
+    if (s->tmp == NULL) {
+      panic("sortList(): out of memory");
+    }
+    s->tmpLength = length;
+  }
+  return s->tmp;
+}
+
+/* Merges the adjacent runs a[base1, base1 + length1) and
+ * a[base2, base2 + length2), where length1 <= length2, and
+ * a[base2] < a[base1] and a[base1 + length1 - 1] > every element
+ * of the second run (mergeAt() trims them so that this holds) */
+static void SORT_FN(mergeLo)(
+    SORT_STATE *s, ptrdiff_t base1, ptrdiff_t length1,
+    ptrdiff_t base2, ptrdiff_t length2) {
+  SORT_ELEMENT *a = s->a;
+  SORT_ELEMENT *tmp = SORT_FN(ensureTmp)(s, length1);
+  ptrdiff_t cursor1 = 0, cursor2 = base2, dest = base1;
+  ptrdiff_t minGallop = s->minGallop;
+
+  memcpy(tmp, a + base1, sizeof(SORT_ELEMENT) * length1);
+  a[dest++] = a[cursor2++];
+  if (--length2 == 0) {
+    memcpy(a + dest, tmp + cursor1, sizeof(SORT_ELEMENT) * length1);
+    return;
+  }
+  if (length1 == 1) {
+    memmove(a + dest, a + cursor2, sizeof(SORT_ELEMENT) * length2);
+    a[dest + length2] = tmp[cursor1];
+    return;
+  }
+
+  for (;;) {
+    ptrdiff_t count1 = 0, count2 = 0;
+
+    /* one at a time, until one run keeps winning */
+    do {
+      if (SORT_LESS(a[cursor2], tmp[cursor1])) {
+        a[dest++] = a[cursor2++];
+        count2++;
+        count1 = 0;
+        if (--length2 == 0) {
+          goto done;
+        }
+      } else {
+        a[dest++] = tmp[cursor1++];
+        count1++;
+        count2 = 0;
+        if (--length1 == 1) {
+          goto done;
+        }
+      }
+    } while ((count1 | count2) < minGallop);
+
+    /* galloping, until neither run wins by much any more */
+    do {
+      count1 = SORT_FN(gallopRight)(a[cursor2], tmp, cursor1, length1, 0);
+      if (count1 != 0) {
+        memcpy(a + dest, tmp + cursor1, sizeof(SORT_ELEMENT) * count1);
+        dest += count1;
+        cursor1 += count1;
+        length1 -= count1;
+        if (length1 <= 1) {
+          goto done;
+        }
+      }
+      a[dest++] = a[cursor2++];
+      if (--length2 == 0) {
+        goto done;
+      }
+
+      count2 = SORT_FN(gallopLeft)(tmp[cursor1], a, cursor2, length2, 0);
+      if (count2 != 0) {
+        memmove(a + dest, a + cursor2, sizeof(SORT_ELEMENT) * count2);
+        dest += count2;
+        cursor2 += count2;
+        length2 -= count2;
+        if (length2 == 0) {
+          goto done;
+        }
+      }
+      a[dest++] = tmp[cursor1++];
+      if (--length1 == 1) {
+        goto done;
+      }
+      minGallop--;
+    } while (count1 >= SORT_MIN_GALLOP || count2 >= SORT_MIN_GALLOP);
+    if (minGallop < 0) {
+      minGallop = 0;
+    }
+    minGallop += 2; /* penalty for leaving galloping mode */
+  }
+
+done:
+  s->minGallop = minGallop < 1 ? 1 : minGallop;
+  if (length1 == 1) {
+    memmove(a + dest, a + cursor2, sizeof(SORT_ELEMENT) * length2);
+    a[dest + length2] = tmp[cursor1];
+  } else if (length1 > 0) {
+    memcpy(a + dest, tmp + cursor1, sizeof(SORT_ELEMENT) * length1);
+  }
+  /* length1 can only be 0 if '<' is not consistent (e.g. with NAN).
+   * Nothing is lost then: the rest of the second run is in place. */
+}
+
+/* Like mergeLo(), but for length1 >= length2, merging from the end */
+static void SORT_FN(mergeHi)(
+    SORT_STATE *s, ptrdiff_t base1, ptrdiff_t length1,
+    ptrdiff_t base2, ptrdiff_t length2) {
+  SORT_ELEMENT *a = s->a;
+  SORT_ELEMENT *tmp = SORT_FN(ensureTmp)(s, length2);
+  ptrdiff_t cursor1 = base1 + length1 - 1, cursor2 = length2 - 1;
+  ptrdiff_t dest = base2 + length2 - 1;
+  ptrdiff_t minGallop = s->minGallop;
+
+  memcpy(tmp, a + base2, sizeof(SORT_ELEMENT) * length2);
+  a[dest--] = a[cursor1--];
+  if (--length1 == 0) {
+    memcpy(a + (dest - (length2 - 1)), tmp, sizeof(SORT_ELEMENT) * length2);
+    return;
+  }
+  if (length2 == 1) {
+    dest -= length1;
+    cursor1 -= length1;
+    memmove(a + (dest + 1), a + (cursor1 + 1), sizeof(SORT_ELEMENT) * length1);
+    a[dest] = tmp[cursor2];
+    return;
+  }
+
+  for (;;) {
+    ptrdiff_t count1 = 0, count2 = 0;
+
+    do {
+      if (SORT_LESS(tmp[cursor2], a[cursor1])) {
+        a[dest--] = a[cursor1--];
+        count1++;
+        count2 = 0;
+        if (--length1 == 0) {
+          goto done;
+        }
+      } else {
+        a[dest--] = tmp[cursor2--];
+        count2++;
+        count1 = 0;
+        if (--length2 == 1) {
+          goto done;
+        }
+      }
+    } while ((count1 | count2) < minGallop);
+
+    do {
+      count1 = length1 - SORT_FN(gallopRight)(
+        tmp[cursor2], a, base1, length1, length1 - 1);
+      if (count1 != 0) {
+        dest -= count1;
+        cursor1 -= count1;
+        length1 -= count1;
+        memmove(
+          a + (dest + 1), a + (cursor1 + 1), sizeof(SORT_ELEMENT) * count1);
+        if (length1 == 0) {
+          goto done;
+        }
+      }
+      a[dest--] = tmp[cursor2--];
+      if (--length2 == 1) {
+        goto done;
+      }
+
+      count2 = length2 - SORT_FN(gallopLeft)(
+        a[cursor1], tmp, 0, length2, length2 - 1);
+      if (count2 != 0) {
+        dest -= count2;
+        cursor2 -= count2;
+        length2 -= count2;
+        memcpy(
+          a + (dest + 1), tmp + (cursor2 + 1), sizeof(SORT_ELEMENT) * count2);
+        if (length2 <= 1) {
+          goto done;
+        }
+      }
+      a[dest--] = a[cursor1--];
+      if (--length1 == 0) {
+        goto done;
+      }
+      minGallop--;
+    } while (count1 >= SORT_MIN_GALLOP || count2 >= SORT_MIN_GALLOP);
+    if (minGallop < 0) {
+      minGallop = 0;
+    }
+    minGallop += 2;
+  }
+
+done:
+  s->minGallop = minGallop < 1 ? 1 : minGallop;
+  if (length2 == 1) {
+    dest -= length1;
+    cursor1 -= length1;
+    memmove(a + (dest + 1), a + (cursor1 + 1), sizeof(SORT_ELEMENT) * length1);
+    a[dest] = tmp[cursor2];
+  } else if (length2 > 0) {
+    memcpy(a + (dest - (length2 - 1)), tmp, sizeof(SORT_ELEMENT) * length2);
+  }
+}
+
+/* Merges runs i and i + 1 on the stack */
+static void SORT_FN(mergeAt)(SORT_STATE *s, ptrdiff_t i) {
+  SORT_ELEMENT *a = s->a;
+  ptrdiff_t base1 = s->runBase[i], length1 = s->runLength[i];
+  ptrdiff_t base2 = s->runBase[i + 1], length2 = s->runLength[i + 1];
+  ptrdiff_t k;
+
+  s->runLength[i] = length1 + length2;
+  if (i == s->stackSize - 3) {
+    s->runBase[i + 1] = s->runBase[i + 2];
+    s->runLength[i + 1] = s->runLength[i + 2];
+  }
+  s->stackSize--;
+
+  /* Elements of the first run that go before all of the second run,
+   * and elements of the second run that go after all of the first,
+   * are already in place */
+  k = SORT_FN(gallopRight)(a[base2], a, base1, length1, 0);
+  base1 += k;
+  length1 -= k;
+  if (length1 == 0) {
+    return;
+  }
+  length2 = SORT_FN(gallopLeft)(
+    a[base1 + length1 - 1], a, base2, length2, length2 - 1);
+  if (length2 == 0) {
+    return;
+  }
+
+  if (length1 <= length2) {
+    SORT_FN(mergeLo)(s, base1, length1, base2, length2);
+  } else {
+    SORT_FN(mergeHi)(s, base1, length1, base2, length2);
+  }
+}
+
+/* Merges runs until the lengths on the stack shrink faster than
+ * the Fibonacci numbers, which keeps the merges balanced */
+static void SORT_FN(mergeCollapse)(SORT_STATE *s) {
+  ptrdiff_t *length = s->runLength;
+  while (s->stackSize > 1) {
+    ptrdiff_t n = s->stackSize - 2;
+    if ((n > 0 && length[n - 1] <= length[n] + length[n + 1]) ||
+        (n > 1 && length[n - 2] <= length[n] + length[n - 1])) {
+      if (length[n - 1] < length[n + 1]) {
+        n--;
+      }
+    } else if (length[n] > length[n + 1]) {
+      break;
+    }
+    SORT_FN(mergeAt)(s, n);
+  }
+}
+
+static void SORT_FN(mergeForceCollapse)(SORT_STATE *s) {
+  while (s->stackSize > 1) {
+    ptrdiff_t n = s->stackSize - 2;
+    if (n > 0 && s->runLength[n - 1] < s->runLength[n + 1]) {
+      n--;
+    }
+    SORT_FN(mergeAt)(s, n);
+  }
+}
+
+static void SORT_FN(timsort)(SORT_ELEMENT *a, ptrdiff_t length) {
+  SORT_STATE s;
+  ptrdiff_t lo = 0, remaining = length, minRun;
+
+  if (length < 2) {
+    return;
+  }
+  if (length < SORT_MIN_MERGE) {
+    SORT_FN(binaryInsertionSort)(a, 0, length, SORT_FN(countRun)(a, 0, length));
+    return;
+  }
+
+  s.a = a;
+  s.tmp = NULL;
+  s.tmpLength = 0;
+  s.minGallop = SORT_MIN_GALLOP;
+  s.stackSize = 0;
+  minRun = sortMinRunLength(length);
+  do {
+    ptrdiff_t runLength = SORT_FN(countRun)(a, lo, length);
+    if (runLength < minRun) {
+      /* extend short runs to minRun elements */
+      ptrdiff_t force = remaining <= minRun ? remaining : minRun;
+      SORT_FN(binaryInsertionSort)(a, lo, lo + force, lo + runLength);
+      runLength = force;
+    }
+    s.runBase[s.stackSize] = lo;
+    s.runLength[s.stackSize] = runLength;
+    s.stackSize++;
+    SORT_FN(mergeCollapse)(&s);
+    lo += runLength;
+    remaining -= runLength;
+  } while (remaining != 0);
+  SORT_FN(mergeForceCollapse)(&s);
+  free(s.tmp);
+}
+
+#undef SORT_STATE
+#undef SORT_FN
+#undef SORT_CAT
+#undef SORT_CAT2
+#undef SORT_SUFFIX
+#undef SORT_ELEMENT
+#undef SORT_LESS
@@ -0,0 +1,791 @@
+#include "mtots_optimizer.h"
+#include "mtots_vm.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The chunk is decoded into an array of instructions, rewritten there
+ * until nothing changes anymore, and then encoded back into the chunk.
+ *
+ * Jumps are kept as indices into the instruction array while the chunk
+ * is being rewritten. A removed instruction stays in the array (with
+ * 'isLive' cleared), and a jump to it goes to the next live instruction
+ * instead.
+ *
+ * None of the rewrites make any instruction larger, so every distance
+ * in the final code is at most what it was in the original code. Jumps
+ * are only redirected when the distance in the original code fits in
+ * a jump operand.
+ *
+ * Once nothing else changes, common sequences of instructions are fused
+ * into superinstructions. The first instruction of a sequence becomes
+ * the superinstruction, and the rest are removed. A superinstruction is
+ * always smaller than the sequence it replaces, so the above still holds.
+ */
+
+typedef struct Instruction {
+  i32 offset;       /* where the instruction started in the original code */
+  i32 size;         /* in the original code, including operands */
+  i32 target;       /* index of the instruction jumped to, for jumps */
+  i16 line;
+  u8 op;
+  u8 operands[4];   /* of a rewritten instruction, except jump offsets */
+  ubool isRewritten;  /* op or operands no longer match the original code */
+  ubool isLive;
+  ubool isTarget;
+  ubool isReachable;
+} Instruction;
+
+typedef struct Optimizer {
+  Chunk *chunk;
+  Instruction *instructions;
+  i32 count;
+  ubool changed;
+} Optimizer;
+
+static ubool isJump(u8 op) {
+  switch (op) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+    case OP_JUMP_IF_STOP_ITERATION:
+    case OP_TRY_START:
+    case OP_TRY_END:
+    case OP_LOOP:
+    case OP_LESS_LOCAL_CONSTANT_JUMP_IF_FALSE:
+      return UTRUE;
+    default:
+      return UFALSE;
+  }
+}
+
+/* Instructions after which execution never continues with
+ * the next instruction */
+static ubool isTerminator(u8 op) {
+  switch (op) {
+    case OP_JUMP:
+    case OP_LOOP:
+    case OP_RETURN:
+    case OP_RAISE:
+      return UTRUE;
+    default:
+      return UFALSE;
+  }
+}
+
+static i32 getSize(Instruction *ins) {
+  if (!ins->isRewritten) {
+    return ins->size;
+  }
+  switch (ins->op) {
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_RETURN:
+      return 1;
+    case OP_CONSTANT:
+    case OP_SET_LOCAL_POP:
+      return 2;
+    case OP_GET_LOCAL_FIELD:
+    case OP_LESS_LOCAL_CONSTANT_JUMP_IF_FALSE:
+      return 5;
+    default:
+      return 3; /* jumps, OP_GET_LOCALS, OP_ADD_LOCALS,
+                 * OP_NUMBER_MULTIPLY_LOCALS and OP_GET_LOCAL_CONSTANT */
+  }
+}
+
+/* Returns the operand byte at 'index' (0 is the byte right after the
+ * opcode), wherever it is currently stored */
+static u8 getOperand(Optimizer *opt, Instruction *ins, i32 index) {
+  return ins->isRewritten ?
+    ins->operands[index] :
+    opt->chunk->code[ins->offset + 1 + index];
+}
+
+static void decode(Optimizer *opt) {
+  Chunk *chunk = opt->chunk;
+  i32 *indexAt, offset, i;
+
+  opt->instructions =
+    (Instruction*)malloc(sizeof(Instruction) * chunk->count);
+  indexAt = (i32*)malloc(sizeof(i32) * (chunk->count + 1));
+  if (opt->instructions == NULL || indexAt == NULL) {
+    panic("out of memory");
+  }
+  for (offset = 0; offset <= chunk->count; offset++) {
+    indexAt[offset] = -1;
+  }
+
+  opt->count = 0;
+  for (offset = 0; offset < chunk->count;) {
+    Instruction *ins = &opt->instructions[opt->count];
+    indexAt[offset] = opt->count++;
+    ins->offset = offset;
+    ins->size = instructionSize(chunk, offset);
+    ins->target = -1;
+    ins->line = chunk->lines[offset];
+    ins->op = chunk->code[offset];
+    memset(ins->operands, 0, sizeof(ins->operands));
+    ins->isRewritten = UFALSE;
+    ins->isLive = UTRUE;
+    ins->isTarget = UFALSE;
+    ins->isReachable = UFALSE;
+    offset += ins->size;
+  }
+
+  for (i = 0; i < opt->count; i++) {
+    Instruction *ins = &opt->instructions[i];
+    if (isJump(ins->op)) {
+      /* The offset is always the last operand */
+      i32 next = ins->offset + ins->size;
+      i32 distance = (chunk->code[next - 2] << 8) | chunk->code[next - 1];
+      i32 targetOffset = ins->op == OP_LOOP ?
+        next - distance : next + distance;
+      if (targetOffset < 0 || targetOffset >= chunk->count ||
+          indexAt[targetOffset] < 0) {
+        panic("optimizeChunk: jump into the middle of an instruction");
+      }
+      ins->target = indexAt[targetOffset];
+    }
+  }
+
+  free(indexAt);
+}
+
+static i32 nextLive(Optimizer *opt, i32 i) {
+  while (i < opt->count && !opt->instructions[i].isLive) {
+    i++;
+  }
+  return i;
+}
+
+static i32 prevLive(Optimizer *opt, i32 i) {
+  do {
+    i--;
+  } while (i >= 0 && !opt->instructions[i].isLive);
+  return i;
+}
+
+/* Returns the instruction a jump actually lands on */
+static i32 resolveTarget(Optimizer *opt, Instruction *ins) {
+  i32 target = nextLive(opt, ins->target);
+  if (target >= opt->count) {
+    panic("optimizeChunk: jump past the end of the chunk");
+  }
+  return target;
+}
+
+/* Checks that a jump from instruction 'from' to instruction 'to'
+ * could be encoded in the original code */
+static ubool jumpFits(Optimizer *opt, i32 from, i32 to) {
+  i32 next = opt->instructions[from].offset + 3;
+  i32 target = opt->instructions[to].offset;
+  i32 distance = target < next ? next - target : target - next;
+  return distance <= U16_MAX;
+}
+
+static void removeInstruction(Optimizer *opt, i32 i) {
+  Instruction *ins = &opt->instructions[i];
+  ins->isLive = UFALSE;
+  opt->changed = UTRUE;
+  if (ins->isTarget) {
+    /* Jumps to it now land on the next live instruction */
+    i32 next = nextLive(opt, i + 1);
+    if (next < opt->count) {
+      opt->instructions[next].isTarget = UTRUE;
+    }
+  }
+}
+
+static void rewriteJump(Optimizer *opt, i32 i, u8 op, i32 target) {
+  Instruction *ins = &opt->instructions[i];
+  ins->op = op;
+  ins->target = target;
+  ins->isRewritten = UTRUE;
+  opt->changed = UTRUE;
+}
+
+/* Jumps to unconditional jumps go to their targets instead, and
+ * unconditional jumps to loops and returns are replaced by copies
+ * of those */
+static void threadJumps(Optimizer *opt) {
+  i32 i;
+  for (i = 0; i < opt->count; i++) {
+    Instruction *ins = &opt->instructions[i];
+    i32 hops;
+    if (!ins->isLive) {
+      continue;
+    }
+    switch (ins->op) {
+      case OP_JUMP:
+      case OP_JUMP_IF_FALSE:
+      case OP_JUMP_IF_TRUE:
+      case OP_TRY_END:
+        break;
+      default:
+        continue;
+    }
+    /* The bound only guards against cycles of jumps that can never
+     * be taken anyway */
+    for (hops = 0; hops < opt->count; hops++) {
+      i32 target = resolveTarget(opt, ins);
+      Instruction *targetIns = &opt->instructions[target];
+      i32 newTarget;
+      if (targetIns->op == OP_JUMP ||
+          (targetIns->op == ins->op &&
+            (ins->op == OP_JUMP_IF_FALSE || ins->op == OP_JUMP_IF_TRUE))) {
+        /* A conditional jump that lands on the same conditional jump
+         * sees the same value, so it would jump again */
+        newTarget = resolveTarget(opt, targetIns);
+        if (newTarget == target || !jumpFits(opt, i, newTarget)) {
+          break;
+        }
+        if (newTarget > i) {
+          rewriteJump(opt, i, ins->op, newTarget);
+        } else if (ins->op == OP_JUMP) {
+          rewriteJump(opt, i, OP_LOOP, newTarget);
+          break;
+        } else {
+          break;
+        }
+      } else if (ins->op == OP_JUMP && targetIns->op == OP_LOOP) {
+        newTarget = resolveTarget(opt, targetIns);
+        if (!jumpFits(opt, i, newTarget)) {
+          break;
+        }
+        rewriteJump(
+          opt, i, newTarget > i ? OP_JUMP : OP_LOOP, newTarget);
+        break;
+      } else if (ins->op == OP_JUMP && targetIns->op == OP_RETURN) {
+        ins->op = OP_RETURN;
+        ins->isRewritten = UTRUE;
+        opt->changed = UTRUE;
+        break;
+      } else {
+        break;
+      }
+    }
+  }
+}
+
+static void markJumpTargets(Optimizer *opt) {
+  i32 i;
+  for (i = 0; i < opt->count; i++) {
+    opt->instructions[i].isTarget = UFALSE;
+  }
+  for (i = 0; i < opt->count; i++) {
+    Instruction *ins = &opt->instructions[i];
+    if (ins->isLive && isJump(ins->op)) {
+      opt->instructions[resolveTarget(opt, ins)].isTarget = UTRUE;
+    }
+  }
+}
+
+/* Returns UTRUE and sets 'out' if the instruction pushes a constant */
+static ubool getConstant(Optimizer *opt, Instruction *ins, Value *out) {
+  switch (ins->op) {
+    case OP_NIL: *out = NIL_VAL(); return UTRUE;
+    case OP_TRUE: *out = BOOL_VAL(UTRUE); return UTRUE;
+    case OP_FALSE: *out = BOOL_VAL(UFALSE); return UTRUE;
+    case OP_CONSTANT:
+      *out = opt->chunk->constants.values[getOperand(opt, ins, 0)];
+      return UTRUE;
+    default:
+      return UFALSE;
+  }
+}
+
+/* Turns the instruction into one that pushes the given value.
+ * Returns UFALSE, leaving the instruction as is, if that is not
+ * possible. */
+static ubool setConstant(Optimizer *opt, i32 i, Value value) {
+  Instruction *ins = &opt->instructions[i];
+  ValueArray *constants = &opt->chunk->constants;
+  size_t constant;
+
+  if (IS_NIL(value)) {
+    ins->op = OP_NIL;
+  } else if (IS_BOOL(value)) {
+    ins->op = AS_BOOL(value) ? OP_TRUE : OP_FALSE;
+  } else {
+    if (IS_NUMBER(value) && AS_NUMBER(value) == 0) {
+      /* addConstant() would not tell 0 and -0 apart */
+      return UFALSE;
+    }
+    if (constants->count <= U8_MAX) {
+      constant = addConstant(opt->chunk, value);
+    } else {
+      for (constant = 0; constant < constants->count; constant++) {
+        if (valuesIs(value, constants->values[constant])) {
+          break;
+        }
+      }
+      if (constant > U8_MAX) {
+        return UFALSE;
+      }
+    }
+    ins->op = OP_CONSTANT;
+    ins->operands[0] = (u8)constant;
+  }
+  ins->isRewritten = UTRUE;
+  opt->changed = UTRUE;
+  return UTRUE;
+}
+
+static ubool isFalseyConstant(Value value) {
+  /* Must agree with isFalsey() in mtots_vm.c */
+  return IS_NIL(value) ||
+    (IS_BOOL(value) && !AS_BOOL(value)) ||
+    (IS_NUMBER(value) && AS_NUMBER(value) == 0);
+}
+
+static ubool foldUnary(u8 op, Value a, Value *out) {
+  switch (op) {
+    case OP_NOT:
+      *out = BOOL_VAL(isFalseyConstant(a));
+      return UTRUE;
+    case OP_NEGATE:
+      if (!IS_NUMBER(a)) {
+        return UFALSE;
+      }
+      *out = NUMBER_VAL(-AS_NUMBER(a));
+      return UTRUE;
+    case OP_BITWISE_NOT:
+      if (!IS_NUMBER(a)) {
+        return UFALSE;
+      }
+      *out = NUMBER_VAL(~AS_U32(a));
+      return UTRUE;
+    default:
+      return UFALSE;
+  }
+}
+
+/* Folds only what the VM would compute without raising an error or
+ * calling any method */
+static ubool foldBinary(u8 op, Value a, Value b, Value *out) {
+  double x, y;
+
+  if (op == OP_IS) {
+    *out = BOOL_VAL(valuesIs(a, b));
+    return UTRUE;
+  }
+  if (op == OP_EQUAL) {
+    *out = BOOL_VAL(valuesEqual(a, b));
+    return UTRUE;
+  }
+  if (op == OP_ADD && IS_STRING(a) && IS_STRING(b)) {
+    String *strA = AS_STRING(a), *strB = AS_STRING(b);
+    size_t length = strA->length + strB->length;
+    char *chars = (char*)malloc(length + 1);
+    if (chars == NULL) {
+      panic("out of memory");
+    }
+    memcpy(chars, strA->chars, strA->length);
+    memcpy(chars + strA->length, strB->chars, strB->length);
+    chars[length] = '\0';
+    /* Constants are always interned */
+    *out = STRING_VAL(internOwnedString(chars, length));
+    return UTRUE;
+  }
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+    return UFALSE;
+  }
+
+  x = AS_NUMBER(a);
+  y = AS_NUMBER(b);
+  switch (op) {
+    case OP_GREATER:
+    case OP_NUMBER_GREATER: *out = BOOL_VAL(y < x); return UTRUE;
+    case OP_LESS:
+    case OP_NUMBER_LESS: *out = BOOL_VAL(x < y); return UTRUE;
+    case OP_ADD:
+    case OP_NUMBER_ADD: *out = NUMBER_VAL(x + y); return UTRUE;
+    case OP_SUBTRACT:
+    case OP_NUMBER_SUBTRACT: *out = NUMBER_VAL(x - y); return UTRUE;
+    case OP_MULTIPLY:
+    case OP_NUMBER_MULTIPLY: *out = NUMBER_VAL(x * y); return UTRUE;
+    case OP_DIVIDE:
+    case OP_NUMBER_DIVIDE: *out = NUMBER_VAL(x / y); return UTRUE;
+    case OP_FLOOR_DIVIDE: *out = NUMBER_VAL(floor(x / y)); return UTRUE;
+    case OP_MODULO: *out = NUMBER_VAL(fmod(x, y)); return UTRUE;
+    case OP_BITWISE_OR: *out = NUMBER_VAL(AS_U32(a) | AS_U32(b)); return UTRUE;
+    case OP_BITWISE_AND: *out = NUMBER_VAL(AS_U32(a) & AS_U32(b)); return UTRUE;
+    case OP_BITWISE_XOR: *out = NUMBER_VAL(AS_U32(a) ^ AS_U32(b)); return UTRUE;
+    case OP_SHIFT_LEFT:
+    case OP_SHIFT_RIGHT:
+      /* Shifting by the width of u32 or more is left to the machine */
+      if (AS_U32(b) >= 32) {
+        return UFALSE;
+      }
+      *out = NUMBER_VAL(op == OP_SHIFT_LEFT ?
+        AS_U32(a) << AS_U32(b) :
+        AS_U32(a) >> AS_U32(b));
+      return UTRUE;
+    default:
+      return UFALSE;
+  }
+}
+
+static ubool isPurePush(u8 op) {
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_UPVALUE:
+      return UTRUE;
+    default:
+      return UFALSE;
+  }
+}
+
+/* Looks at instruction 'i' together with the live instructions right
+ * before it. Only the first instruction of such a sequence may be
+ * a jump target. */
+static void peephole(Optimizer *opt, i32 i) {
+  Instruction *ins = &opt->instructions[i];
+  i32 prev = prevLive(opt, i);
+  Instruction *prevIns = prev >= 0 ? &opt->instructions[prev] : NULL;
+  Value a, b, result;
+
+  if (prevIns == NULL || ins->isTarget) {
+    return;
+  }
+
+  switch (ins->op) {
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_BITWISE_NOT:
+      if (getConstant(opt, prevIns, &a) &&
+          foldUnary(ins->op, a, &result)) {
+        push(result);
+        if (setConstant(opt, prev, result)) {
+          removeInstruction(opt, i);
+        }
+        pop();
+      }
+      return;
+    case OP_IS:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_FLOOR_DIVIDE:
+    case OP_MODULO:
+    case OP_SHIFT_LEFT:
+    case OP_SHIFT_RIGHT:
+    case OP_BITWISE_OR:
+    case OP_BITWISE_AND:
+    case OP_BITWISE_XOR:
+    case OP_NUMBER_ADD:
+    case OP_NUMBER_SUBTRACT:
+    case OP_NUMBER_MULTIPLY:
+    case OP_NUMBER_DIVIDE:
+    case OP_NUMBER_LESS:
+    case OP_NUMBER_GREATER: {
+      i32 first = prevLive(opt, prev);
+      if (first < 0 || prevIns->isTarget ||
+          !getConstant(opt, &opt->instructions[first], &a) ||
+          !getConstant(opt, prevIns, &b) ||
+          !foldBinary(ins->op, a, b, &result)) {
+        return;
+      }
+      push(result);
+      if (setConstant(opt, first, result)) {
+        removeInstruction(opt, prev);
+        removeInstruction(opt, i);
+      }
+      pop();
+      return;
+    }
+    case OP_POP:
+      if (isPurePush(prevIns->op)) {
+        removeInstruction(opt, prev);
+        removeInstruction(opt, i);
+      }
+      return;
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE: {
+      i32 next, target;
+      if (getConstant(opt, prevIns, &a)) {
+        /* The value stays on the stack either way */
+        if (isFalseyConstant(a) == (ins->op == OP_JUMP_IF_FALSE)) {
+          rewriteJump(opt, i, OP_JUMP, ins->target);
+        } else {
+          removeInstruction(opt, i);
+        }
+        return;
+      }
+      /* 'not x' is only ever looked at by this jump if both places it
+       * can go to start by popping it */
+      next = nextLive(opt, i + 1);
+      target = resolveTarget(opt, ins);
+      if (prevIns->op == OP_NOT &&
+          next < opt->count && opt->instructions[next].op == OP_POP &&
+          opt->instructions[target].op == OP_POP) {
+        removeInstruction(opt, prev);
+        rewriteJump(
+          opt, i,
+          ins->op == OP_JUMP_IF_FALSE ? OP_JUMP_IF_TRUE : OP_JUMP_IF_FALSE,
+          ins->target);
+      }
+      return;
+    }
+    default:
+      return;
+  }
+}
+
+static void removeUnreachable(Optimizer *opt) {
+  i32 *worklist, worklistCount = 0, i;
+
+  worklist = (i32*)malloc(sizeof(i32) * opt->count);
+  if (worklist == NULL) {
+    panic("out of memory");
+  }
+  for (i = 0; i < opt->count; i++) {
+    opt->instructions[i].isReachable = UFALSE;
+  }
+
+  i = nextLive(opt, 0);
+  if (i < opt->count) {
+    opt->instructions[i].isReachable = UTRUE;
+    worklist[worklistCount++] = i;
+  }
+  while (worklistCount > 0) {
+    Instruction *ins;
+    i32 successors[2], successorCount = 0, j;
+    i = worklist[--worklistCount];
+    ins = &opt->instructions[i];
+    if (!isTerminator(ins->op)) {
+      successors[successorCount++] = nextLive(opt, i + 1);
+    }
+    if (isJump(ins->op)) {
+      successors[successorCount++] = resolveTarget(opt, ins);
+    }
+    for (j = 0; j < successorCount; j++) {
+      i32 successor = successors[j];
+      if (successor >= opt->count) {
+        panic("optimizeChunk: execution falls off the end of the chunk");
+      }
+      if (!opt->instructions[successor].isReachable) {
+        opt->instructions[successor].isReachable = UTRUE;
+        worklist[worklistCount++] = successor;
+      }
+    }
+  }
+
+  for (i = 0; i < opt->count; i++) {
+    Instruction *ins = &opt->instructions[i];
+    if (ins->isLive && !ins->isReachable) {
+      removeInstruction(opt, i);
+    }
+  }
+
+  free(worklist);
+}
+
+static void removeJumpsToNext(Optimizer *opt) {
+  i32 i;
+  for (i = 0; i < opt->count; i++) {
+    Instruction *ins = &opt->instructions[i];
+    if (ins->isLive && ins->op == OP_JUMP &&
+        resolveTarget(opt, ins) == nextLive(opt, i + 1)) {
+      removeInstruction(opt, i);
+    }
+  }
+}
+
+/* The superinstructions check the types of their operands anyway, so
+ * an OP_NUMBER_* instruction can take the place of the generic one */
+static u8 getMatchedOp(u8 op) {
+  switch (op) {
+    case OP_NUMBER_ADD: return OP_ADD;
+    case OP_NUMBER_LESS: return OP_LESS;
+    default: return op;
+  }
+}
+
+/* Checks that the 'count' live instructions starting at 'i' have the
+ * given ops, and that only the first of them is a jump target. On success,
+ * their indices are stored in 'out'. */
+static ubool matchSequence(
+    Optimizer *opt, i32 i, const u8 *ops, i32 count, i32 *out) {
+  i32 j;
+  for (j = 0; j < count; j++) {
+    Instruction *ins;
+    if (i >= opt->count) {
+      return UFALSE;
+    }
+    ins = &opt->instructions[i];
+    if (getMatchedOp(ins->op) != ops[j] || (j > 0 && ins->isTarget)) {
+      return UFALSE;
+    }
+    out[j] = i;
+    i = nextLive(opt, i + 1);
+  }
+  return UTRUE;
+}
+
+/* Replaces the matched instructions with the superinstruction 'op'.
+ * It takes its operands from the matched instructions in order, except
+ * for a jump offset, and the line of the instruction at 'lineFrom',
+ * which should be the one that can raise an error. */
+static void fuse(
+    Optimizer *opt, u8 op, const i32 *matched, i32 count, i32 lineFrom) {
+  Instruction *first = &opt->instructions[matched[0]];
+  u8 operands[4];
+  i32 operandCount = 0, j;
+
+  for (j = 0; j < count; j++) {
+    Instruction *ins = &opt->instructions[matched[j]];
+    i32 k, size = getSize(ins) - 1;
+    if (isJump(ins->op)) {
+      first->target = ins->target;
+      continue;
+    }
+    for (k = 0; k < size; k++) {
+      operands[operandCount++] = getOperand(opt, ins, k);
+    }
+  }
+
+  first->line = opt->instructions[matched[lineFrom]].line;
+  first->op = op;
+  memcpy(first->operands, operands, operandCount);
+  first->isRewritten = UTRUE;
+  for (j = 1; j < count; j++) {
+    removeInstruction(opt, matched[j]);
+  }
+}
+
+/* The sequences that scripts/opcode-pairs.py finds most often in
+ * typical code */
+static void fuseSuperinstructions(Optimizer *opt) {
+  static const u8 lessJump[] = {
+    OP_GET_LOCAL, OP_CONSTANT, OP_LESS, OP_JUMP_IF_FALSE };
+  static const u8 addLocals[] = { OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD };
+  static const u8 multiplyLocals[] = {
+    OP_GET_LOCAL, OP_GET_LOCAL, OP_NUMBER_MULTIPLY };
+  static const u8 getLocals[] = { OP_GET_LOCAL, OP_GET_LOCAL };
+  static const u8 localField[] = { OP_GET_LOCAL, OP_GET_FIELD };
+  static const u8 localConstant[] = { OP_GET_LOCAL, OP_CONSTANT };
+  static const u8 setLocalPop[] = { OP_SET_LOCAL, OP_POP };
+  i32 i, matched[4];
+
+  for (i = 0; i < opt->count; i++) {
+    if (!opt->instructions[i].isLive) {
+      continue;
+    }
+    if (matchSequence(opt, i, lessJump, 4, matched)) {
+      fuse(opt, OP_LESS_LOCAL_CONSTANT_JUMP_IF_FALSE, matched, 4, 2);
+    } else if (matchSequence(opt, i, addLocals, 3, matched)) {
+      fuse(opt, OP_ADD_LOCALS, matched, 3, 2);
+    } else if (matchSequence(opt, i, multiplyLocals, 3, matched)) {
+      fuse(opt, OP_NUMBER_MULTIPLY_LOCALS, matched, 3, 2);
+    } else if (matchSequence(opt, i, getLocals, 2, matched)) {
+      fuse(opt, OP_GET_LOCALS, matched, 2, 0);
+    } else if (matchSequence(opt, i, localField, 2, matched)) {
+      fuse(opt, OP_GET_LOCAL_FIELD, matched, 2, 1);
+    } else if (matchSequence(opt, i, localConstant, 2, matched)) {
+      fuse(opt, OP_GET_LOCAL_CONSTANT, matched, 2, 0);
+    } else if (matchSequence(opt, i, setLocalPop, 2, matched)) {
+      fuse(opt, OP_SET_LOCAL_POP, matched, 2, 0);
+    }
+  }
+}
+
+static void encode(Optimizer *opt) {
+  Chunk *chunk = opt->chunk;
+  i32 *newOffsets, newCount = 0, i;
+  u8 *code;
+  i16 *lines;
+
+  newOffsets = (i32*)malloc(sizeof(i32) * opt->count);
+  if (newOffsets == NULL) {
+    panic("out of memory");
+  }
+  for (i = 0; i < opt->count; i++) {
+    newOffsets[i] = newCount;
+    if (opt->instructions[i].isLive) {
+      newCount += getSize(&opt->instructions[i]);
+    }
+  }
+
+  code = ALLOCATE(u8, newCount);
+  lines = ALLOCATE(i16, newCount);
+  for (i = 0; i < opt->count; i++) {
+    Instruction *ins = &opt->instructions[i];
+    i32 offset = newOffsets[i], size = getSize(ins), j;
+    if (!ins->isLive) {
+      continue;
+    }
+    if (isJump(ins->op)) {
+      i32 next = offset + size;
+      i32 target = newOffsets[resolveTarget(opt, ins)];
+      i32 distance = ins->op == OP_LOOP ? next - target : target - next;
+      if (distance < 0 || distance > U16_MAX) {
+        panic("optimizeChunk: jump out of range");
+      }
+      code[offset] = ins->op;
+      memcpy(code + offset + 1, ins->operands, size - 3);
+      code[next - 2] = (distance >> 8) & 0xFF;
+      code[next - 1] = distance & 0xFF;
+    } else if (ins->isRewritten) {
+      code[offset] = ins->op;
+      memcpy(code + offset + 1, ins->operands, size - 1);
+    } else {
+      memcpy(code + offset, chunk->code + ins->offset, size);
+    }
+    for (j = 0; j < size; j++) {
+      lines[offset + j] = ins->line;
+    }
+  }
+
+  FREE_ARRAY(u8, chunk->code, chunk->capacity);
+  FREE_ARRAY(i16, chunk->lines, chunk->capacity);
+  chunk->code = code;
+  chunk->lines = lines;
+  chunk->count = chunk->capacity = newCount;
+
+  free(newOffsets);
+}
+
+void optimizeChunk(Chunk *chunk) {
+  Optimizer opt;
+  i32 i;
+
+  if (chunk->count == 0) {
+    return;
+  }
+
+  opt.chunk = chunk;
+  decode(&opt);
+
+  do {
+    opt.changed = UFALSE;
+    threadJumps(&opt);
+    markJumpTargets(&opt);
+    for (i = 0; i < opt.count; i++) {
+      if (opt.instructions[i].isLive) {
+        peephole(&opt, i);
+      }
+    }
+    removeUnreachable(&opt);
+    removeJumpsToNext(&opt);
+  } while (opt.changed);
+
+#if MTOTS_USE_SUPERINSTRUCTIONS
+  markJumpTargets(&opt);
+  fuseSuperinstructions(&opt);
+#endif
+
+  encode(&opt);
+  free(opt.instructions);
+}
@@ -0,0 +1,25 @@
+#ifndef mtots_optimizer_h
+#define mtots_optimizer_h
+
+#include "mtots_object.h"
+
+/* Rewrites the bytecode of a freshly compiled chunk:
+ *
+ *   - operators applied to constants are folded into a single constant
+ *     (e.g. '1 + 2' becomes '3'),
+ *   - jumps to jumps go straight to the final target,
+ *   - conditional jumps on constants become unconditional or go away,
+ *   - OP_NOT followed by a conditional jump whose value is popped on
+ *     both sides becomes the opposite conditional jump,
+ *   - values that are pushed and then immediately popped are dropped,
+ *   - unreachable code (e.g. after 'return') is removed,
+ *   - common sequences of instructions are fused into superinstructions
+ *     (e.g. OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD becomes OP_ADD_LOCALS).
+ *
+ * Every instruction that is kept keeps its line, so error traces do not
+ * change. New constants may be added to the chunk, but existing ones are
+ * never removed or renumbered.
+ */
+void optimizeChunk(Chunk *chunk);
+
+#endif/*mtots_optimizer_h*/
@@ -0,0 +1,218 @@
+#include "mtots_pool.h"
+#include "mtots_util_error.h"
+
+#include <stdlib.h>
+
+/* Pages are POOL_PAGE_SIZE bytes, and aligned to POOL_PAGE_SIZE, so that
+ * the page a block belongs to can be found by masking its address.
+ * Each page starts with a PoolPage header, followed by blocks of a
+ * single size class. */
+#define POOL_PAGE_SIZE (8 * 1024)
+#define POOL_PAGE_HEADER_SIZE 64
+#define POOL_ARENA_PAGE_COUNT 32
+
+/* Size classes are multiples of 16 up to 128, and multiples of 32
+ * after that */
+#define POOL_CLASS_COUNT 12
+#define POOL_NO_CLASS POOL_CLASS_COUNT
+
+typedef struct PoolArena PoolArena;
+
+typedef struct PoolPage {
+  struct PoolPage *prev;
+  struct PoolPage *next;
+  PoolArena *arena;
+  void *freeBlocks;     /* blocks that were freed, linked through their
+                         * first word */
+  char *unusedBlocks;   /* blocks past this point were never handed out */
+  size_t usedCount;
+  size_t sizeClass;
+} PoolPage;
+
+struct PoolArena {
+  PoolArena *next;
+  void *allocation;     /* what malloc returned, before alignment */
+  size_t freePageCount;
+};
+
+static const size_t classSizes[POOL_CLASS_COUNT] = {
+  16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256,
+};
+
+/* Maps (size + 15) / 16 to the size class */
+static const u8 classTable[POOL_MAX_SIZE / 16 + 1] = {
+  0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 8, 9, 9, 10, 10, 11, 11,
+};
+
+static PoolArena *arenas;
+
+/* Pages that are not assigned to any size class */
+static PoolPage *freePages;
+
+/* Pages of each size class that have room for more blocks.
+ * Full pages are not on any list. */
+static PoolPage *classPages[POOL_CLASS_COUNT];
+
+size_t poolSizeClass(size_t size) {
+  return classTable[(size + 15) / 16];
+}
+
+static PoolPage *getPage(void *pointer) {
+  return (PoolPage*)((size_t)pointer & ~(size_t)(POOL_PAGE_SIZE - 1));
+}
+
+static ubool pageIsFull(PoolPage *page) {
+  return page->freeBlocks == NULL &&
+    page->unusedBlocks + classSizes[page->sizeClass] >
+      ((char*)page) + POOL_PAGE_SIZE;
+}
+
+static void unlinkPage(PoolPage *page) {
+  if (page->prev) {
+    page->prev->next = page->next;
+  } else {
+    classPages[page->sizeClass] = page->next;
+  }
+  if (page->next) {
+    page->next->prev = page->prev;
+  }
+  page->prev = page->next = NULL;
+}
+
+static void pushPage(PoolPage *page) {
+  PoolPage **head = &classPages[page->sizeClass];
+  page->prev = NULL;
+  page->next = *head;
+  if (*head) {
+    (*head)->prev = page;
+  }
+  *head = page;
+}
+
+static void newArena() {
+  PoolArena *arena = (PoolArena*)malloc(sizeof(PoolArena));
+  char *start;
+  size_t i;
+  if (arena == NULL) {
+    panic("out of memory");
+  }
+  arena->allocation = malloc(POOL_PAGE_SIZE * (POOL_ARENA_PAGE_COUNT + 1));
+  if (arena->allocation == NULL) {
+    panic("out of memory");
+  }
+  start = (char*)getPage(((char*)arena->allocation) + POOL_PAGE_SIZE - 1);
+  for (i = 0; i < POOL_ARENA_PAGE_COUNT; i++) {
+    PoolPage *page = (PoolPage*)(start + i * POOL_PAGE_SIZE);
+    page->arena = arena;
+    page->sizeClass = POOL_NO_CLASS;
+    page->prev = NULL;
+    page->next = freePages;
+    freePages = page;
+  }
+  arena->freePageCount = POOL_ARENA_PAGE_COUNT;
+  arena->next = arenas;
+  arenas = arena;
+}
+
+static PoolPage *newPage(size_t sizeClass) {
+  PoolPage *page;
+  if (freePages == NULL) {
+    newArena();
+  }
+  page = freePages;
+  freePages = page->next;
+  page->arena->freePageCount--;
+  page->freeBlocks = NULL;
+  page->unusedBlocks = ((char*)page) + POOL_PAGE_HEADER_SIZE;
+  page->usedCount = 0;
+  page->sizeClass = sizeClass;
+  pushPage(page);
+  return page;
+}
+
+void *poolAllocate(size_t size) {
+  size_t sizeClass = poolSizeClass(size);
+  PoolPage *page = classPages[sizeClass];
+  void *block;
+
+  if (page == NULL) {
+    page = newPage(sizeClass);
+  }
+
+  if (page->freeBlocks) {
+    block = page->freeBlocks;
+    page->freeBlocks = *(void**)block;
+  } else {
+    block = page->unusedBlocks;
+    page->unusedBlocks += classSizes[sizeClass];
+  }
+  page->usedCount++;
+
+  /* Full pages are kept off the list until a block is freed */
+  if (pageIsFull(page)) {
+    unlinkPage(page);
+  }
+
+  return block;
+}
+
+void poolFree(void *pointer) {
+  PoolPage *page = getPage(pointer);
+  ubool wasFull = pageIsFull(page);
+  *(void**)pointer = page->freeBlocks;
+  page->freeBlocks = pointer;
+  page->usedCount--;
+  if (wasFull) {
+    pushPage(page);
+  }
+}
+
+void poolReleaseEmptyPages() {
+  size_t sizeClass;
+  PoolArena **arenaPtr;
+  PoolPage **pagePtr;
+  ubool anyArenaEmpty = UFALSE;
+
+  for (sizeClass = 0; sizeClass < POOL_CLASS_COUNT; sizeClass++) {
+    PoolPage *page = classPages[sizeClass];
+    while (page) {
+      PoolPage *next = page->next;
+      if (page->usedCount == 0) {
+        unlinkPage(page);
+        page->sizeClass = POOL_NO_CLASS;
+        page->next = freePages;
+        freePages = page;
+        if (++page->arena->freePageCount == POOL_ARENA_PAGE_COUNT) {
+          anyArenaEmpty = UTRUE;
+        }
+      }
+      page = next;
+    }
+  }
+
+  if (!anyArenaEmpty) {
+    return;
+  }
+
+  /* Drop the pages of empty arenas from the free list,
+   * then the arenas themselves */
+  pagePtr = &freePages;
+  while (*pagePtr) {
+    if ((*pagePtr)->arena->freePageCount == POOL_ARENA_PAGE_COUNT) {
+      *pagePtr = (*pagePtr)->next;
+    } else {
+      pagePtr = &(*pagePtr)->next;
+    }
+  }
+  arenaPtr = &arenas;
+  while (*arenaPtr) {
+    PoolArena *arena = *arenaPtr;
+    if (arena->freePageCount == POOL_ARENA_PAGE_COUNT) {
+      *arenaPtr = arena->next;
+      free(arena->allocation);
+      free(arena);
+    } else {
+      arenaPtr = &arena->next;
+    }
+  }
+}
@@ -0,0 +1,32 @@
+#ifndef mtots_pool_h
+#define mtots_pool_h
+
+#include "mtots_common.h"
+
+/* Size-classed pool allocator for small heap blocks.
+ *
+ * reallocate() sends every block of at most POOL_MAX_SIZE bytes here
+ * instead of to malloc. Blocks are carved out of fixed size pages, one
+ * size class per page, and pages are carved out of larger arenas that
+ * come from malloc.
+ *
+ * The pool does not record which blocks it handed out, so reallocate()
+ * relies on its callers passing back the size each block was allocated
+ * with to tell pool blocks from malloc blocks.
+ */
+
+#define POOL_MAX_SIZE 256
+
+void *poolAllocate(size_t size);
+void poolFree(void *pointer);
+
+/* Returns the size class 'size' belongs to. Two sizes with the same
+ * size class can share a block. */
+size_t poolSizeClass(size_t size);
+
+/* Gives pages that no longer hold any blocks back to their arena, and
+ * arenas that no longer hold any pages back to the system.
+ * The GC calls this after every sweep. */
+void poolReleaseEmptyPages();
+
+#endif/*mtots_pool_h*/
@@ -0,0 +1,83 @@
+#include "mtots_shape.h"
+#include "mtots_memory.h"
+
+void initShape(Shape *shape) {
+  shape->parent = NULL;
+  shape->firstChild = NULL;
+  shape->nextSibling = NULL;
+  shape->keys = NULL;
+  shape->fieldCount = 0;
+  shape->childCount = 0;
+}
+
+void freeShapeChildren(Shape *shape) {
+  Shape *child = shape->firstChild;
+  while (child != NULL) {
+    Shape *next = child->nextSibling;
+    freeShapeChildren(child);
+    FREE_ARRAY(String*, child->keys, child->fieldCount);
+    FREE(Shape, child);
+    child = next;
+  }
+  shape->firstChild = NULL;
+  shape->childCount = 0;
+}
+
+void markShape(Shape *shape) {
+  Shape *child;
+  /* Every key other than the last one is also a key of the parent */
+  if (shape->fieldCount > 0) {
+    markString(shape->keys[shape->fieldCount - 1]);
+  }
+  for (child = shape->firstChild; child != NULL; child = child->nextSibling) {
+    markShape(child);
+  }
+}
+
+i32 shapeFindField(Shape *shape, String *key) {
+  u32 i;
+  for (i = 0; i < shape->fieldCount; i++) {
+    if (shape->keys[i] == key) {
+      return (i32)i;
+    }
+  }
+  return -1;
+}
+
+Shape *shapeAddField(Shape *shape, String *key) {
+  Shape *child;
+  String **keys;
+  u32 i;
+
+  for (child = shape->firstChild; child != NULL; child = child->nextSibling) {
+    if (child->keys[shape->fieldCount] == key) {
+      return child;
+    }
+  }
+
+  if (shape->fieldCount >= SHAPE_MAX_FIELDS ||
+      shape->childCount >= SHAPE_MAX_CHILDREN) {
+    return NULL;
+  }
+
+  /* Nothing allocated here is reachable until it is linked into the
+   * tree below, but it also does not own anything the GC could free:
+   * the caller keeps 'key' alive, and the other keys belong to 'shape'. */
+  keys = ALLOCATE(String*, shape->fieldCount + 1);
+  for (i = 0; i < shape->fieldCount; i++) {
+    keys[i] = shape->keys[i];
+  }
+  keys[shape->fieldCount] = key;
+
+  child = ALLOCATE(Shape, 1);
+  initShape(child);
+  child->parent = shape;
+  child->keys = keys;
+  child->fieldCount = shape->fieldCount + 1;
+
+  child->nextSibling = shape->firstChild;
+  shape->firstChild = child;
+  shape->childCount++;
+
+  return child;
+}
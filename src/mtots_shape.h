@@ -0,0 +1,52 @@
+#ifndef mtots_shape_h
+#define mtots_shape_h
+
+#include "mtots_value.h"
+
+/* Instances with no more than this many fields can share a Shape.
+ * An instance that grows past it switches to dictionary mode. */
+#define SHAPE_MAX_FIELDS 64
+
+/* A Shape with this many children gets no new ones. Instances that would
+ * need one switch to dictionary mode instead. This keeps objects used as
+ * ad-hoc string-keyed records from growing the shape tree without bound. */
+#define SHAPE_MAX_CHILDREN 16
+
+/* A Shape (a.k.a. hidden class) describes the field layout of instances:
+ * the value of the field named keys[i] lives in slot i.
+ *
+ * Each class owns a tree of Shapes, rooted at the empty shape embedded
+ * in the ObjClass. Adding a field to an instance moves it to a child of
+ * its current Shape, so instances of the same class whose fields were
+ * added in the same order share a single Shape.
+ *
+ * Shapes are not GC objects. They are owned by their class, and are
+ * marked and freed along with it.
+ */
+typedef struct Shape {
+  struct Shape *parent;      /* NULL for the root shape */
+  struct Shape *firstChild;
+  struct Shape *nextSibling;
+  String **keys;             /* names of the fields, in slot order */
+  u32 fieldCount;
+  u32 childCount;
+} Shape;
+
+void initShape(Shape *shape);
+
+/* Frees every descendant of the given shape, but not the shape itself */
+void freeShapeChildren(Shape *shape);
+
+/* Marks the field names used anywhere in the shape tree */
+void markShape(Shape *shape);
+
+/* Returns the slot of the given field, or -1 if the shape does
+ * not have it */
+i32 shapeFindField(Shape *shape, String *key);
+
+/* Returns the shape reached by adding the given field to 'shape'.
+ * Returns NULL if that would exceed SHAPE_MAX_FIELDS or
+ * SHAPE_MAX_CHILDREN. */
+Shape *shapeAddField(Shape *shape, String *key);
+
+#endif/*mtots_shape_h*/
@@ -20,7 +20,9 @@ NORETURN void panic(const char *format, ...) {
     StringBuffer sb;
     initStringBuffer(&sb);
     errorContextProvider(&sb);
-    fprintf(stderr, "%s", sb.chars);
+    if (sb.length > 0) {
+      fprintf(stderr, "%s", sb.chars);
+    }
     freeStringBuffer(&sb);
   }
   exit(1);
@@ -7,12 +7,34 @@
 
 #define STRING_SET_MAX_LOAD 0.75
 
+/* Concatenating onto a rope whose right side is nested this deep
+ * flattens the right side first. This bounds the recursion in
+ * copyRope() and markStringParts(), which loop over left sides
+ * and only recurse into right sides. */
+#define ROPE_MAX_DEPTH 64
+
 typedef struct StringSet {
   String **strings;
-  size_t capacity, occupied, allocationSize;
+  size_t capacity, occupied;
 } StringSet;
 
+/* Strings that are not interned, kept so that the GC can free them */
+typedef struct StringList {
+  String **strings;
+  size_t count, capacity;
+} StringList;
+
+typedef struct Rope {
+  String string;
+  String *left;    /* both NULL once the rope is flattened */
+  String *right;
+  u32 depth;
+} Rope;
+
 static StringSet allStrings;
+static StringList looseStrings;
+static size_t allocationSize;
+static ubool markInternedStrings;
 
 static u32 hashString(const char *key, size_t length) {
   /* FNV-1a as presented in the Crafting Interpreters book */
@@ -40,56 +62,121 @@ static String **stringSetFindEntry(const char *chars, size_t length, u32 hash) {
   }
 }
 
-String *internString(const char *chars, size_t length) {
-  if (allStrings.occupied + 1 > allStrings.capacity * STRING_SET_MAX_LOAD) {
-    size_t oldCap = allStrings.capacity;
-    size_t newCap = oldCap < 8 ? 8 : oldCap * 2;
-    size_t i;
-    String **oldStrings = allStrings.strings;
-    String **newStrings = (String**)malloc(sizeof(String*) * newCap);
+static void growStringSet() {
+  size_t oldCap = allStrings.capacity;
+  size_t newCap = oldCap < 8 ? 8 : oldCap * 2;
+  size_t i;
+  String **oldStrings = allStrings.strings;
+  String **newStrings = (String**)malloc(sizeof(String*) * newCap);
+  if (newStrings == NULL) {
+    panic("out of memory");
+  }
+  for (i = 0; i < newCap; i++) {
+    newStrings[i] = NULL;
+  }
+  allStrings.strings = newStrings;
+  allStrings.capacity = newCap;
+  for (i = 0; i < oldCap; i++) {
+    String *oldString = oldStrings[i];
     String **entry;
-    for (i = 0; i < newCap; i++) {
-      newStrings[i] = NULL;
+    if (oldString == NULL) {
+      continue;
     }
-    allStrings.strings = newStrings;
-    allStrings.capacity = newCap;
-    allStrings.occupied = 0;
-    allStrings.allocationSize = 0;
-    for (i = 0; i < oldCap; i++) {
-      String *oldString = oldStrings[i];
-      if (oldString == NULL) {
-        continue;
-      }
-      entry = stringSetFindEntry(oldString->chars, oldString->length, oldString->hash);
-      if (*entry) {
-        assertionError();
-      }
-      *entry = oldString;
-      allStrings.occupied++;
-      allStrings.allocationSize += sizeof(String) + oldString->length;
+    entry = stringSetFindEntry(oldString->chars, oldString->length, oldString->hash);
+    if (*entry) {
+      assertionError();
     }
-    free(oldStrings);
+    *entry = oldString;
   }
+  free(oldStrings);
+}
 
-  {
-    u32 hash = hashString(chars, length);
-    String **entry = stringSetFindEntry(chars, length, hash);
-    String *string;
-    if (*entry) {
-      return *entry;
+/* Returns the entry for the given string, growing the table first if
+ * adding a string might push it past STRING_SET_MAX_LOAD */
+static String **findOrReserveEntry(const char *chars, size_t length, u32 hash) {
+  if (allStrings.occupied + 1 > allStrings.capacity * STRING_SET_MAX_LOAD) {
+    growStringSet();
+  }
+  return stringSetFindEntry(chars, length, hash);
+}
+
+static String *foundString(String *string) {
+  if (markInternedStrings) {
+    string->isMarked = UTRUE;
+  }
+  return string;
+}
+
+static void initString(String *string, char *chars, size_t length) {
+  string->isMarked = markInternedStrings;
+  string->isInterned = UFALSE;
+  string->isHashed = UFALSE;
+  string->isRope = UFALSE;
+  string->chars = chars;
+  string->length = length;
+  string->hash = 0;
+}
+
+static void addInternedString(String **entry, String *string, u32 hash) {
+  string->isInterned = UTRUE;
+  string->isHashed = UTRUE;
+  string->hash = hash;
+  *entry = string;
+  allStrings.occupied++;
+}
+
+static void addLooseString(String *string) {
+  if (looseStrings.count >= looseStrings.capacity) {
+    looseStrings.capacity =
+      looseStrings.capacity < 8 ? 8 : looseStrings.capacity * 2;
+    looseStrings.strings = (String**)realloc(
+      looseStrings.strings, sizeof(String*) * looseStrings.capacity);
+    if (looseStrings.strings == NULL) {
+      panic("out of memory");
     }
-    string = (String*)malloc(sizeof(String));
-    string->isMarked = UFALSE;
-    string->length = length;
-    string->hash = hash;
-    string->chars = (char*)malloc(length + 1);
-    memcpy(string->chars, chars, length);
-    string->chars[length] = '\0';
-    *entry = string;
-    allStrings.occupied++;
-    allStrings.allocationSize += sizeof(String) + string->length;
-    return string;
   }
+  looseStrings.strings[looseStrings.count++] = string;
+}
+
+/* Allocates a flat string with its characters inline */
+static String *newInlineString(const char *chars, size_t length) {
+  String *string = (String*)malloc(sizeof(String) + length + 1);
+  char *inlineChars;
+  if (string == NULL) {
+    panic("out of memory");
+  }
+  inlineChars = (char*)(string + 1);
+  if (length > 0) {
+    /* 'chars' may be NULL for the empty string */
+    memcpy(inlineChars, chars, length);
+  }
+  inlineChars[length] = '\0';
+  initString(string, inlineChars, length);
+  allocationSize += sizeof(String) + length;
+  return string;
+}
+
+/* Allocates a flat string that uses the given buffer */
+static String *newOwnedString(char *chars, size_t length) {
+  String *string = (String*)malloc(sizeof(String));
+  if (string == NULL) {
+    panic("out of memory");
+  }
+  initString(string, chars, length);
+  allocationSize += sizeof(String) + length;
+  return string;
+}
+
+String *internString(const char *chars, size_t length) {
+  u32 hash = hashString(chars, length);
+  String **entry = findOrReserveEntry(chars, length, hash);
+  String *string;
+  if (*entry) {
+    return foundString(*entry);
+  }
+  string = newInlineString(chars, length);
+  addInternedString(entry, string, hash);
+  return string;
 }
 
 String *internCString(const char *string) {
@@ -97,44 +184,276 @@ String *internCString(const char *string) {
 }
 
 String *internOwnedString(char *chars, size_t length) {
-  /* TODO actually reuse the memory provided by the caller */
-  String *string = internString(chars, length);
-  free(chars);
+  u32 hash = hashString(chars, length);
+  String **entry = findOrReserveEntry(chars, length, hash);
+  String *string;
+  if (*entry) {
+    free(chars);
+    return foundString(*entry);
+  }
+  string = newOwnedString(chars, length);
+  addInternedString(entry, string, hash);
   return string;
 }
 
-size_t getInternedStringsAllocationSize() {
-  return allStrings.allocationSize;
+String *makeString(const char *chars, size_t length) {
+  String *string;
+  if (length <= STRING_MAX_INTERN_LENGTH) {
+    return internString(chars, length);
+  }
+  string = newInlineString(chars, length);
+  addLooseString(string);
+  return string;
 }
 
-void freeUnmarkedStrings() {
-  size_t i, cap = allStrings.capacity;
-  String **oldEntries = allStrings.strings;
-  String **newEntries = (String**)malloc(sizeof(String*) * cap);
-  for (i = 0; i < cap; i++) {
-    newEntries[i] = NULL;
-  }
-  allStrings.occupied = 0;
-  allStrings.allocationSize = 0;
-  allStrings.strings = newEntries;
-  for (i = 0; i < cap; i++) {
-    String *str = oldEntries[i];
-    if (str) {
-      if (str->isMarked) {
-        String **entry = stringSetFindEntry(str->chars, str->length, str->hash);
-        if (*entry) {
-          assertionError();
-        }
-        *entry = str;
-        str->isMarked = UFALSE;
-        allStrings.occupied++;
-        allStrings.allocationSize += sizeof(String) + str->length;
-      } else {
-        free(str->chars);
-        free(str);
-        oldEntries[i] = NULL;
+String *makeOwnedString(char *chars, size_t length) {
+  String *string;
+  if (length <= STRING_MAX_INTERN_LENGTH) {
+    return internOwnedString(chars, length);
+  }
+  string = newOwnedString(chars, length);
+  addLooseString(string);
+  return string;
+}
+
+static u32 ropeDepth(String *string) {
+  return string->chars ? 0 : ((Rope*)string)->depth;
+}
+
+String *concatStrings(String *a, String *b) {
+  size_t length = a->length + b->length;
+  u32 depth;
+  Rope *rope;
+
+  if (a->length == 0) {
+    return b;
+  }
+  if (b->length == 0) {
+    return a;
+  }
+
+  if (length <= STRING_MAX_INTERN_LENGTH) {
+    /* Both sides are too short to be ropes */
+    char *chars = (char*)malloc(length + 1);
+    if (chars == NULL) {
+      panic("out of memory");
+    }
+    memcpy(chars, a->chars, a->length);
+    memcpy(chars + a->length, b->chars, b->length);
+    chars[length] = '\0';
+    return internOwnedString(chars, length);
+  }
+
+  if (ropeDepth(b) + 1 > ROPE_MAX_DEPTH) {
+    flattenString(b);
+  }
+  depth = ropeDepth(b) + 1;
+  if (ropeDepth(a) > depth) {
+    depth = ropeDepth(a);
+  }
+
+  rope = (Rope*)malloc(sizeof(Rope));
+  if (rope == NULL) {
+    panic("out of memory");
+  }
+  initString(&rope->string, NULL, length);
+  rope->string.isRope = UTRUE;
+  rope->left = a;
+  rope->right = b;
+  rope->depth = depth;
+  allocationSize += sizeof(Rope);
+  addLooseString(&rope->string);
+  if (markInternedStrings) {
+    /* The parts may not have been reached by the GC yet */
+    markStringParts(a);
+    markStringParts(b);
+  }
+  return &rope->string;
+}
+
+/* Copies the characters of 'string' so that they end at 'end' */
+static void copyRope(String *string, char *end) {
+  while (string->chars == NULL) {
+    Rope *rope = (Rope*)string;
+    copyRope(rope->right, end);
+    end -= rope->right->length;
+    string = rope->left;
+  }
+  memcpy(end - string->length, string->chars, string->length);
+}
+
+String *flattenString(String *string) {
+  Rope *rope;
+  char *chars;
+  if (string->chars) {
+    return string;
+  }
+  rope = (Rope*)string;
+  chars = (char*)malloc(string->length + 1);
+  if (chars == NULL) {
+    panic("out of memory");
+  }
+  copyRope(string, chars + string->length);
+  chars[string->length] = '\0';
+  string->chars = chars;
+  rope->left = rope->right = NULL;
+  allocationSize += string->length;
+  return string;
+}
+
+String *internedString(String *string) {
+  String **entry;
+  if (string->isInterned) {
+    return string;
+  }
+  flattenString(string);
+  entry = findOrReserveEntry(string->chars, string->length, stringHash(string));
+  if (*entry) {
+    return foundString(*entry);
+  }
+  /* The string becomes the interned one. freeUnmarkedStrings() drops it
+   * from the list of loose strings. */
+  addInternedString(entry, string, string->hash);
+  return foundString(string);
+}
+
+u32 stringHash(String *string) {
+  if (!string->isHashed) {
+    flattenString(string);
+    string->hash = hashString(string->chars, string->length);
+    string->isHashed = UTRUE;
+  }
+  return string->hash;
+}
+
+ubool stringsEqual(String *a, String *b) {
+  if (a == b) {
+    return UTRUE;
+  }
+  if ((a->isInterned && b->isInterned) || a->length != b->length) {
+    return UFALSE;
+  }
+  return stringHash(a) == stringHash(b) &&
+    memcmp(a->chars, b->chars, a->length) == 0;
+}
+
+void markStringParts(String *string) {
+  while (string && !string->isMarked) {
+    string->isMarked = UTRUE;
+    if (string->chars) {
+      return;
+    }
+    markStringParts(((Rope*)string)->right);
+    string = ((Rope*)string)->left;
+  }
+}
+
+void setMarkInternedStrings(ubool mark) {
+  markInternedStrings = mark;
+}
+
+size_t getStringsAllocationSize() {
+  return allocationSize;
+}
+
+size_t getInternedStringCount() {
+  return allStrings.occupied;
+}
+
+size_t getInternTableSize() {
+  return allStrings.capacity * sizeof(String*);
+}
+
+static void freeString(String *string) {
+  if (string->isRope) {
+    allocationSize -= sizeof(Rope) + (string->chars ? string->length : 0);
+    free(string->chars);
+  } else {
+    allocationSize -= sizeof(String) + string->length;
+    if (string->chars != (char*)(string + 1)) {
+      free(string->chars);
+    }
+  }
+  free(string);
+}
+
+/* Empties the entry at 'index', then moves later entries of the same
+ * probe sequence back, so that lookups never stop early at the hole
+ * (i.e. backward shift deletion, Knuth's Algorithm R) */
+static void removeEntry(size_t index) {
+  size_t mask = allStrings.capacity - 1;
+  size_t hole = index, next = index;
+  for (;;) {
+    allStrings.strings[hole] = NULL;
+    for (;;) {
+      size_t home;
+      next = (next + 1) & mask;
+      if (allStrings.strings[next] == NULL) {
+        return;
       }
+      /* The entry may stay unless 'hole' lies between its home
+       * slot and where it is now */
+      home = allStrings.strings[next]->hash & mask;
+      if (hole <= next ?
+          (hole < home && home <= next) :
+          (hole < home || home <= next)) {
+        continue;
+      }
+      break;
+    }
+    allStrings.strings[hole] = allStrings.strings[next];
+    hole = next;
+  }
+}
+
+static void freeUnmarkedInternedStrings() {
+  size_t mask = allStrings.capacity - 1;
+  size_t start, i, visited;
+  if (allStrings.capacity == 0) {
+    return;
+  }
+
+  /* Start right after an empty slot, so that removeEntry() only ever
+   * moves entries that have not been visited yet */
+  start = 0;
+  while (allStrings.strings[start] != NULL) {
+    start++;
+  }
+
+  i = (start + 1) & mask;
+  for (visited = 1; visited < allStrings.capacity;) {
+    String *string = allStrings.strings[i];
+    if (string && !string->isMarked) {
+      freeString(string);
+      allStrings.occupied--;
+      removeEntry(i);
+      continue; /* another entry may have moved into slot i */
+    }
+    if (string) {
+      string->isMarked = UFALSE;
     }
+    i = (i + 1) & mask;
+    visited++;
   }
-  free(oldEntries);
+}
+
+static void freeUnmarkedLooseStrings() {
+  size_t i, count = 0;
+  for (i = 0; i < looseStrings.count; i++) {
+    String *string = looseStrings.strings[i];
+    if (string->isInterned) {
+      /* Now owned by the intern table */
+    } else if (string->isMarked) {
+      string->isMarked = UFALSE;
+      looseStrings.strings[count++] = string;
+    } else {
+      freeString(string);
+    }
+  }
+  looseStrings.count = count;
+}
+
+void freeUnmarkedStrings() {
+  freeUnmarkedLooseStrings();
+  freeUnmarkedInternedStrings();
 }
@@ -3,18 +3,84 @@
 
 #include "mtots_common.h"
 
+/* Short strings are interned: there is only ever one String with given
+ * contents, so they can be compared and hashed by address.
+ *
+ * Longer strings built at runtime (see makeString()) are not interned
+ * unless they are used as a map key or field name, and their hash is
+ * only computed when first needed. Concatenating long strings produces
+ * a rope, whose characters are only put together when they are needed.
+ * Until then, 'chars' is NULL. See flattenString().
+ *
+ * A String is allocated in a single block, with 'chars' pointing just
+ * past the header, except for strings created from a caller's buffer
+ * (see makeOwnedString()) and ropes.
+ */
 typedef struct String {
   ubool isMarked;
+  ubool isInterned;
+  ubool isHashed;
+  ubool isRope;
   char *chars;
   size_t length;
   u32 hash;
 } String;
 
+/* Strings longer than this are not interned when they are created
+ * with makeString() or makeOwnedString() */
+#define STRING_MAX_INTERN_LENGTH 128
+
 String *internString(const char *chars, size_t length);
 String *internCString(const char *string);
+
+/* Like internString(), but takes ownership of 'chars', which must be
+ * malloc'd and NUL terminated at chars[length]. If the string was not
+ * interned yet, the buffer becomes its storage. Otherwise it is freed. */
 String *internOwnedString(char *chars, size_t length);
-size_t getInternedStringsAllocationSize();
+
+/* Like internString() and internOwnedString(), but for strings longer
+ * than STRING_MAX_INTERN_LENGTH, returns a new string that is not
+ * interned, so that its characters are neither hashed nor compared
+ * with existing strings. */
+String *makeString(const char *chars, size_t length);
+String *makeOwnedString(char *chars, size_t length);
+
+/* Returns 'a' followed by 'b'. Short results are interned like with
+ * makeString(), longer results are ropes. Neither string needs to be
+ * flat. */
+String *concatStrings(String *a, String *b);
+
+/* Makes sure 'chars' is set, and returns the same string */
+String *flattenString(String *string);
+
+/* Returns the interned string with the same contents, which is 'string'
+ * itself if there was none yet */
+String *internedString(String *string);
+
+u32 stringHash(String *string);
+ubool stringsEqual(String *a, String *b);
+
+/* Marks the string, and for ropes, the strings it is made of */
+void markStringParts(String *string);
+
+/* Bytes used by all strings, interned or not */
+size_t getStringsAllocationSize();
+
+/* The number of interned strings, and the bytes used by the table
+ * that holds them (not counting the strings themselves) */
+size_t getInternedStringCount();
+size_t getInternTableSize();
+
+/* Frees every unmarked string, and clears the mark on the rest.
+ * Interned strings are removed in place, without reallocating
+ * the intern table. */
 void freeUnmarkedStrings();
 
+/* While set, every String returned by the functions above is marked,
+ * whether it is new or already existed. The incremental garbage
+ * collector sets this while it is marking, so that strings
+ * created or looked up in the meantime are not freed. */
+void setMarkInternedStrings(ubool mark);
+
 
 #endif/*mtots_util_string_h*/
@@ -13,6 +13,7 @@
   return (i32) AS_NUMBER(value);
 }
 
+#if !MTOTS_USE_NAN_BOXING
 Value BOOL_VAL(ubool value) {
   Value v = {VAL_BOOL};
   v.as.boolean = value;
@@ -52,6 +53,7 @@ Value OBJ_VAL_EXPLICIT(Obj *object) {
   v.as.obj = object;
   return v;
 }
+#endif
 
 void initValueArray(ValueArray *array) {
   array->values = NULL;
@@ -76,7 +78,7 @@ void freeValueArray(ValueArray *array) {
 }
 
 void printValue(Value value) {
-  switch (value.type) {
+  switch (VALUE_TYPE(value)) {
     case VAL_BOOL:
       printf(AS_BOOL(value) ? "true" : "false");
       return;
@@ -107,7 +109,7 @@ void printValue(Value value) {
       printObject(value);
       return;
   }
-  printf("UNRECOGNIZED(%d)", value.type);
+  printf("UNRECOGNIZED(%d)", VALUE_TYPE(value));
 }
 
 const char *getValueTypeName(ValueType type) {
@@ -129,7 +131,7 @@ const char *getValueTypeName(ValueType type) {
  * For object values, a string describing its object type is returned.
  */
 const char *getKindName(Value value) {
-  switch (value.type) {
+  switch (VALUE_TYPE(value)) {
     case VAL_BOOL: return "bool";
     case VAL_NIL: return "nil";
     case VAL_NUMBER: return "number";
@@ -137,7 +139,7 @@ const char *getKindName(Value value) {
     case VAL_CFUNCTION: return "cfunction";
     case VAL_OPERATOR: return "operator";
     case VAL_SENTINEL: return "sentinel";
-    case VAL_OBJ: switch (value.as.obj->type) {
+    case VAL_OBJ: switch (AS_OBJ(value)->type) {
       case OBJ_CLASS: return "class";
       case OBJ_CLOSURE: return "closure";
       case OBJ_THUNK: return "function";
@@ -148,6 +150,9 @@ const char *getKindName(Value value) {
       case OBJ_TUPLE: return "tuple";
       case OBJ_DICT: return "dict";
       case OBJ_FROZEN_DICT: return "frozendict";
+      case OBJ_SET: return "set";
+      case OBJ_FROZEN_SET: return "frozenset";
+      case OBJ_DEQUE: return "deque";
       case OBJ_FILE: return "file";
       case OBJ_NATIVE: return AS_NATIVE(value)->descriptor->name;
       case OBJ_UPVALUE: return "upvalue";
@@ -178,6 +183,9 @@ ubool typePatternMatch(TypePattern pattern, Value value) {
     case TYPE_PATTERN_TUPLE: return IS_TUPLE(value);
     case TYPE_PATTERN_DICT: return IS_DICT(value);
     case TYPE_PATTERN_FROZEN_DICT: return IS_FROZEN_DICT(value);
+    case TYPE_PATTERN_SET: return IS_SET(value);
+    case TYPE_PATTERN_FROZEN_SET: return IS_FROZEN_SET(value);
+    case TYPE_PATTERN_DEQUE: return IS_DEQUE(value);
     case TYPE_PATTERN_CLASS: return IS_CLASS(value);
     case TYPE_PATTERN_NATIVE_OR_NIL:
       if (IS_NIL(value)) {
@@ -206,6 +214,9 @@ const char *getTypePatternName(TypePattern pattern) {
     case TYPE_PATTERN_TUPLE: return "tuple";
     case TYPE_PATTERN_DICT: return "dict";
     case TYPE_PATTERN_FROZEN_DICT: return "frozendict";
+    case TYPE_PATTERN_SET: return "set";
+    case TYPE_PATTERN_FROZEN_SET: return "frozenset";
+    case TYPE_PATTERN_DEQUE: return "deque";
     case TYPE_PATTERN_CLASS: return "class";
     case TYPE_PATTERN_NATIVE_OR_NIL:
       return pattern.nativeTypeDescriptor ?
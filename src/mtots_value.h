@@ -18,6 +18,9 @@ typedef enum TypePatternType {
   TYPE_PATTERN_TUPLE,
   TYPE_PATTERN_DICT,
   TYPE_PATTERN_FROZEN_DICT,
+  TYPE_PATTERN_SET,
+  TYPE_PATTERN_FROZEN_SET,
+  TYPE_PATTERN_DEQUE,
   TYPE_PATTERN_CLASS,
   TYPE_PATTERN_NATIVE_OR_NIL,
   TYPE_PATTERN_NATIVE
@@ -48,6 +51,48 @@ typedef enum ValueType {
   VAL_OBJ
 } ValueType;
 
+#if MTOTS_USE_NAN_BOXING
+/* NaN-boxed representation: every Value is a single 64-bit word.
+ *
+ * Numbers are stored as-is. Everything else is a quiet NaN whose top
+ * 16 bits identify the kind of value:
+ *
+ *   0x7ffd  nil
+ *   0x7ffe  bool       (payload 0 or 1)
+ *   0x7fff  sentinel   (payload is the Sentinel)
+ *   0xfffc  Obj*       (payload is the pointer)
+ *   0xfffd  String*    (payload is the pointer)
+ *   0xfffe  CFunction* (payload is the pointer)
+ *   0xffff  operator   (payload is the Operator)
+ *
+ * Pointers are assumed to fit in the lower 48 bits. NaNs that are real
+ * numbers are canonicalized by NUMBER_VAL so that they can never be
+ * mistaken for one of the above.
+ *
+ * This needs a 64-bit integer type, so it requires C99.
+ */
+#if !defined(__STDC_VERSION__) || __STDC_VERSION__ < 199901L
+#error "MTOTS_USE_NAN_BOXING requires C99 or later"
+#endif
+#include <stdint.h>
+
+typedef struct Value {
+  uint64_t bits;
+} Value;
+
+#define NANBOX_QNAN     ((uint64_t)0x7ffc000000000000)
+#define NANBOX_PTR_MASK ((uint64_t)0x0000ffffffffffff)
+#define NANBOX_NIL      ((uint64_t)0x7ffd000000000000)
+#define NANBOX_BOOL     ((uint64_t)0x7ffe000000000000)
+#define NANBOX_SENTINEL ((uint64_t)0x7fff000000000000)
+#define NANBOX_OBJ      ((uint64_t)0xfffc000000000000)
+#define NANBOX_STRING   ((uint64_t)0xfffd000000000000)
+#define NANBOX_CFUNC    ((uint64_t)0xfffe000000000000)
+#define NANBOX_OPERATOR ((uint64_t)0xffff000000000000)
+#define NANBOX_TAG(value) ((value).bits & ~NANBOX_PTR_MASK)
+#define NANBOX_PAYLOAD(value) ((value).bits & NANBOX_PTR_MASK)
+
+#else
 typedef struct Value {
   ValueType type;
   union {
@@ -60,6 +105,7 @@ typedef struct Value {
     Obj *obj;
   } as;
 } Value;
+#endif
 
 struct CFunction {
   ubool (*body)(i16 argCount, Value *args, Value *out);
@@ -76,6 +122,80 @@ typedef struct ValueArray {
   Value *values;
 } ValueArray;
 
+#if MTOTS_USE_NAN_BOXING
+#define IS_BOOL(value) (NANBOX_TAG(value) == NANBOX_BOOL)
+#define IS_NIL(value) ((value).bits == NANBOX_NIL)
+#define IS_NUMBER(value) (((value).bits & NANBOX_QNAN) != NANBOX_QNAN)
+#define IS_STRING(value) (NANBOX_TAG(value) == NANBOX_STRING)
+#define IS_CFUNCTION(value) (NANBOX_TAG(value) == NANBOX_CFUNC)
+#define IS_OPERATOR(value) (NANBOX_TAG(value) == NANBOX_OPERATOR)
+#define IS_SENTINEL(value) (NANBOX_TAG(value) == NANBOX_SENTINEL)
+#define IS_OBJ(value) (NANBOX_TAG(value) == NANBOX_OBJ)
+#define AS_OBJ(value) ((Obj*)(size_t)NANBOX_PAYLOAD(value))
+#define AS_BOOL(value) ((ubool)NANBOX_PAYLOAD(value))
+#define AS_NUMBER(value) (nanboxToNumber(value))
+#define AS_STRING_OR_ROPE(value) ((String*)(size_t)NANBOX_PAYLOAD(value))
+#define AS_CFUNCTION(value) ((CFunction*)(size_t)NANBOX_PAYLOAD(value))
+#define AS_OPERATOR(value) ((Operator)NANBOX_PAYLOAD(value))
+#define AS_SENTINEL(value) ((Sentinel)NANBOX_PAYLOAD(value))
+#define VALUE_TYPE(value) (nanboxValueType(value))
+
+static inline double nanboxToNumber(Value value) {
+  union { uint64_t bits; double number; } u;
+  u.bits = value.bits;
+  return u.number;
+}
+
+static inline Value nanboxMake(uint64_t bits) {
+  Value v;
+  v.bits = bits;
+  return v;
+}
+
+static inline ValueType nanboxValueType(Value value) {
+  if (IS_NUMBER(value)) {
+    return VAL_NUMBER;
+  }
+  switch (NANBOX_TAG(value)) {
+    case NANBOX_NIL: return VAL_NIL;
+    case NANBOX_BOOL: return VAL_BOOL;
+    case NANBOX_SENTINEL: return VAL_SENTINEL;
+    case NANBOX_OBJ: return VAL_OBJ;
+    case NANBOX_STRING: return VAL_STRING;
+    case NANBOX_CFUNC: return VAL_CFUNCTION;
+    case NANBOX_OPERATOR: return VAL_OPERATOR;
+  }
+  return VAL_NUMBER; /* unreachable: tag 0x7ffc is never produced */
+}
+
+static inline Value NUMBER_VAL(double value) {
+  union { uint64_t bits; double number; } u;
+  if (value != value) {
+    /* canonical quiet NaN; never collides with a tagged value */
+    return nanboxMake((uint64_t)0x7ff8000000000000);
+  }
+  u.number = value;
+  return nanboxMake(u.bits);
+}
+
+#define BOOL_VAL(value) (nanboxMake(NANBOX_BOOL | ((value) ? 1 : 0)))
+#define NIL_VAL() (nanboxMake(NANBOX_NIL))
+#define STRING_VAL(string) \
+  (nanboxMake(NANBOX_STRING | (uint64_t)(size_t)(string)))
+#define CFUNCTION_VAL(func) \
+  (nanboxMake(NANBOX_CFUNC | (uint64_t)(size_t)(func)))
+#define OPERATOR_VAL(op) (nanboxMake(NANBOX_OPERATOR | (uint64_t)(op)))
+#define SENTINEL_VAL(sentinel) \
+  (nanboxMake(NANBOX_SENTINEL | (uint64_t)(sentinel)))
+#define OBJ_VAL_EXPLICIT(object) \
+  (nanboxMake(NANBOX_OBJ | (uint64_t)(size_t)(object)))
+
+#define IS_STOP_ITERATION(value) \
+  ((value).bits == (NANBOX_SENTINEL | SentinelStopIteration))
+#define IS_EMPTY_KEY(value) \
+  ((value).bits == (NANBOX_SENTINEL | SentinelEmptyKey))
+
+#else
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
@@ -87,14 +207,11 @@ typedef struct ValueArray {
 #define AS_OBJ(value) ((value).as.obj)
 #define AS_BOOL(value) ((value).as.boolean)
 #define AS_NUMBER(value) ((value).as.number)
-#define AS_STRING(value) ((value).as.string)
-#define AS_CSTRING(value) ((value).as.string->chars)
+#define AS_STRING_OR_ROPE(value) ((value).as.string)
 #define AS_CFUNCTION(value) ((value).as.cfunction)
 #define AS_OPERATOR(value) ((value).as.op)
 #define AS_SENTINEL(value) ((value).as.sentinel)
-
-/* should-be-inline */ u32 AS_U32(Value value);
-/* should-be-inline */ i32 AS_I32(Value value);
+#define VALUE_TYPE(value) ((value).type)
 
 Value BOOL_VAL(ubool value);
 Value NIL_VAL();
@@ -111,6 +228,17 @@ Value OBJ_VAL_EXPLICIT(Obj *object);
 #define IS_EMPTY_KEY(value) ( \
   IS_SENTINEL(value) && \
   ((value).as.sentinel == SentinelEmptyKey))
+#endif
+
+/* A string value may be a rope whose characters have not been put
+ * together yet (see mtots_util_string.h). AS_STRING flattens it first,
+ * so that 'chars' can be used. AS_STRING_OR_ROPE does not, and is only
+ * for code that needs nothing but the length, or that handles ropes. */
+#define AS_STRING(value) (flattenString(AS_STRING_OR_ROPE(value)))
+#define AS_CSTRING(value) (AS_STRING(value)->chars)
+
+/* should-be-inline */ u32 AS_U32(Value value);
+/* should-be-inline */ i32 AS_I32(Value value);
 
 #define STOP_ITERATION_VAL() (SENTINEL_VAL(SentinelStopIteration))
 #define EMPTY_KEY_VAL() (SENTINEL_VAL(SentinelEmptyKey))
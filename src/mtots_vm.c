@@ -7,9 +7,12 @@
 #include "mtots_class_str.h"
 #include "mtots_class_dict.h"
 #include "mtots_class_frozendict.h"
+#include "mtots_class_set.h"
+#include "mtots_class_deque.h"
 #include "mtots_class_class.h"
 #include "mtots_class_buffer.h"
 #include "mtots_modules.h"
+#include "mtots_jit.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,7 +28,49 @@
 VM vm;
 
 static ubool invoke(String *name, i16 argCount);
-static void prepPrelude();
+
+#if MTOTS_COUNT_OPCODE_PAIRS
+/* opcodePairCounts[a][b] is the number of times an 'a' instruction
+ * was followed by a 'b' instruction that comes right after it in the
+ * same chunk, i.e. a pair that a superinstruction could replace */
+static unsigned long opcodePairCounts[U8_COUNT][U8_COUNT];
+static Chunk *previousChunk;
+static i32 previousOffset = -1;
+
+static void countOpcodePair(CallFrame *frame) {
+  Chunk *chunk = &frame->closure->thunk->chunk;
+  i32 offset = (i32)(frame->ip - chunk->code);
+  if (chunk == previousChunk && previousOffset >= 0 &&
+      offset == previousOffset + instructionSize(chunk, previousOffset)) {
+    opcodePairCounts[chunk->code[previousOffset]][chunk->code[offset]]++;
+  }
+  previousChunk = chunk;
+  previousOffset = offset;
+}
+
+/* Appends the counts to the file named by MTOTS_OPCODE_PAIRS_PATH,
+ * or writes them to stderr, one 'opcode opcode count' line per pair.
+ * See scripts/opcode-pairs.py */
+static void writeOpcodePairCounts() {
+  const char *path = getenv("MTOTS_OPCODE_PAIRS_PATH");
+  FILE *out = path ? fopen(path, "a") : stderr;
+  size_t a, b;
+  if (out == NULL) {
+    return;
+  }
+  for (a = 0; a < U8_COUNT; a++) {
+    for (b = 0; b < U8_COUNT; b++) {
+      if (opcodePairCounts[a][b] > 0) {
+        fprintf(out, "%lu %lu %lu\n",
+          (unsigned long)a, (unsigned long)b, opcodePairCounts[a][b]);
+      }
+    }
+  }
+  if (out != stderr) {
+    fclose(out);
+  }
+}
+#endif
 
 static void resetStack() {
   vm.stackTop = vm.stack;
@@ -93,18 +138,32 @@ static void initNoMethodClass(ObjClass **clsptr, const char *name) {
 
 void initVM() {
   setErrorContextProvider(printStackToStringBuffer);
+#if MTOTS_COUNT_OPCODE_PAIRS
+  atexit(writeOpcodePairCounts);
+#endif
   checkAssumptions();
   initParseRules();
   resetStack();
   vm.objects = NULL;
   vm.bytesAllocated = 0;
-  vm.nextGC = 1024 * 1024;
 
   vm.grayCount = 0;
   vm.grayCapacity = 0;
   vm.grayStack = NULL;
 
-  vm.preludeString = NULL;
+  vm.gcPhase = GC_PHASE_IDLE;
+  vm.gcIncremental = MTOTS_INCREMENTAL_GC;
+  vm.gcDebt = 0;
+  vm.stringsAllocationSize = 0;
+  vm.sweepObjects = NULL;
+  memset(vm.gcPauses, 0, sizeof(vm.gcPauses));
+  vm.gcMaxPause = 0;
+  vm.gcTotalPause = 0;
+  vm.gcCollections = 0;
+  memset(vm.objectBytes, 0, sizeof(vm.objectBytes));
+  memset(vm.liveObjects, 0, sizeof(vm.liveObjects));
+  initGCPolicy();
+
   vm.initString = NULL;
   vm.iterString = NULL;
   vm.lenString = NULL;
@@ -123,6 +182,9 @@ void initVM() {
   vm.tupleClass = NULL;
   vm.mapClass = NULL;
   vm.frozenDictClass = NULL;
+  vm.setClass = NULL;
+  vm.frozenSetClass = NULL;
+  vm.dequeClass = NULL;
   vm.functionClass = NULL;
   vm.operatorClass = NULL;
   vm.classClass = NULL;
@@ -136,8 +198,8 @@ void initVM() {
   initMap(&vm.nativeModuleThunks);
   initMap(&vm.tuples);
   initMap(&vm.frozenDicts);
+  initMap(&vm.frozenSets);
 
-  vm.preludeString = internCString("__prelude__");
   vm.initString = internCString("__init__");
   vm.iterString = internCString("__iter__");
   vm.lenString = internCString("__len__");
@@ -158,6 +220,9 @@ void initVM() {
   initTupleClass();
   initDictClass();
   initFrozenDictClass();
+  initSetClass();
+  initFrozenSetClass();
+  initDequeClass();
   initNoMethodClass(&vm.functionClass, "Function");
   initNoMethodClass(&vm.operatorClass, "Operator");
   initClassClass();
@@ -165,17 +230,16 @@ void initVM() {
 
   defineDefaultGlobals();
   addNativeModules();
-
-  prepPrelude();
 }
 
 void freeVM() {
+  writeGCStatsAtExit();
   freeMap(&vm.globals);
   freeMap(&vm.modules);
   freeMap(&vm.nativeModuleThunks);
   freeMap(&vm.tuples);
   freeMap(&vm.frozenDicts);
-  vm.preludeString = NULL;
+  freeMap(&vm.frozenSets);
   vm.initString = NULL;
   vm.iterString = NULL;
   vm.lenString = NULL;
@@ -219,6 +283,100 @@ static ubool isIterator(Value value) {
   return UFALSE;
 }
 
+/* Gets the next item of a loop over a container (see OP_GET_ITER in
+ * mtots_chunk.h), and advances the index in the loop state.
+ * Returns UFALSE when there are no more items. */
+static ubool getNextItem(Value *state, Value *out) {
+  size_t index = (size_t)AS_NUMBER(state[0]);
+  Value container = state[2];
+  if (IS_STRING(container)) {
+    /* OP_GET_ITER has already flattened the string */
+    String *str = AS_STRING_OR_ROPE(container);
+    if (index >= str->length) {
+      return UFALSE;
+    }
+    *out = STRING_VAL(internString(str->chars + index, 1));
+    state[0] = NUMBER_VAL(index + 1);
+    return UTRUE;
+  }
+  switch (AS_OBJ(container)->type) {
+    case OBJ_LIST: {
+      ObjList *list = AS_LIST(container);
+      if (index >= list->length) {
+        return UFALSE;
+      }
+      *out = list->buffer[index];
+      state[0] = NUMBER_VAL(index + 1);
+      return UTRUE;
+    }
+    case OBJ_TUPLE: {
+      ObjTuple *tuple = AS_TUPLE(container);
+      if (index >= tuple->length) {
+        return UFALSE;
+      }
+      *out = tuple->buffer[index];
+      state[0] = NUMBER_VAL(index + 1);
+      return UTRUE;
+    }
+    case OBJ_DICT:
+    case OBJ_FROZEN_DICT: {
+      MapIterator di;
+      di.map = IS_DICT(container) ?
+        &AS_DICT(container)->map :
+        &AS_FROZEN_DICT(container)->map;
+      di.index = index;
+      if (!mapIteratorNextKey(&di, out)) {
+        return UFALSE;
+      }
+      state[0] = NUMBER_VAL(di.index);
+      return UTRUE;
+    }
+    case OBJ_DEQUE: {
+      ObjDeque *deque = AS_DEQUE(container);
+      if (index >= deque->length) {
+        return UFALSE;
+      }
+      *out = DEQUE_ITEM(deque, index);
+      state[0] = NUMBER_VAL(index + 1);
+      return UTRUE;
+    }
+    case OBJ_SET:
+    case OBJ_FROZEN_SET: {
+      KeySetIterator it;
+      it.set = IS_SET(container) ?
+        &AS_SET(container)->set :
+        &AS_FROZEN_SET(container)->set;
+      it.index = index;
+      if (!keySetIteratorNext(&it, out)) {
+        return UFALSE;
+      }
+      state[0] = NUMBER_VAL(it.index);
+      return UTRUE;
+    }
+    default:
+      panic("getNextItem: unexpected container %s", getKindName(container));
+      return UFALSE;
+  }
+}
+
+/* Sets up the state of a loop over state[2] (see OP_GET_ITER in
+ * mtots_chunk.h), if it is a container that getNextItem() handles.
+ * Returns UFALSE for anything else. */
+static ubool startContainerIteration(Value *state) {
+  Value iterable = state[2];
+  if (IS_LIST(iterable) || IS_TUPLE(iterable) ||
+      IS_DICT(iterable) || IS_FROZEN_DICT(iterable) ||
+      IS_SET(iterable) || IS_FROZEN_SET(iterable) || IS_DEQUE(iterable)) {
+    state[0] = NUMBER_VAL(0);
+    return UTRUE;
+  } else if (IS_STRING(iterable)) {
+    state[2] = STRING_VAL(AS_STRING(iterable));
+    state[0] = NUMBER_VAL(0);
+    return UTRUE;
+  }
+  return UFALSE;
+}
+
 static ubool callCFunction(CFunction *cfunc, i16 argCount) {
   Value result = NIL_VAL(), *argsStart;
   ubool status;
@@ -275,6 +433,7 @@ static ubool callCFunction(CFunction *cfunc, i16 argCount) {
   }
   vm.stackTop -= argCount + 1;
   push(result);
+  collectGarbageForStrings();
   return UTRUE;
 }
 
@@ -345,6 +504,9 @@ ubool call(ObjClosure *closure, i16 argCount) {
   frame->closure = closure;
   frame->ip = closure->thunk->chunk.code;
   frame->slots = vm.stackTop - argCount - 1;
+#if MTOTS_USE_JIT
+  JIT_TICK(closure->thunk);
+#endif
   return UTRUE;
 }
 
@@ -432,6 +594,8 @@ static ubool callClass(ObjClass *klass, i16 argCount) {
     /* builtin class */
     if (klass == vm.bufferClass) {
       return callBufferClass(argCount);
+    } else if (klass == vm.dequeClass) {
+      return callDequeClass(argCount);
     }
     runtimeError("Builtin class %s does not allow instantiation",
       klass->name->chars);
@@ -465,7 +629,7 @@ static ubool callOperator(Operator op, i16 argCount) {
       vm.stackTop[-1] = receiver;
 
       if (IS_STRING(receiver)) {
-        vm.stackTop[-1] = NUMBER_VAL(AS_STRING(receiver)->length);
+        vm.stackTop[-1] = NUMBER_VAL(AS_STRING_OR_ROPE(receiver)->length);
         return UTRUE;
       } else if (IS_OBJ(receiver)) {
         switch (AS_OBJ(receiver)->type) {
@@ -484,6 +648,15 @@ static ubool callOperator(Operator op, i16 argCount) {
           case OBJ_FROZEN_DICT:
             vm.stackTop[-1] = NUMBER_VAL(AS_FROZEN_DICT(receiver)->map.size);
             return UTRUE;
+          case OBJ_SET:
+            vm.stackTop[-1] = NUMBER_VAL(AS_SET(receiver)->set.size);
+            return UTRUE;
+          case OBJ_FROZEN_SET:
+            vm.stackTop[-1] = NUMBER_VAL(AS_FROZEN_SET(receiver)->set.size);
+            return UTRUE;
+          case OBJ_DEQUE:
+            vm.stackTop[-1] = NUMBER_VAL(AS_DEQUE(receiver)->length);
+            return UTRUE;
           default:
             return invoke(vm.lenString, 0);
         }
@@ -566,6 +739,87 @@ static ubool invoke(String *name, i16 argCount) {
   return invokeFromClass(klass, name, argCount);
 }
 
+/* Runs the frame pushed by a call that just started, if any,
+ * until it returns */
+static ubool finishCall(i16 frameCount) {
+  return vm.frameCount == frameCount || run();
+}
+
+ubool callFunction(i16 argCount) {
+  i16 frameCount = vm.frameCount;
+  return callValue(peek(argCount), argCount) && finishCall(frameCount);
+}
+
+ubool callMethod(String *name, i16 argCount) {
+  i16 frameCount = vm.frameCount;
+  return invoke(name, argCount) && finishCall(frameCount);
+}
+
+ubool startIteration() {
+  Value iterable = pop();
+  i16 frameCount;
+  push(NIL_VAL());
+  push(NIL_VAL());
+  push(iterable);
+  if (startContainerIteration(vm.stackTop - 3) || isIterator(iterable)) {
+    return UTRUE;
+  }
+  frameCount = vm.frameCount;
+  return invoke(vm.iterString, 0) && finishCall(frameCount);
+}
+
+ubool nextIteration(Value *state) {
+  Value item;
+  if (!IS_NUMBER(state[0])) {
+    push(state[2]);
+    return callFunction(0);
+  }
+  if (!getNextItem(state, &item)) {
+    item = STOP_ITERATION_VAL();
+  }
+  push(item);
+  return UTRUE;
+}
+
+static void fillInlineCache(InlineCache *ic, void *guard, u32 index) {
+  if (ic->guard != guard) {
+    if (ic->misses >= INLINE_CACHE_MAX_MISSES) {
+      /* megamorphic: leave the guard cleared so that the fast path
+       * is never taken again */
+      ic->guard = NULL;
+      return;
+    }
+    ic->misses++;
+    ic->guard = guard;
+  }
+  ic->index = index;
+}
+
+/* Like invoke, but remembers where the method was found in the
+ * receiver class's method table */
+static ubool invokeCached(String *name, i16 argCount, InlineCache *ic) {
+  Value receiver = peek(argCount);
+  ObjClass *klass;
+  Value method;
+  u32 index;
+
+  klass = IS_INSTANCE(receiver) ?
+    AS_INSTANCE(receiver)->klass :
+    getClassOfValue(receiver);
+  if (klass == NULL || klass == vm.classClass) {
+    return invoke(name, argCount);
+  }
+  if (ic->guard == klass &&
+      mapGetStrAt(&klass->methods, ic->index, name, &method)) {
+    return callValue(method, argCount);
+  }
+  if (!mapGetStrIndex(&klass->methods, name, &method, &index)) {
+    return invokeFromClass(klass, name, argCount);
+  }
+  fillInlineCache(ic, klass, index);
+  return callValue(method, argCount);
+}
+
 static ObjUpvalue *captureUpvalue(Value *local) {
   ObjUpvalue *prevUpvalue = NULL;
   ObjUpvalue *upvalue = vm.openUpvalues;
@@ -614,41 +868,135 @@ static void defineStaticMethod(String *name) {
   pop();
 }
 
-static ubool isFalsey(Value value) {
+ubool isFalsey(Value value) {
   return IS_NIL(value) ||
     (IS_BOOL(value) && !AS_BOOL(value)) ||
     (IS_NUMBER(value) && AS_NUMBER(value) == 0);
 }
 
 static void concatenate() {
-  String *result;
-  String *b = AS_STRING(peek(0));
-  String *a = AS_STRING(peek(1));
-  size_t length = a->length + b->length;
-  char *chars = malloc(sizeof(char) * (length + 1));
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
-  result = internOwnedString(chars, length);
+  String *b = AS_STRING_OR_ROPE(peek(0));
+  String *a = AS_STRING_OR_ROPE(peek(1));
+  String *result = concatStrings(a, b);
   pop();
   pop();
   push(STRING_VAL(result));
+  collectGarbageForStrings();
 }
 
+/* Whether run() jumps from one opcode straight to the next through a
+ * table of labels. Tracing and counting opcode pairs need to see every
+ * instruction, so they go back through the top of the loop instead. */
+#define THREADED_DISPATCH ( \
+  MTOTS_USE_COMPUTED_GOTO && \
+  !DEBUG_TRACE_EXECUTION && !MTOTS_COUNT_OPCODE_PAIRS)
+
 ubool run() {
   i16 returnFrameCount = vm.frameCount - 1;
+  /* When run() is nested (e.g. in callFunction()), a 'try' from outside
+   * is not allowed to catch errors here, since its frames belong to
+   * another run(). The error is returned instead, and caught once
+   * it gets there. */
+  i16 trySnapshotsBase = vm.trySnapshotsCount;
   CallFrame *frame = &vm.frames[vm.frameCount - 1];
+#if THREADED_DISPATCH
+  static void *const dispatchTable[] = {
+    [OP_CONSTANT] = &&TARGET_OP_CONSTANT,
+    [OP_NIL] = &&TARGET_OP_NIL,
+    [OP_TRUE] = &&TARGET_OP_TRUE,
+    [OP_FALSE] = &&TARGET_OP_FALSE,
+    [OP_POP] = &&TARGET_OP_POP,
+    [OP_GET_LOCAL] = &&TARGET_OP_GET_LOCAL,
+    [OP_SET_LOCAL] = &&TARGET_OP_SET_LOCAL,
+    [OP_GET_GLOBAL] = &&TARGET_OP_GET_GLOBAL,
+    [OP_DEFINE_GLOBAL] = &&TARGET_OP_DEFINE_GLOBAL,
+    [OP_SET_GLOBAL] = &&TARGET_OP_SET_GLOBAL,
+    [OP_GET_UPVALUE] = &&TARGET_OP_GET_UPVALUE,
+    [OP_SET_UPVALUE] = &&TARGET_OP_SET_UPVALUE,
+    [OP_GET_FIELD] = &&TARGET_OP_GET_FIELD,
+    [OP_SET_FIELD] = &&TARGET_OP_SET_FIELD,
+    [OP_IS] = &&TARGET_OP_IS,
+    [OP_EQUAL] = &&TARGET_OP_EQUAL,
+    [OP_GREATER] = &&TARGET_OP_GREATER,
+    [OP_LESS] = &&TARGET_OP_LESS,
+    [OP_ADD] = &&TARGET_OP_ADD,
+    [OP_SUBTRACT] = &&TARGET_OP_SUBTRACT,
+    [OP_MULTIPLY] = &&TARGET_OP_MULTIPLY,
+    [OP_DIVIDE] = &&TARGET_OP_DIVIDE,
+    [OP_FLOOR_DIVIDE] = &&TARGET_OP_FLOOR_DIVIDE,
+    [OP_MODULO] = &&TARGET_OP_MODULO,
+    [OP_SHIFT_LEFT] = &&TARGET_OP_SHIFT_LEFT,
+    [OP_SHIFT_RIGHT] = &&TARGET_OP_SHIFT_RIGHT,
+    [OP_BITWISE_OR] = &&TARGET_OP_BITWISE_OR,
+    [OP_BITWISE_AND] = &&TARGET_OP_BITWISE_AND,
+    [OP_BITWISE_XOR] = &&TARGET_OP_BITWISE_XOR,
+    [OP_BITWISE_NOT] = &&TARGET_OP_BITWISE_NOT,
+    [OP_IN] = &&TARGET_OP_IN,
+    [OP_NOT] = &&TARGET_OP_NOT,
+    [OP_NEGATE] = &&TARGET_OP_NEGATE,
+    [OP_JUMP] = &&TARGET_OP_JUMP,
+    [OP_JUMP_IF_FALSE] = &&TARGET_OP_JUMP_IF_FALSE,
+    [OP_JUMP_IF_TRUE] = &&TARGET_OP_JUMP_IF_TRUE,
+    [OP_JUMP_IF_STOP_ITERATION] = &&TARGET_OP_JUMP_IF_STOP_ITERATION,
+    [OP_TRY_START] = &&TARGET_OP_TRY_START,
+    [OP_TRY_END] = &&TARGET_OP_TRY_END,
+    [OP_RAISE] = &&TARGET_OP_RAISE,
+    [OP_GET_ITER] = &&TARGET_OP_GET_ITER,
+    [OP_GET_NEXT] = &&TARGET_OP_GET_NEXT,
+    [OP_LOOP] = &&TARGET_OP_LOOP,
+    [OP_CALL] = &&TARGET_OP_CALL,
+    [OP_CALL_RANGE] = &&TARGET_OP_CALL_RANGE,
+    [OP_INVOKE] = &&TARGET_OP_INVOKE,
+    [OP_SUPER_INVOKE] = &&TARGET_OP_SUPER_INVOKE,
+    [OP_CLOSURE] = &&TARGET_OP_CLOSURE,
+    [OP_CLOSE_UPVALUE] = &&TARGET_OP_CLOSE_UPVALUE,
+    [OP_RETURN] = &&TARGET_OP_RETURN,
+    [OP_IMPORT] = &&TARGET_OP_IMPORT,
+    [OP_NEW_LIST] = &&TARGET_OP_NEW_LIST,
+    [OP_NEW_TUPLE] = &&TARGET_OP_NEW_TUPLE,
+    [OP_NEW_DICT] = &&TARGET_OP_NEW_DICT,
+    [OP_NEW_FROZEN_DICT] = &&TARGET_OP_NEW_FROZEN_DICT,
+    [OP_CLASS] = &&TARGET_OP_CLASS,
+    [OP_INHERIT] = &&TARGET_OP_INHERIT,
+    [OP_METHOD] = &&TARGET_OP_METHOD,
+    [OP_STATIC_METHOD] = &&TARGET_OP_STATIC_METHOD,
+    [OP_GET_LOCALS] = &&TARGET_OP_GET_LOCALS,
+    [OP_ADD_LOCALS] = &&TARGET_OP_ADD_LOCALS,
+    [OP_GET_LOCAL_CONSTANT] = &&TARGET_OP_GET_LOCAL_CONSTANT,
+    [OP_GET_LOCAL_FIELD] = &&TARGET_OP_GET_LOCAL_FIELD,
+    [OP_SET_LOCAL_POP] = &&TARGET_OP_SET_LOCAL_POP,
+    [OP_LESS_LOCAL_CONSTANT_JUMP_IF_FALSE] =
+      &&TARGET_OP_LESS_LOCAL_CONSTANT_JUMP_IF_FALSE,
+    [OP_NUMBER_ADD] = &&TARGET_OP_NUMBER_ADD,
+    [OP_NUMBER_SUBTRACT] = &&TARGET_OP_NUMBER_SUBTRACT,
+    [OP_NUMBER_MULTIPLY] = &&TARGET_OP_NUMBER_MULTIPLY,
+    [OP_NUMBER_DIVIDE] = &&TARGET_OP_NUMBER_DIVIDE,
+    [OP_NUMBER_LESS] = &&TARGET_OP_NUMBER_LESS,
+    [OP_NUMBER_GREATER] = &&TARGET_OP_NUMBER_GREATER,
+    [OP_CHECK_NUMBER] = &&TARGET_OP_CHECK_NUMBER,
+    [OP_CHECK_LOCAL_NUMBER] = &&TARGET_OP_CHECK_LOCAL_NUMBER,
+    [OP_NUMBER_MULTIPLY_LOCALS] = &&TARGET_OP_NUMBER_MULTIPLY_LOCALS,
+    [OP_EQUAL_NUMBERS] = &&TARGET_OP_EQUAL_NUMBERS,
+    [OP_GREATER_NUMBERS] = &&TARGET_OP_GREATER_NUMBERS,
+    [OP_LESS_NUMBERS] = &&TARGET_OP_LESS_NUMBERS,
+    [OP_ADD_NUMBERS] = &&TARGET_OP_ADD_NUMBERS,
+    [OP_ADD_STRINGS] = &&TARGET_OP_ADD_STRINGS
+  };
+#endif
 
 #define READ_BYTE() (*frame->ip++)
 #define READ_SHORT() \
   (frame->ip += 2, (u16)((frame->ip[-2] << 8) | frame->ip[-1]))
 #define READ_CONSTANT() \
   (frame->closure->thunk->chunk.constants.values[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
+/* String constants are never ropes */
+#define READ_STRING() AS_STRING_OR_ROPE(READ_CONSTANT())
+#define READ_CACHE() \
+  (&frame->closure->thunk->chunk.caches[READ_SHORT()])
 #define RETURN_RUNTIME_ERROR() \
   do { \
     TrySnapshot *snap; \
-    if (vm.trySnapshotsCount == 0) return UFALSE; \
+    if (vm.trySnapshotsCount <= trySnapshotsBase) return UFALSE; \
     snap = &vm.trySnapshots[--vm.trySnapshotsCount]; \
     vm.stackTop = snap->stackTop; \
     vm.frameCount = snap->frameCount; \
@@ -669,6 +1017,24 @@ ubool run() {
       push(valueType(a op b)); \
     } \
   } while (0)
+/* For the OP_NUMBER_* instructions, whose operands are already known
+ * to be numbers */
+#define NUMBER_OP(valueType, op) \
+  do { \
+    double b = AS_NUMBER(pop()); \
+    double a = AS_NUMBER(pop()); \
+    push(valueType(a op b)); \
+  } while (0)
+/* Replaces the instruction being run (which must not have operands)
+ * with the given one, for the next time it runs */
+#if MTOTS_USE_QUICKENING
+#define QUICKEN(op) (frame->ip[-1] = (op))
+#else
+#define QUICKEN(op) ((void)0)
+#endif
+/* Replaces the instruction being run with the given one, and makes
+ * the following DISPATCH() run that instead */
+#define DEOPTIMIZE(op) (*--frame->ip = (op))
 #define BINARY_BITWISE_OP(op) \
   do { \
     if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
@@ -682,6 +1048,32 @@ ubool run() {
     } \
   } while (0)
 
+/* Each opcode body starts with TARGET(op) and ends with DISPATCH().
+ * With THREADED_DISPATCH, DISPATCH() jumps straight to the next opcode's
+ * label through dispatchTable, so every opcode gets its own indirect
+ * branch. Otherwise TARGET is just a case label and DISPATCH() goes back
+ * to the top of the loop, where the instruction can be seen.
+ * With the JIT, DISPATCH() also goes back to the top of the loop once
+ * the thunk has machine code, so that the machine code runs instead. */
+#if THREADED_DISPATCH
+#define TARGET(op) case op: TARGET_##op:
+#if MTOTS_USE_JIT
+#define DISPATCH() \
+  do { \
+    if (frame->closure->thunk->jitCode != NULL) goto loop; \
+    goto *dispatchTable[READ_BYTE()]; \
+  } while (0)
+#else
+#define DISPATCH() goto *dispatchTable[READ_BYTE()]
+#endif
+#elif MTOTS_USE_COMPUTED_GOTO
+#define TARGET(op) case op:
+#define DISPATCH() goto loop
+#else
+#define TARGET(op) case op:
+#define DISPATCH() break
+#endif
+
   for(;;) {
     u8 instruction;
 
@@ -700,89 +1092,141 @@ loop:
       (int)(frame->ip - frame->closure->thunk->chunk.code));
 #else
 loop:
+#endif
+#if MTOTS_USE_JIT
+    if (frame->closure->thunk->jitCode != NULL) {
+      runJitCode(frame);
+    }
+#endif
+#if MTOTS_COUNT_OPCODE_PAIRS
+    countOpcodePair(frame);
 #endif
 
     switch (instruction = READ_BYTE()) {
-      case OP_CONSTANT: {
+      TARGET(OP_CONSTANT) {
         Value constant = READ_CONSTANT();
         push(constant);
-        break;
+        DISPATCH();
       }
-      case OP_NIL: push(NIL_VAL()); break;
-      case OP_TRUE: push(BOOL_VAL(1)); break;
-      case OP_FALSE: push(BOOL_VAL(0)); break;
-      case OP_POP: pop(); break;
-      case OP_GET_LOCAL: {
+      TARGET(OP_NIL) push(NIL_VAL()); DISPATCH();
+      TARGET(OP_TRUE) push(BOOL_VAL(1)); DISPATCH();
+      TARGET(OP_FALSE) push(BOOL_VAL(0)); DISPATCH();
+      TARGET(OP_POP) pop(); DISPATCH();
+      TARGET(OP_GET_LOCAL) {
         u8 slot = READ_BYTE();
         push(frame->slots[slot]);
-        break;
+        DISPATCH();
       }
-      case OP_SET_LOCAL: {
+      TARGET(OP_SET_LOCAL) {
         u8 slot = READ_BYTE();
         frame->slots[slot] = peek(0);
-        break;
+        DISPATCH();
       }
-      case OP_GET_GLOBAL: {
+      TARGET(OP_GET_GLOBAL) {
         String *name = READ_STRING();
+        InlineCache *ic = READ_CACHE();
+        Map *fields = &frame->closure->module->fields;
         Value value;
-        if (!mapGetStr(&frame->closure->module->fields, name, &value)) {
-          runtimeError("Undefined variable '%s'", name->chars);
-          RETURN_RUNTIME_ERROR();
+        if (ic->guard != fields ||
+            !mapGetStrAt(fields, ic->index, name, &value)) {
+          u32 index;
+          if (!mapGetStrIndex(fields, name, &value, &index)) {
+            runtimeError("Undefined variable '%s'", name->chars);
+            RETURN_RUNTIME_ERROR();
+          }
+          fillInlineCache(ic, fields, index);
         }
         push(value);
-        break;
+        DISPATCH();
       }
-      case OP_DEFINE_GLOBAL: {
+      TARGET(OP_DEFINE_GLOBAL) {
         String *name = READ_STRING();
         mapSetStr(&frame->closure->module->fields, name, peek(0));
         pop();
-        break;
+        DISPATCH();
       }
-      case OP_SET_GLOBAL: {
+      TARGET(OP_SET_GLOBAL) {
         String *name = READ_STRING();
-        if (mapSetStr(&frame->closure->module->fields, name, peek(0))) {
-          mapDeleteStr(&frame->closure->module->fields, name);
-          runtimeError("Undefined variable '%s'", name->chars);
-          RETURN_RUNTIME_ERROR();
+        InlineCache *ic = READ_CACHE();
+        Map *fields = &frame->closure->module->fields;
+        if (ic->guard != fields ||
+            !mapSetStrAt(fields, ic->index, name, peek(0))) {
+          Value value;
+          u32 index;
+          if (!mapGetStrIndex(fields, name, &value, &index)) {
+            runtimeError("Undefined variable '%s'", name->chars);
+            RETURN_RUNTIME_ERROR();
+          }
+          mapSetStr(fields, name, peek(0));
+          fillInlineCache(ic, fields, index);
         }
-        break;
+        DISPATCH();
       }
-      case OP_GET_UPVALUE: {
+      TARGET(OP_GET_UPVALUE) {
         u8 slot = READ_BYTE();
         push(*frame->closure->upvalues[slot]->location);
-        break;
+        DISPATCH();
       }
-      case OP_SET_UPVALUE: {
+      TARGET(OP_SET_UPVALUE) {
         u8 slot = READ_BYTE();
-        *frame->closure->upvalues[slot]->location = peek(0);
-        break;
+        Value *location = frame->closure->upvalues[slot]->location;
+        WRITE_BARRIER(*location);
+        *location = peek(0);
+        DISPATCH();
       }
-      case OP_GET_FIELD: {
+      TARGET(OP_GET_LOCAL_FIELD)
+        push(frame->slots[READ_BYTE()]);
+        goto getField;
+      TARGET(OP_GET_FIELD) {
         String *name;
-        Value value = NIL_VAL();
+        InlineCache *ic;
+        Value value;
+      getField:
+        name = READ_STRING();
+        ic = READ_CACHE();
+        value = NIL_VAL();
 
         if (IS_INSTANCE(peek(0))) {
-          ObjInstance *instance;
-          instance = AS_INSTANCE(peek(0));
-          name = READ_STRING();
-          if (mapGetStr(&instance->fields, name, &value)) {
-            pop(); /* Instance */
-            push(value);
-            break;
+          ObjInstance *instance = AS_INSTANCE(peek(0));
+          Shape *shape = instance->shape;
+          if (shape != NULL) {
+            if (ic->guard == shape &&
+                ic->index < shape->fieldCount &&
+                shape->keys[ic->index] == name) {
+              value = instance->slots[ic->index];
+            } else {
+              i32 slot = shapeFindField(shape, name);
+              if (slot < 0) {
+                runtimeError(
+                  "Field '%s' not found in %s",
+                  name->chars, instance->klass->name->chars);
+                RETURN_RUNTIME_ERROR();
+              }
+              value = instance->slots[slot];
+              fillInlineCache(ic, shape, (u32)slot);
+            }
+          } else if (ic->guard != &instance->fields ||
+              !mapGetStrAt(&instance->fields, ic->index, name, &value)) {
+            u32 index;
+            if (!mapGetStrIndex(&instance->fields, name, &value, &index)) {
+              runtimeError(
+                "Field '%s' not found in %s",
+                name->chars, instance->klass->name->chars);
+              RETURN_RUNTIME_ERROR();
+            }
+            fillInlineCache(ic, &instance->fields, index);
           }
-          runtimeError(
-            "Field '%s' not found in %s",
-            name->chars, instance->klass->name->chars);
-          RETURN_RUNTIME_ERROR();
+          pop(); /* Instance */
+          push(value);
+          DISPATCH();
         }
 
         if (IS_DICT(peek(0))) {
           ObjDict *d = AS_DICT(peek(0));
-          name = READ_STRING();
           if (mapGet(&d->map, STRING_VAL(name), &value)) {
             pop(); /* Instance */
             push(value);
-            break;
+            DISPATCH();
           }
           runtimeError("Field '%s' not found in Map", name->chars);
           RETURN_RUNTIME_ERROR();
@@ -791,11 +1235,10 @@ loop:
         if (IS_NATIVE(peek(0))) {
           ObjNative *n = AS_NATIVE(peek(0));
           if (n->descriptor->getField) {
-            name = READ_STRING();
             if (n->descriptor->getField(n, name, &value)) {
               pop(); /* Instance */
               push(value);
-              break;
+              DISPATCH();
             } else {
               runtimeError(
                 "Field '%s' not found in native type %s",
@@ -810,37 +1253,66 @@ loop:
           "%s values do not have have fields", getKindName(peek(0)));
         RETURN_RUNTIME_ERROR();
       }
-      case OP_SET_FIELD: {
+      TARGET(OP_SET_FIELD) {
+        String *name = READ_STRING();
+        InlineCache *ic = READ_CACHE();
         Value value;
 
         if (IS_INSTANCE(peek(1))) {
-          ObjInstance *instance;
-          instance = AS_INSTANCE(peek(1));
-          mapSetStr(&instance->fields, READ_STRING(), peek(0));
+          ObjInstance *instance = AS_INSTANCE(peek(1));
+          Shape *shape = instance->shape;
+          if (shape != NULL &&
+              ic->guard == shape &&
+              ic->index < shape->fieldCount &&
+              shape->keys[ic->index] == name) {
+            WRITE_BARRIER(instance->slots[ic->index]);
+            instance->slots[ic->index] = peek(0);
+          } else if (shape == NULL &&
+              ic->guard == &instance->fields &&
+              mapSetStrAt(&instance->fields, ic->index, name, peek(0))) {
+            /* updated in place */
+          } else {
+            u32 index;
+            if (instance->klass->isModuleClass &&
+                mapGetStr(&instance->klass->constants, name, &value)) {
+              runtimeError(
+                "Can't assign to constant %s.%s",
+                instance->klass->name->chars, name->chars);
+              RETURN_RUNTIME_ERROR();
+            }
+            instanceSetField(instance, name, peek(0));
+            if (instance->shape != NULL) {
+              fillInlineCache(
+                ic, instance->shape,
+                (u32)shapeFindField(instance->shape, name));
+            } else if (
+                mapGetStrIndex(&instance->fields, name, &value, &index)) {
+              fillInlineCache(ic, &instance->fields, index);
+            }
+          }
           value = pop();
           pop();
           push(value);
-          break;
+          DISPATCH();
         }
 
         if (IS_DICT(peek(1))) {
           ObjDict *d = AS_DICT(peek(1));
-          mapSet(&d->map, STRING_VAL(READ_STRING()), peek(0));
+          mapSet(&d->map, STRING_VAL(name), peek(0));
           value = pop();
           pop();
           push(value);
-          break;
+          DISPATCH();
         }
 
         if (IS_NATIVE(peek(1))) {
           ObjNative *n = AS_NATIVE(peek(1));
           if (n->descriptor->setField) {
-            String *name = READ_STRING();
             if (n->descriptor->setField(n, name, peek(0))) {
               value = pop();
               pop();
               push(value);
-              break;
+              DISPATCH();
             } else {
               runtimeError(
                 "Field %s not found on %s",
@@ -854,35 +1326,98 @@ loop:
         runtimeError(
           "%s values do not have have fields", getKindName(peek(1)));
         RETURN_RUNTIME_ERROR();
-        break;
+        DISPATCH();
       }
-      case OP_IS: {
+      TARGET(OP_IS) {
         Value b = pop();
         Value a = pop();
         push(BOOL_VAL(valuesIs(a, b)));
-        break;
+        DISPATCH();
       }
-      case OP_EQUAL: {
+      TARGET(OP_EQUAL) {
         Value b = pop();
         Value a = pop();
+        if (IS_NUMBER(a) && IS_NUMBER(b)) {
+          QUICKEN(OP_EQUAL_NUMBERS);
+        }
         push(BOOL_VAL(valuesEqual(a, b)));
-        break;
+        DISPATCH();
       }
-      case OP_GREATER: {
-        ubool result = valueLessThan(peek(0), peek(1));
+      TARGET(OP_EQUAL_NUMBERS) {
+        double a, b;
+        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+          DEOPTIMIZE(OP_EQUAL);
+          DISPATCH();
+        }
+        b = AS_NUMBER(pop());
+        a = AS_NUMBER(pop());
+        push(BOOL_VAL(a == b));
+        DISPATCH();
+      }
+      TARGET(OP_GREATER) {
+        ubool result;
+        if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+          QUICKEN(OP_GREATER_NUMBERS);
+        }
+        result = valueLessThan(peek(0), peek(1));
         pop();
         pop();
         push(BOOL_VAL(result));
-        break;
+        DISPATCH();
       }
-      case OP_LESS: {
-        ubool result = valueLessThan(peek(1), peek(0));
+      TARGET(OP_GREATER_NUMBERS) {
+        double a, b;
+        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+          DEOPTIMIZE(OP_GREATER);
+          DISPATCH();
+        }
+        b = AS_NUMBER(pop());
+        a = AS_NUMBER(pop());
+        push(BOOL_VAL(b < a));
+        DISPATCH();
+      }
+      TARGET(OP_LESS) {
+        ubool result;
+        if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+          QUICKEN(OP_LESS_NUMBERS);
+        }
+        result = valueLessThan(peek(1), peek(0));
         pop();
         pop();
         push(BOOL_VAL(result));
-        break;
+        DISPATCH();
+      }
+      TARGET(OP_LESS_NUMBERS) {
+        double a, b;
+        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+          DEOPTIMIZE(OP_LESS);
+          DISPATCH();
+        }
+        b = AS_NUMBER(pop());
+        a = AS_NUMBER(pop());
+        push(BOOL_VAL(a < b));
+        DISPATCH();
+      }
+      TARGET(OP_ADD_LOCALS) {
+        Value a = frame->slots[READ_BYTE()];
+        Value b = frame->slots[READ_BYTE()];
+        if (IS_NUMBER(a) && IS_NUMBER(b)) {
+          push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+          DISPATCH();
+        }
+        push(a);
+        push(b);
+        goto add;
       }
-      case OP_ADD: {
+      TARGET(OP_ADD)
+        if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+          QUICKEN(OP_ADD_NUMBERS);
+        } else if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+          QUICKEN(OP_ADD_STRINGS);
+        }
+        /* OP_ADD_LOCALS jumps here, past the quickening, because
+         * it has operands */
+      add: {
         if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
           concatenate();
         } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
@@ -893,10 +1428,28 @@ loop:
           runtimeError("Operands must be two numbers or two strings");
           RETURN_RUNTIME_ERROR();
         }
-        break;
+        DISPATCH();
+      }
+      TARGET(OP_ADD_NUMBERS) {
+        double a, b;
+        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+          DEOPTIMIZE(OP_ADD);
+          DISPATCH();
+        }
+        b = AS_NUMBER(pop());
+        a = AS_NUMBER(pop());
+        push(NUMBER_VAL(a + b));
+        DISPATCH();
       }
-      case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-      case OP_MULTIPLY: {
+      TARGET(OP_ADD_STRINGS)
+        if (!IS_STRING(peek(0)) || !IS_STRING(peek(1))) {
+          DEOPTIMIZE(OP_ADD);
+          DISPATCH();
+        }
+        concatenate();
+        DISPATCH();
+      TARGET(OP_SUBTRACT) BINARY_OP(NUMBER_VAL, -); DISPATCH();
+      TARGET(OP_MULTIPLY) {
         if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
           double b = AS_NUMBER(pop());
           double a = AS_NUMBER(pop());
@@ -907,10 +1460,10 @@ loop:
           }
           frame = &vm.frames[vm.frameCount - 1];
         }
-        break;
+        DISPATCH();
       }
-      case OP_DIVIDE: BINARY_OP(NUMBER_VAL, /); break;
-      case OP_FLOOR_DIVIDE: {
+      TARGET(OP_DIVIDE) BINARY_OP(NUMBER_VAL, /); DISPATCH();
+      TARGET(OP_FLOOR_DIVIDE) {
         if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
           runtimeError("Operands must be numbers");
           RETURN_RUNTIME_ERROR();
@@ -920,9 +1473,9 @@ loop:
           double a = AS_NUMBER(pop());
           push(NUMBER_VAL(floor(a / b)));
         }
-        break;
+        DISPATCH();
       }
-      case OP_MODULO:
+      TARGET(OP_MODULO)
         if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
           double b = AS_NUMBER(pop());
           double a = AS_NUMBER(pop());
@@ -933,13 +1486,13 @@ loop:
           }
           frame = &vm.frames[vm.frameCount - 1];
         }
-        break;
-      case OP_SHIFT_LEFT: BINARY_BITWISE_OP(<<); break;
-      case OP_SHIFT_RIGHT: BINARY_BITWISE_OP(>>); break;
-      case OP_BITWISE_OR: BINARY_BITWISE_OP(|); break;
-      case OP_BITWISE_AND: BINARY_BITWISE_OP(&); break;
-      case OP_BITWISE_XOR: BINARY_BITWISE_OP(^); break;
-      case OP_BITWISE_NOT: {
+        DISPATCH();
+      TARGET(OP_SHIFT_LEFT) BINARY_BITWISE_OP(<<); DISPATCH();
+      TARGET(OP_SHIFT_RIGHT) BINARY_BITWISE_OP(>>); DISPATCH();
+      TARGET(OP_BITWISE_OR) BINARY_BITWISE_OP(|); DISPATCH();
+      TARGET(OP_BITWISE_AND) BINARY_BITWISE_OP(&); DISPATCH();
+      TARGET(OP_BITWISE_XOR) BINARY_BITWISE_OP(^); DISPATCH();
+      TARGET(OP_BITWISE_NOT) {
         u32 x;
         if (!IS_NUMBER(peek(0))) {
           runtimeError("Operand must be a number");
@@ -947,12 +1500,19 @@ loop:
         }
         x = AS_U32(pop());
         push(NUMBER_VAL(~x));
-        break;
+        DISPATCH();
       }
-      case OP_IN: {
+      TARGET(OP_IN) {
         if (IS_CLASS(peek(0))) {
           ObjClass *cls = AS_CLASS(pop());
           push(BOOL_VAL(cls == getClassOfValue(pop())));
+        } else if (IS_SET(peek(0)) || IS_FROZEN_SET(peek(0))) {
+          KeySet *set = IS_SET(peek(0)) ?
+            &AS_SET(peek(0))->set :
+            &AS_FROZEN_SET(peek(0))->set;
+          ubool found = keySetContains(set, peek(1));
+          vm.stackTop -= 2;
+          push(BOOL_VAL(found));
         } else {
           Value b = pop();
           Value a = pop();
@@ -963,38 +1523,45 @@ loop:
           }
           frame = &vm.frames[vm.frameCount - 1];
         }
-        break;
+        DISPATCH();
       }
-      case OP_NOT:
+      TARGET(OP_NOT)
         push(BOOL_VAL(isFalsey(pop())));
-        break;
-      case OP_NEGATE:
+        DISPATCH();
+      TARGET(OP_NEGATE)
         if (!IS_NUMBER(peek(0))) {
           runtimeError("Operand must be an number");
           RETURN_RUNTIME_ERROR();
         }
         push(NUMBER_VAL(-AS_NUMBER(pop())));
-        break;
-      case OP_JUMP: {
+        DISPATCH();
+      TARGET(OP_JUMP) {
         u16 offset = READ_SHORT();
         frame->ip += offset;
-        break;
+        DISPATCH();
       }
-      case OP_JUMP_IF_FALSE: {
+      TARGET(OP_JUMP_IF_FALSE) {
         u16 offset = READ_SHORT();
         if (isFalsey(peek(0))) {
           frame->ip += offset;
         }
-        break;
+        DISPATCH();
+      }
+      TARGET(OP_JUMP_IF_TRUE) {
+        u16 offset = READ_SHORT();
+        if (!isFalsey(peek(0))) {
+          frame->ip += offset;
+        }
+        DISPATCH();
       }
-      case OP_JUMP_IF_STOP_ITERATION: {
+      TARGET(OP_JUMP_IF_STOP_ITERATION) {
         u16 offset = READ_SHORT();
         if (IS_STOP_ITERATION(peek(0))) {
           frame->ip += offset;
         }
-        break;
+        DISPATCH();
       }
-      case OP_TRY_START: {
+      TARGET(OP_TRY_START) {
         u16 offset = READ_SHORT();
         TrySnapshot *snapshot;
         if (vm.trySnapshotsCount >= TRY_SNAPSHOTS_MAX) {
@@ -1007,66 +1574,129 @@ loop:
         if (frame != &vm.frames[vm.frameCount - 1]) {
           panic("internal vm frame error");
         }
-        break;
+        DISPATCH();
       }
-      case OP_TRY_END: {
+      TARGET(OP_TRY_END) {
         u16 offset = READ_SHORT();
         if (vm.trySnapshotsCount == 0) {
           panic("try snapshot underflow");
         }
         frame->ip += offset;
         vm.trySnapshotsCount--;
-        break;
+        DISPATCH();
       }
-      case OP_RAISE: {
+      TARGET(OP_RAISE) {
         if (!IS_STRING(peek(0))) {
           panic("Only strings can be raised right now");
         }
         runtimeError("%s", AS_STRING(peek(0))->chars);
         RETURN_RUNTIME_ERROR();
       }
-      case OP_GET_ITER: {
-        Value iterable = peek(0);
-        if (isIterator(iterable)) {
-          /* nothing to do */
-        } else {
+      TARGET(OP_GET_ITER) {
+        Value iterable = pop();
+        push(NIL_VAL());
+        push(NIL_VAL());
+        push(iterable);
+        if (!startContainerIteration(vm.stackTop - 3) &&
+            !isIterator(iterable)) {
           if (!invoke(vm.iterString, 0)) {
             RETURN_RUNTIME_ERROR();
           }
+          frame = &vm.frames[vm.frameCount - 1];
         }
-        break;
+        DISPATCH();
       }
-      case OP_GET_NEXT: {
-        push(peek(0));
-        if (!callValue(peek(0), 0)) {
-          RETURN_RUNTIME_ERROR();
+      TARGET(OP_GET_NEXT) {
+        Value *state = vm.stackTop - 3;
+        Value item;
+        if (IS_NUMBER(state[1])) {
+          /* range() */
+          double next = AS_NUMBER(state[0]);
+          double stop = AS_NUMBER(state[1]);
+          double step = AS_NUMBER(state[2]);
+          if (step >= 0 ? next >= stop : next <= stop) {
+            push(STOP_ITERATION_VAL());
+            DISPATCH();
+          }
+          state[0] = NUMBER_VAL(next + step);
+          item = NUMBER_VAL(next);
+        } else if (IS_NUMBER(state[0])) {
+          if (!getNextItem(state, &item)) {
+            push(STOP_ITERATION_VAL());
+            DISPATCH();
+          }
+        } else {
+          push(state[2]);
+          if (!callValue(state[2], 0)) {
+            RETURN_RUNTIME_ERROR();
+          }
+          frame = &vm.frames[vm.frameCount - 1];
+          DISPATCH();
         }
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+        push(item);
+        frame->ip += 3; /* skip OP_JUMP_IF_STOP_ITERATION */
+        DISPATCH();
       }
-      case OP_LOOP: {
+      TARGET(OP_LOOP) {
         u16 offset = READ_SHORT();
         frame->ip -= offset;
-        break;
+#if MTOTS_USE_JIT
+        JIT_TICK(frame->closure->thunk);
+#endif
+        DISPATCH();
       }
-      case OP_CALL: {
+      TARGET(OP_CALL) {
         i16 argCount = READ_BYTE();
         if (!callValue(peek(argCount), argCount)) {
           RETURN_RUNTIME_ERROR();
         }
         frame = &vm.frames[vm.frameCount - 1];
-        break;
+        DISPATCH();
       }
-      case OP_INVOKE: {
+      TARGET(OP_CALL_RANGE) {
+        i16 argCount = READ_BYTE(), i;
+        Value *args = vm.stackTop - argCount;
+        double start = 0, stop, step = 1;
+        ubool isRange = IS_CFUNCTION(args[-1]) &&
+          AS_CFUNCTION(args[-1]) == &cfunctionRange &&
+          argCount >= 1 && argCount <= 3;
+        for (i = 0; isRange && i < argCount; i++) {
+          isRange = IS_NUMBER(args[i]);
+        }
+        if (!isRange) {
+          if (!callValue(args[-1], argCount)) {
+            RETURN_RUNTIME_ERROR();
+          }
+          frame = &vm.frames[vm.frameCount - 1];
+          DISPATCH();
+        }
+        if (argCount == 1) {
+          stop = AS_NUMBER(args[0]);
+        } else {
+          start = AS_NUMBER(args[0]);
+          stop = AS_NUMBER(args[1]);
+          if (argCount == 3) {
+            step = AS_NUMBER(args[2]);
+          }
+        }
+        vm.stackTop = args - 1;
+        push(NUMBER_VAL(start));
+        push(NUMBER_VAL(stop));
+        push(NUMBER_VAL(step));
+        frame->ip++; /* skip OP_GET_ITER */
+        DISPATCH();
+      }
+      TARGET(OP_INVOKE) {
         String *method = READ_STRING();
         i16 argCount = READ_BYTE();
-        if (!invoke(method, argCount)) {
+        InlineCache *ic = READ_CACHE();
+        if (!invokeCached(method, argCount, ic)) {
           RETURN_RUNTIME_ERROR();
         }
         frame = &vm.frames[vm.frameCount - 1];
-        break;
+        DISPATCH();
       }
-      case OP_SUPER_INVOKE: {
+      TARGET(OP_SUPER_INVOKE) {
         String *method = READ_STRING();
         i16 argCount = READ_BYTE();
         ObjClass *superclass = AS_CLASS(pop());
@@ -1074,9 +1704,9 @@ loop:
           RETURN_RUNTIME_ERROR();
         }
         frame = &vm.frames[vm.frameCount - 1];
-        break;
+        DISPATCH();
       }
-      case OP_CLOSURE: {
+      TARGET(OP_CLOSURE) {
         ObjThunk *thunk = AS_THUNK(READ_CONSTANT());
         ObjClosure *closure = newClosure(thunk, frame->closure->module);
         i16 i;
@@ -1091,13 +1721,13 @@ loop:
             closure->upvalues[i] = frame->closure->upvalues[index];
           }
         }
-        break;
+        DISPATCH();
       }
-      case OP_CLOSE_UPVALUE:
+      TARGET(OP_CLOSE_UPVALUE)
         closeUpvalues(vm.stackTop - 1);
         pop();
-        break;
-      case OP_RETURN: {
+        DISPATCH();
+      TARGET(OP_RETURN) {
         Value result = pop();
         closeUpvalues(frame->slots);
         vm.frameCount--;
@@ -1116,16 +1746,16 @@ loop:
         vm.stackTop = frame->slots;
         push(result);
         frame = &vm.frames[vm.frameCount - 1];
-        break;
+        DISPATCH();
       }
-      case OP_IMPORT: {
+      TARGET(OP_IMPORT) {
         String *name = READ_STRING();
         if (!importModule(name)) {
           RETURN_RUNTIME_ERROR();
         }
-        break;
+        DISPATCH();
       }
-      case OP_NEW_LIST: {
+      TARGET(OP_NEW_LIST) {
         size_t i, length = READ_BYTE();
         ObjList *list = newList(length);
         Value *start = vm.stackTop - length;
@@ -1134,17 +1764,17 @@ loop:
         }
         *start = LIST_VAL(list);
         vm.stackTop = start + 1;
-        break;
+        DISPATCH();
       }
-      case OP_NEW_TUPLE: {
+      TARGET(OP_NEW_TUPLE) {
         size_t length = READ_BYTE();
         Value *start = vm.stackTop - length;
         ObjTuple *tuple = copyTuple(start, length);
         *start = TUPLE_VAL(tuple);
         vm.stackTop = start + 1;
-        break;
+        DISPATCH();
       }
-      case OP_NEW_DICT: {
+      TARGET(OP_NEW_DICT) {
         size_t i, length = READ_BYTE();
         ObjDict *dict = newDict();
         Value *start = vm.stackTop - 2 * length;
@@ -1154,9 +1784,9 @@ loop:
         }
         vm.stackTop = start;
         push(DICT_VAL(dict));
-        break;
+        DISPATCH();
       }
-      case OP_NEW_FROZEN_DICT: {
+      TARGET(OP_NEW_FROZEN_DICT) {
         size_t i, length = READ_BYTE();
         ObjFrozenDict *fdict;
         Map map;
@@ -1169,12 +1799,12 @@ loop:
         vm.stackTop = start;
         push(FROZEN_DICT_VAL(fdict));
         freeMap(&map);
-        break;
+        DISPATCH();
       }
-      case OP_CLASS:
+      TARGET(OP_CLASS)
         push(CLASS_VAL(newClass(READ_STRING())));
-        break;
-      case OP_INHERIT: {
+        DISPATCH();
+      TARGET(OP_INHERIT) {
         Value superclass;
         ObjClass *subclass;
         superclass = peek(1);
@@ -1186,21 +1816,91 @@ loop:
         subclass = AS_CLASS(peek(0));
         mapAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
         pop(); /* subclass */
-        break;
+        DISPATCH();
       }
-      case OP_METHOD:
+      TARGET(OP_METHOD)
         defineMethod(READ_STRING());
-        break;
-      case OP_STATIC_METHOD:
+        DISPATCH();
+      TARGET(OP_STATIC_METHOD)
         defineStaticMethod(READ_STRING());
-        break;
+        DISPATCH();
+      TARGET(OP_GET_LOCALS) {
+        u8 first = READ_BYTE();
+        u8 second = READ_BYTE();
+        push(frame->slots[first]);
+        push(frame->slots[second]);
+        DISPATCH();
+      }
+      TARGET(OP_GET_LOCAL_CONSTANT) {
+        u8 slot = READ_BYTE();
+        push(frame->slots[slot]);
+        push(READ_CONSTANT());
+        DISPATCH();
+      }
+      TARGET(OP_SET_LOCAL_POP) {
+        u8 slot = READ_BYTE();
+        frame->slots[slot] = pop();
+        DISPATCH();
+      }
+      TARGET(OP_LESS_LOCAL_CONSTANT_JUMP_IF_FALSE) {
+        Value a = frame->slots[READ_BYTE()];
+        Value b = READ_CONSTANT();
+        u16 offset = READ_SHORT();
+        ubool result = IS_NUMBER(a) && IS_NUMBER(b) ?
+          AS_NUMBER(a) < AS_NUMBER(b) :
+          valueLessThan(a, b);
+        push(BOOL_VAL(result));
+        if (!result) {
+          frame->ip += offset;
+        }
+        DISPATCH();
+      }
+      TARGET(OP_NUMBER_ADD) NUMBER_OP(NUMBER_VAL, +); DISPATCH();
+      TARGET(OP_NUMBER_SUBTRACT) NUMBER_OP(NUMBER_VAL, -); DISPATCH();
+      TARGET(OP_NUMBER_MULTIPLY) NUMBER_OP(NUMBER_VAL, *); DISPATCH();
+      TARGET(OP_NUMBER_DIVIDE) NUMBER_OP(NUMBER_VAL, /); DISPATCH();
+      TARGET(OP_NUMBER_LESS) NUMBER_OP(BOOL_VAL, <); DISPATCH();
+      TARGET(OP_NUMBER_GREATER) NUMBER_OP(BOOL_VAL, >); DISPATCH();
+      TARGET(OP_NUMBER_MULTIPLY_LOCALS) {
+        double a = AS_NUMBER(frame->slots[READ_BYTE()]);
+        double b = AS_NUMBER(frame->slots[READ_BYTE()]);
+        push(NUMBER_VAL(a * b));
+        DISPATCH();
+      }
+      TARGET(OP_CHECK_NUMBER) {
+        String *name = READ_STRING();
+        if (!IS_NUMBER(peek(0))) {
+          runtimeError(
+            "Expected a number for '%s' but got %s",
+            name->chars, getKindName(peek(0)));
+          RETURN_RUNTIME_ERROR();
+        }
+        DISPATCH();
+      }
+      TARGET(OP_CHECK_LOCAL_NUMBER) {
+        Value value = frame->slots[READ_BYTE()];
+        String *name = READ_STRING();
+        if (!IS_NUMBER(value)) {
+          runtimeError(
+            "Expected a number for '%s' but got %s",
+            name->chars, getKindName(value));
+          RETURN_RUNTIME_ERROR();
+        }
+        DISPATCH();
+      }
     }
   }
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_SHORT
 #undef READ_STRING
+#undef READ_CACHE
 #undef BINARY_OP
+#undef NUMBER_OP
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef TARGET
+#undef DISPATCH
 }
 
 /* Runs true on success, false otherwise */
@@ -1220,47 +1920,6 @@ ubool interpret(const char *source, ObjInstance *module) {
   return run();
 }
 
-static void prepPrelude() {
-  /* Import __prelude__ */
-  if (!importModule(vm.preludeString)) {
-    panic("Faield to load prelude");
-  }
-  if (!IS_MODULE(peek(0)) ||
-      strcmp(AS_INSTANCE(peek(0))->klass->name->chars, "__prelude__") != 0) {
-    panic("Unexpected stack state after loading prelude");
-  }
-
-  /* Copy over values from __prelude__ into global */
-  {
-    ObjInstance *prelude = AS_INSTANCE(peek(0));
-    MapIterator ti, tj;
-    MapEntry *entry, *e;
-
-    initMapIterator(&ti, &prelude->fields);
-    while (mapIteratorNext(&ti, &entry)) {
-      if (valueIsCString(entry->key, "sorted") ||
-          valueIsCString(entry->key, "list") ||
-          valueIsCString(entry->key, "tuple") ||
-          valueIsCString(entry->key, "dict") ||
-          valueIsCString(entry->key, "set")) {
-        mapSet(&vm.globals, entry->key, entry->value);
-      } else if (valueIsCString(entry->key, "__List__")) {
-        ObjClass *mixinListClass;
-        if (!IS_CLASS(entry->value)) {
-          panic("__prelude__.__List__ is not a class");
-        }
-        mixinListClass = AS_CLASS(entry->value);
-        initMapIterator(&tj, &mixinListClass->methods);
-        while (mapIteratorNext(&tj, &e)) {
-          if (valueIsCString(e->key, "sort")) {
-            mapSet(&vm.listClass->methods, e->key, e->value);
-          }
-        }
-      }
-    }
-  }
-}
-
 ubool valueIsCString(Value value, const char *string) {
   return IS_STRING(value) && strcmp(AS_STRING(value)->chars, string) == 0;
 }
@@ -34,8 +34,8 @@ typedef struct VM {
   Map nativeModuleThunks;  /* Map of CFunctions */
   Map tuples;              /* table of all interned tuples */
   Map frozenDicts;         /* a table of all interned FrozenDicts */
+  Map frozenSets;          /* a table of all interned FrozenSets */
 
-  String *preludeString;
   String *initString;
   String *iterString;
   String *lenString;
@@ -56,6 +56,9 @@ typedef struct VM {
   ObjClass *tupleClass;
   ObjClass *mapClass;
   ObjClass *frozenDictClass;
+  ObjClass *setClass;
+  ObjClass *frozenSetClass;
+  ObjClass *dequeClass;
   ObjClass *functionClass;
   ObjClass *operatorClass;
   ObjClass *classClass;
@@ -74,11 +77,45 @@ typedef struct VM {
   size_t grayCapacity;
   Obj **grayStack;
 
+  GCPhase gcPhase;
+  ubool gcIncremental;
+  size_t gcDebt;      /* bytes allocated since the last incremental step */
+  size_t stringsAllocationSize; /* as of the last collectGarbageForStrings() */
+  Obj *sweepObjects;  /* objects the current sweep has not yet visited */
+  size_t gcPauses[GC_PAUSE_BUCKET_COUNT];
+  double gcMaxPause;  /* in seconds */
+  double gcTotalPause;
+  size_t gcCollections; /* complete cycles */
+  size_t objectBytes[OBJ_TYPE_COUNT]; /* ever allocated, per ObjType */
+  size_t liveObjects[OBJ_TYPE_COUNT];
+  double gcGrowthFactor; /* see the GC policy in mtots_memory.h */
+  size_t gcMaxHeapSize;  /* 0 if there is no maximum */
+  ubool gcEnabled;
+  ubool gcStress;
+
   char *errorString;
 } VM;
 
 extern VM vm;
 
+/* A snapshot of the GC and allocation statistics (see getGCStats()
+ * in mtots_memory.h). Times are in seconds, sizes in bytes. */
+struct GCStats {
+  size_t collections;        /* complete collection cycles */
+  size_t pauses;             /* incremental steps and full collections */
+  double totalPause;
+  double maxPause;
+  size_t heapSize;           /* see getHeapSize() */
+  size_t stringsSize;        /* all strings, interned or not */
+  size_t internedStrings;
+  size_t internTableSize;
+  size_t internedTuples;
+  size_t internedFrozenDicts;
+  size_t internedFrozenSets;
+  size_t allocatedBytes[OBJ_TYPE_COUNT]; /* since the start, per ObjType */
+  size_t liveObjects[OBJ_TYPE_COUNT];    /* not yet freed, per ObjType */
+};
+
 void initVM();
 void freeVM();
 ubool interpret(const char *source, ObjInstance *module);
@@ -95,6 +132,41 @@ void addNativeModule(CFunction *func);
 ubool run();
 ubool call(ObjClosure *closure, i16 argCount);
 
+/* Calling mtots from C
+ *
+ * callFunction() calls the value just below the top 'argCount' values
+ * of the stack, with those values as arguments, like OP_CALL.
+ * callMethod() calls the named method of that value, like OP_INVOKE.
+ * Either way, all of those values are replaced with the return value,
+ * and functions written in mtots run to completion in a nested run()
+ * before these return. So they may be used from a CFunction, e.g. to
+ * call a callback.
+ *
+ * On error, they return UFALSE, which the CFunction should pass on.
+ * A 'try' around the call to the CFunction catches the error then.
+ *
+ * Everything on the stack stays reachable, so any other Value the
+ * caller still needs must be on the stack as well. */
+ubool callFunction(i16 argCount);
+ubool callMethod(String *name, i16 argCount);
+
+/* Iterating from C
+ *
+ * startIteration() replaces the iterable on top of the stack with the
+ * 3 values of a loop over it, like OP_GET_ITER. While those stay on the
+ * stack, each call to nextIteration() with a pointer to them pushes the
+ * next item, or StopIteration once there are none left. The caller
+ * pops each item, and the loop state when done.
+ *
+ * Lists, tuples, dicts, frozendicts and strings are iterated directly
+ * in C, without calling __iter__ or an iterator. Both return UFALSE on
+ * error, like callFunction(). */
+ubool startIteration();
+ubool nextIteration(Value *state);
+
+/* Whether the value counts as false in conditions */
+ubool isFalsey(Value value);
+
 /* Stack manipulation.
  * Alternative to using the Ref API. */
 void push(Value value);